@@ -0,0 +1,165 @@
+#!/bin/bash
+# zprd / bench/netns-bench.sh - end-to-end benchmark with network namespaces
+# (C) 2019 Erik Zscheile.
+# License: GPL-2+
+#
+# USAGE: netns-bench.sh (run as root, from the build directory)
+#
+# Creates NODES network namespaces (zb-1 ... zb-N), connected via veth pairs
+# to a bridge in the namespace zb-hub. Every node gets a tun device and its own
+# zprd instance. Traffic is sent from node 1 to node N with zprd-pktgen.
+#
+# environment:
+#   ZPRD=./zprd  PKTGEN=./zprd-pktgen
+#   NODES=2             number of zprd nodes (>= 2)
+#   TOPO=mesh|chain     mesh: every node knows all others,
+#                       chain: node i only knows i-1 and i+1 (multi-hop)
+#   DURATION=5          seconds per test
+#   SIZES="64 512 1400" udp payload sizes
+#   PPS=0               udp flood rate limit (0 = unlimited)
+#   OUT=/dev/stdout     where the JSON lines are written
+#
+# Every test produces one JSON line:
+#   {"test":"udp|rr|tcp", "size":.., "nodes":.., "topo":.., "gen":{..}, "sink":{..},
+#    "cpu":[{"node":1, "cpu_ms":.., "pkts":.., "cpu_ns_per_pkt":..}, ...]}
+
+set -e
+
+ZPRD="$(realpath "${ZPRD:-./zprd}")"
+PKTGEN="$(realpath "${PKTGEN:-./zprd-pktgen}")"
+NODES="${NODES:-2}"
+TOPO="${TOPO:-mesh}"
+DURATION="${DURATION:-5}"
+SIZES="${SIZES:-64 512 1400}"
+PPS="${PPS:-0}"
+OUT="${OUT:-/dev/stdout}"
+PORT=9000
+
+[ "$(id -u)" = 0 ] || { echo "netns-bench: needs root" 1>&2; exit 1; }
+[ -x "$ZPRD" ] && [ -x "$PKTGEN" ] || { echo "netns-bench: zprd or zprd-pktgen not found" 1>&2; exit 1; }
+[ "$NODES" -ge 2 ] || { echo "netns-bench: NODES must be >= 2" 1>&2; exit 1; }
+
+WORKDIR="$(mktemp -d /tmp/zprd-bench.XXXXXX)"
+CLK_TCK="$(getconf CLK_TCK)"
+declare -a PIDS
+
+nsx() {
+  local ns="$1"; shift
+  ip netns exec "zb-$ns" "$@"
+}
+
+cleanup() {
+  set +e
+  for pid in "${PIDS[@]}"; do kill -INT "$pid" 2>/dev/null; done
+  sleep 0.5
+  for i in $(seq "$NODES"); do ip netns del "zb-$i" 2>/dev/null; done
+  ip netns del zb-hub 2>/dev/null
+  echo "netns-bench: logs are in $WORKDIR" 1>&2
+}
+trap cleanup EXIT
+
+setup() {
+  ip netns add zb-hub
+  ip -n zb-hub link add br0 type bridge
+  ip -n zb-hub link set br0 up
+
+  for i in $(seq "$NODES"); do
+    ip netns add "zb-$i"
+    ip -n zb-hub link add "v$i" type veth peer name eth0 netns "zb-$i"
+    ip -n zb-hub link set "v$i" master br0 up
+    ip -n "zb-$i" link set lo up
+    ip -n "zb-$i" addr add "192.168.77.$i/24" dev eth0
+    ip -n "zb-$i" link set eth0 up
+    ip -n "zb-$i" tuntap add mode tun zt0
+
+    local conf="$WORKDIR/node$i.conf"
+    {
+      echo "Izt0"
+      echo "A10.78.0.$i/24"
+      echo "C$WORKDIR/node$i.sock"
+      for j in $(seq "$NODES"); do
+        [ "$i" = "$j" ] && continue
+        if [ "$TOPO" = chain ] && [ "$j" -ne $((i - 1)) ] && [ "$j" -ne $((i + 1)) ]; then
+          continue
+        fi
+        echo "R192.168.77.$j"
+      done
+    } > "$conf"
+
+    # no nsx here: $! has to be the pid of zprd itself (ip netns exec uses exec)
+    ip netns exec "zb-$i" "$ZPRD" "C$conf" > "$WORKDIR/node$i.log" 2>&1 &
+    PIDS[$i]=$!
+  done
+
+  # wait until the routes are learned (the first packets are flooded)
+  local sinkpid
+  for try in $(seq 20); do
+    nsx "$NODES" timeout 3 "$PKTGEN" sink-udp "$PORT" > /dev/null &
+    sinkpid=$!
+    sleep 0.2
+    nsx 1 "$PKTGEN" rr "10.78.0.$NODES" "$PORT" 64 1 > "$WORKDIR/warmup.json" || true
+    wait "$sinkpid" || true
+    grep -q '"transactions":[1-9]' "$WORKDIR/warmup.json" && return 0
+  done
+  echo "netns-bench: tunnel didn't come up" 1>&2
+  exit 1
+}
+
+# cpu_ticks PID: utime + stime of a process in clock ticks
+cpu_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# zprd rx packet counters, via the control socket
+zprd_pkts() {
+  nsx "$1" "$PKTGEN" zstat "$WORKDIR/node$1.sock"
+}
+
+declare -a CPU0 PKTS0
+
+measure_begin() {
+  for i in $(seq "$NODES"); do
+    CPU0[$i]="$(cpu_ticks "${PIDS[$i]}")"
+    PKTS0[$i]="$(zprd_pkts "$i")"
+  done
+}
+
+# measure_end: prints the "cpu" JSON array
+measure_end() {
+  local sep="" cpu pkts
+  printf '['
+  for i in $(seq "$NODES"); do
+    cpu=$(( $(cpu_ticks "${PIDS[$i]}") - CPU0[i] ))
+    pkts=$(( $(zprd_pkts "$i") - PKTS0[i] ))
+    awk -v n="$i" -v c="$cpu" -v p="$pkts" -v hz="$CLK_TCK" -v sep="$sep" 'BEGIN {
+      ms = c * 1000 / hz
+      printf "%s{\"node\":%d,\"cpu_ms\":%.0f,\"pkts\":%d,\"cpu_ns_per_pkt\":%.0f}", sep, n, ms, p, (p ? ms * 1e6 / p : 0)
+    }'
+    sep=","
+  done
+  printf ']'
+}
+
+# run_test NAME SIZE SINKMODE GEN_ARGS...
+run_test() {
+  local name="$1" size="$2" sinkmode="$3"; shift 3
+  nsx "$NODES" "$PKTGEN" "$sinkmode" "$PORT" > "$WORKDIR/sink.json" &
+  local sinkpid=$!
+  sleep 0.3
+  measure_begin
+  nsx 1 "$PKTGEN" "$@" > "$WORKDIR/gen.json"
+  wait "$sinkpid"
+  local cpu
+  cpu="$(measure_end)"
+  printf '{"test":"%s","size":%s,"nodes":%s,"topo":"%s","gen":%s,"sink":%s,"cpu":%s}\n' \
+    "$name" "$size" "$NODES" "$TOPO" "$(cat "$WORKDIR/gen.json")" "$(cat "$WORKDIR/sink.json")" "$cpu" >> "$OUT"
+}
+
+setup
+DST="10.78.0.$NODES"
+
+for size in $SIZES; do
+  run_test udp "$size" sink-udp udp "$DST" "$PORT" "$size" "$DURATION" "$PPS"
+  run_test rr  "$size" sink-udp rr  "$DST" "$PORT" "$size" "$DURATION"
+done
+run_test tcp 0 sink-tcp tcp "$DST" "$PORT" "$DURATION"
@@ -0,0 +1,389 @@
+/**
+ * zprd / bench/zprd-bench.cxx - microbenchmarks for the routing primitives
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ *
+ * USAGE: zprd-bench [--quick] [FILTER]
+ *   --quick  use smaller iteration counts and table sizes
+ *   FILTER   only run benchmarks whose name starts with FILTER
+ *
+ * The results are printed as one JSON object to stdout, e.g.
+ *   {"results":[{"name":"inner_addr_hash","variant":"ipv4","n":1024,"iters":...,"ns_per_op":...},...]}
+ **/
+
+#include "AFa.hpp"
+#include "iAFa.hpp"
+#include "oAFa.hpp"
+#include "crest.h"
+#include "remote_peer.hpp"
+#include "routes.hpp"
+#include "sender.hpp"
+#include "zprd_conf.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// globals which are normally defined in main.cxx
+zprd_conf_t zprd_conf;
+time_t last_time;
+std::vector<local_fd_t> local_fds;
+std::array<int, ZOAF_MAX> server_fds = {{ -1, -1 }};
+std::vector<uplink_fd_t> uplink_fds;
+
+namespace {
+  struct result_t final {
+    string name, variant;
+    size_t n;
+    uint64_t iters;
+    double ns_per_op;
+  };
+
+  vector<result_t> results;
+  string filter;
+  bool quick = false;
+  mt19937_64 rng(0x7a707264);
+}
+
+template<typename T>
+static inline void keep(const T &x) noexcept
+  { asm volatile("" : : "r,m"(x) : "memory"); }
+
+static uint64_t now_ns() noexcept {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static bool wanted(const char *name) {
+  return filter.empty() || !strncmp(name, filter.c_str(), filter.size());
+}
+
+static uint64_t scale(const uint64_t iters) noexcept
+  { return quick ? std::max(iters / 20, static_cast<uint64_t>(1)) : iters; }
+
+/* bench: run fn (which has to return the elapsed time in ns for 'iters' operations)
+ *   several times and keep the best result
+ */
+static void bench(const char *name, const string &variant, const size_t n, uint64_t iters,
+                  const function<uint64_t (uint64_t)> &fn) {
+  if(!wanted(name)) return;
+  iters = scale(iters);
+  uint64_t best = UINT64_MAX;
+  for(unsigned run = 0; run < 5; ++run)
+    best = std::min(best, fn(iters));
+  results.push_back({name, variant, n, iters, static_cast<double>(best) / iters});
+  fprintf(stderr, "%-28s %-16s n=%-8zu %10.2f ns/op\n", name, variant.c_str(), n, results.back().ns_per_op);
+}
+
+template<typename Fn>
+static uint64_t timed(const Fn &fn) {
+  const uint64_t start = now_ns();
+  fn();
+  return now_ns() - start;
+}
+
+static inner_addr_t rand_inner(const bool v6) {
+  if(!v6) return inner_addr_t(static_cast<uint32_t>(rng()));
+  struct in6_addr a;
+  const uint64_t x = rng(), y = rng();
+  memcpy(a.s6_addr, &x, 8);
+  memcpy(a.s6_addr + 8, &y, 8);
+  return inner_addr_t(a);
+}
+
+static vector<inner_addr_t> rand_inners(const size_t n, const bool v6) {
+  vector<inner_addr_t> ret;
+  ret.reserve(n);
+  for(size_t i = 0; i < n; ++i)
+    ret.emplace_back(rand_inner(v6));
+  return ret;
+}
+
+static struct sockaddr_storage rand_saddr(const bool v6) {
+  struct sockaddr_storage ret;
+  zeroify(ret);
+  if(v6) {
+    auto &s6 = reinterpret_cast<struct sockaddr_in6&>(ret);
+    s6.sin6_family = AF_INET6;
+    s6.sin6_port = htons(45940);
+    const uint64_t x = rng();
+    memcpy(s6.sin6_addr.s6_addr + 8, &x, 8);
+  } else {
+    auto &s4 = reinterpret_cast<struct sockaddr_in&>(ret);
+    s4.sin_family = AF_INET;
+    s4.sin_port = htons(45940);
+    s4.sin_addr.s_addr = static_cast<uint32_t>(rng());
+  }
+  return ret;
+}
+
+static const char *afname(const bool v6) noexcept
+  { return v6 ? "ipv6" : "ipv4"; }
+
+static void bench_addr() {
+  const size_t n = 1024;
+  for(const bool v6 : {false, true}) {
+    const auto addrs = rand_inners(n, v6);
+
+    bench("inner_addr_hash", afname(v6), n, 20000000, [&](const uint64_t iters) {
+      const inner_addr_hash h;
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(h(addrs[i % n]));
+      });
+    });
+
+    auto copies = addrs;
+    bench("inner_addr_eq", string(afname(v6)) + "/equal", n, 20000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(addrs[i % n] == copies[i % n]);
+      });
+    });
+    bench("inner_addr_eq", string(afname(v6)) + "/differ", n, 20000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(addrs[i % n] == addrs[(i + 1) % n]);
+      });
+    });
+
+    vector<xner_addr_t> xaddrs, xcopies;
+    xaddrs.reserve(n);
+    xcopies.reserve(n);
+    for(const auto &i : addrs) {
+      xaddrs.emplace_back(i, v6 ? 64 : 24);
+      xcopies.emplace_back(i, v6 ? 64 : 24);
+    }
+    bench("xner_addr_eq", string(afname(v6)) + "/equal", n, 20000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(xaddrs[i % n] == xcopies[i % n]);
+      });
+    });
+
+    vector<struct sockaddr_storage> sas;
+    sas.reserve(n);
+    for(size_t i = 0; i < n; ++i)
+      sas.emplace_back(rand_saddr(v6));
+    bench("AFa_sa_compare", afname(v6), n, 20000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(AFa_sa_compare(sas[i % n], sas[(i + 1) % n]));
+      });
+    });
+
+    vector<outer_addr_t> oas(sas.cbegin(), sas.cend());
+    bench("AFa_oa_compare", afname(v6), n, 20000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(AFa_oa_compare(oas[i % n], oas[(i + 1) % n]));
+      });
+    });
+    bench("outer_addr_hash", afname(v6), n, 20000000, [&](const uint64_t iters) {
+      const outer_addr_hash h;
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(h(oas[i % n]));
+      });
+    });
+  }
+}
+
+typedef unordered_map<inner_addr_t, route_via_t, inner_addr_hash> routes_t;
+
+static void bench_routes() {
+  const auto router = make_shared<remote_peer_t>(rand_saddr(false));
+
+  for(const size_t n : {size_t(1000), size_t(100000), size_t(1000000)}) {
+    const size_t rn = quick ? std::max(n / 20, size_t(1000)) : n;
+    const auto addrs = rand_inners(rn, false), misses = rand_inners(rn, false);
+
+    // NOTE: iters <= rn
+    bench("routes_insert", "ipv4", rn, rn, [&](const uint64_t iters) {
+      routes_t routes;
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          routes[addrs[i]].add_router(router, 1);
+      });
+    });
+
+    routes_t routes;
+    routes.reserve(rn);
+    for(const auto &i : addrs)
+      routes[i].add_router(router, 1);
+
+    // walk the addresses in a random order, to get realistic cache misses
+    vector<size_t> order(rn);
+    for(size_t i = 0; i < rn; ++i) order[i] = i;
+    shuffle(order.begin(), order.end(), rng);
+
+    bench("routes_lookup", "ipv4/hit", rn, 5000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(routes.find(addrs[order[i % rn]]) != routes.end());
+      });
+    });
+    bench("routes_lookup", "ipv4/miss", rn, 5000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(routes.find(misses[order[i % rn]]) != routes.end());
+      });
+    });
+  }
+}
+
+static void bench_route_via() {
+  zprd_conf.max_near_rtt   = 5;
+  zprd_conf.remote_timeout = 300;
+  last_time = time(nullptr);
+
+  for(const size_t n : {size_t(1), size_t(4), size_t(16)}) {
+    vector<remote_peer_ptr_t> routers;
+    for(size_t i = 0; i < n; ++i)
+      routers.emplace_back(make_shared<remote_peer_t>(rand_saddr(false)));
+
+    route_via_t rvia;
+    for(const auto &i : routers)
+      rvia.add_router(i, 2);
+
+    // the router exists already -> refresh path (hot path of resolve_route)
+    bench("route_via_add_router", "existing", n, 10000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          keep(rvia.add_router(routers[i % n], 2));
+      });
+    });
+
+    bench("route_via_add_router", "new+del", n, 2000000, [&](const uint64_t iters) {
+      const auto xr = make_shared<remote_peer_t>(rand_saddr(false));
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i) {
+          keep(rvia.add_router(xr, 3));
+          keep(rvia.del_router(xr));
+        }
+      });
+    });
+
+    // nothing is outdated -> measures the sort
+    bench("route_via_cleanup", "fresh", n, 2000000, [&](const uint64_t iters) {
+      size_t removed = 0;
+      const std::function<void (const remote_peer_ptr_t&)> f = [&removed](const remote_peer_ptr_t&) { ++removed; };
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          rvia.cleanup(f);
+        keep(removed);
+      });
+    });
+
+    // all routers are near each other
+    bench("route_via_swap_near", "near", n, 5000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i)
+          rvia.swap_near_routers();
+      });
+    });
+  }
+}
+
+static void bench_cksum() {
+  alignas(4) char buf[1500];
+  for(auto &i : buf) i = static_cast<char>(rng());
+  for(const int n : {20, 64, 576, 1472}) {
+    bench("in_cksum", "bytes", n, 10000000, [&](const uint64_t iters) {
+      return timed([&] {
+        for(uint64_t i = 0; i < iters; ++i) {
+          keep(in_cksum(reinterpret_cast<const uint16_t*>(buf), n));
+          buf[i % 16] ^= 1;
+        }
+      });
+    });
+  }
+}
+
+/* the worker isn't started, so the sender benchmarks measure only the enqueue side (copy + lock + notify);
+ * the queue is discarded (untimed) after each batch, it would grow to iters * payload otherwise
+ */
+static constexpr uint64_t sender_batch = 4096;
+
+template<typename Fn>
+static uint64_t timed_sender(const uint64_t iters, const Fn &fn) {
+  uint64_t ret = 0;
+  for(uint64_t done = 0; done < iters; done += sender_batch) {
+    auto sender = make_unique<sender_t>();
+    const uint64_t cnt = std::min(sender_batch, iters - done);
+    ret += timed([&] { fn(*sender, done, done + cnt); });
+  }
+  return ret;
+}
+
+static void bench_sender() {
+  const size_t npeers = 8;
+  vector<remote_peer_ptr_t> peers;
+  for(size_t i = 0; i < npeers; ++i)
+    peers.emplace_back(make_shared<remote_peer_t>(rand_saddr(false)));
+
+  for(const size_t plen : {size_t(64), size_t(1400)}) {
+    vector<char> payload(plen, 'x');
+    bench("sender_enqueue", "data/1dest", plen, 1000000, [&](const uint64_t iters) {
+      return timed_sender(iters, [&](sender_t &sender, const uint64_t from, const uint64_t to) {
+        for(uint64_t i = from; i < to; ++i)
+          sender.enqueue(send_data{vector<char>(payload), {peers[i % npeers]}});
+      });
+    });
+  }
+
+  bench("sender_enqueue", "zprn/all", npeers, 1000000, [&](const uint64_t iters) {
+    zprn_v2 msg;
+    msg.zprn_cmd  = ZPRN_ROUTEMOD;
+    msg.zprn_prio = 1;
+    msg.route     = rand_inner(false);
+    return timed_sender(iters, [&](sender_t &sender, const uint64_t from, const uint64_t to) {
+      for(uint64_t i = from; i < to; ++i)
+        sender.enqueue(zprn2_sdat{msg, vector<remote_peer_ptr_t>(peers)});
+    });
+  });
+}
+
+static void print_json() {
+  printf("{\"results\":[");
+  bool first = true;
+  for(const auto &i : results) {
+    printf("%s{\"name\":\"%s\",\"variant\":\"%s\",\"n\":%zu,\"iters\":%" PRIu64 ",\"ns_per_op\":%.3f}",
+      first ? "" : ",", i.name.c_str(), i.variant.c_str(), i.n, i.iters, i.ns_per_op);
+    first = false;
+  }
+  puts("]}");
+}
+
+int main(int argc, char *argv[]) {
+  for(int i = 1; i < argc; ++i) {
+    const string cur = argv[i];
+    if(cur == "-h" || cur == "--help") {
+      puts("USAGE: zprd-bench [--quick] [FILTER]");
+      return 0;
+    } else if(cur == "--quick") {
+      quick = true;
+    } else {
+      filter = cur;
+    }
+  }
+
+  bench_addr();
+  bench_routes();
+  bench_route_via();
+  bench_cksum();
+  bench_sender();
+  print_json();
+  return 0;
+}
@@ -0,0 +1,303 @@
+/**
+ * zprd / bench/zprd-pktgen.cxx - traffic generator for bench/netns-bench.sh
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ *
+ * USAGE:
+ *   zprd-pktgen sink-udp PORT                  count + echo udp packets, report after 1s idle
+ *   zprd-pktgen sink-tcp PORT                  accept one stream, report bytes at EOF
+ *   zprd-pktgen udp HOST PORT SIZE SECS [PPS]  udp flood with fixed size (PPS = 0: unlimited)
+ *   zprd-pktgen rr  HOST PORT SIZE SECS        udp request/response (one outstanding request)
+ *   zprd-pktgen tcp HOST PORT SECS             tcp bulk transfer
+ *   zprd-pktgen zstat SOCKPATH                 print rx packet count from a zprd control socket
+ *
+ * All reports are single JSON lines on stdout. Latencies are measured with
+ * CLOCK_MONOTONIC, which is shared between network namespaces on one host.
+ **/
+
+#include "histogram.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+  enum { PG_MAGIC = 0x7a707067, PG_FLOOD = 1, PG_REQ = 2, PG_RESP = 3 };
+
+  struct pg_hdr_t final {
+    uint32_t magic, kind;
+    uint64_t seq, t_send;
+  };
+}
+
+static void print_latency(const char *key, const histogram_snap_t &h) {
+  printf(",\"%s\":{\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}", key,
+    h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.max / 1e3);
+}
+
+static bool make_sin(const char *host, const char *port, struct sockaddr_in &sin) {
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(atoi(port));
+  if(inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+    fprintf(stderr, "ERROR: invalid address '%s'\n", host);
+    return false;
+  }
+  return true;
+}
+
+static int bind_any(const int type, const char *port) {
+  const int fd = socket(AF_INET, type, 0);
+  if(fd < 0) { perror("socket()"); return -1; }
+  int optval = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  optval = 4 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(atoi(port));
+  if(bind(fd, reinterpret_cast<struct sockaddr*>(&sin), sizeof(sin)) < 0) {
+    perror("bind()");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int sink_udp(const char *port) {
+  const int fd = bind_any(SOCK_DGRAM, port);
+  if(fd < 0) return 1;
+
+  latency_histogram_t owd;
+  uint64_t pkts = 0, bytes = 0, max_seq = 0, t_first = 0, t_last = 0, echoed = 0;
+  char buf[0x10000];
+  struct pollfd pfd = { fd, POLLIN, 0 };
+
+  // wait up to 60s for the first packet, then stop after 1s idle
+  while(poll(&pfd, 1, (pkts || echoed) ? 1000 : 60000) > 0) {
+    struct sockaddr_in src;
+    socklen_t srclen = sizeof(src);
+    const ssize_t len = recvfrom(fd, buf, sizeof(buf), 0, reinterpret_cast<struct sockaddr*>(&src), &srclen);
+    if(len < static_cast<ssize_t>(sizeof(pg_hdr_t))) continue;
+    const auto h = reinterpret_cast<pg_hdr_t*>(buf);
+    if(h->magic != PG_MAGIC) continue;
+    const uint64_t now = zprd_now_ns();
+
+    if(h->kind == PG_REQ) {
+      h->kind = PG_RESP;
+      if(sendto(fd, buf, len, 0, reinterpret_cast<struct sockaddr*>(&src), srclen) == len)
+        ++echoed;
+      continue;
+    }
+
+    if(!pkts) t_first = now;
+    t_last = now;
+    ++pkts;
+    bytes += len;
+    if(h->seq > max_seq) max_seq = h->seq;
+    if(now > h->t_send) owd.record(now - h->t_send);
+  }
+  close(fd);
+
+  const double secs = (t_last - t_first) / 1e9;
+  printf("{\"role\":\"sink-udp\",\"pkts\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"echoed\":%" PRIu64 ",\"lost\":%" PRIu64
+         ",\"secs\":%.3f,\"pps\":%.0f,\"gbps\":%.4f",
+    pkts, bytes, echoed, pkts ? (max_seq + 1 - pkts) : 0, secs,
+    secs > 0 ? pkts / secs : 0, secs > 0 ? bytes * 8 / secs / 1e9 : 0);
+  print_latency("one_way", owd.snapshot());
+  puts("}");
+  return 0;
+}
+
+static int sink_tcp(const char *port) {
+  const int lfd = bind_any(SOCK_STREAM, port);
+  if(lfd < 0 || listen(lfd, 1) < 0) { perror("listen()"); return 1; }
+  const int fd = accept(lfd, nullptr, nullptr);
+  if(fd < 0) { perror("accept()"); return 1; }
+  close(lfd);
+
+  vector<char> buf(1 << 16);
+  uint64_t bytes = 0;
+  const uint64_t t_start = zprd_now_ns();
+  ssize_t len;
+  while((len = read(fd, buf.data(), buf.size())) > 0)
+    bytes += len;
+  const double secs = (zprd_now_ns() - t_start) / 1e9;
+  close(fd);
+
+  printf("{\"role\":\"sink-tcp\",\"bytes\":%" PRIu64 ",\"secs\":%.3f,\"gbps\":%.4f}\n",
+    bytes, secs, secs > 0 ? bytes * 8 / secs / 1e9 : 0);
+  return 0;
+}
+
+static int gen_udp(const char *host, const char *port, const size_t size, const unsigned secs, const uint64_t pps) {
+  struct sockaddr_in dst;
+  if(!make_sin(host, port, dst)) return 1;
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&dst), sizeof(dst)) < 0) {
+    perror("connect()");
+    return 1;
+  }
+
+  vector<char> buf(std::max(size, sizeof(pg_hdr_t)), 0);
+  const auto h = reinterpret_cast<pg_hdr_t*>(buf.data());
+  h->magic = PG_MAGIC;
+  h->kind  = PG_FLOOD;
+
+  const uint64_t t_start = zprd_now_ns(), t_end = t_start + secs * UINT64_C(1000000000);
+  const uint64_t gap = pps ? (UINT64_C(1000000000) / pps) : 0;
+  uint64_t sent = 0, errors = 0, now;
+  while((now = zprd_now_ns()) < t_end) {
+    if(gap && now < t_start + sent * gap) continue;
+    h->seq = sent;
+    h->t_send = now;
+    if(send(fd, buf.data(), buf.size(), 0) < 0) ++errors;
+    else ++sent;
+  }
+  close(fd);
+
+  const double dur = (zprd_now_ns() - t_start) / 1e9;
+  printf("{\"role\":\"udp\",\"size\":%zu,\"sent\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"secs\":%.3f,\"pps\":%.0f}\n",
+    buf.size(), sent, errors, dur, sent / dur);
+  return 0;
+}
+
+static int gen_rr(const char *host, const char *port, const size_t size, const unsigned secs) {
+  struct sockaddr_in dst;
+  if(!make_sin(host, port, dst)) return 1;
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&dst), sizeof(dst)) < 0) {
+    perror("connect()");
+    return 1;
+  }
+
+  vector<char> buf(std::max(size, sizeof(pg_hdr_t)), 0), rbuf(0x10000);
+  const auto h = reinterpret_cast<pg_hdr_t*>(buf.data());
+  h->magic = PG_MAGIC;
+  h->kind  = PG_REQ;
+
+  latency_histogram_t rtt;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  const uint64_t t_start = zprd_now_ns(), t_end = t_start + secs * UINT64_C(1000000000);
+  uint64_t seq = 0, done = 0, timeouts = 0;
+  while(zprd_now_ns() < t_end) {
+    h->seq = seq++;
+    h->t_send = zprd_now_ns();
+    if(send(fd, buf.data(), buf.size(), 0) < 0) continue;
+
+    // wait for the matching response, drop late ones
+    bool got = false;
+    while(!got && poll(&pfd, 1, 200) > 0) {
+      const ssize_t len = recv(fd, rbuf.data(), rbuf.size(), 0);
+      const auto rh = reinterpret_cast<const pg_hdr_t*>(rbuf.data());
+      if(len >= static_cast<ssize_t>(sizeof(pg_hdr_t)) && rh->magic == PG_MAGIC && rh->kind == PG_RESP && rh->seq == h->seq)
+        got = true;
+    }
+    if(got) {
+      rtt.record(zprd_now_ns() - h->t_send);
+      ++done;
+    } else {
+      ++timeouts;
+    }
+  }
+  close(fd);
+
+  const double dur = (zprd_now_ns() - t_start) / 1e9;
+  printf("{\"role\":\"rr\",\"size\":%zu,\"transactions\":%" PRIu64 ",\"timeouts\":%" PRIu64 ",\"secs\":%.3f,\"tps\":%.0f",
+    buf.size(), done, timeouts, dur, done / dur);
+  print_latency("rtt", rtt.snapshot());
+  puts("}");
+  return 0;
+}
+
+static int gen_tcp(const char *host, const char *port, const unsigned secs) {
+  struct sockaddr_in dst;
+  if(!make_sin(host, port, dst)) return 1;
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&dst), sizeof(dst)) < 0) {
+    perror("connect()");
+    return 1;
+  }
+
+  vector<char> buf(1 << 16, 'x');
+  uint64_t bytes = 0;
+  const uint64_t t_start = zprd_now_ns(), t_end = t_start + secs * UINT64_C(1000000000);
+  while(zprd_now_ns() < t_end) {
+    const ssize_t len = write(fd, buf.data(), buf.size());
+    if(len <= 0) { perror("write()"); break; }
+    bytes += len;
+  }
+  close(fd);
+
+  const double dur = (zprd_now_ns() - t_start) / 1e9;
+  printf("{\"role\":\"tcp\",\"bytes\":%" PRIu64 ",\"secs\":%.3f,\"gbps\":%.4f}\n", bytes, dur, bytes * 8 / dur / 1e9);
+  return 0;
+}
+
+// zstat: sum of "rx_pkts_local" and "rx_pkts_remote" from the stats response
+static int zstat(const char *path) {
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un sun;
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+  if(fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&sun), sizeof(sun)) < 0) {
+    perror("connect()");
+    return 1;
+  }
+  if(write(fd, "stats\n", 6) != 6) { perror("write()"); return 1; }
+
+  string resp;
+  char buf[4096];
+  ssize_t len;
+  while(resp.find('\n') == string::npos && (len = read(fd, buf, sizeof(buf))) > 0)
+    resp.append(buf, len);
+  close(fd);
+
+  uint64_t sum = 0;
+  for(const char *key : {"\"rx_pkts_local\":", "\"rx_pkts_remote\":"}) {
+    const size_t pos = resp.find(key);
+    if(pos == string::npos) {
+      fprintf(stderr, "ERROR: invalid stats response\n");
+      return 1;
+    }
+    sum += strtoull(resp.c_str() + pos + strlen(key), nullptr, 10);
+  }
+  printf("%" PRIu64 "\n", sum);
+  return 0;
+}
+
+static int usage() {
+  puts("USAGE: zprd-pktgen sink-udp PORT | sink-tcp PORT | udp HOST PORT SIZE SECS [PPS] |\n"
+       "                   rr HOST PORT SIZE SECS | tcp HOST PORT SECS | zstat SOCKPATH");
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  if(argc < 3) return usage();
+  const string mode = argv[1];
+  if(mode == "sink-udp")
+    return sink_udp(argv[2]);
+  if(mode == "sink-tcp")
+    return sink_tcp(argv[2]);
+  if(mode == "zstat")
+    return zstat(argv[2]);
+  if(mode == "udp" && argc >= 6)
+    return gen_udp(argv[2], argv[3], atoi(argv[4]), atoi(argv[5]), (argc > 6) ? strtoull(argv[6], nullptr, 10) : 0);
+  if(mode == "rr" && argc >= 6)
+    return gen_rr(argv[2], argv[3], atoi(argv[4]), atoi(argv[5]));
+  if(mode == "tcp" && argc >= 5)
+    return gen_tcp(argv[2], argv[3], atoi(argv[4]));
+  return usage();
+}
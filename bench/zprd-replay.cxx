@@ -0,0 +1,499 @@
+/**
+ * zprd / bench/zprd-replay.cxx - replays a pcap capture through the routing core
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ *
+ * USAGE: zprd-replay [-v] [-q] [-t] [-l LOOPS] [-p PEERS] [-i local|remote] [-r ROUTES] PCAP
+ *   -v  print the log output of the router
+ *   -q  don't measure the per-stage cost (saves 2-3 clock reads per packet)
+ *   -t  replay with the captured timing instead of max rate
+ *   -l  replay the capture LOOPS times (default 1)
+ *   -p  number of (fake) remote peers (default 4)
+ *   -i  local  = packets come from the tun device (default)
+ *       remote = packets come from a peer and are forwarded to another peer
+ *   -r  max count of learned routes (default 0 = unlimited), e.g. to measure
+ *       the eviction cost with a capture of spoofed source addresses
+ *
+ * The IP packets of the capture (classic pcap; ethernet, raw ip, linux cooked
+ * and loopback link types) are fed into router_t::route_genip_packet.
+ * Before the replay, a route to every destination address of the capture is
+ * added via one of the fake peers. The routed packets go into a stub sender,
+ * which queues them like sender_t and releases them in batches ("drain"),
+ * no sockets or tun devices are involved. This makes the tool well suited
+ * for profiling, e.g. perf record ./zprd-replay -q -l 100 trace.pcap
+ *
+ * Prints one JSON object to stdout, e.g.
+ *   {"pcap":"..","mode":"max","ingress":"local","loops":1,"pkts":..,"bytes":..,"elapsed_ms":..,
+ *    "pps":..,"mbit":..,"stages":[{"name":"route","ns_per_pkt":..,"p50_ns":..,"p99_ns":..,
+ *    "allocs_per_pkt":..,"alloc_bytes_per_pkt":..},...],"tx":{..},"drops":{..}}
+ *
+ * allocs are calls of operator new, ns_per_pkt includes the clock overhead
+ * (reported as clock_ns). The percentiles of "drain" are per batch.
+ **/
+
+#include "crest.h"
+#include "histogram.hpp"
+#include "iAFa.hpp"
+#include "remote_peer.hpp"
+#include "router.hpp"
+#include "sender.hpp"
+#include "stats.hpp"
+#include "zprd_conf.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+// globals which are normally defined in main.cxx
+zprd_conf_t zprd_conf;
+time_t last_time;
+std::vector<local_fd_t> local_fds;
+std::array<int, ZOAF_MAX> server_fds = {{ -1, -1 }};
+std::vector<uplink_fd_t> uplink_fds;
+
+// allocation accounting (the replay is single-threaded)
+static uint64_t alloc_cnt = 0, alloc_bytes = 0;
+
+void* operator new(const size_t n) {
+  ++alloc_cnt;
+  alloc_bytes += n;
+  if(void *const ret = malloc(n ? n : 1))
+    return ret;
+  fputs("zprd-replay: out of memory\n", stderr);
+  abort();
+}
+
+void* operator new[](const size_t n) { return operator new(n); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+namespace {
+  enum stage_t { ST_ROUTE, ST_ENQUEUE, ST_DRAIN, ST_MAX };
+  const char *const stage_names[ST_MAX] = { "route", "enqueue", "drain" };
+
+  struct stage_cnt_t final {
+    uint64_t ns = 0, allocs = 0, alloc_bytes = 0;
+    latency_histogram_t hist;
+  };
+
+  struct pkt_t final {
+    uint64_t ts_ns;
+    size_t off;
+    uint16_t len;
+  };
+
+  struct capture_t final {
+    vector<char> data;
+    vector<pkt_t> pkts;
+    size_t ipv4 = 0, ipv6 = 0, skipped = 0;
+  };
+
+  // cost of nested stages, which is subtracted from the enclosing one
+  struct nested_t final {
+    uint64_t ns = 0, allocs = 0, alloc_bytes = 0;
+  };
+
+  // collects the per-packet cost of a stage
+  class stage_timer_t final {
+    stage_cnt_t &_st;
+    nested_t *_parent;
+    uint64_t _t0, _a0, _b0;
+
+   public:
+    static bool enabled;
+
+    stage_timer_t(stage_cnt_t &st, nested_t *parent) noexcept
+      : _st(st), _parent(parent), _t0(enabled ? zprd_now_ns() : 0), _a0(alloc_cnt), _b0(alloc_bytes) { }
+
+    void stop(const nested_t &nested = {}) noexcept {
+      const uint64_t da = alloc_cnt - _a0, db = alloc_bytes - _b0;
+      const uint64_t d = enabled ? (zprd_now_ns() - _t0) : 0;
+      _st.allocs += da - nested.allocs;
+      _st.alloc_bytes += db - nested.alloc_bytes;
+      if(enabled) {
+        _st.ns += d - nested.ns;
+        _st.hist.record(d - nested.ns);
+      }
+      if(_parent) {
+        _parent->ns += d;
+        _parent->allocs += da;
+        _parent->alloc_bytes += db;
+      }
+    }
+  };
+
+  bool stage_timer_t::enabled = true;
+
+  /* stub_sender_t: queues packets like sender_t, the queue is released
+   * in batches of 'batch' packets (the sender worker takes the whole queue)
+   * and the send_data objects are recycled
+   */
+  class stub_sender_t final : public packet_sink_t {
+    vector<send_data> _q, _spares;
+    vector<zprn2_sdat> _zq;
+
+   public:
+    enum { batch = 64 };
+    stage_cnt_t stages[ST_MAX];
+    nested_t nested; // enqueue + drain during the current packet
+    uint64_t tx_pkts = 0, tx_dests = 0, tx_local = 0, tx_bytes = 0, zprn_msgs = 0;
+
+    stub_sender_t() { _q.reserve(batch); _spares.reserve(batch); }
+
+    void enqueue(send_data &&dat) override {
+      {
+        stage_timer_t tm(stages[ST_ENQUEUE], &nested);
+        if(!dat.dests.empty() && dat.dests.front()->is_local())
+          dat.dests.clear();
+        _q.emplace_back(move(dat));
+        if(!_spares.empty()) {
+          dat = move(_spares.back());
+          _spares.pop_back();
+        }
+        tm.stop();
+      }
+      if(_q.size() >= batch) drain();
+    }
+
+    void enqueue(zprn2_sdat &&dat) override {
+      ++zprn_msgs;
+      _zq.emplace_back(move(dat));
+    }
+
+    void drain() {
+      stage_timer_t tm(stages[ST_DRAIN], &nested);
+      for(auto &i : _q) {
+        ++tx_pkts;
+        if(i.dests.empty()) ++tx_local;
+        tx_dests += i.dests.size();
+        tx_bytes += i.buffer.size() * i.dests.size();
+        i.buffer.clear();
+        i.dests.clear();
+        _spares.emplace_back(move(i));
+      }
+      _q.clear();
+      _zq.clear();
+      tm.stop();
+    }
+  };
+
+  bool verbose = false, timed = false, remote_ingress = false;
+  size_t loops = 1, peer_cnt = 4, max_learned = 0;
+}
+
+template<typename T>
+static T pcap_get(const char *p, const bool swapped) noexcept {
+  T ret;
+  memcpy(&ret, p, sizeof(ret));
+  if(swapped) {
+    switch(sizeof(T)) {
+      case 2: ret = __builtin_bswap16(ret); break;
+      case 4: ret = __builtin_bswap32(ret); break;
+      default: break;
+    }
+  }
+  return ret;
+}
+
+/* ip_offset: returns the offset of the ip header in a frame of the given link type
+ *   or -1 if the frame doesn't contain an ip packet
+ */
+static ssize_t ip_offset(const uint32_t linktype, const char *frame, const size_t len) noexcept {
+  const auto u8 = reinterpret_cast<const unsigned char*>(frame);
+  const auto be16 = [u8](size_t o) noexcept -> uint16_t { return (u8[o] << 8) | u8[o + 1]; };
+  switch(linktype) {
+    case 0:   // BSD loopback (AF_ in host byte order)
+    case 108: // OpenBSD loopback (AF_ in network byte order)
+      return (len >= 4) ? 4 : -1;
+
+    case 1: // ethernet
+      {
+        size_t off = 12;
+        while(off + 2 <= len) {
+          const uint16_t et = be16(off);
+          if(et == 0x8100 || et == 0x88a8) { off += 4; continue; } // VLAN tags
+          return (et == 0x0800 || et == 0x86dd) ? static_cast<ssize_t>(off + 2) : -1;
+        }
+        return -1;
+      }
+
+    case 12:  // raw ip (OpenBSD)
+    case 14:  // raw ip
+    case 101: // raw ip
+    case 228: // ipv4
+    case 229: // ipv6
+      return 0;
+
+    case 113: // linux cooked capture
+      return (len >= 16 && (be16(14) == 0x0800 || be16(14) == 0x86dd)) ? 16 : -1;
+
+    case 276: // linux cooked capture v2
+      return (len >= 20 && (be16(0) == 0x0800 || be16(0) == 0x86dd)) ? 20 : -1;
+
+    default:
+      return -1;
+  }
+}
+
+static bool load_pcap(const char *path, capture_t &cap) {
+  FILE *const f = fopen(path, "rb");
+  if(!f) {
+    perror("fopen()");
+    return false;
+  }
+
+  bool ret = false;
+  char ghdr[24], phdr[16];
+  vector<char> frame;
+  bool swapped, nsec;
+  uint32_t linktype;
+
+  if(fread(ghdr, sizeof(ghdr), 1, f) != 1) {
+    fprintf(stderr, "zprd-replay: %s: too short\n", path);
+    goto out;
+  }
+
+  switch(pcap_get<uint32_t>(ghdr, false)) {
+    case 0xa1b2c3d4: swapped = false; nsec = false; break;
+    case 0xd4c3b2a1: swapped = true;  nsec = false; break;
+    case 0xa1b23c4d: swapped = false; nsec = true;  break;
+    case 0x4d3cb2a1: swapped = true;  nsec = true;  break;
+    case 0x0a0d0d0a:
+      fprintf(stderr, "zprd-replay: %s: pcapng isn't supported, convert it with 'editcap -F pcap'\n", path);
+      goto out;
+    default:
+      fprintf(stderr, "zprd-replay: %s: not a pcap file\n", path);
+      goto out;
+  }
+  linktype = pcap_get<uint32_t>(ghdr + 20, swapped) & 0xffff;
+
+  while(fread(phdr, sizeof(phdr), 1, f) == 1) {
+    const uint64_t ts_sec  = pcap_get<uint32_t>(phdr, swapped);
+    const uint64_t ts_frac = pcap_get<uint32_t>(phdr + 4, swapped);
+    const uint32_t caplen  = pcap_get<uint32_t>(phdr + 8, swapped);
+    const uint32_t origlen = pcap_get<uint32_t>(phdr + 12, swapped);
+    if(caplen > 0x40000) {
+      fprintf(stderr, "zprd-replay: %s: invalid record (caplen = %u)\n", path, caplen);
+      goto out;
+    }
+    frame.resize(caplen);
+    if(caplen && fread(frame.data(), caplen, 1, f) != 1) {
+      fprintf(stderr, "zprd-replay: %s: truncated record\n", path);
+      break;
+    }
+
+    const ssize_t off = ip_offset(linktype, frame.data(), caplen);
+    const size_t iplen = (off < 0) ? 0 : (caplen - off);
+    // skip truncated captures (snaplen) and non-ip frames
+    if(off < 0 || caplen != origlen || iplen < sizeof(struct ip) || iplen > 0xffff) {
+      ++cap.skipped;
+      continue;
+    }
+    switch(frame[off] >> 4 & 0xf) {
+      case 4: ++cap.ipv4; break;
+      case 6:
+        if(iplen < sizeof(struct ip6_hdr)) {
+          ++cap.skipped;
+          continue;
+        }
+        ++cap.ipv6;
+        break;
+      default:
+        ++cap.skipped;
+        continue;
+    }
+
+    cap.pkts.push_back({ts_sec * 1000000000 + (nsec ? ts_frac : ts_frac * 1000),
+                        cap.data.size(), static_cast<uint16_t>(iplen)});
+    cap.data.insert(cap.data.end(), frame.begin() + off, frame.end());
+  }
+  ret = true;
+
+ out:
+  fclose(f);
+  return ret;
+}
+
+static sockaddr_storage fake_peer_addr(const uint32_t idx) noexcept {
+  sockaddr_storage ret;
+  zeroify(ret);
+  auto &sin = reinterpret_cast<sockaddr_in&>(ret);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(zprd_conf.data_port);
+  sin.sin_addr.s_addr = htonl(0xc0000200 | (idx + 1)); // 192.0.2.x
+  return ret;
+}
+
+static inner_addr_t pkt_dest(const char *buf) noexcept {
+  if((buf[0] >> 4 & 0xf) == 4)
+    return inner_addr_t(reinterpret_cast<const struct ip*>(buf)->ip_dst.s_addr);
+  return inner_addr_t(reinterpret_cast<const struct ip6_hdr*>(buf)->ip6_dst);
+}
+
+// preload: create the fake peers and add a route to every destination of the capture
+static void preload(router_t &router, const capture_t &cap) {
+  for(uint32_t i = 0; i < peer_cnt; ++i)
+    router.intern_peer(make_shared<remote_peer_detail_t>(fake_peer_addr(i)));
+
+  // with remote ingress, the first peer is the source and not used as next hop
+  const size_t first = remote_ingress ? 1 : 0;
+  const size_t nhops = router.remotes.size() - first;
+  inner_addr_hash h;
+  for(const auto &i : cap.pkts) {
+    const auto dest = pkt_dest(cap.data.data() + i.off);
+    auto &r = router.routes[dest];
+    if(r.empty())
+      r.add_router(router.remotes[first + h(dest) % nhops], 1);
+  }
+}
+
+static void print_stage(FILE *out, const char *name, const stage_cnt_t &st, const uint64_t pkts, const bool last) {
+  const auto hs = st.hist.snapshot();
+  const double n = pkts ? pkts : 1;
+  fprintf(out, "{\"name\":\"%s\",\"ns_per_pkt\":%.1f,\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+         ",\"allocs_per_pkt\":%.3f,\"alloc_bytes_per_pkt\":%.1f}%s",
+    name, st.ns / n, hs.percentile(0.5), hs.percentile(0.99),
+    st.allocs / n, st.alloc_bytes / n, last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+  const char *const usage = "USAGE: zprd-replay [-v] [-q] [-t] [-l LOOPS] [-p PEERS] [-i local|remote] [-r ROUTES] PCAP\n";
+  const char *path = nullptr;
+  for(int i = 1; i < argc; ++i) {
+    const string cur = argv[i];
+    const bool has_arg = (i + 1 < argc);
+    if(cur == "-v") verbose = true;
+    else if(cur == "-q") stage_timer_t::enabled = false;
+    else if(cur == "-t") timed = true;
+    else if(cur == "-l" && has_arg) loops = max(1, atoi(argv[++i]));
+    else if(cur == "-p" && has_arg) peer_cnt = max(2, atoi(argv[++i]));
+    else if(cur == "-i" && has_arg) remote_ingress = !strcmp(argv[++i], "remote");
+    else if(cur == "-r" && has_arg) max_learned = strtoul(argv[++i], nullptr, 10);
+    else if(cur == "-h" || cur == "--help") {
+      fputs(usage, stdout);
+      return 0;
+    } else if(!path && cur[0] != '-') path = argv[i];
+    else {
+      fputs(usage, stderr);
+      return 1;
+    }
+  }
+  if(!path) {
+    fputs(usage, stderr);
+    return 1;
+  }
+
+  capture_t cap;
+  if(!load_pcap(path, cap))
+    return 1;
+  if(cap.pkts.empty()) {
+    fprintf(stderr, "zprd-replay: %s: no ip packets found\n", path);
+    return 1;
+  }
+
+  // the router logs to stdout, keep the results apart
+  FILE *const out = fdopen(dup(STDOUT_FILENO), "w");
+  if(!out || (!verbose && !freopen("/dev/null", "w", stdout))) {
+    perror("zprd-replay: stdout");
+    return 1;
+  }
+
+  zprd_conf.data_port = 45940;
+  zprd_conf.remote_timeout = 300;
+  zprd_conf.max_near_rtt = 5;
+  zprd_conf.preferred_af = AF_INET;
+  last_time = time(nullptr);
+  inner_addr_hash_seed_random();
+
+  stub_sender_t sink;
+  router_t router(sink);
+  router.max_learned_routes = max_learned;
+  // an address which doesn't appear in the capture
+  router.locals.emplace_back(inner_addr_t(htonl(0xc6120001)), 32); // 198.18.0.1
+  preload(router, cap);
+  const auto ingress = remote_ingress ? router.remotes.front() : router.local_router;
+  const size_t routes_cnt = router.routes.size();
+
+  fprintf(stderr, "zprd-replay: %zu packets (%zu skipped), %zu routes via %zu peers\n",
+    cap.pkts.size(), cap.skipped, routes_cnt, router.remotes.size());
+
+  // clock overhead
+  uint64_t clock_ns;
+  {
+    const uint64_t t0 = zprd_now_ns();
+    for(unsigned i = 0; i < 1000; ++i) (void) zprd_now_ns();
+    clock_ns = (zprd_now_ns() - t0) / 1001;
+  }
+
+  vector<char> buf(0x10000);
+  uint64_t pkts = 0, bytes = 0, max_lag = 0;
+  const uint64_t t_start = zprd_now_ns();
+
+  for(size_t l = 0; l < loops; ++l) {
+    const uint64_t t_loop = zprd_now_ns(), ts0 = cap.pkts.front().ts_ns;
+    for(const auto &p : cap.pkts) {
+      if(timed) {
+        const uint64_t due = t_loop + (p.ts_ns - ts0);
+        uint64_t now = zprd_now_ns();
+        if(now + 100000 < due) {
+          const uint64_t d = due - now - 50000;
+          const struct timespec ts = { static_cast<time_t>(d / 1000000000), static_cast<long>(d % 1000000000) };
+          nanosleep(&ts, nullptr);
+        }
+        while((now = zprd_now_ns()) < due) { }
+        max_lag = max(max_lag, now - due);
+      }
+      if(!(pkts & 255)) last_time = time(nullptr);
+
+      // the router modifies the packet (ttl, checksum)
+      memcpy(buf.data(), cap.data.data() + p.off, p.len);
+      sink.nested = {};
+      stage_timer_t tm(sink.stages[ST_ROUTE], nullptr);
+      router.route_genip_packet(ingress, buf.data(), p.len, stage_timer_t::enabled ? zprd_now_ns() : 0);
+      tm.stop(sink.nested);
+      ++pkts;
+      bytes += p.len;
+    }
+  }
+  sink.drain();
+  const uint64_t elapsed = zprd_now_ns() - t_start;
+
+  fprintf(out, "{\"pcap\":\"%s\",\"mode\":\"%s\",\"ingress\":\"%s\",\"loops\":%zu,\"pkts\":%" PRIu64
+               ",\"bytes\":%" PRIu64 ",\"ipv4\":%zu,\"ipv6\":%zu,\"skipped\":%zu,\"routes\":%zu,\"peers\":%zu",
+    path, timed ? "timed" : "max", remote_ingress ? "remote" : "local", loops, pkts, bytes,
+    cap.ipv4 * loops, cap.ipv6 * loops, cap.skipped, routes_cnt, router.remotes.size());
+  fprintf(out, ",\"routes_end\":%zu,\"route_evictions\":%" PRIu64, router.routes.size(), zprd_stats.snapshot().route_evictions);
+  fprintf(out, ",\"elapsed_ms\":%.1f,\"pps\":%.0f,\"mbit\":%.1f,\"clock_ns\":%" PRIu64,
+    elapsed / 1e6, pkts * 1e9 / elapsed, bytes * 8e3 / elapsed, clock_ns);
+  if(timed)
+    fprintf(out, ",\"max_lag_us\":%.1f", max_lag / 1e3);
+
+  fputs(",\"stages\":[", out);
+  for(unsigned i = 0; i < ST_MAX; ++i)
+    print_stage(out, stage_names[i], sink.stages[i], pkts, i + 1 == ST_MAX);
+
+  fprintf(out, "],\"tx\":{\"pkts\":%" PRIu64 ",\"remote\":%" PRIu64 ",\"local\":%" PRIu64
+               ",\"bytes\":%" PRIu64 ",\"zprn_msgs\":%" PRIu64 "},\"drops\":{",
+    sink.tx_pkts, sink.tx_dests, sink.tx_local, sink.tx_bytes, sink.zprn_msgs);
+  const auto st = zprd_stats.snapshot();
+  for(unsigned i = 0; i < ZDROP_MAX; ++i)
+    fprintf(out, "%s\"%s\":%" PRIu64, i ? "," : "", zprd_drop_reason2str(static_cast<zprd_drop_reason_t>(i)), st.drops[i]);
+  fputs("}}\n", out);
+  fclose(out);
+  return 0;
+}
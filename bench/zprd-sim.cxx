@@ -0,0 +1,1103 @@
+/**
+ * zprd / bench/zprd-sim.cxx - in-process mesh simulator for convergence benchmarks
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ *
+ * USAGE: zprd-sim [-v] SCENARIO...
+ *   -v  print the log output of the routers
+ *
+ * Runs many router_t instances in one process, connected via an in-memory
+ * transport with per-link latency, jitter and loss. The time is simulated,
+ * so a scenario of some minutes runs in a fraction of a second.
+ * See bench/scenarios/README for the scenario format.
+ *
+ * For each scenario one JSON line is printed to stdout, e.g.
+ *   {"scenario":"ring16","nodes":16,"links":16,"phases":[{"event":"start","t_ms":0,
+ *    "converged_ms":..,"reach_ms":..,"ctl":{..},"walk":{..},"probes":{..}},...],"per_node":[..]}
+ *
+ * converged_ms : time from the event until the last change of any primary route
+ * reach_ms     : time until every pair of connected nodes reaches each other
+ *                by following the routing tables (-1 = never)
+ * walk         : transient blackholes / loops found by walking the routing tables
+ *                at every sample (pair_s = pairs * seconds)
+ * probes       : data plane probes (UDP packets between random node pairs)
+ * mcast        : multicast probes (UDP packets to a group), expected = receivers
+ *                joined at send time (all reachable nodes for 255.255.255.255 and
+ *                in TAP mode), tx = link transmissions of these packets
+ **/
+
+#define __USE_MISC 1
+#include <sys/types.h>
+#include "crest.h"
+#include "iAFa.hpp"
+#include "l2.hpp"
+#include "remote_peer.hpp"
+#include "router.hpp"
+#include "sender.hpp"
+#include "zprd_conf.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/igmp.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// globals which are normally defined in main.cxx
+zprd_conf_t zprd_conf;
+time_t last_time;
+std::vector<local_fd_t> local_fds;
+std::array<int, ZOAF_MAX> server_fds = {{ -1, -1 }};
+std::vector<uplink_fd_t> uplink_fds;
+
+namespace {
+  // the simulated clock starts at this unix time
+  constexpr time_t sim_epoch = 1000000000;
+  constexpr uint32_t probe_magic = 0x5a53494d; // "ZSIM"
+  constexpr uint32_t mprobe_magic = 0x5a4d4353; // "ZMCS"
+  constexpr uint64_t probe_timeout_us = 2000000;
+
+  struct link_t final {
+    bool up = true;
+    uint32_t latency_us, jitter_us;
+    double loss;
+    // serialization: the transmit queue of each direction is busy until ...
+    uint64_t busy_until[2] = {0, 0};
+  };
+
+  enum sim_event_type_t : uint8_t {
+    EV_DELIVER, EV_CLEANUP, EV_SAMPLE, EV_PROBE, EV_MPROBE, EV_ACTION
+  };
+
+  struct event_t final {
+    uint64_t t, seq;
+    sim_event_type_t type;
+    uint32_t a, b;
+    vector<char> buf;
+  };
+
+  struct event_later final {
+    bool operator()(const event_t &x, const event_t &y) const noexcept
+      { return tie(x.t, x.seq) > tie(y.t, y.seq); }
+  };
+
+  struct action_t final {
+    uint64_t t;
+    vector<string> args;
+  };
+
+  struct probe_t final {
+    uint32_t src, dst, phase;
+    uint64_t t_sent, t_delivered;
+    uint32_t copies;
+    bool looped, lossy;
+    vector<uint32_t> visited;
+  };
+
+  struct mprobe_t final {
+    uint32_t src, phase;
+    uint64_t t_sent;
+    uint32_t expected, tx;
+    // copies delivered to the tun device, index = node
+    vector<uint8_t> copies;
+  };
+
+  struct ctl_cnt_t final {
+    uint64_t pkts = 0, bytes = 0;
+  };
+
+  struct phase_t final {
+    string event;
+    uint64_t t_start;
+    uint64_t t_last_change = 0, t_reach = 0;
+    bool reached = false;
+    uint64_t route_changes = 0, samples = 0;
+    ctl_cnt_t ctl, data;
+    uint64_t queue_drops = 0;
+    vector<uint64_t> ctl_bytes_per_node;
+    size_t max_blackhole_pairs = 0, max_loop_pairs = 0;
+    double blackhole_pair_s = 0, loop_pair_s = 0;
+    size_t final_ok = 0, final_blackhole = 0, final_loop = 0, final_pairs = 0;
+  };
+
+  class simulator_t;
+
+  // sim_node_t: one zprd instance, the tun device and the sender are simulated
+  struct sim_node_t final : packet_sink_t {
+    simulator_t &sim;
+    uint32_t idx;
+    bool up;
+    bool dirty;
+    sockaddr_storage outer;
+    inner_addr_t inner;
+    router_t router;
+    zprn2_packer_t packer;
+    ctl_cnt_t ctl_tx, ctl_rx;
+
+    sim_node_t(simulator_t &s, uint32_t i);
+    void enqueue(send_data &&dat) override;
+    void enqueue(zprn2_sdat &&dat) override;
+  };
+
+  class simulator_t final {
+   public:
+    string name;
+    size_t node_cnt = 0;
+    uint32_t latency_us = 1000, jitter_us = 0;
+    double loss = 0;
+    // link bandwidth in bit/s, packets which would wait longer than queue_us are dropped
+    double bandwidth = 10e6;
+    uint64_t queue_us = 50000;
+    time_t timeout = 8;
+    uint64_t seed = 1, sample_us = 100000, end_us = 60000000;
+    double probe_rate = 0;
+    uint64_t probe_start_us = 0;
+    // multicast probes: rate, source node, group (network byte order)
+    double mprobe_rate = 0;
+    uint32_t mprobe_src = 0, mprobe_group = 0;
+    // TAP mode: the packets are sent as ethernet frames
+    bool tap = false;
+    string topo = "none";
+    size_t topo_arg = 0;
+    vector<pair<uint32_t, uint32_t>> extra_links;
+    vector<action_t> actions;
+
+    vector<unique_ptr<sim_node_t>> nodes; // index 0 is unused
+    map<pair<uint32_t, uint32_t>, link_t> links;
+    vector<uint32_t> group, component;
+    vector<probe_t> probes;
+    vector<mprobe_t> mprobes;
+    // joined[group] = receivers per node
+    map<uint32_t, vector<bool>> joined;
+    vector<phase_t> phases;
+
+    uint64_t now = 0;
+
+    bool parse(const string &path);
+    void run();
+    void print(FILE *out) const;
+
+    link_t *get_link(uint32_t a, uint32_t b) {
+      if(a > b) swap(a, b);
+      const auto it = links.find({a, b});
+      return (it == links.end()) ? nullptr : &it->second;
+    }
+
+    const link_t *get_link(const uint32_t a, const uint32_t b) const
+      { return const_cast<simulator_t*>(this)->get_link(a, b); }
+
+    bool usable(const uint32_t a, const uint32_t b) const {
+      const auto l = get_link(a, b);
+      return l && l->up && nodes[a]->up && nodes[b]->up && group[a] == group[b];
+    }
+
+    void mark_dirty(sim_node_t &n) {
+      if(n.dirty) return;
+      n.dirty = true;
+      _dirty.push_back(n.idx);
+    }
+
+    void transmit(sim_node_t &from, const remote_peer_ptr_t &dest, const vector<char> &buf, bool is_ctl);
+    void deliver_local(sim_node_t &n, const vector<char> &buf);
+
+   private:
+    mt19937_64 _rng;
+    priority_queue<event_t, vector<event_t>, event_later> _events;
+    uint64_t _seq = 0, _last_fp = 0;
+    vector<uint32_t> _dirty;
+
+    void push(uint64_t t, sim_event_type_t type, uint32_t a = 0, uint32_t b = 0, vector<char> &&buf = {}) {
+      _events.push(event_t{t, _seq++, type, a, b, move(buf)});
+    }
+
+    double uniform() { return uniform_real_distribution<double>(0, 1)(_rng); }
+
+    void build_topology();
+    void start_node(uint32_t i);
+    void update_components();
+    bool do_action(const action_t &act);
+    void new_phase(const string &ev);
+    void flush_dirty();
+    void send_probe();
+    void send_mprobe();
+    void send_igmp(uint32_t node, uint32_t group, bool join);
+    void send_local(sim_node_t &n, char *buf, size_t len);
+    void sample();
+    uint64_t fingerprint() const;
+    int walk(uint32_t s, uint32_t d) const;
+    probe_t *find_probe(const char *buf, size_t len, bool via_icmp);
+    mprobe_t *find_mprobe(const char *buf, size_t len);
+    uint32_t peer2idx(const remote_peer_t &p) const noexcept;
+  };
+
+  bool verbose = false;
+}
+
+static sockaddr_storage sim_outer_addr(const uint32_t idx) noexcept {
+  sockaddr_storage ret;
+  zeroify(ret);
+  auto &sin = reinterpret_cast<sockaddr_in&>(ret);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(zprd_conf.data_port);
+  sin.sin_addr.s_addr = htonl(0xac100000 | idx); // 172.16.x.y
+  return ret;
+}
+
+static uint32_t sim_inner_addr(const uint32_t idx) noexcept
+  { return htonl(0x0a000001 | (idx << 8)); } // 10.x.y.1
+
+static string sim_outer_str(const uint32_t idx) {
+  char tmp[INET_ADDRSTRLEN];
+  const auto ss = sim_outer_addr(idx);
+  return inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in&>(ss).sin_addr, tmp, sizeof(tmp));
+}
+
+sim_node_t::sim_node_t(simulator_t &s, const uint32_t i)
+  : sim(s), idx(i), up(false), dirty(false), outer(sim_outer_addr(i)),
+    inner(sim_inner_addr(i)), router(*this) { router.tap = s.tap; }
+
+void sim_node_t::enqueue(send_data &&dat) {
+  // ^ sender_t::enqueue
+  if(!up || dat.dests.empty()) return;
+  if(dat.dests.front()->is_local()) {
+    sim.deliver_local(*this, dat.buffer);
+    return;
+  }
+  for(const auto &i : dat.dests)
+    sim.transmit(*this, i, dat.buffer, false);
+}
+
+void sim_node_t::enqueue(zprn2_sdat &&dat) {
+  if(!up) return;
+  const auto ie = dat.dests.end();
+  dat.dests.erase(remove_if(dat.dests.begin(), ie,
+    [](const auto &x) noexcept { return !x || x->is_local(); }), ie);
+  if(dat.dests.empty()) return;
+  // the messages are batched until the current event is handled, like in sender_t::worker_fn
+  packer.add(dat);
+  sim.mark_dirty(*this);
+}
+
+uint32_t simulator_t::peer2idx(const remote_peer_t &p) const noexcept {
+  if(p.saddr.family != AF_INET) return 0;
+  uint32_t a;
+  memcpy(&a, p.saddr.addr, sizeof(a));
+  a = ntohl(a);
+  if((a & 0xffff0000) != 0xac100000) return 0;
+  const uint32_t i = a & 0xffff;
+  return (i && i <= node_cnt) ? i : 0;
+}
+
+// TAP mode: skip the encapsulation + ethernet header of a frame
+static void sim_skip_l2(const char *&buf, size_t &len) noexcept {
+  constexpr size_t hlen = sizeof(struct zprd_l2hdr) + 14;
+  if(zprd_is_l2(buf, len) && len >= hlen) {
+    buf += hlen;
+    len -= hlen;
+  }
+}
+
+// TAP mode: per-node MAC address 02:00:00:00:xx:xx
+static void sim_node_mac(uint8_t mac[6], const uint32_t idx) noexcept {
+  const uint8_t tmp[6] = { 0x02, 0, 0, 0, static_cast<uint8_t>(idx >> 8), static_cast<uint8_t>(idx) };
+  memcpy(mac, tmp, 6);
+}
+
+probe_t *simulator_t::find_probe(const char *buf, size_t len, const bool via_icmp) {
+  sim_skip_l2(buf, len);
+  if(len < sizeof(struct ip)) return nullptr;
+  const auto h_ip = reinterpret_cast<const struct ip*>(buf);
+  if(h_ip->ip_v != 4) return nullptr;
+
+  if(via_icmp) {
+    // the ICMP error message contains the original ip header
+    if(h_ip->ip_p != IPPROTO_ICMP || len < 2 * sizeof(struct ip) + sizeof(struct icmphdr))
+      return nullptr;
+    const auto o_ip = reinterpret_cast<const struct ip*>(buf + sizeof(struct ip) + sizeof(struct icmphdr));
+    if(o_ip->ip_p != IPPROTO_UDP) return nullptr;
+    const uint16_t pid = ntohs(o_ip->ip_id);
+    // the newest probe with these id bits
+    for(size_t i = probes.size(); i; --i) {
+      auto &p = probes[i - 1];
+      if(((i - 1) & 0xffff) == pid && o_ip->ip_dst.s_addr == sim_inner_addr(p.dst))
+        return &p;
+    }
+    return nullptr;
+  }
+
+  if(h_ip->ip_p != IPPROTO_UDP || len < sizeof(struct ip) + sizeof(struct udphdr) + 8)
+    return nullptr;
+  uint32_t magic, id;
+  memcpy(&magic, buf + sizeof(struct ip) + sizeof(struct udphdr), 4);
+  memcpy(&id, buf + sizeof(struct ip) + sizeof(struct udphdr) + 4, 4);
+  if(magic != htonl(probe_magic) || id >= probes.size()) return nullptr;
+  return &probes[id];
+}
+
+mprobe_t *simulator_t::find_mprobe(const char *buf, size_t len) {
+  sim_skip_l2(buf, len);
+  if(len < sizeof(struct ip) + sizeof(struct udphdr) + 8) return nullptr;
+  const auto h_ip = reinterpret_cast<const struct ip*>(buf);
+  if(h_ip->ip_v != 4 || h_ip->ip_p != IPPROTO_UDP || h_ip->ip_dst.s_addr != mprobe_group)
+    return nullptr;
+  uint32_t magic, id;
+  memcpy(&magic, buf + sizeof(struct ip) + sizeof(struct udphdr), 4);
+  memcpy(&id, buf + sizeof(struct ip) + sizeof(struct udphdr) + 4, 4);
+  if(magic != htonl(mprobe_magic) || id >= mprobes.size()) return nullptr;
+  return &mprobes[id];
+}
+
+void simulator_t::transmit(sim_node_t &from, const remote_peer_ptr_t &dest, const vector<char> &buf, const bool is_ctl) {
+  auto &ph = phases.back();
+  (is_ctl ? ph.ctl : ph.data).pkts++;
+  (is_ctl ? ph.ctl : ph.data).bytes += buf.size();
+  if(is_ctl) {
+    from.ctl_tx.pkts++;
+    from.ctl_tx.bytes += buf.size();
+    ph.ctl_bytes_per_node[from.idx] += buf.size();
+  }
+
+  const uint32_t to = peer2idx(*dest);
+  probe_t *const probe = is_ctl ? nullptr : find_probe(buf.data(), buf.size(), false);
+  if(!is_ctl)
+    if(const auto mp = find_mprobe(buf.data(), buf.size()))
+      ++mp->tx;
+  if(!to || !usable(from.idx, to))
+    return;
+
+  auto &l = *get_link(from.idx, to);
+  if(l.loss > 0 && uniform() < l.loss) {
+    if(probe) probe->lossy = true;
+    return;
+  }
+
+  // a flooded packet can multiply itself in a meshed topology, the bandwidth limits that
+  auto &busy = l.busy_until[from.idx > to];
+  if(busy > now + queue_us) {
+    ++ph.queue_drops;
+    if(probe) probe->lossy = true;
+    return;
+  }
+  busy = std::max(busy, now) + static_cast<uint64_t>((buf.size() + 28) * 8e6 / bandwidth);
+  uint64_t t = busy + l.latency_us;
+  if(l.jitter_us) t += static_cast<uint64_t>(uniform() * l.jitter_us);
+  push(t, EV_DELIVER, from.idx, to, vector<char>(buf));
+}
+
+void simulator_t::deliver_local(sim_node_t &n, const vector<char> &buf) {
+  // a packet is written to the tun device of node n
+  if(const auto mp = find_mprobe(buf.data(), buf.size())) {
+    ++mp->copies[n.idx];
+    return;
+  }
+  if(const auto p = find_probe(buf.data(), buf.size(), false)) {
+    if(p->dst == n.idx) {
+      if(!p->copies++) p->t_delivered = now;
+    }
+    return;
+  }
+  if(const auto p = find_probe(buf.data(), buf.size(), true)) {
+    const char *ibuf = buf.data();
+    size_t ilen = buf.size();
+    sim_skip_l2(ibuf, ilen);
+    const auto h_icmp = reinterpret_cast<const struct icmphdr*>(ibuf + sizeof(struct ip));
+    if(h_icmp->type == ICMP_TIMXCEED)
+      p->looped = true;
+  }
+}
+
+bool simulator_t::parse(const string &path) {
+  ifstream in(path.c_str());
+  if(!in) {
+    fprintf(stderr, "SIM ERROR: unable to open scenario file '%s'\n", path.c_str());
+    return false;
+  }
+  {
+    const auto sl = path.find_last_of('/');
+    name = path.substr(sl == string::npos ? 0 : sl + 1);
+    const auto dot = name.find_last_of('.');
+    if(dot != string::npos) name.erase(dot);
+  }
+
+  const auto ms2us = [](double ms) { return static_cast<uint64_t>(ms * 1000); };
+  string line;
+  size_t lno = 0;
+  while(getline(in, line)) {
+    ++lno;
+    {
+      const auto hash = line.find('#');
+      if(hash != string::npos) line.erase(hash);
+    }
+    istringstream ss(line);
+    vector<string> args;
+    for(string tmp; ss >> tmp;) args.emplace_back(move(tmp));
+    if(args.empty()) continue;
+
+    const string &cmd = args.front();
+    const size_t argc = args.size();
+    bool ok = true;
+    if(cmd == "nodes" && argc == 2)
+      node_cnt = stoul(args[1]);
+    else if(cmd == "topo" && argc >= 2) {
+      topo = args[1];
+      topo_arg = (argc > 2) ? stoul(args[2]) : 0;
+    } else if(cmd == "link" && argc == 3)
+      extra_links.emplace_back(stoul(args[1]), stoul(args[2]));
+    else if(cmd == "latency" && argc >= 2) {
+      latency_us = ms2us(stod(args[1]));
+      jitter_us = (argc > 2) ? ms2us(stod(args[2])) : 0;
+    } else if(cmd == "loss" && argc == 2)
+      loss = stod(args[1]);
+    else if(cmd == "bandwidth" && argc >= 2) {
+      bandwidth = stod(args[1]) * 1e6;
+      if(argc > 2) queue_us = ms2us(stod(args[2]));
+    }
+    else if(cmd == "timeout" && argc == 2)
+      timeout = stoul(args[1]);
+    else if(cmd == "seed" && argc == 2)
+      seed = stoull(args[1]);
+    else if(cmd == "sample" && argc == 2)
+      sample_us = ms2us(stod(args[1]));
+    else if(cmd == "probe" && argc >= 2) {
+      probe_rate = stod(args[1]);
+      probe_start_us = (argc > 2) ? ms2us(stod(args[2]) * 1000) : 0;
+    }
+    else if(cmd == "mprobe" && argc == 4) {
+      mprobe_rate = stod(args[1]);
+      mprobe_src = stoul(args[2]);
+      struct in_addr grp;
+      ok = (inet_pton(AF_INET, args[3].c_str(), &grp) == 1);
+      mprobe_group = grp.s_addr;
+    }
+    else if(cmd == "tap" && argc == 1)
+      tap = true;
+    else if(cmd == "end" && argc == 2)
+      end_us = ms2us(stod(args[1]) * 1000);
+    else if(cmd == "at" && argc >= 3)
+      actions.push_back({ms2us(stod(args[1]) * 1000), vector<string>(args.begin() + 2, args.end())});
+    else
+      ok = false;
+
+    if(!ok) {
+      fprintf(stderr, "SIM ERROR: %s:%zu: invalid statement '%s'\n", path.c_str(), lno, line.c_str());
+      return false;
+    }
+  }
+
+  if(node_cnt < 2 || node_cnt > 0xfffe) {
+    fprintf(stderr, "SIM ERROR: %s: 'nodes' must be between 2 and 65534\n", path.c_str());
+    return false;
+  }
+  if(timeout < 1 || !sample_us || bandwidth <= 0) {
+    fprintf(stderr, "SIM ERROR: %s: invalid timeout or sample interval\n", path.c_str());
+    return false;
+  }
+  stable_sort(actions.begin(), actions.end(),
+    [](const action_t &a, const action_t &b) { return a.t < b.t; });
+  return true;
+}
+
+void simulator_t::build_topology() {
+  const auto add = [this](uint32_t a, uint32_t b) {
+    if(a == b || !a || !b || a > node_cnt || b > node_cnt) return;
+    if(a > b) swap(a, b);
+    links.insert({{a, b}, link_t{true, latency_us, jitter_us, loss}});
+  };
+  const uint32_t n = node_cnt;
+
+  if(topo == "line" || topo == "ring") {
+    for(uint32_t i = 1; i < n; ++i) add(i, i + 1);
+    if(topo == "ring") add(n, 1);
+  } else if(topo == "full") {
+    for(uint32_t i = 1; i <= n; ++i)
+      for(uint32_t j = i + 1; j <= n; ++j) add(i, j);
+  } else if(topo == "star") {
+    for(uint32_t i = 2; i <= n; ++i) add(1, i);
+  } else if(topo == "grid") {
+    const uint32_t w = topo_arg ? topo_arg : 1;
+    for(uint32_t i = 0; i < n; ++i) {
+      if((i % w) + 1 < w && i + 1 < n) add(i + 1, i + 2);
+      if(i + w < n) add(i + 1, i + w + 1);
+    }
+  } else if(topo == "random") {
+    // random spanning tree + random edges up to the requested average degree
+    for(uint32_t i = 2; i <= n; ++i)
+      add(i, 1 + _rng() % (i - 1));
+    const size_t want = n * std::max(topo_arg, static_cast<size_t>(2)) / 2;
+    for(size_t tries = 0; links.size() < want && tries < 16 * want; ++tries)
+      add(1 + _rng() % n, 1 + _rng() % n);
+  } else if(topo != "none") {
+    fprintf(stderr, "SIM WARNING: unknown topology '%s', using 'none'\n", topo.c_str());
+  }
+
+  for(const auto &i : extra_links) add(i.first, i.second);
+}
+
+void simulator_t::start_node(const uint32_t i) {
+  auto &n = *nodes[i];
+  auto &r = n.router;
+  r.clear();
+  r.locals.emplace_back(n.inner, 24);
+  r.cfg_remotes.clear();
+  for(const auto &l : links) {
+    if(l.first.first == i) r.cfg_remotes.emplace_back(sim_outer_str(l.first.second));
+    if(l.first.second == i) r.cfg_remotes.emplace_back(sim_outer_str(l.first.first));
+  }
+  n.up = true;
+  r.connect_remotes();
+  r.start();
+  mark_dirty(n);
+  // the receivers on a restarted node join again
+  for(const auto &g : joined)
+    if(i < g.second.size() && g.second[i])
+      send_igmp(i, g.first, true);
+}
+
+void simulator_t::update_components() {
+  // union-find over the usable links
+  component.resize(node_cnt + 1);
+  iota(component.begin(), component.end(), 0);
+  const auto root = [this](uint32_t x) {
+    while(component[x] != x) x = component[x] = component[component[x]];
+    return x;
+  };
+  for(const auto &l : links)
+    if(usable(l.first.first, l.first.second))
+      component[root(l.first.first)] = root(l.first.second);
+  for(uint32_t i = 1; i <= node_cnt; ++i)
+    component[i] = nodes[i]->up ? root(i) : 0;
+}
+
+void simulator_t::new_phase(const string &ev) {
+  phases.emplace_back();
+  auto &ph = phases.back();
+  ph.event = ev;
+  ph.t_start = ph.t_last_change = now;
+  ph.ctl_bytes_per_node.assign(node_cnt + 1, 0);
+  update_components();
+}
+
+bool simulator_t::do_action(const action_t &act) {
+  const auto &a = act.args;
+  const auto &cmd = a.front();
+  const auto node_arg = [&](size_t pos) -> uint32_t {
+    if(pos >= a.size()) return 0;
+    const uint32_t i = stoul(a[pos]);
+    return (i <= node_cnt) ? i : 0;
+  };
+
+  string desc = cmd;
+  for(size_t i = 1; i < a.size(); ++i) desc += ' ' + a[i];
+
+  if(cmd == "link-down" || cmd == "link-up" || cmd == "link-loss" || cmd == "link-latency") {
+    const auto l = get_link(node_arg(1), node_arg(2));
+    if(!l) goto error;
+    if(cmd == "link-down") l->up = false;
+    else if(cmd == "link-up") l->up = true;
+    else if(a.size() != 4) goto error;
+    else if(cmd == "link-loss") l->loss = stod(a[3]);
+    else l->latency_us = static_cast<uint32_t>(stod(a[3]) * 1000);
+  } else if(cmd == "node-down" || cmd == "node-up") {
+    const uint32_t i = node_arg(1);
+    if(!i) goto error;
+    auto &n = *nodes[i];
+    if(cmd == "node-up") {
+      if(!n.up) start_node(i);
+    } else if(n.up) {
+      // crash: the node loses its state and doesn't say goodbye
+      n.up = false;
+      n.router.clear();
+      n.packer.flush([](const remote_peer_ptr_t&, const vector<char>&) { });
+    }
+  } else if(cmd == "partition") {
+    // partition A-B C-D ...: every range becomes an island, the rest stays together
+    fill(group.begin(), group.end(), 0);
+    uint32_t g = 0;
+    for(size_t i = 1; i < a.size(); ++i) {
+      ++g;
+      const auto dash = a[i].find('-');
+      const uint32_t lo = stoul(a[i].substr(0, dash));
+      const uint32_t hi = (dash == string::npos) ? lo : stoul(a[i].substr(dash + 1));
+      for(uint32_t j = lo; j <= hi && j <= node_cnt; ++j) group[j] = g;
+    }
+  } else if(cmd == "heal") {
+    fill(group.begin(), group.end(), 0);
+  } else if(cmd == "join" || cmd == "leave") {
+    // join N GROUP: a receiver on node N joins the group (IGMPv2 report on the tun device)
+    const uint32_t i = node_arg(1);
+    struct in_addr grp;
+    if(!i || a.size() != 3 || inet_pton(AF_INET, a[2].c_str(), &grp) != 1) goto error;
+    auto &jv = joined[grp.s_addr];
+    jv.resize(node_cnt + 1, false);
+    jv[i] = (cmd == "join");
+    if(nodes[i]->up) send_igmp(i, grp.s_addr, jv[i]);
+  } else if(cmd == "mark") {
+    // only starts a new phase
+  } else {
+    goto error;
+  }
+
+  // actions at the same time belong to the same phase
+  if(phases.size() > 1 && phases.back().t_start == now) {
+    phases.back().event += "; " + desc;
+    update_components();
+  } else {
+    new_phase(desc);
+  }
+  return true;
+
+ error:
+  fprintf(stderr, "SIM ERROR: %s: invalid action '%s'\n", name.c_str(), desc.c_str());
+  return false;
+}
+
+void simulator_t::flush_dirty() {
+  for(const uint32_t i : _dirty) {
+    auto &n = *nodes[i];
+    n.dirty = false;
+    n.packer.flush([this, &n](const remote_peer_ptr_t &dest, const vector<char> &pkt) {
+      transmit(n, dest, pkt, true);
+    });
+  }
+  _dirty.clear();
+}
+
+void simulator_t::send_probe() {
+  const uint32_t src = 1 + _rng() % node_cnt;
+  uint32_t dst = 1 + _rng() % (node_cnt - 1);
+  if(dst >= src) ++dst;
+  auto &n = *nodes[src];
+  if(!n.up || !nodes[dst]->up || component[src] != component[dst]) return;
+
+  const uint32_t id = probes.size();
+  probes.push_back(probe_t{src, dst, static_cast<uint32_t>(phases.size() - 1), now, 0, 0, false, false, {src}});
+
+  char buf[sizeof(struct ip) + sizeof(struct udphdr) + 8];
+  zeroify(buf);
+  struct ip h_ip;
+  zeroify(h_ip);
+  h_ip.ip_v   = 4;
+  h_ip.ip_hl  = 5;
+  h_ip.ip_len = htons(sizeof(buf));
+  h_ip.ip_id  = htons(id & 0xffff);
+  h_ip.ip_ttl = 64;
+  h_ip.ip_p   = IPPROTO_UDP;
+  h_ip.ip_src.s_addr = sim_inner_addr(src);
+  h_ip.ip_dst.s_addr = sim_inner_addr(dst);
+  h_ip.ip_sum = IN_CKSUM(&h_ip);
+  memcpy(buf, &h_ip, sizeof(h_ip));
+
+  struct udphdr h_udp;
+  zeroify(h_udp);
+  h_udp.uh_sport = h_udp.uh_dport = htons(9);
+  h_udp.uh_ulen = htons(sizeof(struct udphdr) + 8);
+  memcpy(buf + sizeof(h_ip), &h_udp, sizeof(h_udp));
+  const uint32_t magic = htonl(probe_magic);
+  memcpy(buf + sizeof(h_ip) + sizeof(h_udp), &magic, 4);
+  memcpy(buf + sizeof(h_ip) + sizeof(h_udp) + 4, &id, 4);
+
+  send_local(n, buf, sizeof(buf));
+}
+
+// send_local: inject an IPv4 packet at the tun device of node n (TAP mode: as ethernet frame)
+void simulator_t::send_local(sim_node_t &n, char *const buf, const size_t len) {
+  if(!tap) {
+    n.router.route_genip_packet(n.router.local_router, buf, len);
+    mark_dirty(n);
+    return;
+  }
+
+  constexpr size_t hlen = sizeof(struct zprd_l2hdr) + 14;
+  vector<char> frame(hlen + len, 0);
+  frame[0] = ZL2_MGC;
+  const auto h_ip = reinterpret_cast<const struct ip*>(buf);
+  const uint32_t dst = ntohl(h_ip->ip_dst.s_addr);
+  uint8_t h_eth[14];
+  if(dst == INADDR_BROADCAST) {
+    memset(h_eth, 0xff, 6);
+  } else if(IN_MULTICAST(dst)) {
+    const uint8_t tmp[6] = { 0x01, 0x00, 0x5e, static_cast<uint8_t>((dst >> 16) & 0x7f),
+                             static_cast<uint8_t>(dst >> 8), static_cast<uint8_t>(dst) };
+    memcpy(h_eth, tmp, 6);
+  } else {
+    // 10.x.y.1 -> node (x << 8 | y)
+    sim_node_mac(h_eth, (dst >> 8) & 0xffff);
+  }
+  sim_node_mac(h_eth + 6, n.idx);
+  h_eth[12] = 0x08;
+  h_eth[13] = 0x00;
+  memcpy(frame.data() + sizeof(struct zprd_l2hdr), h_eth, sizeof(h_eth));
+  memcpy(frame.data() + hlen, buf, len);
+  n.router.route_genip_packet(n.router.local_router, frame.data(), frame.size());
+  mark_dirty(n);
+}
+
+void simulator_t::send_igmp(const uint32_t node, const uint32_t group, const bool join) {
+  char buf[sizeof(struct ip) + 4 + sizeof(struct igmp)];
+  zeroify(buf);
+  struct ip h_ip;
+  zeroify(h_ip);
+  h_ip.ip_v   = 4;
+  h_ip.ip_hl  = 6; // + router alert
+  h_ip.ip_len = htons(sizeof(buf));
+  h_ip.ip_ttl = 1;
+  h_ip.ip_p   = IPPROTO_IGMP;
+  h_ip.ip_src.s_addr = sim_inner_addr(node);
+  h_ip.ip_dst.s_addr = join ? group : htonl(INADDR_ALLRTRS_GROUP);
+  memcpy(buf, &h_ip, sizeof(h_ip));
+  const uint8_t ra[4] = { 0x94, 0x04, 0, 0 };
+  memcpy(buf + sizeof(h_ip), ra, sizeof(ra));
+  h_ip.ip_sum = IN_CKSUM(reinterpret_cast<struct ip*>(buf));
+  memcpy(buf, &h_ip, sizeof(h_ip));
+
+  struct igmp h_igmp;
+  zeroify(h_igmp);
+  h_igmp.igmp_type = join ? IGMP_V2_MEMBERSHIP_REPORT : IGMP_V2_LEAVE_GROUP;
+  h_igmp.igmp_group.s_addr = group;
+  memcpy(buf + sizeof(h_ip) + 4, &h_igmp, sizeof(h_igmp));
+
+  auto &n = *nodes[node];
+  send_local(n, buf, sizeof(buf));
+}
+
+void simulator_t::send_mprobe() {
+  auto &n = *nodes[mprobe_src];
+  if(!n.up) return;
+
+  const uint32_t id = mprobes.size();
+  mprobes.push_back(mprobe_t{mprobe_src, static_cast<uint32_t>(phases.size() - 1), now, 0, 0, vector<uint8_t>(node_cnt + 1, 0)});
+  if(mprobe_group == INADDR_BROADCAST || tap) {
+    // every reachable node receives a broadcast, multicast frames are flooded in TAP mode
+    for(uint32_t i = 1; i <= node_cnt; ++i)
+      if(i != mprobe_src && nodes[i]->up && component[i] == component[mprobe_src])
+        ++mprobes.back().expected;
+  } else {
+    const auto it = joined.find(mprobe_group);
+    if(it != joined.end())
+      for(uint32_t i = 1; i < it->second.size(); ++i)
+        if(it->second[i] && i != mprobe_src && nodes[i]->up && component[i] == component[mprobe_src])
+          ++mprobes.back().expected;
+  }
+
+  char buf[sizeof(struct ip) + sizeof(struct udphdr) + 8];
+  zeroify(buf);
+  struct ip h_ip;
+  zeroify(h_ip);
+  h_ip.ip_v   = 4;
+  h_ip.ip_hl  = 5;
+  h_ip.ip_len = htons(sizeof(buf));
+  h_ip.ip_id  = htons(id & 0xffff);
+  h_ip.ip_ttl = 64;
+  h_ip.ip_p   = IPPROTO_UDP;
+  h_ip.ip_src.s_addr = sim_inner_addr(mprobe_src);
+  h_ip.ip_dst.s_addr = mprobe_group;
+  h_ip.ip_sum = IN_CKSUM(&h_ip);
+  memcpy(buf, &h_ip, sizeof(h_ip));
+
+  struct udphdr h_udp;
+  zeroify(h_udp);
+  h_udp.uh_sport = h_udp.uh_dport = htons(9);
+  h_udp.uh_ulen = htons(sizeof(struct udphdr) + 8);
+  memcpy(buf + sizeof(h_ip), &h_udp, sizeof(h_udp));
+  const uint32_t magic = htonl(mprobe_magic);
+  memcpy(buf + sizeof(h_ip) + sizeof(h_udp), &magic, 4);
+  memcpy(buf + sizeof(h_ip) + sizeof(h_udp) + 4, &id, 4);
+
+  send_local(n, buf, sizeof(buf));
+}
+
+uint64_t simulator_t::fingerprint() const {
+  // hash of the primary router of each (node, destination node)
+  uint64_t fp = 0;
+  for(uint32_t s = 1; s <= node_cnt; ++s) {
+    const auto &n = *nodes[s];
+    if(!n.up) continue;
+    for(const auto &r : n.router.routes) {
+      if(r.second.empty()) continue;
+      const uint64_t hop = peer2idx(*r.second.get_router());
+      const uint64_t x = (static_cast<uint64_t>(s) << 40) ^ (hop << 20) ^ inner_addr_hash()(r.first);
+      fp += x * 0x9e3779b97f4a7c15ULL ^ (x >> 29);
+    }
+  }
+  return fp;
+}
+
+// walk: follows the routing tables from s to d, returns 0 = ok, 1 = blackhole, 2 = loop
+int simulator_t::walk(const uint32_t s, const uint32_t d) const {
+  const inner_addr_t dest(sim_inner_addr(d));
+  uint32_t cur = s;
+  for(size_t hops = 0; hops <= node_cnt; ++hops) {
+    if(cur == d) return 0;
+    const auto &rts = nodes[cur]->router.routes;
+    const auto it = rts.find(dest);
+    if(it == rts.end() || it->second.empty()) return 1;
+    const uint32_t nxt = peer2idx(*it->second.get_router());
+    if(!nxt || !usable(cur, nxt)) return 1;
+    cur = nxt;
+  }
+  return 2;
+}
+
+void simulator_t::sample() {
+  auto &ph = phases.back();
+  ++ph.samples;
+  const uint64_t fp = fingerprint();
+  if(fp != _last_fp) {
+    _last_fp = fp;
+    ph.t_last_change = now;
+    ++ph.route_changes;
+  }
+
+  size_t ok = 0, bh = 0, lp = 0;
+  for(uint32_t s = 1; s <= node_cnt; ++s) {
+    if(!component[s]) continue;
+    for(uint32_t d = 1; d <= node_cnt; ++d) {
+      if(s == d || component[s] != component[d]) continue;
+      switch(walk(s, d)) {
+        case 0:  ++ok; break;
+        case 1:  ++bh; break;
+        default: ++lp; break;
+      }
+    }
+  }
+
+  const double dt = sample_us / 1e6;
+  ph.max_blackhole_pairs = std::max(ph.max_blackhole_pairs, bh);
+  ph.max_loop_pairs = std::max(ph.max_loop_pairs, lp);
+  ph.blackhole_pair_s += bh * dt;
+  ph.loop_pair_s += lp * dt;
+  ph.final_ok = ok;
+  ph.final_blackhole = bh;
+  ph.final_loop = lp;
+  ph.final_pairs = ok + bh + lp;
+  if(!bh && !lp && !ph.reached) {
+    ph.reached = true;
+    ph.t_reach = now;
+  } else if(bh || lp) {
+    ph.reached = false;
+  }
+}
+
+void simulator_t::run() {
+  _rng.seed(seed);
+  srand(seed);
+  zprd_conf.data_port = 45940;
+  zprd_conf.remote_timeout = timeout;
+  zprd_conf.max_near_rtt = 5;
+  zprd_conf.preferred_af = AF_INET;
+  zprd_conf.l2_flood_rate = 1000;
+  last_time = sim_epoch;
+
+  build_topology();
+  group.assign(node_cnt + 1, 0);
+  nodes.clear();
+  nodes.emplace_back();
+  for(uint32_t i = 1; i <= node_cnt; ++i)
+    nodes.emplace_back(new sim_node_t(*this, i));
+
+  new_phase("start");
+  for(uint32_t i = 1; i <= node_cnt; ++i) {
+    start_node(i);
+    // ^ main loop: the cleanup runs when more than remote_timeout / 4 seconds passed
+    push(_rng() % ((timeout / 4 + 1) * 1000000), EV_CLEANUP, i);
+  }
+  update_components();
+  flush_dirty();
+
+  push(sample_us, EV_SAMPLE);
+  if(probe_rate > 0) push(probe_start_us + static_cast<uint64_t>(1e6 / probe_rate), EV_PROBE);
+  if(mprobe_rate > 0 && mprobe_src && mprobe_src <= node_cnt) push(static_cast<uint64_t>(1e6 / mprobe_rate), EV_MPROBE);
+  for(uint32_t i = 0; i < actions.size(); ++i)
+    push(actions[i].t, EV_ACTION, i);
+
+  while(!_events.empty()) {
+    const event_t &top = _events.top();
+    if(top.t > end_us) break;
+    event_t ev = move(const_cast<event_t&>(top));
+    _events.pop();
+    now = ev.t;
+    last_time = sim_epoch + now / 1000000;
+
+    switch(ev.type) {
+      case EV_DELIVER: {
+        auto &n = *nodes[ev.b];
+        // the link or the node could have failed while the packet was in flight
+        if(!usable(ev.a, ev.b)) break;
+        if(!ev.buf.empty() && !ev.buf.front()) {
+          n.ctl_rx.pkts++;
+          n.ctl_rx.bytes += ev.buf.size();
+        } else if(const auto p = find_probe(ev.buf.data(), ev.buf.size(), false)) {
+          if(find(p->visited.begin(), p->visited.end(), ev.b) != p->visited.end())
+            p->looped = true;
+          else
+            p->visited.push_back(ev.b);
+        }
+        auto peer = make_shared<remote_peer_detail_t>(nodes[ev.a]->outer);
+        peer = n.router.intern_peer(move(peer));
+        n.router.route_genip_packet(peer, ev.buf.data(), ev.buf.size());
+        mark_dirty(n);
+        break;
+      }
+
+      case EV_CLEANUP: {
+        auto &n = *nodes[ev.a];
+        if(n.up) {
+          n.router.cleanup();
+          mark_dirty(n);
+        }
+        push(now + (timeout / 4 + 1) * 1000000, EV_CLEANUP, ev.a);
+        break;
+      }
+
+      case EV_SAMPLE:
+        sample();
+        push(now + sample_us, EV_SAMPLE);
+        break;
+
+      case EV_PROBE:
+        send_probe();
+        push(now + static_cast<uint64_t>(1e6 / probe_rate), EV_PROBE);
+        break;
+
+      case EV_MPROBE:
+        send_mprobe();
+        push(now + static_cast<uint64_t>(1e6 / mprobe_rate), EV_MPROBE);
+        break;
+
+      case EV_ACTION:
+        if(!do_action(actions[ev.a])) return;
+        break;
+    }
+    flush_dirty();
+  }
+  now = end_us;
+}
+
+void simulator_t::print(FILE *out) const {
+  fprintf(out, "{\"scenario\":\"%s\",\"nodes\":%zu,\"links\":%zu,\"timeout\":%ld,\"phases\":[",
+    name.c_str(), node_cnt, links.size(), static_cast<long>(timeout));
+
+  for(size_t pi = 0; pi < phases.size(); ++pi) {
+    const auto &ph = phases[pi];
+    const auto ms = [&ph](uint64_t t) { return static_cast<long long>((t - ph.t_start) / 1000); };
+
+    // control bytes per node in this phase
+    uint64_t cmin = UINT64_MAX, cmax = 0, csum = 0;
+    for(size_t i = 1; i <= node_cnt; ++i) {
+      const uint64_t c = ph.ctl_bytes_per_node[i];
+      cmin = std::min(cmin, c);
+      cmax = std::max(cmax, c);
+      csum += c;
+    }
+
+    size_t sent = 0, delivered = 0, dups = 0, looped = 0, blackholed = 0, lost = 0, pending = 0;
+    for(const auto &p : probes) {
+      if(p.phase != pi) continue;
+      if(p.t_sent + probe_timeout_us > now) { ++pending; continue; }
+      ++sent;
+      if(p.looped) ++looped;
+      if(p.copies && p.t_delivered - p.t_sent <= probe_timeout_us) {
+        ++delivered;
+        if(p.copies > 1) ++dups;
+      } else if(!p.looped) {
+        ++(p.lossy ? lost : blackholed);
+      }
+    }
+
+    size_t msent = 0, mexpected = 0, mdelivered = 0, mdups = 0, mtx = 0;
+    for(const auto &p : mprobes) {
+      if(p.phase != pi || p.t_sent + probe_timeout_us > now) continue;
+      ++msent;
+      mexpected += p.expected;
+      mtx += p.tx;
+      for(uint32_t i = 1; i < p.copies.size(); ++i) {
+        if(!p.copies[i]) continue;
+        ++mdelivered;
+        mdups += p.copies[i] - 1;
+      }
+    }
+
+    fprintf(out, "%s{\"event\":\"%s\",\"t_ms\":%llu,\"converged_ms\":%lld,\"reach_ms\":%lld,\"route_changes\":%" PRIu64 ","
+      "\"ctl\":{\"pkts\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"node_bytes_min\":%" PRIu64 ",\"node_bytes_avg\":%.1f,\"node_bytes_max\":%" PRIu64 "},"
+      "\"data\":{\"pkts\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"queue_drops\":%" PRIu64 "},"
+      "\"walk\":{\"pairs\":%zu,\"ok\":%zu,\"blackhole\":%zu,\"loop\":%zu,\"max_blackhole_pairs\":%zu,\"max_loop_pairs\":%zu,"
+      "\"blackhole_pair_s\":%.1f,\"loop_pair_s\":%.1f},"
+      "\"probes\":{\"sent\":%zu,\"delivered\":%zu,\"dups\":%zu,\"looped\":%zu,\"blackholed\":%zu,\"lost\":%zu,\"pending\":%zu},"
+      "\"mcast\":{\"sent\":%zu,\"expected\":%zu,\"delivered\":%zu,\"dups\":%zu,\"tx\":%zu}}",
+      pi ? "," : "", ph.event.c_str(), static_cast<unsigned long long>(ph.t_start / 1000),
+      ms(ph.t_last_change), ph.reached ? ms(ph.t_reach) : -1LL, ph.route_changes,
+      ph.ctl.pkts, ph.ctl.bytes, (cmin == UINT64_MAX) ? 0 : cmin, static_cast<double>(csum) / node_cnt, cmax,
+      ph.data.pkts, ph.data.bytes, ph.queue_drops,
+      ph.final_pairs, ph.final_ok, ph.final_blackhole, ph.final_loop, ph.max_blackhole_pairs, ph.max_loop_pairs,
+      ph.blackhole_pair_s, ph.loop_pair_s,
+      sent, delivered, dups, looped, blackholed, lost, pending,
+      msent, mexpected, mdelivered, mdups, mtx);
+  }
+
+  fputs("],\"per_node\":[", out);
+  for(size_t i = 1; i <= node_cnt; ++i) {
+    const auto &n = *nodes[i];
+    fprintf(out, "%s{\"node\":%zu,\"up\":%s,\"routes\":%zu,\"groups\":%zu,\"peers\":%zu,\"ctl_tx_pkts\":%" PRIu64 ",\"ctl_tx_bytes\":%" PRIu64
+      ",\"ctl_rx_pkts\":%" PRIu64 ",\"ctl_rx_bytes\":%" PRIu64 "}",
+      (i > 1) ? "," : "", i, n.up ? "true" : "false", n.router.routes.size(), n.router.groups.size(), n.router.remotes.size(),
+      n.ctl_tx.pkts, n.ctl_tx.bytes, n.ctl_rx.pkts, n.ctl_rx.bytes);
+  }
+  fputs("]}\n", out);
+  fflush(out);
+}
+
+int main(int argc, char *argv[]) {
+  vector<string> files;
+  for(int i = 1; i < argc; ++i) {
+    const string cur = argv[i];
+    if(cur == "-v") verbose = true;
+    else if(cur == "-h" || cur == "--help") {
+      puts("USAGE: zprd-sim [-v] SCENARIO...");
+      return 0;
+    } else files.emplace_back(cur);
+  }
+  if(files.empty()) {
+    fputs("USAGE: zprd-sim [-v] SCENARIO...\n", stderr);
+    return 1;
+  }
+
+  // the routers log to stdout, keep the results apart
+  FILE *const out = fdopen(dup(STDOUT_FILENO), "w");
+  if(!out) {
+    perror("fdopen()");
+    return 1;
+  }
+  if(!verbose && !freopen("/dev/null", "w", stdout)) {
+    perror("freopen()");
+    return 1;
+  }
+
+  int ret = 0;
+  for(const auto &f : files) {
+    simulator_t sim;
+    if(!sim.parse(f)) {
+      ret = 1;
+      continue;
+    }
+    fprintf(stderr, "zprd-sim: %s (%zu nodes)\n", sim.name.c_str(), sim.node_cnt);
+    sim.run();
+    sim.print(out);
+  }
+  fclose(out);
+  return ret;
+}
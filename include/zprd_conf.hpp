@@ -10,9 +10,42 @@
 #include <string>
 #include <vector>
 
-struct zprd_conf_t {
+/* routing domain: one tun / tap device with its own routing table and peers,
+ * all domains share the UDP sockets (see docs/DOMAINS)
+ * config: the statements A B D H I L R belong to the last domain (N<ID> starts a new one)
+ */
+struct zprd_domain_conf_t {
+  // domain ID on the wire, 0 = unencapsulated (compatible with single-domain nodes)
+  uint16_t id;
+
+  // TAP mode: forward ethernet frames instead of IP packets (config: Dtap)
+  bool tap;
+
   std::string iface;
-  std::vector<std::string> remotes, route_hooks;
+  std::vector<std::string> addrs, exported_addrs, blocked_broadcasts, remotes, hooks;
+};
+
+/* uplink: an additional outer socket, bound to a local address or to a network interface
+ * (see docs/UPLINKS), config: u<ADDR|IFACE>[*WEIGHT]
+ */
+struct zprd_uplink_conf_t {
+  std::string dev;
+  // share of the flows relative to the other healthy uplinks
+  unsigned weight;
+};
+
+struct zprd_conf_t {
+  std::vector<zprd_domain_conf_t> domains;
+
+  // path of the control socket (optional)
+  std::string ctl_socket;
+
+  // socket path for shared memory clients (optional, see zprd_shm.hpp)
+  std::string shm_socket;
+
+  // metrics exporter listen address (optional)
+  std::string metrics_addr;
+  std::vector<std::string> route_hooks;
 
   // data port
   uint16_t data_port;
@@ -27,6 +60,31 @@ struct zprd_conf_t {
 
   // preferred AF_* for resolve_...
   sa_family_t preferred_af;
+
+  // main loop iterations which take longer (in ms) are reported as stalls, 0 = disabled
+  unsigned watchdog_ms;
+
+  // memory budgets in bytes, 0 = unlimited (config: mroutes=KiB, mpeers=KiB, msender=KiB)
+  //  routes : idle learned routes are evicted, otherwise new routes are refused, peers : packets from new peers are dropped
+  //  sender : data + ZPRN messages are dropped while the queue is full
+  size_t budget_routes, budget_peers, budget_sender;
+
+  // TAP mode: max count of flooded frames (broadcast, multicast, unknown destination) per second
+  //  from the local tap device, 0 = unlimited
+  unsigned l2_flood_rate;
+
+  // max count of routes learned from data packets, idle ones are evicted above it (0 = unlimited)
+  size_t max_learned_routes;
+
+  // max count of generated ICMP errors per second per source peer / per destination (0 = unlimited)
+  unsigned icmp_rate_peer, icmp_rate_dest;
+
+  // probe interval in seconds of the outer paths of remotes with more than one address, 0 = disabled
+  //  (the first address with the preferred address family is used)
+  time_t path_probe_interval;
+
+  // uplinks, empty = only the wildcard sockets are used
+  std::vector<zprd_uplink_conf_t> uplinks;
 };
 
 extern zprd_conf_t zprd_conf;
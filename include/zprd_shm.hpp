@@ -0,0 +1,141 @@
+/**
+ * zprd / zprd_shm.hpp - shared memory packet interface for local applications
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+
+/* A local application attaches to zprd via the unix socket given with the
+ * config statement 'S' and claims one local address of a routing domain.
+ * zprd answers with a shared memory area (memfd) and two eventfds:
+ *
+ *   tx ring: application -> zprd, the packets are routed like packets
+ *            from the tun device of the domain
+ *   rx ring: zprd -> application, packets to the claimed address are put
+ *            in here instead of being written to the tun device
+ *
+ * Both rings are single-producer single-consumer queues, the eventfds are
+ * only written to if the consumer announced that it is going to sleep.
+ * The connection stays open while the application is attached,
+ * zprd detaches the application when it is closed. See docs/SHM.
+ */
+
+#define ZSHM_MAGIC     0x7a73686dU // 'zshm'
+#define ZSHM_VERSION   1
+#define ZSHM_SLOTS     256         // per ring, power of 2
+#define ZSHM_SLOT_SIZE 2048        // incl. the length field
+#define ZSHM_MTU       (ZSHM_SLOT_SIZE - 4)
+
+struct zprd_shm_slot_t {
+  uint32_t len;
+  char data[ZSHM_MTU];
+};
+
+/* zprd_shm_ring_t: head is only written by the producer, tail only by the consumer,
+ *  waiting is set by the consumer before it blocks on the eventfd of the ring
+ */
+struct zprd_shm_ring_t {
+  alignas(64) std::atomic<uint32_t> head;
+  alignas(64) std::atomic<uint32_t> tail;
+  alignas(64) std::atomic<uint32_t> waiting;
+  alignas(64) zprd_shm_slot_t slots[ZSHM_SLOTS];
+
+  // push: copies the packet into the ring, returns false if the ring is full or the packet too big
+  bool push(const void *const pkt, const uint32_t len) noexcept {
+    const uint32_t h = head.load(std::memory_order_relaxed);
+    if(len > ZSHM_MTU || (h - tail.load(std::memory_order_acquire)) >= ZSHM_SLOTS)
+      return false;
+    auto &s = slots[h % ZSHM_SLOTS];
+    s.len = len;
+    memcpy(s.data, pkt, len);
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // front: returns the oldest packet or nullptr if the ring is empty, pop releases it
+  const zprd_shm_slot_t *front() const noexcept {
+    const uint32_t t = tail.load(std::memory_order_relaxed);
+    return (head.load(std::memory_order_acquire) == t) ? nullptr : &slots[t % ZSHM_SLOTS];
+  }
+
+  void pop() noexcept
+    { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  // need_wakeup: called by the producer after push, true = write to the eventfd
+  bool need_wakeup() noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return waiting.load(std::memory_order_relaxed) && waiting.exchange(0);
+  }
+
+  // prepare_wait: called by the consumer before it blocks on the eventfd,
+  //  false = packets arrived in the meantime, don't block
+  bool prepare_wait() noexcept {
+    waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed))
+      return true;
+    waiting.store(0, std::memory_order_relaxed);
+    return false;
+  }
+};
+
+struct zprd_shm_area_t {
+  uint32_t magic, version;
+  zprd_shm_ring_t tx; // application -> zprd
+  zprd_shm_ring_t rx; // zprd -> application
+};
+
+// attach request (application -> zprd, one SOCK_SEQPACKET message)
+struct zprd_shm_req_t {
+  uint32_t magic, version;
+  uint16_t domain;
+  uint8_t  af;       // AF_INET or AF_INET6
+  uint8_t  reserved;
+  uint8_t  addr[16]; // claimed local address, network byte order
+};
+
+// attach response (zprd -> application), error = 0: carries the fds
+//  [memfd, tx eventfd, rx eventfd] as SCM_RIGHTS
+struct zprd_shm_resp_t {
+  uint32_t magic;
+  int32_t  error; // errno value
+};
+
+// zprd_shm_client_t: client side (libzprdshm), not thread-safe
+class zprd_shm_client_t final {
+  int _sock = -1, _shm_fd = -1, _tx_efd = -1, _rx_efd = -1;
+  zprd_shm_area_t *_area = nullptr;
+
+ public:
+  zprd_shm_client_t() noexcept = default;
+  zprd_shm_client_t(const zprd_shm_client_t &) = delete;
+  zprd_shm_client_t& operator=(const zprd_shm_client_t &) = delete;
+  ~zprd_shm_client_t() noexcept { detach(); }
+
+  // attach: addr = claimed local address (IPv4 or IPv6, one of the addresses
+  //  of the routing domain), returns 0 or an errno value
+  int attach(const std::string &sock_path, const std::string &addr, uint16_t domain = 0);
+  void detach() noexcept;
+  bool attached() const noexcept { return _area; }
+
+  // send: queues an IP packet (IPv4 packets need a valid header checksum),
+  //  returns false if the ring is full or the packet is too big
+  bool send(const void *pkt, size_t len) noexcept;
+
+  // recv: copies the next packet into buf (truncated to buflen),
+  //  returns the packet length or 0 if no packet is available
+  size_t recv(void *buf, size_t buflen) noexcept;
+
+  // wait: blocks until a packet is available, timeout_ms < 0 = infinite,
+  //  returns false on timeout or error
+  bool wait(int timeout_ms = -1) noexcept;
+
+  // get_event_fd: for own poll loops, readable after a wakeup from zprd,
+  //  call prepare_wait before polling on it
+  int get_event_fd() const noexcept { return _rx_efd; }
+  bool prepare_wait() noexcept { return _area->rx.prepare_wait(); }
+};
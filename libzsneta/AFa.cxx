@@ -9,8 +9,9 @@
 #include <config.h>
 #include <arpa/inet.h>
 
+#include <stdio.h>
+
 #ifdef USE_IPX
-# include <stdio.h>
 # include <netipx/ipx.h>
 #endif
 
@@ -54,3 +55,57 @@ auto AFa_sa2string(const struct sockaddr_storage &sas, string &&prefix) noexcept
   ret += sanport ? ui162string(ntohs(*sanport)) : string("(null)");
   return ret;
 }
+
+auto AFa_sa2string(const outer_addr_t &oa, string &&prefix) noexcept -> string {
+  if(oa.is_local()) return "local";
+  string ret = move(prefix);
+  ret += AFa_addr2string(oa.family, oa.addr);
+  ret += ':';
+  ret += ui162string(ntohs(oa.port));
+  return ret;
+}
+
+static void sa2buf_intern(const sa_family_t sa_fam, const char *addr, const uint16_t *sanport,
+                          const char *prefix, char *buf, const size_t buflen) noexcept {
+  char abuf[INET6_ADDRSTRLEN] = "(null)";
+  if(addr) {
+    switch(sa_fam) {
+      case AF_INET:
+      case AF_INET6:
+        inet_ntop(sa_fam, addr, abuf, sizeof(abuf));
+        break;
+#ifdef USE_IPX
+      case AF_IPX:
+        snprintf(abuf, sizeof(abuf), "%s", ipx_ntoa(*addr));
+        break;
+#endif
+      default:
+        snprintf(abuf, sizeof(abuf), "-unsupported-AF-%u", static_cast<unsigned>(sa_fam));
+    }
+  }
+
+  if(sanport)
+    snprintf(buf, buflen, "%s%s:%u", prefix, abuf, static_cast<unsigned>(ntohs(*sanport)));
+  else
+    snprintf(buf, buflen, "%s%s:(null)", prefix, abuf);
+}
+
+[[gnu::hot]]
+void AFa_sa2buf(const struct sockaddr_storage &sas, const char *prefix, char *buf, const size_t buflen) noexcept {
+  if(!buflen) return;
+  if(!sas.ss_family) {
+    snprintf(buf, buflen, "local");
+    return;
+  }
+  sa2buf_intern(sas.ss_family, AFa_gp_addr(sas), AFa_gp_port(sas), prefix, buf, buflen);
+}
+
+[[gnu::hot]]
+void AFa_sa2buf(const outer_addr_t &oa, const char *prefix, char *buf, const size_t buflen) noexcept {
+  if(!buflen) return;
+  if(oa.is_local()) {
+    snprintf(buf, buflen, "local");
+    return;
+  }
+  sa2buf_intern(oa.family, oa.addr, &oa.port, prefix, buf, buflen);
+}
@@ -150,14 +150,105 @@ void xner_apply_netmask(char * addr, const char * nmsk, const size_t cmplen) noe
     addr[i] &= nmsk[i];
 }
 
-#include <zs/ll/hash.hpp>
+#include <sys/random.h>
+
+static uint64_t iafa_hash_key[2] = { 0, 0 };
+
+void inner_addr_hash_seed(const uint64_t k0, const uint64_t k1) noexcept {
+  iafa_hash_key[0] = k0;
+  iafa_hash_key[1] = k1;
+}
+
+bool inner_addr_hash_seed_random() noexcept {
+  uint64_t k[2];
+  if(getrandom(k, sizeof(k), 0) != sizeof(k))
+    return false;
+  inner_addr_hash_seed(k[0], k[1]);
+  return true;
+}
+
+namespace {
+  static inline uint64_t rotl64(const uint64_t x, const unsigned b) noexcept
+    { return (x << b) | (x >> (64 - b)); }
+
+  // SipHash-1-3 state (one compression round, three finalization rounds)
+  struct sip13_t final {
+    uint64_t v0, v1, v2, v3;
+
+    sip13_t(const uint64_t k0, const uint64_t k1) noexcept
+      : v0(k0 ^ 0x736f6d6570736575ULL), v1(k1 ^ 0x646f72616e646f6dULL),
+        v2(k0 ^ 0x6c7967656e657261ULL), v3(k1 ^ 0x7465646279746573ULL) { }
+
+    void round() noexcept {
+      v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);
+      v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;
+      v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;
+      v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);
+    }
+
+    void compress(const uint64_t m) noexcept {
+      v3 ^= m;
+      round();
+      v0 ^= m;
+    }
+
+    uint64_t finish(const uint64_t lastw) noexcept {
+      compress(lastw);
+      v2 ^= 0xff;
+      round(); round(); round();
+      return v0 ^ v1 ^ v2 ^ v3;
+    }
+  };
+}
 
 [[gnu::hot]]
 size_t inner_addr_hash::operator()(const inner_addr_t &addr) const noexcept {
-  uintmax_t seed = 0;
-  llzs::hash_combine(seed, addr.type);
-  const char *aptr = &addr.addr[0], *aeptr = aptr + addr.get_alen();
-  for(; aptr != aeptr; ++aptr)
-    llzs::hash_combine(seed, *aptr);
-  return seed;
+  sip13_t st(iafa_hash_key[0], iafa_hash_key[1]);
+  const size_t alen = addr.get_alen();
+  const uint64_t lenw = static_cast<uint64_t>(IAFA_TLEN + alen) << 56;
+
+  if(zs_likely(alen == 4)) {
+    // IPv4 fast path: type + addr fit into the last word
+    uint32_t a4;
+    memcpy(&a4, addr.addr, 4);
+    return st.finish(lenw | addr.type | (static_cast<uint64_t>(a4) << 16));
+  }
+
+  // message = type + addr[alen], padded with zeros to whole words
+  uint64_t msg[(IAFA_TLEN + IAFA_AL_MAX) / 8 + 1];
+  const size_t mlen = IAFA_TLEN + alen, nwords = mlen / 8;
+  msg[nwords] = 0;
+  memcpy(msg, &addr.type, IAFA_TLEN);
+  memcpy(reinterpret_cast<char *>(msg) + IAFA_TLEN, addr.addr, alen);
+
+  for(size_t i = 0; i < nwords; ++i)
+    st.compress(msg[i]);
+  return st.finish(msg[nwords] | lenw);
+}
+
+uint64_t iafa_hash_bytes(const void *const data, const size_t len) noexcept {
+  sip13_t st(iafa_hash_key[0], iafa_hash_key[1]);
+  const auto ptr = static_cast<const char *>(data);
+  const size_t nwords = len / 8;
+  uint64_t m;
+  for(size_t i = 0; i < nwords; ++i) {
+    memcpy(&m, ptr + 8 * i, 8);
+    st.compress(m);
+  }
+  // last word: remaining bytes + length (as in SipHash)
+  m = 0;
+  memcpy(&m, ptr + 8 * nwords, len % 8);
+  return st.finish(m | (static_cast<uint64_t>(len) << 56));
+}
+
+[[gnu::hot]]
+size_t outer_addr_hash::operator()(const outer_addr_t &addr) const noexcept {
+  // fixed size: three words, no padding (see outer_addr_t)
+  uint64_t msg[3];
+  memcpy(msg, &addr, sizeof(msg));
+  sip13_t st(iafa_hash_key[0], iafa_hash_key[1]);
+  st.compress(msg[0]);
+  st.compress(msg[1]);
+  st.compress(msg[2]);
+  return st.finish(static_cast<uint64_t>(sizeof(msg)) << 56);
 }
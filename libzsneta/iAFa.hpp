@@ -81,8 +81,19 @@ bool operator==(const xner_addr_t &a, const xner_addr_t &b) noexcept;
 bool operator!=(const xner_addr_t &a, const xner_addr_t &b) noexcept;
 
 // hash algorithm for unordered_map<inner_addr_t, ...>
+// SipHash-1-3, keyed per process (see inner_addr_hash_seed, also used by outer_addr_hash), so that
+// remote peers can't craft addresses which collide in the hash tables
 struct inner_addr_hash {
   size_t operator()(const inner_addr_t &addr) const noexcept;
 };
 
+// iafa_hash_bytes: SipHash-1-3 of len bytes with the key of inner_addr_hash
+uint64_t iafa_hash_bytes(const void *data, size_t len) noexcept;
+
+// inner_addr_hash_seed: set the key of inner_addr_hash,
+//  must be called before any container which uses inner_addr_hash is filled
+void inner_addr_hash_seed(uint64_t k0, uint64_t k1) noexcept;
+// inner_addr_hash_seed_random: use a random key (getrandom), returns false on failure
+bool inner_addr_hash_seed_random() noexcept;
+
 void xner_apply_netmask(char * addr, const char * nmsk, size_t cmplen = IAFA_AL_MAX) noexcept;
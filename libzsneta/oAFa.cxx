@@ -40,7 +40,85 @@ int AFa_sa_compare(const struct sockaddr_storage &lhs, const struct sockaddr_sto
     offset = offsetof(struct sockaddr_storage, ss_family);
     cmpsiz = sizeof(sa_family_t);
   }
-  return memcmp(&lhs + offset, &rhs + offset, cmpsiz);
+  return memcmp(reinterpret_cast<const char *>(&lhs) + offset,
+                reinterpret_cast<const char *>(&rhs) + offset, cmpsiz);
+}
+
+// outer_addr_t
+
+#ifdef USE_IPX
+static_assert(sizeof(ipx_network) + IPX_NODE_LEN + 1 <= sizeof(outer_addr_t::addr), "outer_addr_t::addr is too small for IPX");
+#endif
+
+outer_addr_t::outer_addr_t(const struct sockaddr_storage &sas) noexcept : outer_addr_t() {
+  family = sas.ss_family;
+  switch(family) {
+    case AF_INET:
+      {
+        const auto &s = reinterpret_cast<const struct sockaddr_in &>(sas);
+        port = s.sin_port;
+        memcpy(addr, &s.sin_addr, sizeof(s.sin_addr));
+      }
+      break;
+#ifdef USE_IPV6
+    case AF_INET6:
+      {
+        const auto &s = reinterpret_cast<const struct sockaddr_in6 &>(sas);
+        port = s.sin6_port;
+        memcpy(addr, &s.sin6_addr, sizeof(s.sin6_addr));
+        scope_id = s.sin6_scope_id;
+      }
+      break;
+#endif
+#ifdef USE_IPX
+    case AF_IPX:
+      {
+        const auto &s = reinterpret_cast<const struct sockaddr_ipx &>(sas);
+        port = s.sipx_port;
+        memcpy(addr, &s.sipx_network, sizeof(s.sipx_network));
+        memcpy(addr + sizeof(s.sipx_network), s.sipx_node, IPX_NODE_LEN);
+        addr[sizeof(s.sipx_network) + IPX_NODE_LEN] = s.sipx_type;
+      }
+      break;
+#endif
+    default:
+      break;
+  }
+}
+
+socklen_t outer_addr_t::to_sa(struct sockaddr_storage &sas) const noexcept {
+  switch(family) {
+    case AF_INET:
+      return to_sa<AF_INET>(sas);
+#ifdef USE_IPV6
+    case AF_INET6:
+      return to_sa<AF_INET6>(sas);
+#endif
+#ifdef USE_IPX
+    case AF_IPX:
+      {
+        auto &s = reinterpret_cast<struct sockaddr_ipx &>(sas);
+        memset(&s, 0, sizeof(s));
+        s.sipx_family = AF_IPX;
+        s.sipx_port = port;
+        memcpy(&s.sipx_network, addr, sizeof(s.sipx_network));
+        memcpy(s.sipx_node, addr + sizeof(s.sipx_network), IPX_NODE_LEN);
+        s.sipx_type = addr[sizeof(s.sipx_network) + IPX_NODE_LEN];
+        return sizeof(s);
+      }
+#endif
+    default:
+      memset(&sas, 0, sizeof(sas));
+      sas.ss_family = family;
+      return 0;
+  }
+}
+
+auto outer_addr_t::to_sa() const noexcept -> struct sockaddr_storage {
+  struct sockaddr_storage ret;
+  memset(&ret, 0, sizeof(ret));
+  to_sa(ret);
+  return ret;
 }
 
 #define SA_XXX_PTR(PROTO,WHAT) (&reinterpret_cast<struct sockaddr_##PROTO*>(&sas)->s##PROTO##_##WHAT)
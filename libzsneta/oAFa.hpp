@@ -6,10 +6,74 @@
  **/
 #pragma once
 #include <sys/socket.h>
+#include <netinet/in.h> // sockaddr_in, sockaddr_in6
 #include <inttypes.h>
 #include <stddef.h>     // size_t
+#include <string.h>     // memcmp
 #include <string>
 
+/* compact endpoint (family + port + address), replaces sockaddr_storage (128 bytes)
+ * in the peer tables. Comparison and hashing work on the fixed 24 bytes,
+ * conversion to sockaddr only happens at the syscall boundaries (recvfrom, sendto, bind).
+ * NOTE: unused bytes are always zero, so memcmp is a valid comparison
+ */
+struct outer_addr_t final {
+  sa_family_t family; // AF_UNSPEC = local (tun device)
+  uint16_t port;      // network byte order
+  char addr[16];      // IPv4: 4 bytes, IPv6: 16 bytes, IPX: network + node + type
+  uint32_t scope_id;  // IPv6 link-local scope
+
+  outer_addr_t() noexcept { memset(this, 0, sizeof(*this)); }
+  explicit outer_addr_t(const struct sockaddr_storage &sas) noexcept;
+
+  bool is_local() const noexcept { return family == AF_UNSPEC; }
+
+  // to_sa: convert to sockaddr, returns the length of the sockaddr_* struct (0 = unsupported family)
+  socklen_t to_sa(struct sockaddr_storage &sas) const noexcept;
+  // to_sa<AF>: inline variant for a known family (AF_INET, AF_INET6), family is not checked
+  template<sa_family_t AF>
+  socklen_t to_sa(struct sockaddr_storage &sas) const noexcept;
+  auto to_sa() const noexcept -> struct sockaddr_storage;
+};
+
+static_assert(sizeof(outer_addr_t) == 24, "outer_addr_t has padding");
+
+template<>
+inline socklen_t outer_addr_t::to_sa<AF_INET>(struct sockaddr_storage &sas) const noexcept {
+  auto &s = reinterpret_cast<struct sockaddr_in &>(sas);
+  memset(&s, 0, sizeof(s));
+  s.sin_family = AF_INET;
+  s.sin_port = port;
+  memcpy(&s.sin_addr, addr, sizeof(s.sin_addr));
+  return sizeof(s);
+}
+
+template<>
+inline socklen_t outer_addr_t::to_sa<AF_INET6>(struct sockaddr_storage &sas) const noexcept {
+  auto &s = reinterpret_cast<struct sockaddr_in6 &>(sas);
+  memset(&s, 0, sizeof(s));
+  s.sin6_family = AF_INET6;
+  s.sin6_port = port;
+  memcpy(&s.sin6_addr, addr, sizeof(s.sin6_addr));
+  s.sin6_scope_id = scope_id;
+  return sizeof(s);
+}
+
+static inline int AFa_oa_compare(const outer_addr_t &lhs, const outer_addr_t &rhs) noexcept
+  { return memcmp(&lhs, &rhs, sizeof(outer_addr_t)); }
+
+static inline bool operator==(const outer_addr_t &lhs, const outer_addr_t &rhs) noexcept
+  { return !AFa_oa_compare(lhs, rhs); }
+static inline bool operator!=(const outer_addr_t &lhs, const outer_addr_t &rhs) noexcept
+  { return AFa_oa_compare(lhs, rhs); }
+static inline bool operator<(const outer_addr_t &lhs, const outer_addr_t &rhs) noexcept
+  { return AFa_oa_compare(lhs, rhs) < 0; }
+
+// hash algorithm for unordered_map<outer_addr_t, ...>, keyed like inner_addr_hash
+struct outer_addr_hash {
+  size_t operator()(const outer_addr_t &addr) const noexcept;
+};
+
 // sockaddr_* sa_family funcs
 size_t AFa_sa_family2size(const struct sockaddr_storage &sas) noexcept;
 int AFa_sa_compare(const struct sockaddr_storage &lhs, const struct sockaddr_storage &rhs) noexcept;
@@ -25,3 +89,11 @@ const uint16_t* AFa_gp_port(const struct sockaddr_storage &sas) noexcept;
 
 // sockaddr_* fmt funcs
 auto AFa_sa2string(const struct sockaddr_storage &sas, std::string &&prefix = {}) noexcept -> std::string;
+
+// AFa_sa2buf: like AFa_sa2string, but doesn't allocate (buf is always NUL-terminated)
+#define AFA_SA_BUFLEN 64
+void AFa_sa2buf(const struct sockaddr_storage &sas, const char *prefix, char *buf, size_t buflen) noexcept;
+
+// outer_addr_t variants of the fmt funcs
+auto AFa_sa2string(const outer_addr_t &oa, std::string &&prefix = {}) noexcept -> std::string;
+void AFa_sa2buf(const outer_addr_t &oa, const char *prefix, char *buf, size_t buflen) noexcept;
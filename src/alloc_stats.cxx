@@ -0,0 +1,57 @@
+/**
+ * zprd / alloc_stats.cxx - operator new replacement for the allocation accounting
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "alloc_stats.hpp"
+
+#ifdef USE_ALLOC_STATS
+# include "stats.hpp"
+# include "watchdog.hpp"
+# include <stdio.h>
+# include <stdlib.h>
+# include <unistd.h>
+# include <new>
+
+static zprd_alloc_slot_t alloc_slot() noexcept {
+  switch(zprd_alloc_thread) {
+    case ZALLOC_THR_MAIN:   return static_cast<zprd_alloc_slot_t>(zprd_watchdog.get_phase());
+    case ZALLOC_THR_SENDER: return ZALLOC_SENDER;
+    default:                return ZALLOC_OTHER;
+  }
+}
+
+[[gnu::hot]]
+void* operator new(const size_t n) {
+  const auto slot = alloc_slot();
+  zprd_stats.inc(zprd_stats.allocs[slot]);
+  zprd_stats.inc(zprd_stats.alloc_bytes[slot], n);
+
+# ifdef USE_ALLOC_CHECK
+  if(zs_unlikely(zprd_alloc_forbidden > 0)) {
+    // write(2) directly, the stdio buffer of stderr could be allocated lazily
+    char buf[160];
+    const int len = snprintf(buf, sizeof(buf),
+      "ALLOC CHECK: heap allocation of %zu bytes in the forwarding path (phase %s), abort\n",
+      n, zprd_alloc_slot2str(slot));
+    if(len > 0 && write(STDERR_FILENO, buf, len)) { }
+    abort();
+  }
+# endif
+
+  if(void *const ret = malloc(n ? n : 1))
+    return ret;
+  // we are compiled with -fno-exceptions
+  fputs("ALLOC ERROR: out of memory\n", stderr);
+  abort();
+}
+
+void* operator new[](const size_t n) { return operator new(n); }
+void* operator new(const size_t n, const std::nothrow_t &) noexcept { return operator new(n); }
+void* operator new[](const size_t n, const std::nothrow_t &) noexcept { return operator new(n); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+#endif
@@ -0,0 +1,67 @@
+/**
+ * zprd / alloc_stats.hpp - heap allocation accounting
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include <config.h>
+
+/* USE_ALLOC_STATS: zprd replaces operator new (alloc_stats.cxx) and counts
+ *   the allocations per thread and main loop phase in zprd_stats.allocs.
+ *
+ * USE_ALLOC_CHECK: additionally, the forwarding path of data packets is a
+ *   no-allocation zone (zprd_noalloc_t), zprd aborts if something allocates
+ *   in there. Code paths which are allowed to allocate (route changes,
+ *   log messages, pool misses) are marked with zprd_alloc_allow_t.
+ */
+
+enum zprd_alloc_thread_t : unsigned char {
+  ZALLOC_THR_OTHER, ZALLOC_THR_MAIN, ZALLOC_THR_SENDER
+};
+
+#ifdef USE_ALLOC_STATS
+// set once at the start of each thread which should be accounted separately
+inline thread_local zprd_alloc_thread_t zprd_alloc_thread = ZALLOC_THR_OTHER;
+#endif
+
+#ifdef USE_ALLOC_CHECK
+// > 0: inside a no-allocation zone
+inline thread_local int zprd_alloc_forbidden = 0;
+
+class zprd_noalloc_t final {
+ public:
+  zprd_noalloc_t() noexcept { ++zprd_alloc_forbidden; }
+  ~zprd_noalloc_t() noexcept { --zprd_alloc_forbidden; }
+  zprd_noalloc_t(const zprd_noalloc_t &) = delete;
+  zprd_noalloc_t& operator=(const zprd_noalloc_t &) = delete;
+};
+
+class zprd_alloc_allow_t final {
+  int _prev;
+
+ public:
+  explicit zprd_alloc_allow_t(const bool allow = true) noexcept
+    : _prev(zprd_alloc_forbidden) { if(allow) zprd_alloc_forbidden = 0; }
+  ~zprd_alloc_allow_t() noexcept { zprd_alloc_forbidden = _prev; }
+  zprd_alloc_allow_t(const zprd_alloc_allow_t &) = delete;
+  zprd_alloc_allow_t& operator=(const zprd_alloc_allow_t &) = delete;
+};
+#else
+class zprd_noalloc_t final {
+ public:
+  zprd_noalloc_t() noexcept { }
+};
+
+class zprd_alloc_allow_t final {
+ public:
+  explicit zprd_alloc_allow_t(const bool = true) noexcept { }
+};
+#endif
+
+static inline void zprd_alloc_set_thread(const zprd_alloc_thread_t t) noexcept {
+#ifdef USE_ALLOC_STATS
+  zprd_alloc_thread = t;
+#else
+  (void) t;
+#endif
+}
@@ -0,0 +1,656 @@
+/**
+ * zprd / control.cxx
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#define __USE_MISC 1
+#include "control.hpp"
+#include "metrics.hpp"
+#include "AFa.hpp"
+#include "oAFa.hpp"
+#include <config.h>
+#include <zs/ll/memut.hpp>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>    // inet_pton
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/un.h>       // sockaddr_un
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+// snapshots which are younger than this are reused
+#define CTL_SNAP_MAXAGE 1
+
+static string format_time(const time_t x) {
+  char buffer[10] = {0};
+  struct tm tmi;
+  if(localtime_r(&x, &tmi))
+    strftime(buffer, sizeof(buffer), "%H:%M:%S", &tmi);
+  return buffer;
+}
+
+static void json_escape(string &out, const string &in) {
+  out += '"';
+  for(const char i : in) {
+    switch(i) {
+      case '"':  out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      default:
+        if(zs_unlikely(static_cast<unsigned char>(i) < 0x20)) {
+          char tmp[8];
+          snprintf(tmp, sizeof(tmp), "\\u%04x", static_cast<unsigned>(i));
+          out += tmp;
+        } else {
+          out += i;
+        }
+    }
+  }
+  out += '"';
+}
+
+static void json_kv(string &out, const char *key, const string &val) {
+  out += '"'; out += key; out += "\":";
+  json_escape(out, val);
+}
+
+static void json_kv(string &out, const char *key, const uint64_t val) {
+  out += '"'; out += key; out += "\":";
+  out += to_string(val);
+}
+
+static bool write_all(const int fd, const string &buf) noexcept {
+  const char *ptr = buf.data(), *const eptr = ptr + buf.size();
+  while(ptr != eptr) {
+    const ssize_t ret = write(fd, ptr, eptr - ptr);
+    if(ret < 0) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    ptr += ret;
+  }
+  return true;
+}
+
+namespace {
+  struct ctl_request_t final {
+    bool want_routes = true, want_peers = true, want_stats = true, want_groups = true;
+    bool have_dest = false, have_domain = false;
+    uint16_t domain = 0;
+    inner_addr_t dest;
+    size_t dest_pflen = 0;
+    string peer;
+
+    bool parse(const string &line);
+    bool match_dest(const inner_addr_t &a) const noexcept;
+    bool match_domain(const uint16_t d) const noexcept
+      { return !have_domain || d == domain; }
+    bool match_peer(const outer_addr_t &oa) const;
+  };
+}
+
+bool ctl_request_t::parse(const string &line) {
+  size_t pos = 0;
+  bool first = true;
+  while(pos < line.size()) {
+    const size_t tend = line.find(' ', pos);
+    const string tok = line.substr(pos, (tend == string::npos) ? string::npos : (tend - pos));
+    pos = (tend == string::npos) ? line.size() : (tend + 1);
+    if(tok.empty()) continue;
+
+    if(first) {
+      first = false;
+      if(tok == "routes" || tok == "peers" || tok == "stats" || tok == "groups") {
+        want_routes = (tok == "routes");
+        want_peers  = (tok == "peers");
+        want_stats  = (tok == "stats");
+        want_groups = (tok == "groups");
+        continue;
+      } else if(tok == "all") continue;
+      // no command -> 'all' with filters
+    }
+
+    if(!tok.compare(0, 5, "dest=")) {
+      string addr = tok.substr(5);
+      const size_t slash = addr.find('/');
+      long pflen = -1;
+      if(slash != string::npos) {
+        pflen = strtol(addr.c_str() + slash + 1, nullptr, 10);
+        addr.resize(slash);
+      }
+      struct in_addr  a4;
+      struct in6_addr a6;
+      if(inet_pton(AF_INET, addr.c_str(), &a4) == 1)
+        dest = inner_addr_t(a4.s_addr);
+      else if(inet_pton(AF_INET6, addr.c_str(), &a6) == 1)
+        dest = inner_addr_t(a6);
+      else
+        return false;
+      const long maxpf = 8 * dest.get_alen();
+      dest_pflen = (pflen < 0 || pflen > maxpf) ? maxpf : pflen;
+      have_dest = true;
+    } else if(!tok.compare(0, 5, "peer=")) {
+      peer = tok.substr(5);
+    } else if(!tok.compare(0, 7, "domain=")) {
+      char *endp;
+      const unsigned long d = strtoul(tok.c_str() + 7, &endp, 10);
+      if(*endp || endp == tok.c_str() + 7 || d > 0xffff)
+        return false;
+      domain = d;
+      have_domain = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ctl_request_t::match_dest(const inner_addr_t &a) const noexcept {
+  if(!have_dest) return true;
+  if(a.type != dest.type) return false;
+  const size_t fullbytes = dest_pflen / 8, restbits = dest_pflen % 8;
+  if(memcmp(a.addr, dest.addr, fullbytes)) return false;
+  if(!restbits) return true;
+  const uint8_t msk = 0xffU << (8 - restbits);
+  return !((a.addr[fullbytes] ^ dest.addr[fullbytes]) & msk);
+}
+
+bool ctl_request_t::match_peer(const outer_addr_t &oa) const {
+  if(peer.empty()) return true;
+  if(AFa_sa2string(oa) == peer) return true;
+  return !oa.is_local() && AFa_addr2string(oa.family, oa.addr) == peer;
+}
+
+static void format_latency(string &out, const char *stage, const histogram_snap_t &h) {
+  out += '"'; out += stage; out += "\":{";
+  json_kv(out, "count",   h.count);                 out += ',';
+  json_kv(out, "p50_ns",  h.percentile(0.5));       out += ',';
+  json_kv(out, "p99_ns",  h.percentile(0.99));      out += ',';
+  json_kv(out, "p999_ns", h.percentile(0.999));     out += ',';
+  json_kv(out, "max_ns",  h.max);
+  out += '}';
+}
+
+static void format_stats(string &out, const zprd_snapshot_t &snap) {
+  const auto &st = snap.stats;
+  out += "{\"type\":\"stats\",";
+  json_kv(out, "domains", snap.domains);      out += ',';
+  json_kv(out, "peers",  snap.tables->peers.size());  out += ',';
+  json_kv(out, "routes", snap.tables->routes.size()); out += ',';
+  json_kv(out, "route_evictions", st.route_evictions); out += ',';
+  json_kv(out, "groups", snap.tables->groups.size()); out += ',';
+  json_kv(out, "macs",   snap.macs);          out += ',';
+  json_kv(out, "shm_clients", snap.shm_clients); out += ',';
+  json_kv(out, "igmp_msgs",       st.igmp_msgs);   out += ',';
+  json_kv(out, "icmp_ratelimited", st.icmp_ratelimited); out += ',';
+  json_kv(out, "path_switches",   st.path_switches); out += ',';
+  json_kv(out, "uplink_failovers", st.uplink_failovers); out += ',';
+  json_kv(out, "rx_pkts_local",   st.rx_pkts[0]);  out += ',';
+  json_kv(out, "rx_pkts_remote",  st.rx_pkts[1]);  out += ',';
+  json_kv(out, "rx_bytes_local",  st.rx_bytes[0]); out += ',';
+  json_kv(out, "rx_bytes_remote", st.rx_bytes[1]); out += ',';
+  json_kv(out, "tx_pkts_local",   st.tx_pkts[0]);  out += ',';
+  json_kv(out, "tx_pkts_remote",  st.tx_pkts[1]);  out += ',';
+  json_kv(out, "tx_bytes_local",  st.tx_bytes[0]); out += ',';
+  json_kv(out, "tx_bytes_remote", st.tx_bytes[1]); out += ',';
+  json_kv(out, "tx_errors",       st.tx_errors);   out += ',';
+  json_kv(out, "zprn_rx_msgs",    st.zprn_rx_msgs); out += ',';
+  json_kv(out, "zprn_tx_msgs",    st.zprn_tx_msgs); out += ',';
+  json_kv(out, "zprn_tx_pkts",    st.zprn_tx_pkts); out += ",\"drops\":{";
+  for(size_t i = 0; i < ZDROP_MAX; ++i) {
+    if(i) out += ',';
+    json_kv(out, zprd_drop_reason2str(static_cast<zprd_drop_reason_t>(i)), st.drops[i]);
+  }
+  out += "},\"latency\":{";
+  format_latency(out, "forward",    st.fwd_time);   out += ',';
+  format_latency(out, "queue_wait", st.queue_wait); out += ',';
+  format_latency(out, "residence",  st.residence);
+  out += "},\"stalls\":{";
+  json_kv(out, "count",   st.stalls);                        out += ',';
+  json_kv(out, "p99_ns",  st.stall_time.percentile(0.99));   out += ',';
+  json_kv(out, "max_ns",  st.stall_time.max);                out += ",\"phases\":{";
+  for(size_t i = 0; i < ZPH_MAX; ++i) {
+    if(i) out += ',';
+    json_kv(out, zprd_phase2str(static_cast<zprd_phase_t>(i)), st.stall_phases[i]);
+  }
+  out += "}},\"memory\":{";
+  for(size_t i = 0; i < ZMEM_MAX; ++i) {
+    if(i) out += ',';
+    out += '"';
+    out += zprd_mem2str(static_cast<zprd_mem_t>(i));
+    out += "\":{";
+    json_kv(out, "bytes",  snap.mem[i]);        out += ',';
+    json_kv(out, "budget", snap.mem_budget[i]); out += ',';
+    json_kv(out, "hits",   st.budget_hits[i]);
+    out += '}';
+  }
+  out += '}';
+#ifdef USE_ALLOC_STATS
+  out += ",\"allocs\":{";
+  for(size_t i = 0; i < ZALLOC_MAX; ++i) {
+    if(i) out += ',';
+    json_kv(out, zprd_alloc_slot2str(static_cast<zprd_alloc_slot_t>(i)), st.allocs[i]);
+  }
+  out += "},\"alloc_bytes\":{";
+  for(size_t i = 0; i < ZALLOC_MAX; ++i) {
+    if(i) out += ',';
+    json_kv(out, zprd_alloc_slot2str(static_cast<zprd_alloc_slot_t>(i)), st.alloc_bytes[i]);
+  }
+  out += '}';
+#endif
+  out += "}\n";
+}
+
+// don't let a stuck client block the control thread forever
+static void set_client_timeouts(const int fd) noexcept {
+  struct timeval tv = { 5, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+void ctl_server_t::serve_client(const int fd) {
+  set_client_timeouts(fd);
+
+  string line;
+  {
+    char buf[256];
+    while(line.size() < 1024 && line.find('\n') == string::npos) {
+      const ssize_t cnt = read(fd, buf, sizeof(buf));
+      if(cnt < 0 && errno == EINTR) continue;
+      if(cnt <= 0) break;
+      line.append(buf, cnt);
+    }
+    const size_t eol = line.find_first_of("\r\n");
+    if(eol != string::npos) line.resize(eol);
+  }
+
+  ctl_request_t req;
+  if(!req.parse(line)) {
+    string err = "{\"type\":\"error\",";
+    json_kv(err, "message", "invalid request: " + line);
+    err += "}\n";
+    write_all(fd, err);
+    return;
+  }
+
+  const auto snap = fetch_snapshot();
+  if(!snap) {
+    write_all(fd, "{\"type\":\"error\",\"message\":\"no snapshot available\"}\n");
+    return;
+  }
+
+  string out;
+  out.reserve(0x10000);
+  const auto flush_if = [&](const size_t lim) -> bool {
+    if(out.size() < lim) return true;
+    const bool ret = write_all(fd, out);
+    out.clear();
+    return ret;
+  };
+
+  if(req.want_stats)
+    format_stats(out, *snap);
+
+  if(req.want_peers)
+    for(const auto &i : snap->tables->peers) {
+      if(!req.match_domain(i.domain) || !req.match_peer(i.saddr)) continue;
+      out += "{\"type\":\"peer\",";
+      json_kv(out, "domain", i.domain); out += ',';
+      json_kv(out, "addr", AFa_sa2string(i.saddr)); out += ',';
+      json_kv(out, "seen", static_cast<uint64_t>(i.seen)); out += ',';
+      json_kv(out, "cfgent", i.cfgent);
+      out += "}\n";
+      if(!flush_if(0xf000)) return;
+    }
+
+  if(req.want_routes)
+    for(const auto &i : snap->tables->routes) {
+      if(!req.match_domain(i.domain) || !req.match_dest(i.dest)) continue;
+      bool got_via = false;
+      for(const auto &r : i.routers) {
+        if(!req.match_peer(r.saddr)) continue;
+        if(!got_via) {
+          out += "{\"type\":\"route\",";
+          json_kv(out, "domain", i.domain); out += ',';
+          json_kv(out, "dest", i.dest.to_string());
+          out += ",\"via\":[";
+          got_via = true;
+        } else {
+          out += ',';
+        }
+        char lat[32];
+        snprintf(lat, sizeof(lat), "%.2f", r.latency);
+        out += '{';
+        json_kv(out, "gateway", AFa_sa2string(r.saddr)); out += ',';
+        json_kv(out, "seen", static_cast<uint64_t>(r.seen)); out += ",\"latency\":";
+        out += lat; out += ',';
+        json_kv(out, "hops", r.hops);
+        out += '}';
+      }
+      if(got_via) out += "]}\n";
+      if(!flush_if(0xf000)) return;
+    }
+
+  if(req.want_groups)
+    for(const auto &i : snap->tables->groups) {
+      if(!req.match_domain(i.domain) || !req.match_dest(i.group)) continue;
+      out += "{\"type\":\"group\",";
+      json_kv(out, "domain", i.domain); out += ',';
+      json_kv(out, "group", i.group.to_string());
+      out += ",\"local\":";
+      out += i.local ? "true" : "false";
+      out += ",\"members\":[";
+      bool first = true;
+      for(const auto &m : i.members) {
+        if(!first) out += ',';
+        first = false;
+        out += '{';
+        json_kv(out, "receiver", m.receiver.to_string()); out += ',';
+        json_kv(out, "seen", static_cast<uint64_t>(m.seen));
+        out += '}';
+      }
+      out += "]}\n";
+      if(!flush_if(0xf000)) return;
+    }
+
+  out += "{\"type\":\"end\",";
+  json_kv(out, "generation", snap->generation); out += ',';
+  json_kv(out, "taken", static_cast<uint64_t>(snap->taken));
+  out += "}\n";
+  write_all(fd, out);
+}
+
+// serve_metrics: minimal HTTP/1.0 server, every request gets the metrics
+void ctl_server_t::serve_metrics(const int fd) {
+  set_client_timeouts(fd);
+
+  {
+    // read (and ignore) the request header
+    string req;
+    char buf[512];
+    while(req.size() < 0x2000 && req.find("\r\n\r\n") == string::npos && req.find("\n\n") == string::npos) {
+      const ssize_t cnt = read(fd, buf, sizeof(buf));
+      if(cnt < 0 && errno == EINTR) continue;
+      if(cnt <= 0) break;
+      req.append(buf, cnt);
+    }
+    if(req.compare(0, 4, "GET ")) {
+      write_all(fd, "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+      return;
+    }
+  }
+
+  const auto snap = fetch_snapshot();
+  if(!snap) {
+    write_all(fd, "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    return;
+  }
+
+  const string body = format_prometheus(*snap);
+  string hdr = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\nContent-Length: ";
+  hdr += to_string(body.size());
+  hdr += "\r\n\r\n";
+  if(write_all(fd, hdr))
+    write_all(fd, body);
+}
+
+[[gnu::cold]]
+static void print_snapshot(const zprd_snapshot_t &snap) {
+  // the domain column is only printed if there is more than one domain
+  const bool with_dom = snap.domains > 1;
+  const auto head = [with_dom](const char *cols) {
+    printf("%s%s\n", with_dom ? "Domain\t" : "", cols);
+  };
+  const auto dom = [with_dom](const uint16_t d) {
+    if(with_dom) printf("%u\t", static_cast<unsigned>(d));
+  };
+
+  puts("-- connected peers:");
+  head("Peer\t\tSeen\t\tConfig Entry");
+  for(const auto &i: snap.tables->peers) {
+    const string addr = AFa_sa2string(i.saddr);
+    const auto seen = format_time(i.seen);
+    dom(i.domain);
+    printf("%s\t%s\t%s\n", addr.c_str(), seen.c_str(), i.cfgent.c_str());
+  }
+  puts("-- routing table:");
+  head("Destination\tGateway\t\tSeen\t\tLatency\tHops");
+  for(const auto &i: snap.tables->routes) {
+    const string dest = i.dest.to_string();
+    for(const auto &r: i.routers) {
+      const string seen = format_time(r.seen), gateway = AFa_sa2string(r.saddr);
+      dom(i.domain);
+      printf("%s\t%s\t%s\t%4.2f\t%u\n", dest.c_str(), gateway.c_str(), seen.c_str(), r.latency, static_cast<unsigned>(r.hops));
+    }
+  }
+  if(!snap.tables->groups.empty()) {
+    puts("-- multicast groups:");
+    head("Group\t\tReceiver\tSeen");
+    for(const auto &i: snap.tables->groups) {
+      const string group = i.group.to_string();
+      if(i.local) {
+        dom(i.domain);
+        printf("%s\tlocal\n", group.c_str());
+      }
+      for(const auto &m: i.members) {
+        const string seen = format_time(m.seen), receiver = m.receiver.to_string();
+        dom(i.domain);
+        printf("%s\t%s\t%s\n", group.c_str(), receiver.c_str(), seen.c_str());
+      }
+    }
+  }
+  fflush(stdout);
+}
+
+auto ctl_server_t::fetch_snapshot() -> zprd_snapshot_ptr_t {
+  unique_lock<mutex> lock(_mtx);
+  if(_snap && (time(nullptr) - _snap->taken) < CTL_SNAP_MAXAGE)
+    return _snap;
+
+  // ask the forwarding thread for a new snapshot
+  const uint64_t gen = _snap ? _snap->generation : 0;
+  if(eventfd_write(_req_fd, 1) < 0)
+    perror("CONTROL ERROR: eventfd_write()");
+  _cond.wait_for(lock, chrono::seconds(2), [this, gen] {
+    return _stop || (_snap && _snap->generation != gen);
+  });
+  // might be stale if the forwarding thread is busy
+  return _snap;
+}
+
+static int listen_unix(const string &path) {
+  struct sockaddr_un sun;
+  zeroify(sun);
+  if(path.size() >= sizeof(sun.sun_path)) {
+    fprintf(stderr, "STARTUP ERROR: socket path too long: %s\n", path.c_str());
+    return -1;
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd < 0) {
+    perror("STARTUP ERROR: socket(AF_UNIX)");
+    return -1;
+  }
+
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path.c_str());
+  unlink(path.c_str());
+
+  if(::bind(fd, reinterpret_cast<struct sockaddr*>(&sun), sizeof(sun)) < 0 || ::listen(fd, 4) < 0) {
+    fprintf(stderr, "STARTUP ERROR: bind/listen(%s) failed: %s\n", path.c_str(), strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int listen_tcp(const string &addr) {
+  // [host:]port, IPv6 hosts have to be enclosed in brackets
+  string host = "127.0.0.1", port = addr;
+  const size_t colon = addr.rfind(':');
+  if(colon != string::npos) {
+    host = addr.substr(0, colon);
+    port = addr.substr(colon + 1);
+    if(host.size() >= 2 && host.front() == '[' && host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+  }
+
+  struct sockaddr_storage ss;
+  zeroify(ss);
+  bool got_addr = false;
+  for(const sa_family_t i : { AF_INET, AF_INET6 }) {
+    ss.ss_family = i;
+    if((got_addr = (inet_pton(i, host.c_str(), AFa_gp_addr(ss)) == 1)))
+      break;
+  }
+  const long portnum = strtol(port.c_str(), nullptr, 10);
+  if(!got_addr || portnum <= 0 || portnum > 0xffff) {
+    fprintf(stderr, "STARTUP ERROR: invalid metrics listen address: %s\n", addr.c_str());
+    return -1;
+  }
+  *AFa_gp_port(ss) = htons(static_cast<uint16_t>(portnum));
+
+  const int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd < 0) {
+    perror("STARTUP ERROR: socket(metrics)");
+    return -1;
+  }
+  int optval = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+  if(::bind(fd, reinterpret_cast<struct sockaddr*>(&ss), AFa_sa_family2size(ss)) < 0 || ::listen(fd, 4) < 0) {
+    fprintf(stderr, "STARTUP ERROR: bind/listen(%s) failed: %s\n", addr.c_str(), strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool ctl_server_t::listen(const string &path) {
+  _listen_fd = listen_unix(path);
+  if(_listen_fd < 0) return false;
+  _path = path;
+  return true;
+}
+
+bool ctl_server_t::listen_metrics(const string &addr) {
+  const bool is_unix = !addr.empty() && addr.front() == '/';
+  _metrics_fd = is_unix ? listen_unix(addr) : listen_tcp(addr);
+  if(_metrics_fd < 0) return false;
+  if(is_unix) _metrics_path = addr;
+  return true;
+}
+
+bool ctl_server_t::start() {
+  _req_fd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  _wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(_req_fd < 0 || _wake_fd < 0) {
+    perror("STARTUP ERROR: eventfd()");
+    return false;
+  }
+  {
+    lock_guard<mutex> lock(_mtx);
+    _stop = false;
+  }
+  _thread = thread(&ctl_server_t::worker_fn, this);
+  return true;
+}
+
+void ctl_server_t::stop() noexcept {
+  bool wake = false;
+  {
+    lock_guard<mutex> lock(_mtx);
+    if(!_stop && _wake_fd >= 0)
+      _stop = wake = true;
+  }
+  if(wake) {
+    _cond.notify_all();
+    eventfd_write(_wake_fd, 1);
+  }
+  // client sockets have timeouts, a waiting fetch_snapshot is woken up above
+  if(_thread.joinable())
+    _thread.join();
+}
+
+void ctl_server_t::publish(zprd_snapshot_ptr_t snap) {
+  {
+    lock_guard<mutex> lock(_mtx);
+    _snap = move(snap);
+  }
+  _cond.notify_all();
+}
+
+void ctl_server_t::dump(zprd_snapshot_ptr_t snap) {
+  {
+    lock_guard<mutex> lock(_mtx);
+    _dumps.emplace_back(move(snap));
+  }
+  eventfd_write(_wake_fd, 1);
+}
+
+void ctl_server_t::worker_fn() noexcept {
+  prctl(PR_SET_NAME, "control", 0, 0, 0);
+
+  struct pollfd pfds[3];
+  nfds_t npfds = 0;
+  for(const int i : { _wake_fd, _listen_fd, _metrics_fd }) {
+    if(i < 0) continue;
+    pfds[npfds].fd = i;
+    pfds[npfds].events = POLLIN;
+    ++npfds;
+  }
+
+  vector<zprd_snapshot_ptr_t> dumps;
+
+  while(true) {
+    if(poll(pfds, npfds, -1) < 0) {
+      if(errno == EINTR) continue;
+      perror("CONTROL ERROR: poll()");
+      return;
+    }
+
+    if(pfds[0].revents & POLLIN) {
+      eventfd_t tmp;
+      eventfd_read(_wake_fd, &tmp);
+      {
+        lock_guard<mutex> lock(_mtx);
+        if(_stop) break;
+        dumps.swap(_dumps);
+      }
+      for(const auto &i : dumps)
+        print_snapshot(*i);
+      dumps.clear();
+    }
+
+    for(nfds_t i = 1; i < npfds; ++i) {
+      if(!(pfds[i].revents & POLLIN)) continue;
+      const int lfd = pfds[i].fd;
+      const int cfd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+      if(cfd < 0) {
+        if(errno != EINTR && errno != EAGAIN)
+          perror("CONTROL ERROR: accept()");
+        continue;
+      }
+      if(lfd == _metrics_fd)
+        serve_metrics(cfd);
+      else
+        serve_client(cfd);
+      close(cfd);
+    }
+  }
+
+  const auto close_listener = [](int &fd, const string &path) {
+    if(fd < 0) return;
+    close(fd);
+    if(!path.empty()) unlink(path.c_str());
+    fd = -1;
+  };
+  close_listener(_listen_fd, _path);
+  close_listener(_metrics_fd, _metrics_path);
+}
@@ -0,0 +1,61 @@
+/**
+ * zprd / control.hpp - local control socket
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include "snapshot.hpp"
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* The control server runs in its own thread and never touches the live
+ * routing state. When it needs data, it asks the forwarding thread
+ * (via the request eventfd, which is part of the main epoll set) for
+ * a fresh snapshot and formats that one.
+ *
+ * protocol (unix stream socket, one request line per connection):
+ *   routes|peers|stats|groups|all [dest=ADDR[/PFLEN]] [peer=ADDR[:PORT]] [domain=ID]
+ * response: JSON lines, terminated by an {"type":"end",...} line
+ *
+ * The optional metrics listener (unix or localhost tcp socket) answers
+ * each HTTP request with the prometheus text format of a snapshot.
+ */
+class ctl_server_t final {
+  std::string _path, _metrics_path;
+  int _listen_fd = -1, _metrics_fd = -1, _req_fd = -1, _wake_fd = -1;
+
+  zprd_snapshot_ptr_t _snap;
+  std::vector<zprd_snapshot_ptr_t> _dumps;
+
+  // sync
+  std::mutex _mtx;
+  std::condition_variable _cond;
+  bool _stop = false;
+  std::thread _thread;
+
+  void worker_fn() noexcept;
+  void serve_client(int fd);
+  void serve_metrics(int fd);
+  auto fetch_snapshot() -> zprd_snapshot_ptr_t;
+
+ public:
+  ~ctl_server_t() noexcept { stop(); }
+
+  // listen: binds the control socket, should be called before privileges are dropped
+  bool listen(const std::string &path);
+  // listen_metrics: addr = /unix/socket/path or [host:]port (default host = 127.0.0.1)
+  bool listen_metrics(const std::string &addr);
+  bool start();
+  // stop: waits until the control thread has exited (and removed its sockets)
+  void stop() noexcept;
+
+  // get_request_fd: readable when the control thread wants a new snapshot
+  int get_request_fd() const noexcept { return _req_fd; }
+  void publish(zprd_snapshot_ptr_t snap);
+
+  // dump: print a snapshot to stdout (in the control thread)
+  void dump(zprd_snapshot_ptr_t snap);
+};
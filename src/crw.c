@@ -68,11 +68,35 @@ int cread(const int fd, char *buf, const size_t n) {
 
 // TODO: handle ICMP errmsg's with setsockopt IP_RECVERR and recvmsg MSG_ERRQUEUE
 //       ex look @ https://stackoverflow.com/questions/11914568/read-icmp-payload-from-a-recvmsg-with-msg-errqueue-flag
-int recv_n(const int fd, char * __restrict__ buf, const size_t n, struct sockaddr_storage * __restrict__ addr) {
+int recv_n(const int fd, char * __restrict__ buf, const size_t n, struct sockaddr_storage * __restrict__ addr,
+           struct timespec * __restrict__ ts) {
+  char cbuf[CMSG_SPACE(sizeof(struct timespec))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  iov.iov_base = buf;
+  iov.iov_len  = n;
+
   while(1) {
-    socklen_t addrlen = sizeof(*addr);
-    const int cnt = recvfrom(fd, buf, n, 0, (struct sockaddr *) addr, &addrlen);
-    if(cnt > 0) return cnt;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name       = addr;
+    msg.msg_namelen    = sizeof(*addr);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    const int cnt = recvmsg(fd, &msg, 0);
+    if(cnt <= 0) continue;
+
+    if(ts) {
+      ts->tv_sec = ts->tv_nsec = 0;
+      for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+          memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+    }
+    return cnt;
   }
   return -1;
 }
@@ -7,13 +7,16 @@
 #include <linux/if_tun.h>
 #include <netinet/in.h>
 #include <stddef.h>
+#include <time.h>
 #include <zs/ll/cxa_noexcept.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
   int tun_alloc(char *dev, const int flags) noexcept;
   int cread(const int fd, char *buf, const size_t n) noexcept;
-  int recv_n(const int fd, char * __restrict__ buf, const size_t n, struct sockaddr_storage * __restrict__ addr) noexcept;
+  // recv_n: ts (optional) receives the kernel timestamp (SO_TIMESTAMPNS), or zero if unavailable
+  int recv_n(const int fd, char * __restrict__ buf, const size_t n, struct sockaddr_storage * __restrict__ addr,
+             struct timespec * __restrict__ ts) noexcept;
 #ifdef __cplusplus
 }
 #endif
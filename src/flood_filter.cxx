@@ -0,0 +1,108 @@
+/**
+ * zprd / flood_filter.cxx - duplicate suppression of flooded packets
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "flood_filter.hpp"
+#include "iAFa.hpp"           // iafa_hash_bytes
+#include "l2.hpp"             // zprd_l2hdr
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <string.h>
+#include <algorithm>
+
+flood_filter_t::flood_filter_t(const uint64_t window_ms) noexcept
+  : _window(window_ms), _rotated(0), _cur(0) { clear(); }
+
+void flood_filter_t::clear() noexcept {
+  memset(_gen, 0, sizeof(_gen));
+}
+
+[[gnu::hot]]
+bool flood_filter_t::test_and_set(const uint64_t key, const uint64_t now) noexcept {
+  if(now - _rotated >= _window) {
+    // after a long pause both generations are outdated
+    if(now - _rotated >= 2 * _window)
+      memset(_gen[_cur], 0, sizeof(_gen[_cur]));
+    _cur ^= 1;
+    memset(_gen[_cur], 0, sizeof(_gen[_cur]));
+    _rotated = now;
+  }
+
+  // double hashing: bit i = h1 + i * h2
+  const uint32_t h1 = key, h2 = (key >> 32) | 1;
+  size_t idx[nhashes];
+  bool in_cur = true, in_old = true;
+  for(size_t i = 0; i < nhashes; ++i) {
+    idx[i] = (h1 + i * h2) % bits;
+    const uint64_t mask = 1ULL << (idx[i] % 64);
+    in_cur = in_cur && (_gen[_cur][idx[i] / 64] & mask);
+    in_old = in_old && (_gen[_cur ^ 1][idx[i] / 64] & mask);
+  }
+  if(in_cur || in_old)
+    return true;
+  for(size_t i = 0; i < nhashes; ++i)
+    _gen[_cur][idx[i] / 64] |= 1ULL << (idx[i] % 64);
+  return false;
+}
+
+uint64_t flood_filter_t::key(const char buffer[], const uint16_t buflen, const uint16_t l4off) noexcept {
+  // message = stable header fields + up to 18 bytes of the payload
+  //  (e.g. ports + checksum of UDP / TCP + sequence number; the TCP checksum
+  //  covers the timestamp option, which tells retransmitted segments apart)
+  char msg[40 + 18];
+  size_t mlen;
+  size_t hlen;
+
+  switch(*reinterpret_cast<const uint8_t*>(buffer) >> 4) {
+    case 4:
+      {
+        const auto h_ip = reinterpret_cast<const struct ip*>(buffer);
+        // addresses + length + id + fragment offset + protocol; ttl, tos and checksum change on the way
+        memcpy(msg, &h_ip->ip_src, 8);
+        memcpy(msg + 8, &h_ip->ip_len, 6);
+        msg[14] = h_ip->ip_p;
+        mlen = 15;
+        hlen = 4 * h_ip->ip_hl;
+      }
+      break;
+
+    case 6:
+      {
+        const auto h_ip = reinterpret_cast<const struct ip6_hdr*>(buffer);
+        // flow label + payload length + next header, addresses
+        const uint32_t flow = h_ip->ip6_flow & htonl(0x000fffff);
+        memcpy(msg, &flow, 4);
+        memcpy(msg + 4, &h_ip->ip6_plen, 3);
+        memcpy(msg + 7, &h_ip->ip6_src, 32);
+        mlen = 39;
+        hlen = sizeof(struct ip6_hdr);
+      }
+      break;
+
+    case ZL2_MGC >> 4:
+      {
+        // TAP mode: frame id + ethernet addresses + ethertype; the ttl changes on the way
+        const auto h_l2 = reinterpret_cast<const struct zprd_l2hdr*>(buffer);
+        hlen = std::min(sizeof(struct zprd_l2hdr) + 14, static_cast<size_t>(buflen));
+        memcpy(msg, &h_l2->id, 2);
+        memcpy(msg + 2, buffer + sizeof(struct zprd_l2hdr), hlen - sizeof(struct zprd_l2hdr));
+        mlen = 2 + hlen - sizeof(struct zprd_l2hdr);
+      }
+      break;
+
+    default:
+      return iafa_hash_bytes(buffer, std::min(buflen, static_cast<uint16_t>(sizeof(msg))));
+  }
+
+  // IPv6 extension headers may change on the way (hop-by-hop options)
+  if(l4off) hlen = l4off;
+  if(buflen > hlen) {
+    const size_t plen = std::min(buflen - hlen, static_cast<size_t>(18));
+    memcpy(msg + mlen, buffer + hlen, plen);
+    mlen += plen;
+  }
+  return iafa_hash_bytes(msg, mlen);
+}
@@ -0,0 +1,40 @@
+/**
+ * zprd / flood_filter.hpp - duplicate suppression of flooded packets
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include <inttypes.h>
+#include <stddef.h>
+
+/* flood_filter_t: rotating Bloom filter over the recently flooded packets
+ *  two generations of bits, new packets are inserted into the current one,
+ *  both are tested. Every window milliseconds the older generation is cleared and
+ *  becomes the current one, so a packet is remembered for window ... 2 * window ms.
+ *  Copies via other paths arrive within the difference of the path latencies,
+ *  retransmissions (which may be byte-identical, e.g. IPv6 without an ID) after
+ *  the retransmission timeout (>= 1s for TCP SYNs + DNS), so the window is kept short.
+ *  False positives (a new packet is dropped) stay below 1% as long as
+ *  less than ~bits / 8 packets are flooded per window.
+ */
+class flood_filter_t final {
+ public:
+  static constexpr size_t bits = 1 << 15, nhashes = 4;
+
+  explicit flood_filter_t(uint64_t window_ms = 500) noexcept;
+
+  // test_and_set: returns true if key was seen in the last window, inserts it otherwise
+  //  now_ms: monotonic time in milliseconds
+  bool test_and_set(uint64_t key, uint64_t now_ms) noexcept;
+  void clear() noexcept;
+
+  // key: hash of the fields of an IPv4 / IPv6 packet or L2 frame which don't change on the way
+  //  (addresses, id / flow label, protocol, length, first 18 payload bytes = incl. the TCP checksum)
+  //  l4off: offset of the upper-layer header (pkt_meta_t), 0 = the payload follows the fixed header
+  static uint64_t key(const char buffer[], uint16_t buflen, uint16_t l4off = 0) noexcept;
+
+ private:
+  uint64_t _gen[2][bits / 64];
+  uint64_t _window, _rotated;
+  unsigned _cur;
+};
@@ -0,0 +1,66 @@
+/**
+ * zprd / histogram.cxx
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "histogram.hpp"
+
+latency_histogram_t::latency_histogram_t() noexcept {
+  for(auto &i : _buckets) i = 0;
+  _sum = 0;
+  _max = 0;
+}
+
+auto latency_histogram_t::snapshot() const -> histogram_snap_t {
+  constexpr auto mo = std::memory_order_relaxed;
+  histogram_snap_t ret;
+  ret.bounds.reserve(NBUCKETS + 1);
+  ret.counts.reserve(NBUCKETS + 1);
+  for(unsigned i = 0; i <= NBUCKETS; ++i) {
+    ret.bounds.emplace_back(idx2bound(i));
+    ret.counts.emplace_back(_buckets[i].load(mo));
+    // derive count from the buckets, so that both are consistent
+    ret.count += ret.counts.back();
+  }
+  ret.sum = _sum.load(mo);
+  ret.max = _max.load(mo);
+  return ret;
+}
+
+uint64_t histogram_snap_t::percentile(const double q) const noexcept {
+  if(!count) return 0;
+  // rank of the wanted sample, 1-based
+  uint64_t rank = static_cast<uint64_t>(q * count + 0.5);
+  if(rank < 1) rank = 1;
+  if(rank > count) rank = count;
+  uint64_t cumul = 0;
+  for(size_t i = 0; i < counts.size(); ++i) {
+    cumul += counts[i];
+    // the bucket bound might be above the maximum seen value
+    if(cumul >= rank) return (bounds[i] < max) ? bounds[i] : max;
+  }
+  return max;
+}
+
+auto histogram_snap_t::coarsen(const unsigned minshift) const -> histogram_snap_t {
+  histogram_snap_t ret;
+  ret.count = count;
+  ret.sum   = sum;
+  ret.max   = max;
+  uint64_t limit = (uint64_t(1) << minshift) - 1, acc = 0;
+  for(size_t i = 0; i < counts.size(); ++i) {
+    while(bounds[i] > limit && limit != UINT64_MAX) {
+      ret.bounds.emplace_back(limit);
+      ret.counts.emplace_back(acc);
+      acc = 0;
+      // next power-of-two bound, the last bucket is unbounded
+      limit = (limit >= (UINT64_MAX >> 1)) ? UINT64_MAX : (2 * limit + 1);
+      if(bounds[i] == UINT64_MAX) limit = UINT64_MAX;
+    }
+    acc += counts[i];
+  }
+  ret.bounds.emplace_back(UINT64_MAX);
+  ret.counts.emplace_back(acc);
+  return ret;
+}
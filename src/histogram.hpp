@@ -0,0 +1,94 @@
+/**
+ * zprd / histogram.hpp - latency histograms
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include <config.h>
+#include <inttypes.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+
+// monotonic clock in nanoseconds
+static inline uint64_t zprd_now_ns() noexcept {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// kernel timestamps (SO_TIMESTAMPNS) use CLOCK_REALTIME, move them onto the monotonic timeline
+static inline uint64_t zprd_ktime2mono(const struct timespec &kts, const uint64_t mono_now) noexcept {
+  if(!kts.tv_sec) return mono_now;
+  struct timespec rnow;
+  clock_gettime(CLOCK_REALTIME, &rnow);
+  const int64_t age = (rnow.tv_sec - kts.tv_sec) * INT64_C(1000000000) + (rnow.tv_nsec - kts.tv_nsec);
+  return (age > 0 && static_cast<uint64_t>(age) < mono_now) ? (mono_now - age) : mono_now;
+}
+
+struct histogram_snap_t final {
+  // inclusive upper bounds (in ns) per bucket, the last bucket is unbounded
+  std::vector<uint64_t> bounds, counts;
+  uint64_t count = 0, sum = 0, max = 0;
+
+  // percentile: returns the upper bound of the bucket which contains the q-quantile (0 < q <= 1)
+  uint64_t percentile(double q) const noexcept;
+
+  // coarsen: merge buckets, so that only power-of-two bounds remain, starting at 2^minshift
+  auto coarsen(unsigned minshift) const -> histogram_snap_t;
+};
+
+/* HDR-style log-linear histogram:
+ *  values below 2^SUBBITS are recorded exactly, every following
+ *  power-of-two range is split into 2^SUBBITS linear sub-buckets
+ *  (max. relative error = 2^-SUBBITS), values above 2^MAXSHIFT ns (~68s)
+ *  land in the overflow bucket.
+ *
+ * IMPORTANT NOTE: record() may only be called from a single thread,
+ *   snapshot() can be called from any thread
+ */
+class latency_histogram_t final {
+ public:
+  enum {
+    SUBBITS  = 4,
+    SUBCNT   = 1 << SUBBITS,
+    MAXSHIFT = 36,
+    NBUCKETS = (MAXSHIFT - SUBBITS + 1) * SUBCNT,
+  };
+
+  latency_histogram_t() noexcept;
+
+  [[gnu::hot]]
+  void record(const uint64_t ns) noexcept {
+    bump(_buckets[value2idx(ns)], 1);
+    bump(_sum, ns);
+    if(zs_unlikely(ns > _max.load(std::memory_order_relaxed)))
+      _max.store(ns, std::memory_order_relaxed);
+  }
+
+  auto snapshot() const -> histogram_snap_t;
+
+  static unsigned value2idx(const uint64_t ns) noexcept {
+    if(ns < SUBCNT) return ns;
+    const unsigned msb = 63 - __builtin_clzll(ns);
+    if(msb >= MAXSHIFT) return NBUCKETS;
+    const unsigned shift = msb - SUBBITS;
+    return (shift + 1) * SUBCNT + ((ns >> shift) & (SUBCNT - 1));
+  }
+
+  // idx2bound: inclusive upper bound of a bucket
+  static uint64_t idx2bound(const unsigned idx) noexcept {
+    if(idx < SUBCNT) return idx;
+    if(idx >= NBUCKETS) return UINT64_MAX;
+    const unsigned shift = idx / SUBCNT - 1;
+    const uint64_t lo = static_cast<uint64_t>(SUBCNT + idx % SUBCNT) << shift;
+    return lo + (uint64_t(1) << shift) - 1;
+  }
+
+ private:
+  std::atomic<uint64_t> _buckets[NBUCKETS + 1], _sum, _max;
+
+  // single writer -> no need for an atomic read-modify-write
+  static void bump(std::atomic<uint64_t> &x, const uint64_t n) noexcept
+    { x.store(x.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+};
@@ -0,0 +1,36 @@
+/**
+ * zprd / icmp_limit.cxx - rate limiting of generated ICMP errors
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "icmp_limit.hpp"
+#include <string.h>
+#include <algorithm>
+
+void icmp_limit_t::clear() noexcept {
+  // stamp 0: the buckets are full on first use
+  memset(_peers, 0, sizeof(_peers));
+  memset(_dests, 0, sizeof(_dests));
+}
+
+void icmp_limit_t::refill(bucket_t &b, const unsigned rate, const time_t now) noexcept {
+  if(now <= b.stamp) return;
+  const uint64_t burst = std::max(rate, min_burst);
+  b.tokens = std::min(burst, b.tokens + static_cast<uint64_t>(rate) * (now - b.stamp));
+  b.stamp = now;
+}
+
+bool icmp_limit_t::allow(const outer_addr_t &peer, const inner_addr_t &dest,
+                         const unsigned peer_rate, const unsigned dest_rate, const time_t now) noexcept {
+  bucket_t *const pb = peer_rate ? &_peers[outer_addr_hash()(peer) % peer_buckets] : nullptr;
+  bucket_t *const db = dest_rate ? &_dests[inner_addr_hash()(dest) % dest_buckets] : nullptr;
+  if(pb) refill(*pb, peer_rate, now);
+  if(db) refill(*db, dest_rate, now);
+  // don't take a token from one bucket if the other one is empty
+  if((pb && !pb->tokens) || (db && !db->tokens))
+    return false;
+  if(pb) --pb->tokens;
+  if(db) --db->tokens;
+  return true;
+}
@@ -0,0 +1,42 @@
+/**
+ * zprd / icmp_limit.hpp - rate limiting of generated ICMP errors
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include "iAFa.hpp"
+#include "oAFa.hpp"
+#include <inttypes.h>
+#include <stddef.h>
+#include <time.h>
+
+/* icmp_limit_t: token buckets like the icmp_ratelimit of the kernel,
+ *  one per source peer (the peer which sent the triggering packet) and one per
+ *  destination (the source address of the triggering packet). The buckets are
+ *  kept in fixed-size tables indexed by a hash, peers / destinations which share
+ *  a bucket share its tokens. Buckets are refilled with rate tokens per second
+ *  up to max(rate, min_burst).
+ */
+class icmp_limit_t final {
+ public:
+  static constexpr size_t peer_buckets = 256, dest_buckets = 1024;
+  static constexpr unsigned min_burst = 6;
+
+  icmp_limit_t() noexcept { clear(); }
+
+  // allow: takes a token from both buckets, returns false if one of them is empty
+  //  (rate = 0: unlimited)
+  bool allow(const outer_addr_t &peer, const inner_addr_t &dest,
+             unsigned peer_rate, unsigned dest_rate, time_t now) noexcept;
+  void clear() noexcept;
+
+ private:
+  struct bucket_t final {
+    uint32_t tokens;
+    time_t stamp;
+  };
+
+  bucket_t _peers[peer_buckets], _dests[dest_buckets];
+
+  static void refill(bucket_t &b, unsigned rate, time_t now) noexcept;
+};
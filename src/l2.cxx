@@ -0,0 +1,101 @@
+/**
+ * zprd / l2.cxx - MAC forwarding database
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "l2.hpp"
+#include "alloc_stats.hpp"
+#include "routes.hpp"         // last_time
+#include "iAFa.hpp"           // iafa_hash_bytes
+#include <config.h>           // zs_*likely
+#include <utility>
+
+using namespace std;
+
+// keyed hash: hosts on a bridged segment can't craft colliding MACs
+size_t mac_table_t::slot_of(const uint64_t mac) const noexcept
+  { return iafa_hash_bytes(&mac, sizeof(mac)) & (_slots.size() - 1); }
+
+[[gnu::hot]]
+auto mac_table_t::find(const uint64_t mac) noexcept -> entry_t* {
+  if(zs_unlikely(!_used)) return nullptr;
+  const size_t mask = _slots.size() - 1;
+  for(size_t i = slot_of(mac); _slots[i].mac; i = (i + 1) & mask)
+    if(_slots[i].mac == mac)
+      return &_slots[i];
+  return nullptr;
+}
+
+[[gnu::hot]]
+void mac_table_t::learn(const uint64_t mac, const remote_peer_ptr_t &peer) {
+  if(const auto e = find(mac)) {
+    // the host could have moved
+    if(zs_unlikely(e->peer != peer))
+      e->peer = peer;
+    e->seen = last_time;
+    return;
+  }
+  if(zs_unlikely(full()))
+    grow();
+
+  const size_t mask = _slots.size() - 1;
+  size_t i = slot_of(mac);
+  while(_slots[i].mac)
+    i = (i + 1) & mask;
+  _slots[i] = {mac, peer, last_time};
+  ++_used;
+}
+
+void mac_table_t::grow() {
+  zprd_alloc_allow_t aa;
+  vector<entry_t> old(max(_slots.size() * 2, static_cast<size_t>(64)));
+  old.swap(_slots);
+  const size_t mask = _slots.size() - 1;
+  for(auto &e : old) {
+    if(!e.mac) continue;
+    size_t i = slot_of(e.mac);
+    while(_slots[i].mac)
+      i = (i + 1) & mask;
+    _slots[i] = move(e);
+  }
+}
+
+// erase_at: backward shift deletion, moves the following entries of the
+//  probe sequence into the gap, if their home slot allows it
+void mac_table_t::erase_at(size_t i) noexcept {
+  const size_t mask = _slots.size() - 1;
+  for(size_t j = (i + 1) & mask; _slots[j].mac; j = (j + 1) & mask) {
+    const size_t home = slot_of(_slots[j].mac);
+    // the entry at j can move to i if its home isn't cyclically in (i, j]
+    if(((j - home) & mask) >= ((j - i) & mask)) {
+      _slots[i] = move(_slots[j]);
+      i = j;
+    }
+  }
+  _slots[i].mac = 0;
+  _slots[i].peer.reset();
+  --_used;
+}
+
+void mac_table_t::cleanup(const time_t tin) noexcept {
+  // the shifted entries are moved into the current slot or behind it, check the slot again
+  for(size_t i = 0; i < _slots.size(); )
+    if(_slots[i].mac && _slots[i].seen <= tin)
+      erase_at(i);
+    else
+      ++i;
+}
+
+void mac_table_t::del_peer(const remote_peer_ptr_t &peer) noexcept {
+  for(size_t i = 0; i < _slots.size(); )
+    if(_slots[i].mac && _slots[i].peer == peer)
+      erase_at(i);
+    else
+      ++i;
+}
+
+void mac_table_t::clear() noexcept {
+  _slots.clear();
+  _used = 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * zprd / l2.hpp - TAP mode: encapsulation header and MAC forwarding database
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include "remote_peer.hpp"
+#include <inttypes.h>
+#include <time.h>
+#include <vector>
+
+/* In TAP mode, zprd forwards Ethernet frames. Each frame is prefixed with
+ * a zprd_l2hdr, the first nibble (5) distinguishes it from IPv4 / IPv6 packets
+ * and ZPRN messages (see router_t::route_genip_packet, docs/L2).
+ */
+#define ZL2_MGC  0x50
+#define ZL2_TTL  32
+// mgc flag: the frame was flooded, copies are checked against the flood filter on every hop
+#define ZL2_F_FLOODED 0x01
+
+#pragma pack(push, 1)
+struct zprd_l2hdr final {
+  uint8_t  mgc; // ZL2_MGC | flags
+  uint8_t  ttl; // decremented on each hop
+  uint16_t id;  // assigned by the ingress node, distinguishes repeated frames (e.g. ARP retries)
+};
+#pragma pack(pop)
+
+static inline bool zprd_is_l2(const char buffer[], const size_t len) noexcept
+  { return len >= sizeof(zprd_l2hdr) && (static_cast<uint8_t>(buffer[0]) >> 4) == (ZL2_MGC >> 4); }
+
+// MAC address in the lower 48 bits (network byte order: first byte = bits 40..47)
+static inline uint64_t zprd_mac2u64(const uint8_t mac[6]) noexcept {
+  uint64_t ret = 0;
+  for(unsigned i = 0; i < 6; ++i)
+    ret = (ret << 8) | mac[i];
+  return ret;
+}
+
+// group bit (I/G): broadcast or multicast
+static inline bool zprd_mac_is_group(const uint64_t mac) noexcept
+  { return mac & (1ULL << 40); }
+
+/* mac_table_t: MAC forwarding database, open addressing with linear probing,
+ *  the capacity is a power of two and kept at most half full;
+ *  deletions shift the following entries back (no tombstones),
+ *  so lookups stay O(1) with tens of thousands of entries
+ */
+class mac_table_t final {
+ public:
+  struct entry_t final {
+    uint64_t mac; // 0 = empty slot
+    remote_peer_ptr_t peer;
+    time_t seen;
+  };
+
+  mac_table_t() noexcept : _used(0) { }
+
+  // find: returns the entry of mac or nullptr
+  entry_t* find(uint64_t mac) noexcept;
+
+  // learn: add or refresh mac, allocates only if the table grows (see full)
+  void learn(uint64_t mac, const remote_peer_ptr_t &peer);
+
+  // cleanup: drop the entries which weren't seen since tin
+  void cleanup(time_t tin) noexcept;
+  // del_peer: drop the entries which point to peer
+  void del_peer(const remote_peer_ptr_t &peer) noexcept;
+  void clear() noexcept;
+
+  size_t size() const noexcept { return _used; }
+  size_t capacity() const noexcept { return _slots.size(); }
+  // full: the next new entry lets the table grow
+  bool full() const noexcept { return 2 * (_used + 1) > _slots.size(); }
+  size_t mem_size() const noexcept { return _slots.capacity() * sizeof(entry_t); }
+
+ private:
+  std::vector<entry_t> _slots;
+  size_t _used;
+
+  size_t slot_of(uint64_t mac) const noexcept;
+  void erase_at(size_t i) noexcept;
+  void grow();
+};
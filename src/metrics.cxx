@@ -0,0 +1,226 @@
+/**
+ * zprd / metrics.cxx - prometheus text format exporter
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "metrics.hpp"
+#include "oAFa.hpp"
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+
+using namespace std;
+
+namespace {
+  struct peer_agg_t final {
+    size_t routes = 0, rtt_cnt = 0;
+    double rtt_sum = 0, rtt_min = 0;
+  };
+}
+
+static void m_head(string &out, const char *name, const char *type, const char *help) {
+  out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+  out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+}
+
+static void m_val(string &out, const char *name, const string &labels, const uint64_t val) {
+  out += name;
+  if(!labels.empty()) { out += '{'; out += labels; out += '}'; }
+  out += ' ';
+  out += to_string(val);
+  out += '\n';
+}
+
+static void m_val(string &out, const char *name, const string &labels, const double val) {
+  char buf[40];
+  snprintf(buf, sizeof(buf), " %.6g\n", val);
+  out += name;
+  if(!labels.empty()) { out += '{'; out += labels; out += '}'; }
+  out += buf;
+}
+
+static string m_label(const char *key, const string &val) {
+  string ret = key;
+  ret += "=\"";
+  for(const char i : val) {
+    switch(i) {
+      case '"':  ret += "\\\""; break;
+      case '\\': ret += "\\\\"; break;
+      case '\n': ret += "\\n";  break;
+      default:   ret += i;
+    }
+  }
+  ret += '"';
+  return ret;
+}
+
+static void m_counter2(string &out, const char *name, const char *help, const uint64_t (&vals)[2]) {
+  m_head(out, name, "counter", help);
+  m_val(out, name, "source=\"local\"",  vals[0]);
+  m_val(out, name, "source=\"remote\"", vals[1]);
+}
+
+static void m_histogram(string &out, const char *name, const char *help, const histogram_snap_t &h) {
+  m_head(out, name, "histogram", help);
+  const string bname = string(name) + "_bucket";
+  uint64_t cumul = 0;
+  for(size_t i = 0; i < h.counts.size(); ++i) {
+    cumul += h.counts[i];
+    char le[40];
+    if(h.bounds[i] == UINT64_MAX)
+      snprintf(le, sizeof(le), "le=\"+Inf\"");
+    else
+      snprintf(le, sizeof(le), "le=\"%.9g\"", h.bounds[i] / 1e9);
+    m_val(out, bname.c_str(), le, cumul);
+  }
+  m_val(out, (string(name) + "_sum").c_str(), {}, h.sum / 1e9);
+  m_val(out, (string(name) + "_count").c_str(), {}, h.count);
+}
+
+// m_latency: the full log-linear histogram has too many buckets for prometheus,
+//  export a power-of-two coarsened version (from 256ns upwards), see m_quantiles
+static void m_latency(string &out, const char *name, const char *help, const histogram_snap_t &h) {
+  m_histogram(out, name, help, h.coarsen(8));
+}
+
+// m_quantiles: quantiles of the full histogram, reported as the upper bound of the bucket
+//  (at most 2^-SUBBITS = 6.25% above the true value, capped at the maximum)
+static void m_quantiles(string &out, const char *stage, const histogram_snap_t &h) {
+  const string sl = m_label("stage", stage);
+  m_val(out, "zprd_latency_seconds", sl + ",quantile=\"0.5\"",   h.percentile(0.5)   / 1e9);
+  m_val(out, "zprd_latency_seconds", sl + ",quantile=\"0.99\"",  h.percentile(0.99)  / 1e9);
+  m_val(out, "zprd_latency_seconds", sl + ",quantile=\"0.999\"", h.percentile(0.999) / 1e9);
+  m_val(out, "zprd_latency_seconds", sl + ",quantile=\"max\"",   h.max / 1e9);
+}
+
+auto format_prometheus(const zprd_snapshot_t &snap) -> string {
+  const auto &st = snap.stats;
+  string out;
+  out.reserve(0x2000);
+
+  m_head(out, "zprd_domains", "gauge", "Number of routing domains.");
+  m_val(out, "zprd_domains", {}, static_cast<uint64_t>(snap.domains));
+
+  m_head(out, "zprd_shm_clients", "gauge", "Number of attached shared memory clients.");
+  m_val(out, "zprd_shm_clients", {}, static_cast<uint64_t>(snap.shm_clients));
+
+  m_head(out, "zprd_peers", "gauge", "Number of connected peers.");
+  m_val(out, "zprd_peers", {}, static_cast<uint64_t>(snap.tables->peers.size()));
+
+  map<string, peer_agg_t> peers;
+  size_t nrouters = 0;
+  for(const auto &i : snap.tables->routes)
+    for(const auto &r : i.routers) {
+      ++nrouters;
+      if(r.saddr.is_local()) continue;
+      auto &pa = peers[AFa_sa2string(r.saddr)];
+      ++pa.routes;
+      if(r.latency > 0) {
+        pa.rtt_min = pa.rtt_cnt ? std::min(pa.rtt_min, r.latency) : r.latency;
+        pa.rtt_sum += r.latency;
+        ++pa.rtt_cnt;
+      }
+    }
+
+  m_head(out, "zprd_routes", "gauge", "Number of routing table destinations.");
+  m_val(out, "zprd_routes", {}, static_cast<uint64_t>(snap.tables->routes.size()));
+  m_head(out, "zprd_route_entries", "gauge", "Number of routing table entries (destination + router).");
+  m_val(out, "zprd_route_entries", {}, static_cast<uint64_t>(nrouters));
+
+  m_head(out, "zprd_mcast_groups", "gauge", "Number of multicast groups with interested receivers.");
+  m_val(out, "zprd_mcast_groups", {}, static_cast<uint64_t>(snap.tables->groups.size()));
+
+  m_head(out, "zprd_l2_macs", "gauge", "Number of learned MAC addresses (TAP mode).");
+  m_val(out, "zprd_l2_macs", {}, static_cast<uint64_t>(snap.macs));
+
+  m_head(out, "zprd_peer_routes", "gauge", "Number of routes via a peer.");
+  for(const auto &i : peers)
+    m_val(out, "zprd_peer_routes", m_label("peer", i.first), static_cast<uint64_t>(i.second.routes));
+
+  // the latency is only known for routes for which echo request/reply pairs were seen
+  m_head(out, "zprd_peer_rtt_milliseconds", "gauge", "Measured round trip time of routes via a peer.");
+  for(const auto &i : peers) {
+    const auto &pa = i.second;
+    if(!pa.rtt_cnt) continue;
+    const string pl = m_label("peer", i.first);
+    m_val(out, "zprd_peer_rtt_milliseconds", pl + ",stat=\"min\"", pa.rtt_min);
+    m_val(out, "zprd_peer_rtt_milliseconds", pl + ",stat=\"avg\"", pa.rtt_sum / pa.rtt_cnt);
+  }
+
+  m_head(out, "zprd_sender_queue_depth", "gauge", "Number of messages waiting in the sender queue.");
+  m_val(out, "zprd_sender_queue_depth", "kind=\"data\"", static_cast<uint64_t>(snap.sender_tasks));
+  m_val(out, "zprd_sender_queue_depth", "kind=\"zprn\"", static_cast<uint64_t>(snap.sender_zprn_msgs));
+
+  m_counter2(out, "zprd_rx_packets_total", "Received packets.", st.rx_pkts);
+  m_counter2(out, "zprd_rx_bytes_total",   "Received bytes.",   st.rx_bytes);
+  m_counter2(out, "zprd_tx_packets_total", "Sent packets.",     st.tx_pkts);
+  m_counter2(out, "zprd_tx_bytes_total",   "Sent bytes.",       st.tx_bytes);
+
+  m_head(out, "zprd_tx_errors_total", "counter", "Failed send attempts.");
+  m_val(out, "zprd_tx_errors_total", {}, st.tx_errors);
+
+  m_head(out, "zprd_route_evictions_total", "counter", "Idle learned routes evicted to make room for new ones.");
+  m_val(out, "zprd_route_evictions_total", {}, st.route_evictions);
+
+  m_head(out, "zprd_igmp_messages_total", "counter", "IGMP messages seen on the tun device.");
+  m_val(out, "zprd_igmp_messages_total", {}, st.igmp_msgs);
+
+  m_head(out, "zprd_icmp_ratelimited_total", "counter", "ICMP errors suppressed by the rate limit.");
+  m_val(out, "zprd_icmp_ratelimited_total", {}, st.icmp_ratelimited);
+
+  m_head(out, "zprd_path_switches_total", "counter", "Switches of the outer address of dual-stack peers.");
+  m_val(out, "zprd_path_switches_total", {}, st.path_switches);
+
+  m_head(out, "zprd_uplink_failovers_total", "counter", "Uplinks which were dropped from the uplinks of a peer.");
+  m_val(out, "zprd_uplink_failovers_total", {}, st.uplink_failovers);
+
+  m_head(out, "zprd_drops_total", "counter", "Dropped packets by reason.");
+  for(size_t i = 0; i < ZDROP_MAX; ++i)
+    m_val(out, "zprd_drops_total", m_label("reason", zprd_drop_reason2str(static_cast<zprd_drop_reason_t>(i))), st.drops[i]);
+
+  m_head(out, "zprd_zprn_messages_total", "counter", "ZPRN route notification messages.");
+  m_val(out, "zprd_zprn_messages_total", "direction=\"rx\"", st.zprn_rx_msgs);
+  m_val(out, "zprd_zprn_messages_total", "direction=\"tx\"", st.zprn_tx_msgs);
+  m_head(out, "zprd_zprn_tx_packets_total", "counter", "Sent ZPRN packets (each carries one or more messages).");
+  m_val(out, "zprd_zprn_tx_packets_total", {}, st.zprn_tx_pkts);
+
+  m_latency(out, "zprd_forward_duration_seconds", "Time from packet ingress until the routing decision.", st.fwd_time);
+  m_latency(out, "zprd_sender_queue_wait_seconds", "Time packets spent in the sender queue.", st.queue_wait);
+  m_latency(out, "zprd_residence_seconds", "Time from packet ingress until it was sent.", st.residence);
+
+  m_head(out, "zprd_latency_seconds", "gauge", "Latency quantile estimates per stage (bucket upper bounds, since startup).");
+  m_quantiles(out, "forward",    st.fwd_time);
+  m_quantiles(out, "queue_wait", st.queue_wait);
+  m_quantiles(out, "residence",  st.residence);
+
+  m_head(out, "zprd_stalls_total", "counter", "Main loop iterations which exceeded the watchdog threshold.");
+  m_val(out, "zprd_stalls_total", {}, st.stalls);
+  m_head(out, "zprd_stall_phases_total", "counter", "Detected main loop stalls by active phase.");
+  for(size_t i = 0; i < ZPH_MAX; ++i)
+    m_val(out, "zprd_stall_phases_total", m_label("phase", zprd_phase2str(static_cast<zprd_phase_t>(i))), st.stall_phases[i]);
+  m_latency(out, "zprd_stall_duration_seconds", "Duration of stalled main loop iterations.", st.stall_time);
+
+  m_head(out, "zprd_memory_bytes", "gauge", "Estimated heap usage by subsystem.");
+  for(size_t i = 0; i < ZMEM_MAX; ++i)
+    m_val(out, "zprd_memory_bytes", m_label("subsystem", zprd_mem2str(static_cast<zprd_mem_t>(i))), static_cast<uint64_t>(snap.mem[i]));
+  m_head(out, "zprd_memory_budget_bytes", "gauge", "Configured memory budget by subsystem (0 = unlimited).");
+  for(size_t i = 0; i < ZMEM_MAX; ++i)
+    m_val(out, "zprd_memory_budget_bytes", m_label("subsystem", zprd_mem2str(static_cast<zprd_mem_t>(i))), static_cast<uint64_t>(snap.mem_budget[i]));
+  m_head(out, "zprd_budget_hits_total", "counter", "Allocations refused because the memory budget was exhausted.");
+  for(size_t i = 0; i < ZMEM_MAX; ++i)
+    m_val(out, "zprd_budget_hits_total", m_label("subsystem", zprd_mem2str(static_cast<zprd_mem_t>(i))), st.budget_hits[i]);
+
+#ifdef USE_ALLOC_STATS
+  m_head(out, "zprd_allocs_total", "counter", "Heap allocations by main loop phase or thread.");
+  for(size_t i = 0; i < ZALLOC_MAX; ++i)
+    m_val(out, "zprd_allocs_total", m_label("slot", zprd_alloc_slot2str(static_cast<zprd_alloc_slot_t>(i))), st.allocs[i]);
+  m_head(out, "zprd_alloc_bytes_total", "counter", "Heap allocated bytes by main loop phase or thread.");
+  for(size_t i = 0; i < ZALLOC_MAX; ++i)
+    m_val(out, "zprd_alloc_bytes_total", m_label("slot", zprd_alloc_slot2str(static_cast<zprd_alloc_slot_t>(i))), st.alloc_bytes[i]);
+#endif
+
+  m_head(out, "zprd_snapshot_timestamp_seconds", "gauge", "Time at which the exported snapshot was taken.");
+  m_val(out, "zprd_snapshot_timestamp_seconds", {}, static_cast<uint64_t>(snap.taken));
+  return out;
+}
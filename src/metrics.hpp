@@ -0,0 +1,11 @@
+/**
+ * zprd / metrics.hpp - prometheus text format exporter
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include "snapshot.hpp"
+#include <string>
+
+// format_prometheus: formats a snapshot in the prometheus text exposition format (0.0.4)
+auto format_prometheus(const zprd_snapshot_t &snap) -> std::string;
@@ -0,0 +1,295 @@
+/**
+ * zprd / paths.cxx - outer path selection for dual-stack peers and uplinks
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "paths.hpp"
+#include "histogram.hpp" // zprd_now_ns
+#include "router.hpp"
+#include "sender.hpp"    // server_fds, uplink_fds
+#include "stats.hpp"
+#include "watchdog.hpp"  // zprd_phase_guard_t
+#include "zprd_conf.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/random.h>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+static constexpr uint64_t path_unusable = numeric_limits<uint64_t>::max();
+static constexpr uint64_t min_gain = 1000000; // ns
+// uplinks with a score up to 2 * best + uplink_slack are used
+static constexpr uint64_t uplink_slack = 5000000; // ns
+
+// score: smoothed RTT + up to 4 times of it for the loss, path_unusable if the path doesn't answer
+uint64_t path_prober_t::score(const path_t &p) noexcept {
+  // the newest probe (bit 0) may still be in flight
+  const unsigned n = std::min(p.sent, window + 1) - 1;
+  if(!p.srtt || !n) return path_unusable;
+  const uint32_t mask = ((1U << n) - 1) << 1;
+  // none of the last 3 probes answered
+  if(!(p.acked & mask & 0xe)) return path_unusable;
+  const unsigned lost = n - __builtin_popcount(p.acked & mask);
+  return p.srtt + 4 * p.srtt * lost / n;
+}
+
+// fill_random: fills x with getrandom(), falls back to rand() (predictable) if that fails
+template<typename T>
+static void fill_random(T &x) noexcept {
+  if(getrandom(&x, sizeof(x), 0) == static_cast<ssize_t>(sizeof(x)))
+    return;
+  perror("PATHS WARNING: getrandom()");
+  x = (static_cast<uint64_t>(rand()) << 32) ^ (static_cast<uint64_t>(rand()) << 16) ^ static_cast<uint64_t>(rand());
+}
+
+void path_prober_t::set_interval(const time_t interval) noexcept {
+  _interval = interval;
+  // the node ID has to differ between nodes started at the same time, 0 = no uplinks
+  if(!uplink_fds.empty())
+    while(!_node) fill_random(_node);
+}
+
+void path_prober_t::update(router_t &router, const remote_peer_detail_ptr_t &peer, vector<outer_addr_t> &&paths) {
+  auto it = find_if(_remotes.begin(), _remotes.end(),
+    [&peer](const remote_t &r) { return r.peer.lock() == peer; });
+  if(paths.size() < 2 && uplink_fds.empty()) {
+    // nothing to select
+    if(it != _remotes.end()) _remotes.erase(it);
+    return;
+  }
+  if(it == _remotes.end()) {
+    _remotes.emplace_back();
+    it = _remotes.end() - 1;
+    it->router = &router;
+    it->peer = peer;
+    it->switched = last_time;
+    it->uplinks = 0;
+  }
+
+  vector<path_t> npaths;
+  npaths.reserve(paths.size() * std::max(uplink_fds.size(), static_cast<size_t>(1)));
+  const auto add_path = [&](const outer_addr_t &addr, const uint8_t uplink) {
+    const auto kt = find_if(it->paths.cbegin(), it->paths.cend(),
+      [&](const path_t &p) { return p.addr == addr && p.uplink == uplink; });
+    if(kt != it->paths.cend()) {
+      npaths.emplace_back(*kt);
+      return;
+    }
+    path_t p;
+    p.addr = addr;
+    p.uplink = uplink;
+    // the cookie is the only check of a reply, it must not be guessable
+    fill_random(p.cookie);
+    p.seq = 0;
+    p.acked = 0;
+    p.sent = 0;
+    p.srtt = 0;
+    npaths.emplace_back(p);
+  };
+  for(const auto &i : paths) {
+    // addresses without an uplink of their family are probed via the catchall socket
+    const int oaf = zprd_af2oaf(i.family);
+    bool via_uplink = false;
+    for(size_t u = 0; oaf >= 0 && u < uplink_fds.size(); ++u)
+      if(uplink_fds[u].fds[oaf] >= 0) {
+        add_path(i, u);
+        via_uplink = true;
+      }
+    if(!via_uplink)
+      add_path(i, no_uplink);
+  }
+  it->paths = move(npaths);
+}
+
+void path_prober_t::select(remote_t &r, const remote_peer_detail_ptr_t &peer, const time_t now) {
+  const outer_addr_t cur_addr = peer->saddr;
+  // the score of an address is the one of its best uplink
+  const path_t *cur = nullptr, *best = nullptr;
+  uint64_t cur_score = path_unusable, best_score = path_unusable;
+  for(const auto &p : r.paths) {
+    const uint64_t s = score(p);
+    if(p.addr == cur_addr && (!cur || s < cur_score)) {
+      cur = &p;
+      cur_score = s;
+    }
+    if(s < best_score) {
+      best = &p;
+      best_score = s;
+    }
+  }
+  // hysteresis (25%, at least 1 ms), unless the current path is dead
+  if(!best || best->addr == cur_addr || (cur_score != path_unusable && ((now - r.switched) < 5 * _interval
+     || (best_score + std::max(best_score / 4, min_gain)) >= cur_score))) {
+    if(!uplink_fds.empty()) select_uplinks(r, peer, cur_addr);
+    return;
+  }
+
+  char olddesc[AFA_SA_BUFLEN], newdesc[AFA_SA_BUFLEN];
+  AFa_sa2buf(cur_addr, "", olddesc, sizeof(olddesc));
+  AFa_sa2buf(best->addr, "", newdesc, sizeof(newdesc));
+  if(cur_score != path_unusable)
+    printf("PATHS: switch from %s (%.2f ms) to %s (%.2f ms)\n", olddesc, cur->srtt / 1e6, newdesc, best->srtt / 1e6);
+  else
+    printf("PATHS: switch from %s (no answer) to %s (%.2f ms)\n", olddesc, newdesc, best->srtt / 1e6);
+  r.router->switch_path(peer, best->addr);
+  r.switched = now;
+  zprd_stats.inc(zprd_stats.path_switches);
+  if(!uplink_fds.empty()) select_uplinks(r, peer, best->addr);
+}
+
+void path_prober_t::select_uplinks(remote_t &r, const remote_peer_detail_ptr_t &peer, const outer_addr_t &sel) {
+  uint64_t best_score = path_unusable;
+  for(const auto &p : r.paths)
+    if(p.addr == sel)
+      best_score = std::min(best_score, score(p));
+
+  uint8_t mask = 0;
+  if(best_score != path_unusable)
+    for(const auto &p : r.paths)
+      if(p.addr == sel && p.uplink != no_uplink && score(p) <= 2 * best_score + uplink_slack)
+        mask |= 1U << p.uplink;
+  if(mask == r.uplinks)
+    return;
+
+  char desc[AFA_SA_BUFLEN];
+  AFa_sa2buf(sel, "", desc, sizeof(desc));
+  printf("PATHS: uplinks to %s:", desc);
+  for(size_t u = 0; u < zprd_conf.uplinks.size(); ++u)
+    if(mask & (1U << u))
+      printf(" %s", zprd_conf.uplinks[u].dev.c_str());
+  puts(mask ? "" : " none (catchall socket)");
+
+  if(r.uplinks & ~mask)
+    zprd_stats.inc(zprd_stats.uplink_failovers);
+  r.uplinks = mask;
+  peer->locked_run([mask](remote_peer_detail_t &o) { o.uplinks = mask; });
+}
+
+void path_prober_t::expire_nodes(const time_t now) {
+  const time_t tin = now - zprd_conf.remote_timeout;
+  for(auto it = _nodes.begin(); it != _nodes.end();)
+    it = (it->second.seen < tin) ? _nodes.erase(it) : next(it);
+  for(auto it = _node_addrs.begin(); it != _node_addrs.end();)
+    it = (it->second.seen < tin || !_nodes.count(it->second.node)) ? _node_addrs.erase(it) : next(it);
+}
+
+void path_prober_t::tick(const time_t now) {
+  if(!_node_addrs.empty())
+    expire_nodes(now);
+  if(!_interval || (now - _last_probe) < _interval)
+    return;
+  _last_probe = now;
+  zprd_phase_guard_t pg(ZPH_PATHS);
+
+  zprd_pathprobe probe;
+  probe.mgc = ZPATH_MGC;
+  probe.node = _node;
+
+  for(auto it = _remotes.begin(); it != _remotes.end();) {
+    const auto peer = it->peer.lock();
+    if(!peer || peer->to_discard) {
+      it = _remotes.erase(it);
+      continue;
+    }
+
+    // the ZPRN messages are sent via the first healthy uplink (see sender_t::worker_fn),
+    //  the receiver sends to the source address of the primary requests
+    const outer_addr_t cur_addr = peer->saddr;
+    unsigned primary = it->uplinks ? __builtin_ctz(it->uplinks) : no_uplink;
+    if(primary == no_uplink)
+      for(const auto &p : it->paths)
+        if(p.addr == cur_addr && p.uplink != no_uplink) {
+          primary = p.uplink;
+          break;
+        }
+
+    for(auto &p : it->paths) {
+      const int oaf = zprd_af2oaf(p.addr.family);
+      const int fd = (oaf < 0) ? -1 : (p.uplink == no_uplink ? server_fds[oaf] : uplink_fds[p.uplink].fds[oaf]);
+      p.acked <<= 1;
+      if(p.sent <= window) ++p.sent;
+      probe.seq = htons(p.seq++);
+      if(fd < 0) continue;
+
+      probe.type = (p.uplink == primary && p.addr == cur_addr) ? ZPATH_REQUEST_PRIMARY : ZPATH_REQUEST;
+      probe.cookie = p.cookie;
+      probe.t_sent = zprd_now_ns();
+      struct sockaddr_storage sas;
+      const socklen_t saslen = p.addr.to_sa(sas);
+      if(zs_unlikely(sendto(fd, &probe, sizeof(probe), 0, reinterpret_cast<const struct sockaddr *>(&sas), saslen) < 0))
+        zprd_stats.inc(zprd_stats.tx_errors);
+    }
+
+    select(*it, peer, now);
+    ++it;
+  }
+}
+
+void path_prober_t::handle(const int fd, const struct sockaddr_storage &src, char *const buf, const size_t len, const uint64_t t_ingress) noexcept {
+  if(len != sizeof(zprd_pathprobe))
+    return;
+  auto &probe = *reinterpret_cast<zprd_pathprobe *>(buf);
+
+  if(probe.type != ZPATH_REPLY) {
+    if(probe.node)
+      learn_node(probe.node, outer_addr_t(src), probe.type == ZPATH_REQUEST_PRIMARY);
+    // the reply has the same size as the request
+    probe.type = ZPATH_REPLY;
+    if(zs_unlikely(sendto(fd, buf, len, 0, reinterpret_cast<const struct sockaddr *>(&src), AFa_sa_family2size(src)) < 0))
+      zprd_stats.inc(zprd_stats.tx_errors);
+    return;
+  }
+
+  for(auto &r : _remotes)
+    for(auto &p : r.paths) {
+      if(p.cookie != probe.cookie) continue;
+      const uint16_t d = p.seq - 1 - ntohs(probe.seq);
+      if(d >= 32 || t_ingress < probe.t_sent)
+        return;
+      p.acked |= 1U << d;
+      // EWMA with a weight of 1/8 like the TCP SRTT
+      const uint64_t rtt = t_ingress - probe.t_sent;
+      p.srtt = p.srtt ? (p.srtt - p.srtt / 8 + rtt / 8) : rtt;
+      return;
+    }
+}
+
+void path_prober_t::learn_node(const uint64_t node, const outer_addr_t &src, const bool primary) {
+  auto it = _nodes.find(node);
+  if(it == _nodes.end()) {
+    if(_nodes.size() >= max_nodes)
+      return;
+    it = _nodes.emplace(node, node_t{src, last_time}).first;
+  }
+  it->second.seen = last_time;
+
+  const auto at = _node_addrs.find(src);
+  if(at != _node_addrs.end())
+    at->second = node_addr_t{node, last_time};
+  else if(_node_addrs.size() < max_node_addrs)
+    _node_addrs.emplace(src, node_addr_t{node, last_time});
+
+  if(primary && it->second.primary != src) {
+    const outer_addr_t old = it->second.primary;
+    it->second.primary = src;
+    char olddesc[AFA_SA_BUFLEN], newdesc[AFA_SA_BUFLEN];
+    AFa_sa2buf(old, "", olddesc, sizeof(olddesc));
+    AFa_sa2buf(src, "", newdesc, sizeof(newdesc));
+    printf("PATHS: node %016" PRIx64 " moved from %s to %s\n", node, olddesc, newdesc);
+    if(rekey_hook) rekey_hook(old, src);
+  }
+}
+
+bool path_prober_t::alias(const outer_addr_t &saddr, outer_addr_t &primary) const noexcept {
+  const auto at = _node_addrs.find(saddr);
+  if(at == _node_addrs.end())
+    return false;
+  const auto it = _nodes.find(at->second.node);
+  if(it == _nodes.end())
+    return false;
+  primary = it->second.primary;
+  return true;
+}
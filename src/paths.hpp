@@ -0,0 +1,130 @@
+/**
+ * zprd / paths.hpp - outer path selection for dual-stack peers and uplinks
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include "remote_peer.hpp"
+#include <inttypes.h>
+#include <time.h>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class router_t;
+
+/* A configured remote which resolves to more than one address (e.g. IPv4 + IPv6)
+ * is probed via each of them (config statement 'p', see docs/PATHS). The peer
+ * uses the path with the lowest RTT, penalized by the loss of the last probes.
+ * Another path is only selected if it is at least 25% (and 1 ms) better and the current
+ * one was used for a few probe intervals, or if the current one stops answering.
+ *
+ * With uplinks (config statement 'u', see docs/UPLINKS) every configured remote is probed
+ * via each uplink, the score of an address is the one of its best uplink. The flows to
+ * the peer are distributed over the uplinks which aren't much worse than the best one
+ * (remote_peer_t::uplinks), an uplink is dropped after 3 unanswered probes.
+ *
+ * A node with uplinks puts its random node ID into its requests. The receiver attributes
+ * all source addresses of a node ID to one peer (alias), its address is the source of the
+ * primary requests, which are sent via the uplink of the ZPRN messages to the receiver.
+ *
+ * Probe packet (answered by every zprd node, the reply echoes the request):
+ *  [1b MGC] [1b type] [2b seq] [4b cookie] [8b t_sent] [8b node]
+ *  0x20     see ZPATH_*                                 0 = no uplinks
+ */
+#define ZPATH_MGC 0x20
+
+#define ZPATH_REQUEST 0
+#define ZPATH_REPLY   1
+#define ZPATH_REQUEST_PRIMARY 2
+
+#pragma pack(push, 1)
+struct zprd_pathprobe final {
+  uint8_t  mgc;
+  uint8_t  type;
+  uint16_t seq;
+  uint32_t cookie;
+  uint64_t t_sent; // monotonic timestamp of the prober in ns, opaque to the receiver
+  uint64_t node;   // node ID of the prober, opaque
+};
+#pragma pack(pop)
+
+// path_prober_t: runs in the forwarding thread, probes are sent via server_fds / uplink_fds
+class path_prober_t final {
+ public:
+  // count of probes considered for the loss estimate, max 31
+  static constexpr unsigned window = 16;
+
+ private:
+  // path_t::uplink of the paths via the catchall socket
+  static constexpr uint8_t no_uplink = 0xff;
+
+  struct path_t final {
+    outer_addr_t addr;
+    uint8_t uplink;  // index in uplink_fds
+    uint32_t cookie;
+    uint16_t seq;    // of the next probe
+    uint32_t acked;  // bit i = got a reply to probe seq - 1 - i
+    unsigned sent;   // probes sent, saturates at window + 1
+    uint64_t srtt;   // smoothed RTT in ns, 0 = no reply yet
+  };
+
+  struct remote_t final {
+    router_t *router;
+    std::weak_ptr<remote_peer_detail_t> peer;
+    std::vector<path_t> paths;
+    time_t switched;
+    uint8_t uplinks; // remote_peer_t::uplinks of the peer
+  };
+
+  // nodes with uplinks which probe us: node ID -> address of its peer,
+  //  source address -> node ID (both expire after the remote timeout)
+  struct node_t final {
+    outer_addr_t primary;
+    time_t seen;
+  };
+  struct node_addr_t final {
+    uint64_t node;
+    time_t seen;
+  };
+
+  std::vector<remote_t> _remotes;
+  std::unordered_map<uint64_t, node_t> _nodes;
+  std::unordered_map<outer_addr_t, node_addr_t, outer_addr_hash> _node_addrs;
+  time_t _interval, _last_probe;
+  uint64_t _node; // our node ID, 0 = no uplinks
+
+  static uint64_t score(const path_t &p) noexcept;
+  void select(remote_t &r, const remote_peer_detail_ptr_t &peer, time_t now);
+  void select_uplinks(remote_t &r, const remote_peer_detail_ptr_t &peer, const outer_addr_t &sel);
+  void learn_node(uint64_t node, const outer_addr_t &src, bool primary);
+  void expire_nodes(time_t now);
+
+ public:
+  // max count of tracked nodes with uplinks, and of their addresses
+  static constexpr size_t max_nodes = 1024, max_node_addrs = 4 * max_nodes;
+
+  // optional, called if the peer of a node with uplinks has to be reached via another address
+  std::function<void (const outer_addr_t &from, const outer_addr_t &to)> rekey_hook;
+
+  path_prober_t() noexcept: _interval(0), _last_probe(0), _node(0) { }
+
+  // interval: probe interval in seconds, 0 = disabled,
+  //  called after uplink_fds is set up (a node with uplinks gets a node ID)
+  void set_interval(time_t interval) noexcept;
+  bool enabled() const noexcept { return _interval; }
+
+  // update: the addresses of a configured remote (router_t::paths_hook),
+  //  the measurements of known paths are kept
+  void update(router_t &router, const remote_peer_detail_ptr_t &peer, std::vector<outer_addr_t> &&paths);
+
+  // tick: send the probes and select the paths, should be called once a second
+  void tick(time_t now);
+
+  // alias: the address of the peer of a node with uplinks, if saddr is one of its addresses
+  bool alias(const outer_addr_t &saddr, outer_addr_t &primary) const noexcept;
+
+  // handle: answer a probe request or account a reply (received via fd from src)
+  void handle(int fd, const struct sockaddr_storage &src, char *buf, size_t len, uint64_t t_ingress) noexcept;
+};
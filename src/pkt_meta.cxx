@@ -0,0 +1,103 @@
+/**
+ * zprd / pkt_meta.cxx - per-packet metadata of the forwarding path
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "pkt_meta.hpp"
+#include "iAFa.hpp"           // iafa_hash_bytes
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <string.h>
+
+// IPv6 extension headers which may precede the upper-layer header (all protocol numbers are < 64)
+static constexpr uint64_t exthdr_mask =
+    (1ULL << IPPROTO_HOPOPTS) | (1ULL << IPPROTO_ROUTING) | (1ULL << IPPROTO_FRAGMENT)
+  | (1ULL << IPPROTO_AH)      | (1ULL << IPPROTO_DSTOPTS);
+
+[[gnu::hot]]
+void pkt_meta_t::parse4(const char buffer[], const uint16_t buflen) noexcept {
+  const auto h_ip = reinterpret_cast<const struct ip*>(buffer);
+  const size_t hlen = 4 * h_ip->ip_hl;
+  *this = pkt_meta_t();
+  // non-first fragments don't carry the upper-layer header
+  if(hlen >= sizeof(struct ip) && hlen <= buflen && !(h_ip->ip_off & htons(IP_OFFMASK))) {
+    l4off = hlen;
+    l4proto = h_ip->ip_p;
+  }
+}
+
+[[gnu::hot]]
+void pkt_meta_t::parse6(const char buffer[], const uint16_t buflen) noexcept {
+  const auto ubuf = reinterpret_cast<const uint8_t*>(buffer);
+  uint8_t nxt = reinterpret_cast<const struct ip6_hdr*>(buffer)->ip6_nxt;
+  size_t off = sizeof(struct ip6_hdr);
+  *this = pkt_meta_t();
+
+  for(;; ++nexthdrs) {
+    if(nxt >= 64 || !((exthdr_mask >> nxt) & 1)) {
+      // upper-layer header
+      if(nxt != IPPROTO_NONE && off <= buflen) {
+        l4off = off;
+        l4proto = nxt;
+      }
+      return;
+    }
+    // every extension header is at least 8 bytes long
+    if(nexthdrs == max_exthdrs || (off + 8) > buflen)
+      return;
+
+    const uint8_t *const h = ubuf + off;
+    if(nxt == IPPROTO_FRAGMENT) {
+      // non-first fragment
+      if(((h[2] << 8) | h[3]) & 0xfff8)
+        return;
+      off += 8;
+    } else {
+      // length without the first 8 octets in 8-octet units, AH: without the first 2 in 4-octet units
+      off += (nxt == IPPROTO_AH) ? (h[1] + 2u) * 4 : (h[1] + 1u) * 8;
+    }
+    nxt = h[0];
+  }
+}
+
+[[gnu::hot]]
+uint32_t pkt_meta_t::flow(const char buffer[], const uint16_t buflen) const noexcept {
+  // message = addresses + IPv6 flow label + protocol + ports
+  char msg[32 + 4 + 1 + 4];
+  size_t mlen;
+  bool with_ports;
+
+  if((*reinterpret_cast<const uint8_t*>(buffer) >> 4) == 6) {
+    const auto h_ip = reinterpret_cast<const struct ip6_hdr*>(buffer);
+    const uint32_t label = h_ip->ip6_flow & htonl(0x000fffff);
+    memcpy(msg, &h_ip->ip6_src, 32);
+    memcpy(msg + 32, &label, 4);
+    mlen = 36;
+    // the fields of the IP header are the same in all fragments, l4proto isn't
+    //  (the first fragment would end up on another uplink than the others)
+    msg[mlen++] = h_ip->ip6_nxt;
+    with_ports = !nexthdrs;
+  } else {
+    const auto h_ip = reinterpret_cast<const struct ip*>(buffer);
+    memcpy(msg, &h_ip->ip_src, 8);
+    mlen = 8;
+    msg[mlen++] = h_ip->ip_p;
+    with_ports = !(h_ip->ip_off & htons(IP_MF | IP_OFFMASK));
+  }
+
+  switch(l4proto) {
+    case IPPROTO_TCP:
+    case IPPROTO_UDP:
+    case IPPROTO_SCTP:
+      if(with_ports && l4off && (l4off + 4) <= buflen) {
+        memcpy(msg + mlen, buffer + l4off, 4);
+        mlen += 4;
+      }
+      break;
+    default: break;
+  }
+  return iafa_hash_bytes(msg, mlen);
+}
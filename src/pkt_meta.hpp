@@ -0,0 +1,31 @@
+/**
+ * zprd / pkt_meta.hpp - per-packet metadata of the forwarding path
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include <inttypes.h>
+
+/* pkt_meta_t: the location of the upper-layer header of an IP packet,
+ *  parsed once per packet (router_t::route_ip_packet) and reused by the
+ *  ICMP evaluation, the ping cache and the flood filter key
+ */
+struct pkt_meta_t final {
+  // the walker gives up after this count of IPv6 extension headers
+  static constexpr unsigned max_exthdrs = 8;
+
+  uint16_t l4off;   // offset of the upper-layer header, 0 = none
+                    //  (non-first fragment, no next header, truncated or too many extension headers)
+  uint8_t  l4proto; // upper-layer protocol (IPPROTO_*), 0 if l4off is 0
+  uint8_t  nexthdrs; // count of IPv6 extension headers before l4off
+
+  pkt_meta_t() noexcept: l4off(0), l4proto(0), nexthdrs(0) { }
+
+  // parse4 / parse6: the packet has to be verified (buflen = length of the IP packet)
+  void parse4(const char buffer[], uint16_t buflen) noexcept;
+  void parse6(const char buffer[], uint16_t buflen) noexcept;
+
+  // flow: hash of the addresses, the protocol and the ports (TCP, UDP, SCTP) of the parsed packet,
+  //  fragments and IPv6 packets with extension headers are hashed without the ports
+  uint32_t flow(const char buffer[], uint16_t buflen) const noexcept;
+};
@@ -14,14 +14,14 @@
 #include <string.h>
 
 remote_peer_t::remote_peer_t(const struct sockaddr_storage &sas) noexcept
-  { set_saddr(sas, false); }
+  : saddr(sas), uplinks(0) { }
 
 remote_peer_t::remote_peer_t(remote_peer_t &&o) noexcept
-  { set_saddr(o.saddr, false); }
+  : saddr(o.saddr), uplinks(o.uplinks) { }
 
 [[gnu::hot]]
 static inline int compare_peers(const remote_peer_t &lhs, const remote_peer_t &rhs) noexcept
-  { return AFa_sa_compare(lhs.saddr, rhs.saddr); }
+  { return AFa_oa_compare(lhs.saddr, rhs.saddr); }
 
 bool operator==(const remote_peer_t &lhs, const remote_peer_t &rhs) noexcept
   { return !compare_peers(lhs, rhs); }
@@ -30,7 +30,7 @@ bool operator!=(const remote_peer_t &lhs, const remote_peer_t &rhs) noexcept
 bool operator<(const remote_peer_t &lhs, const remote_peer_t &rhs) noexcept
   { return compare_peers(lhs, rhs) < 0; }
 
-auto remote_peer_t::get_saddr() const noexcept -> sockaddr_storage {
+auto remote_peer_t::get_saddr() const noexcept -> outer_addr_t {
   std::shared_lock<_mtx_t> lock(_mtx);
   return saddr;
 }
@@ -41,7 +41,7 @@ void remote_peer_t::set_saddr(const sockaddr_storage &sas, const bool do_lock) n
     // single self-recursion
     set_saddr(sas, false);
   } else {
-    whole_memcpy(&saddr, &sas);
+    saddr = outer_addr_t(sas);
   }
 }
 
@@ -52,10 +52,10 @@ void remote_peer_t::set_port(const uint16_t port, const bool do_lock) noexcept {
     set_port(port, false);
     return;
   }
-  if(uint16_t *portptr = AFa_gp_port(saddr))
-    *portptr = htons(port);
+  if(!saddr.is_local())
+    saddr.port = htons(port);
   else
-    fprintf(stderr, "NOTICE: remote_peer::set_port: unsupported address family %u\n", static_cast<unsigned>(saddr.ss_family));
+    fprintf(stderr, "NOTICE: remote_peer::set_port: unsupported address family %u\n", static_cast<unsigned>(saddr.family));
 }
 
 void remote_peer_t::set_port_if_unset(const uint16_t port, const bool do_lock) noexcept {
@@ -65,10 +65,10 @@ void remote_peer_t::set_port_if_unset(const uint16_t port, const bool do_lock) n
     set_port_if_unset(port, false);
     return;
   }
-  if(uint16_t *portptr = AFa_gp_port(saddr)) {
-    if(!*portptr)
-      *portptr = htons(port);
+  if(!saddr.is_local()) {
+    if(!saddr.port)
+      saddr.port = htons(port);
   } else {
-    fprintf(stderr, "NOTICE: remote_peer::set_port: unsupported address family %u\n", static_cast<unsigned>(saddr.ss_family));
+    fprintf(stderr, "NOTICE: remote_peer::set_port: unsupported address family %u\n", static_cast<unsigned>(saddr.family));
   }
 }
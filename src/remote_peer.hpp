@@ -5,11 +5,13 @@
  * License: GPL-2+
  **/
 #pragma once
+#include "oAFa.hpp"     // outer_addr_t
 #include <sys/socket.h> // sockaddr_storage
 #include <stddef.h>     // size_t
 #include <time.h>       // time_t
 
 #include <memory>
+#include <mutex>        // unique_lock
 #include <shared_mutex>
 #include <string>
 
@@ -20,18 +22,22 @@ class remote_peer_t : public std::enable_shared_from_this<remote_peer_t> {
   typedef std::shared_mutex _mtx_t;
   mutable _mtx_t _mtx;
  public:
-  struct sockaddr_storage saddr;
+  // compact endpoint, converted to a sockaddr only for sendto
+  outer_addr_t saddr;
+  // bit i = uplink_fds[i] is healthy, 0 = use the wildcard socket (set by path_prober_t)
+  uint8_t uplinks;
 
   [[gnu::hot]]
-  remote_peer_t() noexcept { zeroify(saddr); }
+  remote_peer_t() noexcept: uplinks(0) { }
   virtual ~remote_peer_t() = default;
   remote_peer_t(const struct sockaddr_storage &sas) noexcept;
+  explicit remote_peer_t(const outer_addr_t &oa) noexcept: saddr(oa), uplinks(0) { }
   remote_peer_t(remote_peer_t &&o) noexcept;
   remote_peer_t(const remote_peer_t &o) noexcept = delete;
 
   // generic access methods, locked
-  auto get_saddr() const noexcept -> sockaddr_storage;
-  bool is_local() const noexcept { return saddr.ss_family == AF_UNSPEC; }
+  auto get_saddr() const noexcept -> outer_addr_t;
+  bool is_local() const noexcept { return saddr.is_local(); }
   void set_saddr(const sockaddr_storage &sas, bool do_lock = true) noexcept;
   void set_port(uint16_t port, bool do_lock = true) noexcept;
   void set_port_if_unset(uint16_t port, bool do_lock = true) noexcept;
@@ -64,10 +70,9 @@ struct remote_peer_detail_t : remote_peer_t {
   remote_peer_detail_t(const remote_peer_detail_t &o) noexcept = delete;
 
   explicit remote_peer_detail_t(const sockaddr_storage &sas) noexcept;
+  explicit remote_peer_detail_t(const outer_addr_t &oa) noexcept;
   remote_peer_detail_t(const sockaddr_storage &sas, const size_t cfgent) noexcept;
 
-  const char *cfgent_name() const noexcept;
-
   template<typename Fn>
   auto locked_crun(const Fn &fn) const {
     std::shared_lock<_mtx_t> lock(_mtx);
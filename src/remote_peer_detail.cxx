@@ -14,14 +14,8 @@ remote_peer_detail_t::remote_peer_detail_t() noexcept
 remote_peer_detail_t::remote_peer_detail_t(const sockaddr_storage &sas) noexcept
   : remote_peer_t(sas), seen(last_time), cent(0), to_discard(false) { }
 
+remote_peer_detail_t::remote_peer_detail_t(const outer_addr_t &oa) noexcept
+  : remote_peer_t(oa), seen(last_time), cent(0), to_discard(false) { }
+
 remote_peer_detail_t::remote_peer_detail_t(const sockaddr_storage &sas, const size_t cfgent) noexcept
   : remote_peer_detail_t(sas) { cent = cfgent + 1; }
-
-#include "zprd_conf.hpp"
-
-const char *remote_peer_detail_t::cfgent_name() const noexcept {
-  if(cent < 1) return "-";
-  const auto &r = zprd_conf.remotes;
-  const size_t ce = cent - 1;
-  return (ce >= r.size()) ? "####" : r[ce].c_str();
-}
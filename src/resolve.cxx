@@ -10,8 +10,10 @@
 #include <config.h>
 #include <stdio.h>  // printf
 #include <netdb.h>  // getaddrinfo
+#include <algorithm>
 
-bool resolve_hostname(std::string hostname, struct sockaddr_storage &remote, const sa_family_t preferred_af) noexcept {
+// resolve: getaddrinfo wrapper, hostname format := HOST[|PORT]
+static struct addrinfo *resolve(std::string &hostname) noexcept {
   struct addrinfo hints, *servinfo;
 
   // setup hints
@@ -19,19 +21,23 @@ bool resolve_hostname(std::string hostname, struct sockaddr_storage &remote, con
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_DGRAM;
 
-  {
-    char * portptr = nullptr;
-    const size_t befport = hostname.find('|');
-    if(befport != std::string::npos && hostname[befport + 1]) {
-      portptr = &hostname[befport];
-      *(portptr++) = 0;
-    }
-
-    if(const int rv = getaddrinfo(hostname.c_str(), portptr, &hints, &servinfo)) {
-      printf("CLIENT ERROR: getaddrinfo: %s\n", gai_strerror(rv));
-      return false;
-    }
+  char * portptr = nullptr;
+  const size_t befport = hostname.find('|');
+  if(befport != std::string::npos && hostname[befport + 1]) {
+    portptr = &hostname[befport];
+    *(portptr++) = 0;
+  }
+
+  if(const int rv = getaddrinfo(hostname.c_str(), portptr, &hints, &servinfo)) {
+    printf("CLIENT ERROR: getaddrinfo: %s\n", gai_strerror(rv));
+    return nullptr;
   }
+  return servinfo;
+}
+
+bool resolve_hostname(std::string hostname, struct sockaddr_storage &remote, const sa_family_t preferred_af) noexcept {
+  struct addrinfo *const servinfo = resolve(hostname);
+  if(!servinfo) return false;
 
   struct addrinfo *siptr = servinfo;
   if(preferred_af != AF_UNSPEC) {
@@ -50,3 +56,23 @@ bool resolve_hostname(std::string hostname, struct sockaddr_storage &remote, con
   freeaddrinfo(servinfo); // all done with this structure
   return true;
 }
+
+bool resolve_hostname_all(std::string hostname, std::vector<struct sockaddr_storage> &remotes, const sa_family_t preferred_af) {
+  remotes.clear();
+  struct addrinfo *const servinfo = resolve(hostname);
+  if(!servinfo) return false;
+
+  for(struct addrinfo *siptr = servinfo; siptr; siptr = siptr->ai_next) {
+    remotes.emplace_back();
+    auto &remote = remotes.back();
+    zeroify(remote);
+    partial_memcpy(&remote, reinterpret_cast<struct sockaddr_storage *>(siptr->ai_addr), siptr->ai_addrlen);
+  }
+  freeaddrinfo(servinfo);
+
+  // keep the order of getaddrinfo otherwise
+  if(preferred_af != AF_UNSPEC)
+    std::stable_partition(remotes.begin(), remotes.end(),
+      [preferred_af](const struct sockaddr_storage &i) { return i.ss_family == preferred_af; });
+  return !remotes.empty();
+}
@@ -7,6 +7,7 @@
 #pragma once
 #include <sys/socket.h>
 #include <string>
+#include <vector>
 
 /** resolve_hostname:
  * resolves a hostname using (DNS) resolver and establishes a connection to it
@@ -16,3 +17,11 @@
  * @ret             DNS ok marker
  **/
 bool resolve_hostname(std::string hostname, struct sockaddr_storage &remote, sa_family_t preferred_af) noexcept;
+
+/** resolve_hostname_all:
+ * like resolve_hostname, but returns all addresses of the host
+ *
+ * @param remotes   (out) the addresses, the ones with the preferred address family first
+ * @ret             DNS ok marker (false if no address was found)
+ **/
+bool resolve_hostname_all(std::string hostname, std::vector<struct sockaddr_storage> &remotes, sa_family_t preferred_af);
@@ -0,0 +1,2114 @@
+/**
+ * zprd / router.cxx - the routing core
+ *
+ * (C) 2010 Davide Brini.
+ * (C) 2017 - 2019 Erik Zscheile.
+ *
+ * License: GPL-2+
+ **/
+
+#define __USE_MISC 1
+#include <sys/types.h>
+#include "router.hpp"
+#include <stdio.h>
+#include <netinet/ip_icmp.h>  // struct ip, ICMP_*
+#include <netinet/ip6.h>      // struct ip6_hdr
+#include <netinet/icmp6.h>    // struct icmp6_hdr
+#include <netinet/igmp.h>     // IGMP_*
+#include <arpa/inet.h>
+
+// C++
+#include <algorithm>
+#include <string_view>
+
+// own parts
+#include <config.h>
+#include "AFa.hpp"            // AFa_addr2string
+#include "oAFa.hpp"
+#include "alloc_stats.hpp"
+#include "crest.h"
+#include "resolve.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "watchdog.hpp"
+#include "zprd_conf.hpp"
+
+// -lowlevelzs
+#include <zs/ll/memut.hpp>
+
+using namespace std;
+
+extern time_t last_time;
+
+// get_remote_desc: returns a description string of socket ip
+[[gnu::hot]]
+static string get_remote_desc(const remote_peer_ptr_t &addr) {
+  // we don't need a read-only-lock, as we are in the only thread that writes to remotes
+  return AFa_sa2string(addr->saddr, "peer ");
+}
+
+[[gnu::hot]]
+static bool x_less(const remote_peer_ptr_t &a, const remote_peer_ptr_t &b) {
+  return (*a) < (*b);
+}
+
+static bool rem_peer(vector<remote_peer_ptr_t> &vec, const remote_peer_ptr_t &item) {
+  // perform a binary find
+  const auto it = lower_bound(vec.cbegin(), vec.cend(), item, x_less);
+  if(it == vec.cend() || **it != *item)
+    return false;
+  // erase element
+  // NOTE: don't swap [back] with [*it], as that destructs sorted range
+  vec.erase(it);
+  return true;
+}
+
+router_t::router_t(packet_sink_t &sink)
+  : local_router(make_shared<remote_peer_detail_t>()), domain(0), tap(false), budget_routes(0), budget_peers(0),
+    max_learned_routes(0), sender(sink), _snap_generation(0), _tables_dirty(true), pkt_t_ingress(0), _clock_hand(0),
+    _l2_id(0), _l2_floods(0), _l2_flood_sec(0)
+{
+  zeroify(_budget_warned);
+  // every node receives broadcasts
+  _bcast_tree._local = true;
+}
+
+// paths_of: the outer addresses of a resolved remote (for paths_hook)
+static auto paths_of(const vector<struct sockaddr_storage> &addrs) -> vector<outer_addr_t> {
+  vector<outer_addr_t> ret;
+  ret.reserve(addrs.size());
+  for(const auto &i : addrs) {
+    ret.emplace_back(i);
+    auto &port = ret.back().port;
+    if(!port) port = htons(zprd_conf.data_port);
+  }
+  return ret;
+}
+
+void router_t::connect2server(const string &r, const size_t cent) {
+  // don't use a reference into ptr here, it causes memory corruption
+  vector<struct sockaddr_storage> addrs;
+  {
+    zprd_phase_guard_t pg(ZPH_DNS);
+    if(!resolve_hostname_all(r, addrs, zprd_conf.preferred_af))
+      return;
+  }
+  auto ptr = make_shared<remote_peer_detail_t>(addrs.front(), cent);
+  ptr->set_port_if_unset(zprd_conf.data_port, false);
+  {
+    const string remote_desc = AFa_sa2string(ptr->saddr);
+    printf("CLIENT: connected to server %s\n", remote_desc.c_str());
+    if(peer_hook) peer_hook(false, ptr);
+  }
+  if(paths_hook) {
+    auto paths = paths_of(addrs);
+    set_path_peers(ptr, paths);
+    paths_hook(ptr, move(paths));
+  }
+  remotes.emplace_back(move(ptr));
+  _tables_dirty = true;
+}
+
+bool router_t::update_server_addr(const remote_peer_detail_ptr_t &peer) {
+  auto &pdat = *peer;
+  vector<struct sockaddr_storage> addrs;
+  // try to update ip
+  if(!pdat.cent) return false;
+  {
+    zprd_phase_guard_t pg(ZPH_DNS);
+    if(!resolve_hostname_all(cfgent_name(pdat), addrs, zprd_conf.preferred_af))
+      return false;
+  }
+  auto paths = paths_of(addrs);
+  // keep the address selected by the path prober if it is still valid
+  const auto cur = paths_hook ? find(paths.cbegin(), paths.cend(), pdat.saddr) : paths.cend();
+  const outer_addr_t sel = (cur != paths.cend()) ? *cur : paths.front();
+  pdat.locked_run([&sel](remote_peer_detail_t &o) {
+    o.seen = last_time;
+    o.saddr = sel;
+  });
+  if(paths_hook) {
+    set_path_peers(peer, paths);
+    paths_hook(peer, move(paths));
+  }
+  return true;
+}
+
+void router_t::set_path_peers(const remote_peer_detail_ptr_t &peer, const vector<outer_addr_t> &paths) {
+  for(auto it = _path_peers.begin(); it != _path_peers.end();)
+    it = (it->second == peer) ? _path_peers.erase(it) : next(it);
+  for(const auto &i : paths)
+    _path_peers[i] = peer;
+}
+
+void router_t::switch_path(const remote_peer_detail_ptr_t &peer, const outer_addr_t &addr) {
+  // the remote may have sent from addr before (e.g. it selected another path to us)
+  const auto it = lower_bound(remotes.begin(), remotes.end(), addr,
+    [](const remote_peer_detail_ptr_t &a, const outer_addr_t &b) noexcept
+      { return a->saddr < b; });
+  if(it != remotes.end() && (*it)->saddr == addr && *it != peer) {
+    const auto other = move(*it);
+    remotes.erase(it);
+    printf("ROUTER: merge %s into %s\n", get_remote_desc(other).c_str(), get_remote_desc(peer).c_str());
+    forget_peer(other);
+    other->to_discard = true;
+    if(peer_hook) peer_hook(true, other);
+  }
+  peer->locked_run([&addr](remote_peer_detail_t &o) { o.saddr = addr; });
+  // intern_peer does a binary search
+  std::sort(remotes.begin(), remotes.end(), x_less);
+  _tables_dirty = true;
+}
+
+void router_t::rekey_peer(const outer_addr_t &from, const outer_addr_t &to) {
+  const auto it = lower_bound(remotes.cbegin(), remotes.cend(), from,
+    [](const remote_peer_detail_ptr_t &a, const outer_addr_t &b) noexcept
+      { return a->saddr < b; });
+  if(it == remotes.cend() || (*it)->saddr != from)
+    return;
+  // switch_path modifies remotes
+  const auto peer = *it;
+  switch_path(peer, to);
+}
+
+const char *router_t::cfgent_name(const remote_peer_detail_t &pdat) const noexcept {
+  if(pdat.cent < 1) return "-";
+  const size_t ce = pdat.cent - 1;
+  return (ce >= cfg_remotes.size()) ? "####" : cfg_remotes[ce].c_str();
+}
+
+bool router_t::connect_remotes() {
+  remotes.reserve(cfg_remotes.size());
+  size_t i = 0;
+  for(const auto &r : cfg_remotes) {
+    connect2server(r, i);
+    ++i;
+  }
+  std::sort(remotes.begin(), remotes.end(), x_less);
+  return !remotes.empty() || cfg_remotes.empty();
+}
+
+auto router_t::intern_peer(remote_peer_detail_ptr_t &&peer) -> remote_peer_detail_ptr_t {
+  // resolve remote --> shared_ptr, via binary find
+  const auto it = lower_bound(remotes.cbegin(), remotes.cend(), peer, x_less);
+  if(it != remotes.cend() && **it == *peer)
+    return *it;
+  remotes.emplace(it, peer);
+  _tables_dirty = true;
+  if(peer_hook) peer_hook(false, peer);
+  return move(peer);
+}
+
+[[gnu::hot]]
+auto router_t::intern_peer(const outer_addr_t &saddr) -> remote_peer_detail_ptr_t {
+  const auto it = lower_bound(remotes.cbegin(), remotes.cend(), saddr,
+    [](const remote_peer_detail_ptr_t &a, const outer_addr_t &b) noexcept
+      { return a->saddr < b; });
+  if(it != remotes.cend() && (*it)->saddr == saddr)
+    return *it;
+  if(zs_unlikely(!_path_peers.empty())) {
+    // another address of a configured remote
+    const auto pt = _path_peers.find(saddr);
+    if(pt != _path_peers.end() && !pt->second->to_discard)
+      return pt->second;
+  }
+  if(alias_hook) {
+    // another uplink of a node
+    outer_addr_t primary;
+    if(alias_hook(saddr, primary) && primary != saddr)
+      return intern_peer(primary);
+  }
+  if(over_budget(ZMEM_PEERS, mem_usage(ZMEM_PEERS), budget_peers)) {
+    zprd_stats.drop(ZDROP_BUDGET);
+    return {};
+  }
+  return intern_peer(make_shared<remote_peer_detail_t>(saddr));
+}
+
+/* memory accounting: estimates of the heap usage (libstdc++ node layouts)
+ *  malloc_overhead : per allocation (chunk header + alignment)
+ *  route_entry_mem : hash node (next ptr + key/value + cached hash) with one via router
+ */
+static constexpr size_t malloc_overhead = 2 * sizeof(void*);
+static constexpr size_t via_router_mem  = sizeof(void*) + sizeof(via_router_t) + malloc_overhead;
+static constexpr size_t route_entry_mem = 2 * sizeof(void*) + sizeof(router_t::routes_t::value_type)
+                                        + malloc_overhead + via_router_mem;
+// make_shared: control block (vptr + 2 counters) + remote_peer_detail_t (incl. shared_mutex)
+static constexpr size_t peer_mem = sizeof(void*) + 2 * sizeof(int) + sizeof(remote_peer_detail_t) + malloc_overhead;
+// multicast group: hash node + member vector + distribution set (assumed: up to 4 members)
+static constexpr size_t group_entry_mem = 2 * sizeof(void*) + sizeof(router_t::groups_t::value_type)
+                                        + 2 * malloc_overhead + 4 * (sizeof(mcast_member_t) + sizeof(mcast_branch_t) + sizeof(remote_peer_ptr_t));
+
+template<class TSet>
+static size_t set_mem(const TSet &s) noexcept {
+  return s.size() * (2 * sizeof(void*) + sizeof(typename TSet::value_type) + malloc_overhead)
+       + s.bucket_count() * sizeof(void*);
+}
+
+size_t router_t::mem_usage(const zprd_mem_t m) const noexcept {
+  switch(m) {
+    case ZMEM_ROUTES:
+      // the via router lists are usually short, so this doesn't iterate them
+      return routes.size() * route_entry_mem + routes.bucket_count() * sizeof(void*)
+           + _learned_ring.capacity() * sizeof(inner_addr_t)
+           + groups.size() * group_entry_mem + groups.bucket_count() * sizeof(void*)
+           + _macs.mem_size();
+    case ZMEM_PEERS:
+      return remotes.size() * peer_mem + remotes.capacity() * sizeof(remote_peer_detail_ptr_t);
+    case ZMEM_CACHES:
+      return set_mem(exported_locals) + set_mem(blocked_broadcast_dsts)
+           + locals.capacity() * sizeof(xner_addr_t) + sizeof(ping_cache)
+           + _sdat.mem_size();
+    default:
+      return 0;
+  }
+}
+
+bool router_t::over_budget(const zprd_mem_t m, const size_t used, const size_t budget) noexcept {
+  if(zs_likely(!budget || used < budget))
+    return false;
+  zprd_stats.inc(zprd_stats.budget_hits[m]);
+  if(!_budget_warned[m]) {
+    _budget_warned[m] = true;
+    printf("ROUTER WARNING: memory budget of %s exceeded (%zu of %zu bytes)\n", zprd_mem2str(m), used, budget);
+  }
+  return true;
+}
+
+// is inner_addr:o a local ip?
+[[gnu::hot]]
+bool router_t::am_ii_addr(const inner_addr_t &o, const bool with_exported) const noexcept {
+  for(const auto &i : locals)
+    if(*reinterpret_cast<const inner_addr_t *>(&i) == o)
+      return true;
+  return (with_exported && exported_locals.find(o) != exported_locals.end());
+}
+
+[[gnu::hot]]
+auto router_t::get_local_aptr(const iafa_at_t preferred_at) const noexcept -> const xner_addr_t* {
+  for(const auto &i : locals)
+    if(i.type == preferred_at)
+      return &i;
+  return 0;
+}
+
+template<typename T>
+void router_t::get_local_addr(const iafa_at_t preferred_at, T &addr) const noexcept {
+  if(const auto i = get_local_aptr(preferred_at))
+    memcpy(reinterpret_cast<char*>(&addr), i->addr, std::min(pli_at2alen(preferred_at), sizeof(T)));
+}
+
+// icmp_allowed: rate limit of the ICMP errors (and drop messages) caused by packets from source_peer
+bool router_t::icmp_allowed(const remote_peer_ptr_t &source_peer, const inner_addr_t &dest) noexcept {
+  if(zs_likely(_icmp_limit.allow(source_peer->saddr, dest, zprd_conf.icmp_rate_peer, zprd_conf.icmp_rate_dest, last_time)))
+    return true;
+  zprd_stats.inc(zprd_stats.icmp_ratelimited);
+  return false;
+}
+
+// prepare_icmp: setup _sdat for an ICMP error of buflen bytes to source_ip,
+//  uses the recycled buffers of the sender like enqueue_data
+char *router_t::prepare_icmp(const size_t buflen, const remote_peer_ptr_t &source_ip, const uint16_t frag) {
+  auto &sd = _sdat;
+  if(zs_unlikely(sd.buffer.capacity() < buflen || !sd.dests.capacity())) {
+    // the sender had no recycled send_data left
+    zprd_alloc_allow_t aa;
+    sd.buffer.reserve(2048);
+    sd.dests.reserve(4);
+  }
+  sd.buffer.assign(buflen, 0);
+  sd.dests.clear();
+  sd.dests.emplace_back(source_ip);
+  sd.frag = frag;
+  sd.tos = 0;
+  sd.flow = 0;
+  sd.t_ingress = pkt_t_ingress;
+  return sd.buffer.data();
+}
+
+void router_t::send_icmp_msg(const zprd_icmpe msg, struct ip * const orig_hip, const remote_peer_ptr_t &source_ip) {
+  constexpr const size_t buflen = 2 * sizeof(struct ip) + sizeof(struct icmphdr) + 8;
+  char *const buffer = prepare_icmp(buflen, source_ip, 0);
+  char * bufnxt = buffer + sizeof(struct ip);
+
+  {
+    // proper alignment for struct ip
+    struct ip x_ip;
+    zeroify(x_ip);
+    x_ip.ip_v   = 4;
+    x_ip.ip_hl  = 5;
+    x_ip.ip_len = htons(static_cast<uint16_t>(buflen));
+    x_ip.ip_id  = rand();
+    x_ip.ip_ttl = MAXTTL;
+    x_ip.ip_p   = IPPROTO_ICMP;
+    get_local_addr(IAFA_AT_INET, x_ip.ip_src);
+    x_ip.ip_dst = orig_hip->ip_src;
+    memcpy_from(buffer, &x_ip);
+  }
+
+  const auto h_icmp = reinterpret_cast<struct icmphdr*>(bufnxt);
+  bufnxt += sizeof(struct icmphdr);
+
+  switch(msg) {
+    case ZICMPM_TTL:
+      h_icmp->type = ICMP_TIMXCEED;
+      h_icmp->code = ICMP_TIMXCEED_INTRANS;
+      break;
+
+    case ZICMPM_UNREACH:
+      h_icmp->type = ICMP_UNREACH;
+      h_icmp->code = ICMP_UNREACH_HOST;
+      break;
+
+    case ZICMPM_UNREACH_NET:
+      h_icmp->type = ICMP_UNREACH;
+      h_icmp->code = ICMP_UNREACH_NET;
+      break;
+
+    default:
+      fprintf(stderr, "SEND ERROR: invalid ZICMP Message code: %d\n", msg);
+      return;
+  }
+
+  // calculate icmp checksum
+  h_icmp->checksum = IN_CKSUM(h_icmp);
+
+  // setup payload = orig ip header
+  orig_hip->ip_sum = IN_CKSUM(orig_hip);
+  memcpy_from(bufnxt, orig_hip);
+  bufnxt += sizeof(struct ip);
+
+  // setup secondary payload = first 8 bytes of original payload
+  {
+    const uint16_t plen = ntohs(orig_hip->ip_len);
+    if(plen > sizeof(struct ip))
+      memcpy(bufnxt, reinterpret_cast<const char*>(orig_hip) + sizeof(struct ip),
+             std::min(static_cast<size_t>(8), plen - sizeof(struct ip)));
+  }
+
+  // the sender may leave a recycled send_data in _sdat
+  sender.enqueue(move(_sdat));
+}
+
+void router_t::send_icmp_msg(const zprd_icmpe msg, struct ip6_hdr * const orig_hip, const remote_peer_ptr_t &source_ip) {
+  constexpr const size_t ip6hlen = sizeof(struct ip6_hdr);
+  constexpr const size_t buflen = 2 * ip6hlen + sizeof(struct icmp6_hdr) + 8;
+  char *const buffer = prepare_icmp(buflen, source_ip, htons(IP_DF));
+  char * bufnxt = buffer + ip6hlen;
+
+  {
+    // proper alignment for struct ip6_hdr
+    struct ip6_hdr x_ip;
+    zeroify(x_ip);
+    x_ip.ip6_vfc  = 0x60;
+    x_ip.ip6_plen = htons(static_cast<uint16_t>(buflen - ip6hlen));
+    x_ip.ip6_nxt  = 0x3a;
+    x_ip.ip6_hops = MAXTTL;
+
+    // copy ip addrs
+    get_local_addr(IAFA_AT_INET6, x_ip.ip6_src);
+    whole_memcpy(&x_ip.ip6_dst, &orig_hip->ip6_src);
+    memcpy_from(buffer, &x_ip);
+  }
+
+  // setup ICMPv6 part
+  const auto h_icmp = reinterpret_cast<struct icmp6_hdr*>(bufnxt);
+  bufnxt += sizeof(struct icmp6_hdr);
+
+  switch(msg) {
+    case ZICMPM_TTL:
+      h_icmp->icmp6_type = 0x03;
+      h_icmp->icmp6_code = 0x00;
+      break;
+
+    case ZICMPM_UNREACH:
+      h_icmp->icmp6_type = 0x01;
+      h_icmp->icmp6_code = 0x00;
+      break;
+
+    case ZICMPM_UNREACH_NET:
+      h_icmp->icmp6_type = 0x01;
+      h_icmp->icmp6_code = 0x03;
+      break;
+
+    default:
+      fprintf(stderr, "SEND ERROR: invalid ZICMP Message code: %d\n", msg);
+      return;
+  }
+
+  // setup payload = orig ip header
+  memcpy_from(bufnxt, orig_hip);
+  bufnxt += ip6hlen;
+
+  // setup secondary payload = first 8 bytes of original payload
+  memcpy(bufnxt, reinterpret_cast<const char*>(orig_hip) + ip6hlen,
+         std::min(static_cast<size_t>(8), static_cast<size_t>(ntohs(orig_hip->ip6_plen))));
+
+  /* calculate ICMPv6 checksum
+   - create pseudo-header (on the stack)
+   - calculate chksum
+   */
+  {
+    constexpr const size_t bwohl = buflen - ip6hlen;
+    alignas(4) char pseudohdr[2 * sizeof(in6_addr) + 8 + bwohl];
+    const uint32_t pll = htonl(static_cast<uint32_t>(bwohl));
+    const char blk0[] = { 0, 0, 0, 0x3a };
+    char *psnxt = pseudohdr;
+    /* ip addrs     */ memcpy(psnxt, buffer + 8, 2 * sizeof(in6_addr)); psnxt += 2 * sizeof(in6_addr);
+    /* payload len  */ memcpy(psnxt, &pll, sizeof(pll));                psnxt += sizeof(pll);
+    /* pad + ip6nxt */ memcpy(psnxt, blk0, sizeof(blk0));               psnxt += sizeof(blk0);
+    /* REST         */ memcpy(psnxt, buffer + ip6hlen, bwohl);
+
+    // update checksum
+    h_icmp->icmp6_cksum = in_cksum(reinterpret_cast<const uint16_t*>(pseudohdr), sizeof(pseudohdr));
+  }
+
+  // the sender may leave a recycled send_data in _sdat
+  sender.enqueue(move(_sdat));
+}
+
+route_via_t* router_t::have_route(const inner_addr_t &dsta) noexcept {
+  const auto it = routes.find(dsta);
+  if(it == routes.end() || it->second.empty())
+    return nullptr;
+  it->second._referenced = true;
+  return &(it->second);
+}
+
+[[gnu::hot]]
+route_via_t* router_t::route_slot(const inner_addr_t &dsta, const bool learned) {
+  const auto it = routes.find(dsta);
+  if(zs_likely(it != routes.end())) {
+    auto &r = it->second;
+    r._referenced = true;
+    // announced once = protected; the stale ring slot is dropped lazily
+    if(!learned) r._learned = false;
+    return &r;
+  }
+
+  // a flood of spoofed source addresses would grow the table without bound,
+  // make room by evicting idle learned routes
+  if(learned && max_learned_routes)
+    while(_learned_ring.size() >= max_learned_routes && evict_learned_route()) { }
+  if(over_budget(ZMEM_ROUTES, mem_usage(ZMEM_ROUTES), budget_routes) && !evict_learned_route())
+    return nullptr;
+
+  zprd_alloc_allow_t aa;
+  auto &r = routes.emplace(dsta, route_via_t()).first->second;
+  if(learned) {
+    r._learned = true;
+    _learned_ring.emplace_back(dsta);
+  }
+  return &r;
+}
+
+bool router_t::evict_learned_route() noexcept {
+  // visits each slot at most twice: first pass clears the reference bits
+  for(size_t n = 2 * _learned_ring.size(); n && !_learned_ring.empty(); --n) {
+    if(_clock_hand >= _learned_ring.size())
+      _clock_hand = 0;
+    auto &slot = _learned_ring[_clock_hand];
+    const auto it = routes.find(slot);
+    const bool stale = (it == routes.end() || !it->second._learned);
+    if(!stale && it->second._referenced) {
+      it->second._referenced = false;
+      ++_clock_hand;
+      continue;
+    }
+    if(!stale) {
+      // evicted quietly: neither ZPRN messages nor route hooks, peers time it out
+      routes.erase(it);
+      _tables_dirty = true;
+      zprd_stats.inc(zprd_stats.route_evictions);
+    }
+    // swap-remove, the moved slot is visited next
+    if(&slot != &_learned_ring.back())
+      slot = _learned_ring.back();
+    _learned_ring.pop_back();
+    if(!stale)
+      return true;
+  }
+  return false;
+}
+
+void router_t::send_zprn_msg(const zprn_v2 &msg, const remote_peer_ptr_t &confirmed) {
+  zprd_alloc_allow_t aa;
+  vector<remote_peer_ptr_t> peers(remotes.cbegin(), remotes.cend());
+
+  // split horizon
+  if(msg.zprn_prio != 0xff)
+    switch(msg.zprn_cmd) {
+      case ZPRN_ROUTEMOD:
+        if(const auto r = have_route(msg.route))
+          rem_peer(peers, r->get_router());
+        break;
+      default: break;
+    }
+
+  sender.enqueue(zprn2_sdat{msg, move(peers), confirmed});
+}
+
+void router_t::send_zprn_mcast(const zprn_v2 &msg, const remote_peer_ptr_t &except) {
+  zprd_alloc_allow_t aa;
+  vector<remote_peer_ptr_t> peers(remotes.cbegin(), remotes.cend());
+  if(except) rem_peer(peers, except);
+  if(!peers.empty())
+    sender.enqueue(zprn2_sdat{msg, move(peers), {}});
+}
+
+void router_t::send_zprn_probe_req(const inner_addr_t &dest) {
+  zprn_v2 msg;
+  msg.zprn_cmd = ZPRN2_PROBE;
+  msg.route    = dest;
+
+  vector<remote_peer_ptr_t> non_routers(remotes.cbegin(), remotes.cend());
+  // split horizon
+  if(const auto r = have_route(msg.route)) {
+    const auto &rts = r->_routers;
+    vector<remote_peer_ptr_t> routers;
+    for(auto &i : rts) {
+      routers.emplace_back(i.addr);
+      rem_peer(non_routers, i.addr);
+    }
+    msg.zprn_prio = 0xfe;
+    sender.enqueue(zprn2_sdat{msg, move(routers), {}});
+  }
+
+  if(!non_routers.empty()) {
+    msg.zprn_prio = 0xff;
+    sender.enqueue(zprn2_sdat{msg, move(non_routers), {}});
+  }
+}
+
+[[gnu::cold]]
+static void print_packet(const char buffer[], const uint16_t len) {
+  zprd_alloc_allow_t aa;
+  const auto ubuffer = reinterpret_cast<const uint8_t*>(buffer);
+  printf("ROUTER DEBUG: pktdat:");
+  const uint8_t * const ie = ubuffer + std::min(len, static_cast<uint16_t>(80));
+  for(const uint8_t *i = ubuffer; i != ie; ++i)
+    printf(" %02x", static_cast<unsigned>(*i));
+  puts("");
+}
+
+bool router_t::verify_ipv4_packet(const remote_peer_detail_ptr_t &srca, const char buffer[], uint16_t &len, const peer_desc_t &source_desc) {
+  const uint16_t nread = len;
+  const auto h_ip = reinterpret_cast<const struct ip*>(buffer);
+  const bool srca_is_local = srca->is_local();
+
+  if(srca_is_local)
+    if(const uint16_t dsum = IN_CKSUM(h_ip)) {
+      printf("ROUTER ERROR: invalid ipv4 packet (wrong checksum, chksum = %u, d = %u) from local\n",
+        h_ip->ip_sum, dsum);
+      print_packet(buffer, nread);
+      zprd_stats.drop(ZDROP_INVALID);
+      return false;
+    }
+
+  // get total length
+  len = ntohs(h_ip->ip_len);
+
+  if(zs_unlikely(nread < len)) {
+    printf("ROUTER ERROR: can't read whole ipv4 packet (too small, size = %u of %u) from %s\n", nread, len, source_desc.c_str());
+    print_packet(buffer, nread);
+    zprd_stats.drop(ZDROP_INVALID);
+  } else if(zs_unlikely(!srca_is_local && am_ii_addr(inner_addr_t(h_ip->ip_src.s_addr)))) {
+    printf("ROUTER WARNING: drop packet %u (looped with local as source)\n", ntohs(h_ip->ip_id));
+    zprd_stats.drop(ZDROP_LOOP);
+  } else {
+    if(zs_unlikely(nread != len))
+      printf("ROUTER WARNING: ipv4 packet size differ (size read %u / expected %u) from %s\n", nread, len, source_desc.c_str());
+    return true;
+  }
+  return false;
+}
+
+bool router_t::verify_ipv6_packet(const remote_peer_detail_ptr_t &srca, const char buffer[], uint16_t &len, const peer_desc_t &source_desc) {
+  const uint16_t nread = len;
+  const auto h_ip = reinterpret_cast<const struct ip6_hdr*>(buffer);
+
+  // get total length
+  len = ntohs(h_ip->ip6_plen) + sizeof(struct ip6_hdr);
+
+  if(zs_unlikely(nread < len)) {
+    printf("ROUTER ERROR: can't read whole ipv6 packet (too small, size = %u of %u) from %s\n", nread, len, source_desc.c_str());
+    print_packet(buffer, nread);
+    zprd_stats.drop(ZDROP_INVALID);
+  } else if(zs_unlikely(!srca->is_local() && am_ii_addr(inner_addr_t(h_ip->ip6_src)))) {
+    printf("ROUTER WARNING: drop ipv6 packet (looped with local as source)\n");
+    zprd_stats.drop(ZDROP_LOOP);
+  } else {
+    if(zs_unlikely(nread != len))
+      printf("ROUTER WARNING: ipv6 packet size differ (size read %u / expected %u) from %s\n", nread, len, source_desc.c_str());
+    return true;
+  }
+  return false;
+}
+
+[[gnu::hot]]
+void router_t::learn_route(const remote_peer_detail_ptr_t &source_peer, const peer_desc_t &source_desc,
+                const inner_addr_t &iaddr_src, const uint8_t ip_ttl) {
+  if(const auto rsrc = route_slot(iaddr_src, !source_peer->is_local())) {
+    if(rsrc->add_router(
+        source_peer,
+        am_ii_addr(iaddr_src, false) ? 0 : (MAXTTL - ip_ttl)
+    )) {
+      zprd_alloc_allow_t aa;
+      const auto srcdesc = iaddr_src.to_string();
+      printf("ROUTER: add route to %s via %s\n", srcdesc.c_str(), source_desc.c_str());
+      _tables_dirty = true;
+      ZPRD_TRACE(route_add, &iaddr_src, &source_peer->saddr, MAXTTL - ip_ttl);
+    }
+  }
+}
+
+[[gnu::hot]]
+bool router_t::resolve_route(const remote_peer_detail_ptr_t &source_peer, const peer_desc_t &source_desc,
+                const char buffer[], const uint16_t buflen,
+                const inner_addr_t &iaddr_src, const inner_addr_t &iaddr_dest, const uint8_t ip_ttl, const bool destination_is_local,
+                vector<remote_peer_ptr_t> &ret) {
+  ret.clear();
+  if(zs_unlikely(!ret.capacity())) {
+    // the sender had no recycled send_data left
+    zprd_alloc_allow_t aa;
+    ret.reserve(4);
+  }
+
+  learn_route(source_peer, source_desc, iaddr_src, ip_ttl);
+
+  if(destination_is_local) {
+    ZPRD_TRACE(route_decision, &iaddr_src, &iaddr_dest, ZTRACE_RD_LOCAL, 1);
+    ret.emplace_back(local_router);
+    return true;
+  }
+
+  const auto r = have_route(iaddr_dest);
+
+  if(r) {
+    // got_invalid_route: if route [iaddr_dest via source_peer] is deleted twice, only print del...msg once
+    bool got_invalid_route = false;
+
+    if(r->del_router(source_peer))
+      got_invalid_route = true;
+
+    if(!r->empty() && *source_peer == *r->get_router()) {
+      got_invalid_route = true;
+      r->del_primary_router();
+    }
+
+    if(got_invalid_route) {
+      zprd_alloc_allow_t aa;
+      const auto destdesc = iaddr_dest.to_string();
+      printf("ROUTER: delete route to %s via %s (invalid)\n", destdesc.c_str(), source_desc.c_str());
+      _tables_dirty = true;
+      ZPRD_TRACE(route_del, &iaddr_dest, &source_peer->saddr, "invalid");
+    }
+    if(!r->empty()) {
+      // NOTE: disable swapping of near routers if max_near_rtt is null
+      if(zs_likely(zprd_conf.max_near_rtt))
+        r->swap_near_routers();
+      ZPRD_TRACE(route_decision, &iaddr_src, &iaddr_dest, ZTRACE_RD_ROUTE, 1);
+      ret.emplace_back(r->get_router());
+      return true;
+    }
+  }
+
+  // early return if broadcasts should be suppressed, prevent log spam
+  if(blocked_broadcast_dsts.find(iaddr_dest) != blocked_broadcast_dsts.end()) {
+    ZPRD_TRACE(route_decision, &iaddr_src, &iaddr_dest, ZTRACE_RD_BLOCKED, 0);
+    zprd_stats.drop(ZDROP_BLOCKED);
+    return true;
+  }
+
+  // copies of a flooded packet which arrive via other paths would be flooded again
+  if(flood_seen(source_peer, buffer, buflen, pkt_meta.l4off)) {
+    ZPRD_TRACE(route_decision, &iaddr_src, &iaddr_dest, ZTRACE_RD_DUP, 0);
+    zprd_stats.drop(ZDROP_DUP);
+    return false;
+  }
+
+  // flooding isn't the steady state, it follows the broadcast tree
+  zprd_alloc_allow_t aa;
+  const auto destdesc = iaddr_dest.to_string();
+  printf("ROUTER: no known route to %s\n", destdesc.c_str());
+  bcast_dests(source_peer, ret);
+  ZPRD_TRACE(route_decision, &iaddr_src, &iaddr_dest, ZTRACE_RD_FLOOD, ret.size());
+
+  if(ret.empty()) {
+    printf("ROUTER: drop packet (no destination) from %s\n", source_desc.c_str());
+    zprd_stats.drop(ZDROP_NOROUTE);
+  }
+  return true;
+}
+
+// enqueue_data: hand the packet and _sdat.dests over to the sender
+[[gnu::hot]]
+void router_t::enqueue_data(const char *const buffer, const uint16_t buflen, const uint16_t frag, const uint32_t tos) {
+  auto &sd = _sdat;
+  if(zs_unlikely(sd.buffer.capacity() < buflen)) {
+    // the sender had no recycled send_data left (or the packet is huge)
+    zprd_alloc_allow_t aa;
+    sd.buffer.reserve(std::max(buflen, static_cast<uint16_t>(2048)));
+  }
+  sd.buffer.assign(buffer, buffer + buflen);
+  sd.frag = frag;
+  sd.tos = tos;
+  // L2 frames: the flow is the pair of MAC addresses
+  sd.flow = zprd_is_l2(buffer, buflen)
+    ? iafa_hash_bytes(buffer + sizeof(zprd_l2hdr), 12) : pkt_meta.flow(buffer, buflen);
+  sd.t_ingress = pkt_t_ingress;
+  // the sender may leave a recycled send_data in _sdat
+  sender.enqueue(move(sd));
+}
+
+/* ipver_traits: compile-time data + header accessors of the forwarding path per IP version
+ *  icmp_errmsg : is the ICMP message an error message,
+ *                rm_route = it invalidates the route to the original destination
+ */
+template<unsigned IPV> struct ipver_traits;
+
+template<> struct ipver_traits<4> {
+  typedef struct ip      hdr_t;
+  typedef struct icmphdr icmp_t;
+  typedef struct in_addr addr_t;
+  static constexpr uint8_t   icmp_proto = IPPROTO_ICMP;
+  static constexpr iafa_at_t local_at   = IAFA_AT_INET;
+  static constexpr uint8_t   echo_request = ICMP_ECHO, echo_reply = ICMP_ECHOREPLY;
+
+  static uint8_t &ttl(hdr_t &h) noexcept { return h.ip_ttl; }
+  static const addr_t &dst(const hdr_t &h) noexcept { return h.ip_dst; }
+  static inner_addr_t src_iaddr(const hdr_t &h) noexcept { return inner_addr_t(h.ip_src.s_addr); }
+  static inner_addr_t dst_iaddr(const hdr_t &h) noexcept { return inner_addr_t(h.ip_dst.s_addr); }
+  static uint16_t frag(const hdr_t &h) noexcept { return h.ip_off; }
+  static uint32_t tos(const hdr_t &h) noexcept { return h.ip_tos; }
+  // pkt_id: " ID" for the log messages
+  static void pkt_id(const hdr_t &h, char (&buf)[8]) noexcept
+    { snprintf(buf, sizeof(buf), " %u", static_cast<unsigned>(ntohs(h.ip_id))); }
+
+  static uint8_t  icmp_type(const icmp_t &h) noexcept { return h.type; }
+  static uint16_t echo_id(const icmp_t &h) noexcept { return h.un.echo.id; }
+  static uint16_t echo_seq(const icmp_t &h) noexcept { return h.un.echo.sequence; }
+
+  static bool icmp_errmsg(const icmp_t &h, bool &rm_route) noexcept {
+    switch(h.type) {
+      case ICMP_ECHOREPLY: // = 0
+      case ICMP_ECHO:      // = 8
+      case  9: // Router advert
+      case 10: // Router select
+      case 13: // timestamp
+      case 14: // timestamp reply
+        return false;
+
+      case ICMP_TIMXCEED:
+        if(h.code == ICMP_TIMXCEED_INTRANS)
+          rm_route = true;
+        return true;
+
+      case ICMP_UNREACH:
+        switch(h.code) {
+          case ICMP_UNREACH_HOST:
+          case ICMP_UNREACH_NET:
+            rm_route = true;
+            break;
+          default: break;
+        }
+        return true;
+
+      default:
+        return true;
+    }
+  }
+};
+
+template<> struct ipver_traits<6> {
+  typedef struct ip6_hdr   hdr_t;
+  typedef struct icmp6_hdr icmp_t;
+  typedef struct in6_addr  addr_t;
+  static constexpr uint8_t   icmp_proto = IPPROTO_ICMPV6;
+  static constexpr iafa_at_t local_at   = IAFA_AT_INET6;
+  static constexpr uint8_t   echo_request = 0x80, echo_reply = 0x81;
+
+  static uint8_t &ttl(hdr_t &h) noexcept { return h.ip6_hops; }
+  static const addr_t &dst(const hdr_t &h) noexcept { return h.ip6_dst; }
+  static inner_addr_t src_iaddr(const hdr_t &h) noexcept { return inner_addr_t(h.ip6_src); }
+  static inner_addr_t dst_iaddr(const hdr_t &h) noexcept { return inner_addr_t(h.ip6_dst); }
+  static uint16_t frag(const hdr_t &) noexcept { return htons(IP_DF); }
+  // extracts the Type-Of-Service field from the inclusive flow label field
+  static uint32_t tos(const hdr_t &h) noexcept { return (ntohl(h.ip6_flow) & 0xFF00000) >> 20; }
+  // pkt_id: IPv6 packets have no ID (unless fragmented)
+  static void pkt_id(const hdr_t &, char (&buf)[8]) noexcept { buf[0] = 0; }
+
+  static uint8_t  icmp_type(const icmp_t &h) noexcept { return h.icmp6_type; }
+  static uint16_t echo_id(const icmp_t &h) noexcept { return h.icmp6_id; }
+  static uint16_t echo_seq(const icmp_t &h) noexcept { return h.icmp6_seq; }
+
+  static bool icmp_errmsg(const icmp_t &h, bool &rm_route) noexcept {
+    if(h.icmp6_type & 0x80) return false;
+    switch(h.icmp6_type) {
+      case 1:
+      case 3:
+        rm_route = true;
+        break;
+      default: break;
+    }
+    return true;
+  }
+};
+
+/** route_packet<IPV>:
+ *
+ * decide which socket is the destination,
+ * based on the destination ip and the routing table,
+ * decrement the ttl, send the packet
+ *
+ * @param source_ip the source peer ip
+ * @param buffer    (in/out) packet data
+ * @param buflen    length of buffer / packet data
+ *                  (often = nread)
+ *
+ * @do              send packets to the destination sockets
+ * @ret             none
+ **/
+template<unsigned IPV>
+[[gnu::hot]]
+void router_t::route_packet(const remote_peer_detail_ptr_t &source_peer, char *const __restrict__ buffer, const uint16_t buflen, const peer_desc_t &source_desc) {
+  typedef ipver_traits<IPV> ipv;
+  const auto h_ip = reinterpret_cast<typename ipv::hdr_t*>(buffer);
+
+  if constexpr(IPV == 4) {
+    // multicast uses the distribution sets of the groups, broadcasts the broadcast tree
+    if(zs_unlikely(IN_MULTICAST(ntohl(h_ip->ip_dst.s_addr)))) {
+      route_mcast_packet(source_peer, buffer, buflen, source_desc);
+      return;
+    }
+    if(zs_unlikely(h_ip->ip_dst.s_addr == INADDR_BROADCAST)) {
+      route_bcast_packet(source_peer, buffer, buflen, source_desc);
+      return;
+    }
+  } else {
+    // [TODO?] currently: discard IPv6 multicast packets (no MLD snooping, see route_mcast_packet)
+    if(IN6_IS_ADDR_MULTICAST(h_ip->ip6_dst.s6_addr)) {
+      zprd_stats.drop(ZDROP_MCAST);
+      return;
+    }
+  }
+
+  // non-first fragments don't carry the ICMP header, extension headers may precede ICMPv6 (see pkt_meta_t)
+  const bool is_icmp = (pkt_meta.l4proto == ipv::icmp_proto);
+
+  if(is_icmp && (pkt_meta.l4off + sizeof(typename ipv::icmp_t)) > buflen) {
+    char pkid[8];
+    ipv::pkt_id(*h_ip, pkid);
+    printf("ROUTER: drop packet%s (too small icmp packet; size = %u) from %s\n", pkid, buflen, source_desc.c_str());
+    zprd_stats.drop(ZDROP_INVALID);
+    return;
+  }
+
+  // NOTE: h_icmp is only valid if is_icmp is true
+  const auto h_icmp  = reinterpret_cast<const typename ipv::icmp_t*>(buffer + pkt_meta.l4off);
+
+  /* === EVALUATE ICMP MESSAGES
+   * is_icmp_errmsg : flag if packet is an icmp error message
+   *   reason : an echo packet could be used to establish an route without interference on application protos
+   * rm_route : flag, if packet isn't filtered (through split horizon or other peer filters), if primary router
+   *              is considered outdated ^^ see @ 'drop outdated routing table entries'
+   */
+  bool rm_route = false;
+  const bool is_icmp_errmsg = is_icmp && ipv::icmp_errmsg(*h_icmp, rm_route);
+
+  const inner_addr_t iaddr_src = ipv::src_iaddr(*h_ip);
+  const inner_addr_t iaddr_dst = ipv::dst_iaddr(*h_ip);
+
+  // am I an endpoint
+  const bool source_is_local = source_peer->is_local();
+  const bool iam_ep = source_is_local || am_ii_addr(iaddr_dst);
+  auto &ttl = ipv::ttl(*h_ip);
+
+  // we can use the ttl directly, it is 1 byte long
+  if((!ttl) || (!iam_ep && ttl == 1)) {
+    // ttl is too low -> DROP, the message + ICMP error are rate limited (routing loops)
+    zprd_stats.drop(ZDROP_TTL);
+    if(icmp_allowed(source_peer, iaddr_src)) {
+      char pkid[8];
+      ipv::pkt_id(*h_ip, pkid);
+      printf("ROUTER: drop packet%s (too low ttl = %u) from %s\n", pkid, ttl, source_desc.c_str());
+      if(!is_icmp_errmsg)
+        send_icmp_msg(ZICMPM_TTL, h_ip, source_peer);
+    }
+    return;
+  }
+
+  // decrement ttl
+  if(!iam_ep) --ttl;
+
+  // NOTE: make sure that no changes are done to buffer
+  if constexpr(IPV == 4)
+    h_ip->ip_sum = 0;
+
+  auto &ret = _sdat.dests;
+  if(!resolve_route(source_peer, source_desc, buffer, buflen, iaddr_src, iaddr_dst, ttl, !source_is_local && iam_ep, ret))
+    return;
+
+  if(ret.empty()) {
+    if(is_icmp_errmsg) return;
+    zprd_alloc_allow_t aa;
+
+    if(const auto aptr = icmp_allowed(source_peer, iaddr_src) ? get_local_aptr(ipv::local_at) : nullptr) {
+      char tmp[sizeof(typename ipv::addr_t)];
+      whole_memcpy_lazy(tmp, &ipv::dst(*h_ip));
+      xner_apply_netmask(tmp, aptr->nmsk, sizeof(tmp));
+      send_icmp_msg((
+        (!memcmp(aptr->addr, tmp, sizeof(tmp)))
+          ? ZICMPM_UNREACH : ZICMPM_UNREACH_NET
+      ), h_ip, source_peer);
+    }
+
+    // to prevent routing loops
+    // drop routing table entry, if there is any
+    if(const auto route = have_route(iaddr_dst)) {
+      const auto dstnam = iaddr_dst.to_string();
+      const auto d = get_remote_desc(route->get_router());
+      printf("ROUTER: delete route to %s via %s (invalid)\n", dstnam.c_str(), d.c_str());
+      ZPRD_TRACE(route_del, &iaddr_dst, &route->get_router()->saddr, "invalid");
+      route->del_primary_router();
+      _tables_dirty = true;
+    }
+    return;
+  }
+
+  if(is_icmp) {
+    if(is_icmp_errmsg) {
+      const size_t mcpos = pkt_meta.l4off + sizeof(typename ipv::icmp_t);
+      if(rm_route && ((mcpos + sizeof(typename ipv::hdr_t)) <= buflen)) {
+        // drop outdated routing table entry, if there is any
+        //  target = original destination
+        const inner_addr_t iaddr_trg = ipv::dst_iaddr(*reinterpret_cast<const typename ipv::hdr_t*>(buffer + mcpos));
+        if(const auto r = have_route(iaddr_trg)) {
+          if(r->del_router(source_peer)) {
+            // routing table entry dropped
+            zprd_alloc_allow_t aa;
+            const string trgnam = iaddr_trg.to_string();
+            printf("ROUTER: delete route to %s via %s (unreachable)\n", trgnam.c_str(), source_desc.c_str());
+            _tables_dirty = true;
+            ZPRD_TRACE(route_del, &iaddr_trg, &source_peer->saddr, "unreachable");
+          }
+          // if there is a routing table entry left -> discard
+          if(!r->empty()) {
+            zprd_stats.drop(ZDROP_ICMPERR);
+            return;
+          }
+        }
+      }
+    } else if(ret.size() == 1) {
+      /** evaluate ping packets to determine the latency of this route
+       *  echoreply : source and destination are swapped
+       **/
+      const ping_cache_t::data_t edat(iaddr_src, iaddr_dst, ipv::echo_id(*h_icmp), ipv::echo_seq(*h_icmp));
+      const uint8_t icmp_type = ipv::icmp_type(*h_icmp);
+      if(icmp_type == ipv::echo_request) {
+        ping_cache.init(edat, ret.front());
+      } else if(icmp_type == ipv::echo_reply) {
+        const auto m = ping_cache.match(edat, source_peer, ttl);
+        if(m.match)
+          if(const auto r = have_route(edat.src))
+            r->update_router(m.router, m.hops, m.diff);
+      }
+    }
+  }
+
+  enqueue_data(buffer, buflen, ipv::frag(*h_ip), ipv::tos(*h_ip));
+}
+
+/* === MULTICAST
+ * Hosts on the tun device report their group memberships via IGMP (igmp_snoop).
+ * Each node floods its memberships as (group, own address) to the mesh (ZPRN2_MCAST)
+ * and refreshes them on every cleanup, so every node knows the receiving nodes of a group.
+ * The receiving node with the lowest address is the core of the group, the other
+ * receivers graft themselves onto the distribution tree along their unicast route
+ * towards the core, each node on the tree grafts itself onto its next hop (mcast_tree_update).
+ * The tree is shared by all sources (bidirectional): a node off the tree sends
+ * a multicast packet towards the core, a node on the tree sends it to all tree
+ * neighbors except the one it came from (the distribution set), each peer gets one copy.
+ * Only IPv4 groups outside of the link-local scope (224.0.0.0/24) are forwarded.
+ */
+
+// IGMPv3 membership report (RFC 3376 4.2), <netinet/igmp.h> doesn't define it
+#define ZIGMP_V3_MEMBERSHIP_REPORT 0x22
+enum zigmp_v3_rectype {
+  ZIGMP_MODE_IS_INCLUDE = 1, ZIGMP_MODE_IS_EXCLUDE, ZIGMP_CHANGE_TO_INCLUDE,
+  ZIGMP_CHANGE_TO_EXCLUDE, ZIGMP_ALLOW_NEW_SOURCES, ZIGMP_BLOCK_OLD_SOURCES
+};
+
+// mcast_routable: a = network byte order
+static bool mcast_routable(const uint32_t a) noexcept {
+  const uint32_t ha = ntohl(a);
+  return IN_MULTICAST(ha) && (ha & 0xffffff00) != 0xe0000000;
+}
+
+// mcast_msg: ZPRN message for the membership of receiver in group (prio = ZPRN_MCAST_*)
+static zprn_v2 mcast_msg(const inner_addr_t &group, const inner_addr_t &receiver, const uint8_t prio) noexcept {
+  zprn_v2 msg;
+  msg.zprn_cmd   = ZPRN2_MCAST;
+  msg.zprn_prio  = prio;
+  msg.route.type = ZPRN_MCAST_AT;
+  memcpy(msg.route.addr, group.addr, 4);
+  // the core of the broadcast tree could be an IPv6 address, it is informational in grafts
+  if(receiver.type == IAFA_AT_INET)
+    memcpy(msg.route.addr + 4, receiver.addr, 4);
+  else
+    memset(msg.route.addr + 4, 0, 4);
+  return msg;
+}
+
+static bool mcast_msg_split(const zprn_v2 &msg, inner_addr_t &group, inner_addr_t &receiver) noexcept {
+  if(msg.route.type != ZPRN_MCAST_AT)
+    return false;
+  uint32_t a;
+  memcpy(&a, msg.route.addr, 4);
+  if(!mcast_routable(a) && a != INADDR_BROADCAST)
+    return false;
+  group = inner_addr_t(a);
+  memcpy(&a, msg.route.addr + 4, 4);
+  receiver = inner_addr_t(a);
+  return true;
+}
+
+void router_t::mcast_local(const inner_addr_t &group, const bool join) {
+  // our IPv4 address identifies us as receiver
+  const auto aptr = get_local_aptr(IAFA_AT_INET);
+  if(!aptr) return;
+
+  auto it = groups.find(group);
+  if(join) {
+    if(it == groups.end()) {
+      if(over_budget(ZMEM_ROUTES, mem_usage(ZMEM_ROUTES), budget_routes))
+        return;
+      it = groups.emplace(group, mcast_group_t()).first;
+    } else if(it->second._local) {
+      return;
+    }
+    it->second._local = true;
+  } else {
+    if(it == groups.end() || !it->second._local)
+      return;
+    it->second._local = false;
+  }
+
+  const string grpdesc = group.to_string();
+  printf("ROUTER: local receivers %s multicast group %s\n", join ? "joined" : "left", grpdesc.c_str());
+  _tables_dirty = true;
+  send_zprn_mcast(mcast_msg(group, *aptr, join ? ZPRN_MCAST_JOIN : ZPRN_MCAST_LEAVE));
+  mcast_tree_update(group, it->second, false);
+  if(it->second.empty())
+    groups.erase(it);
+}
+
+/* igmp_snoop: evaluate an IGMP message from the tun device
+ *  v1/v2 report: join, v2 leave: leave, v3 report: one join/leave per group record
+ *  source filters are ignored, any interest in a group counts
+ */
+void router_t::igmp_snoop(const char buffer[], const uint16_t buflen) {
+  const auto h_ip = reinterpret_cast<const struct ip*>(buffer);
+  const size_t hlen = 4 * h_ip->ip_hl; // IGMP packets carry the router alert option
+  if(hlen < sizeof(struct ip) || (hlen + IGMP_MINLEN) > buflen) {
+    printf("ROUTER: drop IGMP packet (too small; size = %u) from local\n", buflen);
+    zprd_stats.drop(ZDROP_INVALID);
+    return;
+  }
+  zprd_stats.inc(zprd_stats.igmp_msgs);
+
+  const auto ubuf = reinterpret_cast<const uint8_t*>(buffer);
+  const uint8_t *const h_igmp = ubuf + hlen, *const eobptr = ubuf + buflen;
+  const auto update = [this](const uint8_t *const grp, const bool join) {
+    uint32_t a;
+    memcpy(&a, grp, sizeof(a));
+    if(mcast_routable(a))
+      mcast_local(inner_addr_t(a), join);
+  };
+
+  zprd_alloc_allow_t aa;
+  switch(h_igmp[0]) {
+    case IGMP_V1_MEMBERSHIP_REPORT:
+    case IGMP_V2_MEMBERSHIP_REPORT:
+      update(h_igmp + 4, true);
+      break;
+
+    case IGMP_V2_LEAVE_GROUP:
+      update(h_igmp + 4, false);
+      break;
+
+    case ZIGMP_V3_MEMBERSHIP_REPORT:
+      {
+        // [type, reserved, cksum(2), reserved(2), nrecs(2)] [records...]
+        size_t nrecs = (h_igmp[6] << 8) | h_igmp[7];
+        // record: [type, auxlen, nsrcs(2), group(4)] [sources(4 * nsrcs)] [aux(4 * auxlen)]
+        for(const uint8_t *rec = h_igmp + 8; nrecs && (rec + 8) <= eobptr; --nrecs) {
+          const size_t nsrcs = (rec[2] << 8) | rec[3];
+          switch(rec[0]) {
+            case ZIGMP_MODE_IS_EXCLUDE:
+            case ZIGMP_CHANGE_TO_EXCLUDE:
+              update(rec + 4, true);
+              break;
+
+            // INCLUDE {} = leave
+            case ZIGMP_MODE_IS_INCLUDE:
+            case ZIGMP_CHANGE_TO_INCLUDE:
+              update(rec + 4, nsrcs);
+              break;
+
+            case ZIGMP_ALLOW_NEW_SOURCES:
+              if(nsrcs) update(rec + 4, true);
+              break;
+
+            default: break;
+          }
+          rec += 8 + 4 * (nsrcs + rec[1]);
+        }
+      }
+      break;
+
+    default: break; // queries
+  }
+}
+
+void router_t::mcast_tree_update(const inner_addr_t &group, mcast_group_t &g, const bool refresh) {
+  tree_update(group, g, g.core(g._local ? get_local_aptr(IAFA_AT_INET) : nullptr), refresh);
+}
+
+/* tree_update: select the upstream of the distribution tree g
+ *  (the next hop towards the core if we are on the tree, but not the core),
+ *  graft onto it, prune the previous one; refresh = graft even if it didn't change
+ */
+void router_t::tree_update(const inner_addr_t &group, mcast_group_t &g, const inner_addr_t *const core, const bool refresh) {
+  remote_peer_ptr_t upstream;
+  if(core && g.on_tree() && !am_ii_addr(*core))
+    if(const auto r = have_route(*core)) {
+      const auto &nh = r->get_router();
+      // a downstream neighbor as upstream would close a loop (the routes didn't converge yet)
+      if(!nh->is_local() && none_of(g._downstream.cbegin(), g._downstream.cend(),
+           [&nh](const mcast_branch_t &i) noexcept { return *i.peer == *nh; }))
+        upstream = nh;
+    }
+
+  const bool changed = (upstream && g._upstream) ? !(*upstream == *g._upstream) : (upstream != g._upstream);
+  if(!changed && !(refresh && upstream))
+    return;
+
+  zprd_alloc_allow_t aa;
+  const inner_addr_t coreaddr = core ? *core : inner_addr_t(static_cast<uint32_t>(0));
+  const string grpdesc = group.to_string();
+  if(changed && g._upstream) {
+    const auto d = get_remote_desc(g._upstream);
+    printf("ROUTER: prune distribution tree of %s at %s\n", grpdesc.c_str(), d.c_str());
+    sender.enqueue(zprn2_sdat{mcast_msg(group, coreaddr, ZPRN_MCAST_PRUNE), {g._upstream}, {}});
+  }
+  if(upstream) {
+    if(changed) {
+      const auto d = get_remote_desc(upstream);
+      printf("ROUTER: graft distribution tree of %s onto %s\n", grpdesc.c_str(), d.c_str());
+    }
+    sender.enqueue(zprn2_sdat{mcast_msg(group, coreaddr, ZPRN_MCAST_GRAFT), {upstream}, {}});
+  }
+  if(changed) {
+    g._upstream = move(upstream);
+    g.update_dests();
+  }
+}
+
+/** route_mcast_packet:
+ * send an IPv4 multicast packet along the distribution tree of its group
+ **/
+void router_t::route_mcast_packet(const remote_peer_detail_ptr_t &source_peer, char *const __restrict__ buffer, const uint16_t buflen, const peer_desc_t &source_desc) {
+  const auto h_ip = reinterpret_cast<struct ip*>(buffer);
+  const bool source_is_local = source_peer->is_local();
+
+  // IGMP doesn't leave the link, the memberships are propagated via ZPRN
+  if(h_ip->ip_p == IPPROTO_IGMP) {
+    if(source_is_local)
+      igmp_snoop(buffer, buflen);
+    else
+      zprd_stats.drop(ZDROP_MCAST);
+    return;
+  }
+
+  const uint32_t ip_grp = h_ip->ip_dst.s_addr;
+  const auto git = mcast_routable(ip_grp) ? groups.find(inner_addr_t(ip_grp)) : groups.end();
+  if(git == groups.end()) {
+    // link-local scope or no receivers
+    zprd_stats.drop(ZDROP_MCAST);
+    return;
+  }
+
+  const inner_addr_t iaddr_src(h_ip->ip_src.s_addr);
+  auto &ttl = h_ip->ip_ttl;
+  if(!source_is_local) {
+    // no ICMP errors in response to multicast packets
+    if(!ttl) {
+      zprd_stats.drop(ZDROP_TTL);
+      return;
+    }
+  }
+  learn_route(source_peer, source_desc, iaddr_src, ttl);
+
+  const auto prepare_dests = [this]() -> vector<remote_peer_ptr_t>& {
+    auto &ret = _sdat.dests;
+    ret.clear();
+    if(zs_unlikely(!ret.capacity())) {
+      zprd_alloc_allow_t aa;
+      ret.reserve(4);
+    }
+    return ret;
+  };
+
+  auto &g = git->second;
+  const bool local_member = g._local && !source_is_local;
+  h_ip->ip_sum = 0;
+
+  // the local receivers get their copy before the ttl is decremented
+  //  (the sender doesn't mix the tun device with peers)
+  if(local_member) {
+    prepare_dests().emplace_back(local_router);
+    enqueue_data(buffer, buflen, h_ip->ip_off, h_ip->ip_tos);
+  }
+
+  if(!source_is_local) {
+    if(ttl == 1) {
+      if(!local_member) zprd_stats.drop(ZDROP_TTL);
+      return;
+    }
+    --ttl;
+  }
+
+  auto &ret = prepare_dests();
+  if(g.on_tree()) {
+    for(const auto &i : g._dests)
+      if(*i != *source_peer) {
+        zprd_alloc_allow_t aa(ret.size() == ret.capacity());
+        ret.emplace_back(i);
+      }
+  } else if(const auto core = g.core(nullptr)) {
+    // off the tree: towards the core, the first node on the tree distributes the packet
+    if(const auto r = have_route(*core)) {
+      const auto &nh = r->get_router();
+      if(!nh->is_local() && *nh != *source_peer)
+        ret.emplace_back(nh);
+    }
+  }
+
+  if(ret.empty()) {
+    if(!local_member) zprd_stats.drop(ZDROP_MCAST);
+    return;
+  }
+  enqueue_data(buffer, buflen, h_ip->ip_off, h_ip->ip_tos);
+}
+
+/* === BROADCAST
+ * Limited broadcasts (255.255.255.255) and packets without a known route are sent
+ * along the broadcast tree: a spanning tree over the peers, rooted at the lowest
+ * address which is announced via ZPRN (every node knows the same set of them),
+ * built like the distribution trees of the multicast groups (every node is a receiver).
+ * So each node gets one copy instead of one per link.
+ */
+
+static const inner_addr_t bcast_group(static_cast<uint32_t>(INADDR_BROADCAST));
+
+static bool addr_lower(const inner_addr_t &a, const inner_addr_t &b) noexcept {
+  return (a.type != b.type) ? (a.type < b.type) : (memcmp(a.addr, b.addr, pli_at2alen(a.type)) < 0);
+}
+
+void router_t::bcast_tree_update(const bool refresh) {
+  if(refresh) {
+    const inner_addr_t *root = nullptr;
+    const auto consider = [&root](const inner_addr_t &a) noexcept {
+      if(!root || addr_lower(a, *root)) root = &a;
+    };
+    for(const auto &i : locals)
+      consider(*reinterpret_cast<const inner_addr_t *>(&i));
+    for(const auto &i : exported_locals)
+      consider(i);
+    for(const auto &i : routes)
+      if(!i.second._learned && !i.second.empty())
+        consider(i.first);
+
+    if(!root) {
+      _bcast_root = inner_addr_t();
+    } else if(!(*root == _bcast_root)) {
+      _bcast_root = *root;
+      const string rootdesc = _bcast_root.to_string();
+      printf("ROUTER: broadcast tree root is %s\n", rootdesc.c_str());
+    }
+  }
+  tree_update(bcast_group, _bcast_tree, _bcast_root.type ? &_bcast_root : nullptr, refresh);
+  if(!refresh) return;
+
+  // soft state, like the grafts (which already tell the upstream)
+  //  older versions warn about the unknown code, peers which never sent a broadcast tree
+  //  message are only probed once per remote_timeout
+  const time_t tin = last_time - zprd_conf.remote_timeout;
+  zprd_alloc_allow_t aa;
+  vector<remote_peer_ptr_t> peers;
+  for(auto &i : _zprn_peers) {
+    if(i.first->to_discard || (_bcast_tree._upstream && *i.first == *_bcast_tree._upstream))
+      continue;
+    auto &zp = i.second;
+    if(zp.tree < tin) {
+      if(zp.probed >= tin) continue;
+      zp.probed = last_time;
+    }
+    peers.emplace_back(i.first);
+  }
+  if(!peers.empty())
+    sender.enqueue(zprn2_sdat{mcast_msg(bcast_group, inner_addr_t(), ZPRN_MCAST_TREE), move(peers), {}});
+}
+
+[[gnu::hot]]
+void router_t::bcast_dests(const remote_peer_ptr_t &source_peer, vector<remote_peer_ptr_t> &ret) {
+  const auto &tdests = _bcast_tree._dests;
+  if(zs_unlikely(tdests.empty())) {
+    // no tree neighbors yet, flood (split horizon)
+    zprd_alloc_allow_t aa;
+    ret.assign(remotes.cbegin(), remotes.cend());
+    rem_peer(ret, source_peer);
+    return;
+  }
+  for(const auto &i : tdests)
+    if(*i != *source_peer) {
+      zprd_alloc_allow_t aa(ret.size() == ret.capacity());
+      ret.emplace_back(i);
+    }
+  // live peers without tree support don't get the packet via the tree
+  const time_t tin = last_time - zprd_conf.remote_timeout;
+  for(const auto &i : _zprn_peers)
+    if(i.second.tree < tin && i.second.zprn >= tin && !i.first->to_discard && *i.first != *source_peer
+       && find(tdests.cbegin(), tdests.cend(), i.first) == tdests.cend()) {
+      zprd_alloc_allow_t aa(ret.size() == ret.capacity());
+      ret.emplace_back(i.first);
+    }
+}
+
+bool router_t::flood_seen(const remote_peer_ptr_t &source_peer, const char buffer[], const uint16_t buflen, const uint16_t l4off) noexcept {
+  // packets from the tun device are only remembered (a local application could repeat a packet)
+  const uint64_t now_ms = pkt_t_ingress ? (pkt_t_ingress / 1000000) : (static_cast<uint64_t>(last_time) * 1000);
+  const bool seen = _flood_filter.test_and_set(flood_filter_t::key(buffer, buflen, l4off), now_ms);
+  return seen && !source_peer->is_local();
+}
+
+/** route_bcast_packet:
+ * deliver a limited broadcast locally and send it along the broadcast tree
+ **/
+void router_t::route_bcast_packet(const remote_peer_detail_ptr_t &source_peer, char *const __restrict__ buffer, const uint16_t buflen, const peer_desc_t &source_desc) {
+  const auto h_ip = reinterpret_cast<struct ip*>(buffer);
+  const bool source_is_local = source_peer->is_local();
+  auto &ttl = h_ip->ip_ttl;
+
+  if(!source_is_local) {
+    // no ICMP errors in response to broadcasts
+    if(!ttl) {
+      zprd_stats.drop(ZDROP_TTL);
+      return;
+    }
+  }
+  if(flood_seen(source_peer, buffer, buflen, pkt_meta.l4off)) {
+    zprd_stats.drop(ZDROP_DUP);
+    return;
+  }
+  learn_route(source_peer, source_desc, inner_addr_t(h_ip->ip_src.s_addr), ttl);
+
+  auto &ret = _sdat.dests;
+  const auto prepare_dests = [&ret]() {
+    ret.clear();
+    if(zs_unlikely(!ret.capacity())) {
+      zprd_alloc_allow_t aa;
+      ret.reserve(4);
+    }
+  };
+  h_ip->ip_sum = 0;
+
+  // the local copy is sent before the ttl is decremented
+  //  (the sender doesn't mix the tun device with peers)
+  if(!source_is_local) {
+    prepare_dests();
+    ret.emplace_back(local_router);
+    enqueue_data(buffer, buflen, h_ip->ip_off, h_ip->ip_tos);
+    if(ttl == 1)
+      return;
+    --ttl;
+  }
+
+  if(blocked_broadcast_dsts.find(bcast_group) != blocked_broadcast_dsts.end()) {
+    if(source_is_local) zprd_stats.drop(ZDROP_BLOCKED);
+    return;
+  }
+
+  prepare_dests();
+  bcast_dests(source_peer, ret);
+  if(ret.empty()) {
+    if(source_is_local) zprd_stats.drop(ZDROP_NOROUTE);
+    return;
+  }
+  enqueue_data(buffer, buflen, h_ip->ip_off, h_ip->ip_tos);
+}
+
+/** route_l2_frame:
+ * TAP mode: learn the source MAC address, send frames to known unicast
+ * addresses to the peer they were learned from, flood the others
+ * (group addresses, unknown destinations) along the broadcast tree
+ **/
+[[gnu::hot]]
+void router_t::route_l2_frame(const remote_peer_detail_ptr_t &source_peer, char *const __restrict__ buffer, const uint16_t buflen, const peer_desc_t &source_desc) {
+  if(zs_unlikely(!tap || buflen < sizeof(struct zprd_l2hdr) + 14)) {
+    printf("ROUTER ERROR: got invalid L2 frame from %s\n", source_desc.c_str());
+    zprd_stats.drop(ZDROP_INVALID);
+    return;
+  }
+
+  const auto h_l2 = reinterpret_cast<struct zprd_l2hdr*>(buffer);
+  const auto h_eth = reinterpret_cast<const uint8_t*>(buffer + sizeof(struct zprd_l2hdr));
+  const uint64_t mac_dst = zprd_mac2u64(h_eth), mac_src = zprd_mac2u64(h_eth + 6);
+  const bool source_is_local = source_peer->is_local();
+  auto &ttl = h_l2->ttl;
+
+  if(zs_unlikely(!mac_src || zprd_mac_is_group(mac_src))) {
+    zprd_stats.drop(ZDROP_INVALID);
+    return;
+  }
+  if(source_is_local) {
+    h_l2->mgc = ZL2_MGC;
+    ttl = ZL2_TTL;
+    h_l2->id = _l2_id++;
+  }
+
+  // the peer is copied, learning the source may grow (move) the table
+  remote_peer_ptr_t dst;
+  if(!zprd_mac_is_group(mac_dst))
+    if(const auto ent = _macs.find(mac_dst))
+      dst = ent->peer;
+
+  // copies of a flooded frame which arrive via other paths would be flooded again,
+  //  or delivered twice once a node on the way knows the destination
+  if((!dst || (h_l2->mgc & ZL2_F_FLOODED)) && flood_seen(source_peer, buffer, buflen)) {
+    zprd_stats.drop(ZDROP_DUP);
+    return;
+  }
+
+  // learn or refresh the source, the table only allocates while it grows
+  if(zs_unlikely(_macs.full()) && !_macs.find(mac_src)) {
+    zprd_alloc_allow_t aa;
+    if(!over_budget(ZMEM_ROUTES, mem_usage(ZMEM_ROUTES), budget_routes))
+      _macs.learn(mac_src, source_peer);
+  } else {
+    _macs.learn(mac_src, source_peer);
+  }
+
+  auto &ret = _sdat.dests;
+  const auto prepare_dests = [&ret]() {
+    ret.clear();
+    if(zs_unlikely(!ret.capacity())) {
+      zprd_alloc_allow_t aa;
+      ret.reserve(4);
+    }
+  };
+
+  if(dst) {
+    // the destination is on the same segment as the source, filtered like a bridge does
+    if(*dst == *source_peer)
+      return;
+    if(!dst->is_local()) {
+      if(ttl <= 1) {
+        zprd_stats.drop(ZDROP_TTL);
+        return;
+      }
+      --ttl;
+    }
+    prepare_dests();
+    ret.emplace_back(move(dst));
+    enqueue_data(buffer, buflen, 0, 0);
+    return;
+  }
+
+  h_l2->mgc |= ZL2_F_FLOODED;
+
+  // the local copy is sent before the ttl is decremented
+  //  (the sender doesn't mix the tap device with peers)
+  if(!source_is_local) {
+    prepare_dests();
+    ret.emplace_back(local_router);
+    enqueue_data(buffer, buflen, 0, 0);
+    if(ttl <= 1)
+      return;
+    --ttl;
+  } else if(zprd_conf.l2_flood_rate) {
+    // limit broadcast storms which originate at the tap device
+    if(_l2_flood_sec != last_time) {
+      _l2_flood_sec = last_time;
+      _l2_floods = 0;
+    }
+    if(++_l2_floods > zprd_conf.l2_flood_rate) {
+      zprd_stats.drop(ZDROP_FLOODLIMIT);
+      return;
+    }
+  }
+
+  prepare_dests();
+  bcast_dests(source_peer, ret);
+  if(ret.empty()) {
+    if(source_is_local) zprd_stats.drop(ZDROP_NOROUTE);
+    return;
+  }
+  enqueue_data(buffer, buflen, 0, 0);
+}
+
+// handlers for incoming ZPRN packets
+typedef void (router_t::*zprn_v2_handler_t)(const remote_peer_detail_ptr_t&, const peer_desc_t&, const zprn_v2&);
+
+void router_t::zprn_v2_routemod_handler(const remote_peer_detail_ptr_t &srca, const peer_desc_t &source_desc, const zprn_v2 &d) {
+  const auto &dsta = d.route;
+  const string dstdesc = dsta.to_string();
+  const char * const ddcs = dstdesc.c_str();
+  if(d.zprn_prio != 0xff) {
+    // add route
+    route_via_t *r;
+    if(!am_ii_addr(dsta) && (r = route_slot(dsta, false)) && r->add_router(srca, d.zprn_prio + 1)) {
+      printf("ROUTER: add route to %s via %s with %u hops (notified)\n", ddcs, source_desc.c_str(), static_cast<unsigned>(d.zprn_prio + 1));
+      _tables_dirty = true;
+      ZPRD_TRACE(route_add, &dsta, &srca->saddr, d.zprn_prio + 1);
+    }
+    return;
+  }
+
+  // delete route
+  const auto r = have_route(dsta);
+  if(r && r->del_router(srca)) {
+    printf("ROUTER: delete route to %s via %s (notified)\n", ddcs, source_desc.c_str());
+    _tables_dirty = true;
+    ZPRD_TRACE(route_del, &dsta, &srca->saddr, "notified");
+  }
+
+  zprn_v2 msg = d;
+  if(am_ii_addr(dsta, false)) // a route to us is deleted (and we know we are here)
+    msg.zprn_prio = 0;
+  else if(r && !r->empty()) // we have a route
+    msg.zprn_prio = r->_routers.front().hops;
+  else
+    return;
+
+  send_zprn_msg(msg, srca);
+}
+
+void router_t::zprn_v2_connmgmt_handler(const remote_peer_detail_ptr_t &srca, const peer_desc_t &source_desc, const zprn_v2 &d) {
+  const auto &dsta = d.route;
+  const string dstdesc = dsta.to_string();
+  const char * const ddcs = dstdesc.c_str();
+  if(d.zprn_prio == ZPRN_CONNMGMT_OPEN) {
+    route_via_t *r;
+    if(!am_ii_addr(dsta) && (r = route_slot(dsta, false)) && r->add_router(srca, 1)) {
+      printf("ROUTER: add route to %s via %s with %u hops (notified)\n", ddcs, source_desc.c_str(), 1);
+      _tables_dirty = true;
+      ZPRD_TRACE(route_add, &dsta, &srca->saddr, 1);
+    }
+    return;
+  }
+
+  // close connection
+  for(auto &r: routes) {
+    const string dest_name = r.first.to_string();
+    if(r.second.del_router(srca)) {
+      printf("ROUTER: delete route to %s via %s (notified)\n", dest_name.c_str(), source_desc.c_str());
+      _tables_dirty = true;
+      ZPRD_TRACE(route_del, &r.first, &srca->saddr, "notified");
+    }
+  }
+
+  if(const auto r = have_route(dsta)) {
+    r->_routers.clear();
+    printf("ROUTER: delete route to %s via %s (notified)\n", ddcs, source_desc.c_str());
+    _tables_dirty = true;
+    ZPRD_TRACE(route_del, &dsta, &srca->saddr, "notified");
+  }
+}
+
+void router_t::zprn_handle_probe_req(const remote_peer_ptr_t &srca, const zprn_v2 &d, const bool expected_to_hr) {
+  bool dwhr = false;
+  zprn_v2 msg = d;
+  if(am_ii_addr(d.route, false)) { // a route to us is probed (and we know we are here)
+    dwhr = true;
+    msg.zprn_prio = 0;
+  } else if(const auto r = have_route(d.route)) { // we have a route
+    dwhr = true;
+    msg.zprn_prio = r->_routers.front().hops;
+    if(msg.zprn_prio == 0xff || *r->get_router() == *srca)
+      dwhr = false;
+  }
+
+  if(dwhr) { // we have an route
+    msg.zprn_cmd = ZPRN_ROUTEMOD;
+  } else if(!expected_to_hr) { // no route and not expected to have one --> nothing to do
+    return;
+  } else   { // oh no, invalidated route
+    msg.zprn_prio = 0x00;
+  }
+  sender.enqueue(zprn2_sdat{msg, {srca}, srca});
+}
+
+/* ZPRNv2 PROBE REQUEST
+ * The PROBE request is similar to the ROUTEMOD:DELETE request,
+ * with the difference, that the RMD handler deletes the route
+ * and the PRB handler keeps it
+ */
+void router_t::zprn_v2_probe_handler(const remote_peer_detail_ptr_t &srca, const peer_desc_t &source_desc, const zprn_v2 &d) {
+  switch(d.zprn_prio) {
+    case 0x00: // got probe response: end-of-line or dead-end or loop
+      /* almost equivalent to a ROUTEMOD:DELETE request, with the difference,
+         that the RMD handler sends an ROUTEMOD:ADD response if it has a route
+         here, we don't */
+      if(const auto r = have_route(d.route))
+        if(r->del_router(srca)) {
+          const string dstdesc = d.route.to_string();
+          const char * const ddcs = dstdesc.c_str();
+          printf("ROUTER: delete route to %s via %s (notified)\n", ddcs, source_desc.c_str());
+          _tables_dirty = true;
+          ZPRD_TRACE(route_del, &d.route, &srca->saddr, "notified");
+        }
+      break;
+
+    // probe requests
+    case 0xff: zprn_handle_probe_req(srca, d, false); break;
+    case 0xfe: zprn_handle_probe_req(srca, d, true ); break;
+  }
+}
+
+/* ZPRNv2 MULTICAST MEMBERSHIP
+ * joins and leaves are flooded, each node passes an entry on once;
+ * refreshes of known members are only accepted from the next hop towards the receiver
+ * and at most once per second, otherwise the nodes would keep each other's
+ * stale entries alive or pass them around in circles.
+ * grafts and prunes are sent to one neighbor only and maintain the distribution tree.
+ */
+void router_t::zprn_v2_mcast_handler(const remote_peer_detail_ptr_t &srca, const peer_desc_t &source_desc, const zprn_v2 &d) {
+  inner_addr_t group, receiver;
+  if(!mcast_msg_split(d, group, receiver))
+    return;
+
+  if(group == bcast_group) {
+    // the broadcast tree only knows grafts, prunes and announcements
+    _zprn_peers[srca].tree = last_time;
+    bool changed;
+    switch(d.zprn_prio) {
+      case ZPRN_MCAST_GRAFT: changed = _bcast_tree.graft(srca); break;
+      case ZPRN_MCAST_PRUNE: changed = _bcast_tree.prune(srca); break;
+      default:               return;
+    }
+    if(changed) {
+      printf("ROUTER: %s %s the broadcast tree\n", source_desc.c_str(),
+        (d.zprn_prio == ZPRN_MCAST_GRAFT) ? "grafted onto" : "pruned");
+      bcast_tree_update(false);
+    }
+    return;
+  }
+
+  auto it = groups.find(group);
+  const string grpdesc = group.to_string();
+  switch(d.zprn_prio) {
+    case ZPRN_MCAST_GRAFT:
+      if(it == groups.end()) {
+        if(over_budget(ZMEM_ROUTES, mem_usage(ZMEM_ROUTES), budget_routes))
+          return;
+        it = groups.emplace(group, mcast_group_t()).first;
+        _tables_dirty = true;
+      }
+      if(it->second.graft(srca)) {
+        printf("ROUTER: %s grafted onto multicast group %s\n", source_desc.c_str(), grpdesc.c_str());
+        mcast_tree_update(group, it->second, false);
+      }
+      return;
+
+    case ZPRN_MCAST_PRUNE:
+      if(it == groups.end() || !it->second.prune(srca))
+        return;
+      printf("ROUTER: %s pruned multicast group %s\n", source_desc.c_str(), grpdesc.c_str());
+      break;
+
+    case ZPRN_MCAST_LEAVE:
+      if(am_ii_addr(receiver, false) || it == groups.end() || !it->second.leave(receiver))
+        return;
+      {
+        const string rcvdesc = receiver.to_string();
+        printf("ROUTER: %s left multicast group %s (notified by %s)\n", rcvdesc.c_str(), grpdesc.c_str(), source_desc.c_str());
+      }
+      send_zprn_mcast(d, srca);
+      break;
+
+    case ZPRN_MCAST_JOIN:
+      if(am_ii_addr(receiver, false))
+        return;
+      if(it == groups.end()) {
+        if(over_budget(ZMEM_ROUTES, mem_usage(ZMEM_ROUTES), budget_routes))
+          return;
+        it = groups.emplace(group, mcast_group_t()).first;
+      }
+      if(const auto m = it->second.find(receiver)) {
+        const auto r = have_route(receiver);
+        if(m->seen == last_time || (r && *r->get_router() != *srca))
+          return;
+        m->seen = last_time;
+        send_zprn_mcast(d, srca);
+        return;
+      }
+      it->second.join(receiver);
+      {
+        const string rcvdesc = receiver.to_string();
+        printf("ROUTER: %s joined multicast group %s (notified by %s)\n", rcvdesc.c_str(), grpdesc.c_str(), source_desc.c_str());
+      }
+      send_zprn_mcast(d, srca);
+      break;
+
+    default: return;
+  }
+  _tables_dirty = true;
+
+  // the core could have changed
+  mcast_tree_update(group, it->second, false);
+  if(it->second.empty())
+    groups.erase(it);
+}
+
+bool router_t::handle_zprn_v2_pkt(const remote_peer_detail_ptr_t &srca, char buffer[], const uint16_t len, const peer_desc_t &source_desc) {
+  static const unordered_map<uint8_t, zprn_v2_handler_t> dpt = {
+    { ZPRN_ROUTEMOD, &router_t::zprn_v2_routemod_handler },
+    { ZPRN_CONNMGMT, &router_t::zprn_v2_connmgmt_handler },
+    { ZPRN2_PROBE  , &router_t::zprn_v2_probe_handler    },
+    { ZPRN2_MCAST  , &router_t::zprn_v2_mcast_handler    },
+  };
+
+  const auto h_zprn = reinterpret_cast<const struct zprn_v2hdr*>(buffer);
+  if(!((sizeof(struct zprn_v2hdr) + 2) < len && h_zprn->valid()))
+    return false;
+
+  char *bptr = buffer + sizeof(struct zprn_v2hdr);
+  const char * const eobptr = buffer + len;
+  bool got_least1 = false;
+  zprd_phase_guard_t pg(ZPH_ZPRN);
+  {
+    // new peers: value-initialized, no tree support seen yet
+    auto &zp = _zprn_peers[srca];
+    zp.zprn = last_time;
+  }
+  while(bptr < eobptr) {
+    const auto cur_ent = reinterpret_cast<struct zprn_v2*>(bptr);
+    { // ^ sender_t::worker_fn
+      auto &x = cur_ent->route.type;
+      x = ntohs(x);
+    }
+
+    if((bptr + cur_ent->get_needed_size()) > eobptr) {
+      if(!got_least1)
+        puts("ROUTER WARNING: got empty / incomplete ZPRNv2 packet");
+      break;
+    }
+
+    // handle entry
+    zprd_stats.inc(zprd_stats.zprn_rx_msgs);
+    ZPRD_TRACE(zprn_msg, cur_ent->zprn_cmd, cur_ent->zprn_prio, &cur_ent->route, &srca->saddr);
+    const auto it = dpt.find(cur_ent->zprn_cmd);
+    if(zs_likely(it != dpt.end())) (this->*(it->second))(srca, source_desc, *cur_ent);
+    else printf("ROUTER WARNING: got unknown ZPRNv2 command (%02x)\n", cur_ent->zprn_cmd);
+
+    // next entry
+    bptr += cur_ent->get_needed_size();
+    got_least1 = true;
+  }
+  return true;
+}
+
+bool router_t::handle_zprn_pkt(const remote_peer_detail_ptr_t &srca, char buffer[], const uint16_t len, const peer_desc_t &source_desc) {
+  if(len < 4 || buffer[0])
+    return false;
+  switch(buffer[1]) {
+    case 2:  return handle_zprn_v2_pkt(srca, buffer, len, source_desc);
+    default: return false;
+  }
+}
+
+template<unsigned IPV>
+[[gnu::hot]]
+inline void router_t::route_ip_packet(const remote_peer_detail_ptr_t &srca, char buffer[], uint16_t len, const peer_desc_t &source_desc) {
+  if(zs_unlikely(sizeof(typename ipver_traits<IPV>::hdr_t) > len)) {
+    printf("ROUTER ERROR: received invalid ip packet (too small, size = %u) from %s\n", len, source_desc.c_str());
+    zprd_stats.drop(ZDROP_INVALID);
+    return;
+  }
+  if constexpr(IPV == 4) {
+    if(!verify_ipv4_packet(srca, buffer, len, source_desc)) return;
+    pkt_meta.parse4(buffer, len);
+  } else {
+    if(!verify_ipv6_packet(srca, buffer, len, source_desc)) return;
+    pkt_meta.parse6(buffer, len);
+  }
+  route_packet<IPV>(srca, buffer, len, source_desc);
+}
+
+// function to route a generic packet
+[[gnu::hot]]
+void router_t::route_genip_packet(const remote_peer_detail_ptr_t &srca, char buffer[], uint16_t len, const uint64_t t_ingress) {
+  srca->seen = last_time;
+  pkt_t_ingress = t_ingress;
+  // NOTE: only formatted if something is logged, this runs for every packet
+  const peer_desc_t source_desc(srca->saddr);
+  const auto ipver = (len < 2) ? 255 : reinterpret_cast<const struct ip*>(buffer)->ip_v;
+  ZPRD_TRACE(pkt_dispatch, ipver, len, &srca->saddr);
+
+  // TAP mode only forwards L2 frames (and ZPRN)
+  if(zs_unlikely(tap && (ipver == 4 || ipver == 6))) {
+    printf("ROUTER ERROR: received an IP packet in TAP mode from %s\n", source_desc.c_str());
+    zprd_stats.drop(ZDROP_INVALID);
+    return;
+  }
+
+  // the only dispatch on the IP version, everything below is specialized
+  switch(ipver) {
+    case 4:
+      route_ip_packet<4>(srca, buffer, len, source_desc);
+      break;
+    case 6:
+      route_ip_packet<6>(srca, buffer, len, source_desc);
+      break;
+    case ZL2_MGC >> 4:
+      route_l2_frame(srca, buffer, len, source_desc);
+      break;
+    case 0:
+      {
+        // control plane
+        zprd_alloc_allow_t aa;
+        if(!handle_zprn_pkt(srca, buffer, len, source_desc)) {
+          printf("ROUTER ERROR: got invalid ZPRN packet from %s\n", source_desc.c_str());
+          zprd_stats.drop(ZDROP_INVALID);
+        }
+      }
+      break;
+    default:
+      printf("ROUTER ERROR: received a packet with unknown payload type (wrong ip_ver = %u) from %s\n", ipver, source_desc.c_str());
+      zprd_stats.drop(ZDROP_INVALID);
+  }
+}
+
+[[gnu::cold]]
+auto router_t::make_snapshot() -> shared_ptr<zprd_snapshot_t> {
+  auto ret = make_shared<zprd_snapshot_t>();
+  ret->taken = time(nullptr);
+  ret->generation = ++_snap_generation;
+
+  if(_tables_dirty || !_snap_tables) {
+    auto tbl = make_shared<zprd_snapshot_t::tables_t>();
+    tbl->peers.reserve(remotes.size());
+    for(const auto &i : remotes)
+      tbl->peers.push_back({domain, i->saddr, i->seen, cfgent_name(*i)});
+
+    tbl->routes.reserve(routes.size());
+    for(const auto &i : routes) {
+      tbl->routes.push_back({domain, i.first, {}});
+      auto &rts = tbl->routes.back().routers;
+      for(const auto &r : i.second._routers)
+        rts.push_back({r.addr->saddr, r.seen, r.latency, r.hops});
+    }
+
+    tbl->groups.reserve(groups.size());
+    for(const auto &i : groups) {
+      tbl->groups.push_back({domain, i.first, false, {}});
+      auto &grp = tbl->groups.back();
+      grp.local = i.second._local;
+      for(const auto &m : i.second._members)
+        grp.members.push_back({m.receiver, m.seen});
+    }
+    _snap_tables = move(tbl);
+    _tables_dirty = false;
+  }
+  ret->tables = _snap_tables;
+
+  ret->macs = _macs.size();
+  ret->domains = 1;
+
+  ret->stats = zprd_stats.snapshot();
+  ret->sender_tasks = ret->sender_zprn_msgs = 0;
+  for(size_t i = 0; i < ZMEM_MAX; ++i) {
+    ret->mem[i] = mem_usage(static_cast<zprd_mem_t>(i));
+    ret->mem_budget[i] = 0;
+  }
+  ret->mem_budget[ZMEM_ROUTES] = budget_routes;
+  ret->mem_budget[ZMEM_PEERS]  = budget_peers;
+  return ret;
+}
+
+static void del_route_msg(const router_t::routes_t::value_type &addr_v, const remote_peer_ptr_t &router) {
+  // discard route message
+  const auto destn = addr_v.first.to_string();
+  const auto d = get_remote_desc(router);
+  printf("ROUTER: delete route to %s via %s (outdated)\n", destn.c_str(), d.c_str());
+  ZPRD_TRACE(route_del, &addr_v.first, &router->saddr, "outdated");
+}
+
+void router_t::forget_peer(const remote_peer_detail_ptr_t &peer) {
+  for(auto &r: routes)
+    if(r.second.del_router(peer))
+      del_route_msg(r, peer);
+  _macs.del_peer(peer);
+  _zprn_peers.erase(peer);
+}
+
+[[gnu::cold]]
+void router_t::send_zprn_connmgmt_msg(const uint8_t prio) {
+  // notify our peers that we are here
+  zprn_v2 msg;
+  zeroify(msg);
+  msg.zprn_cmd = ZPRN_CONNMGMT;
+  msg.zprn_prio = prio;
+  if(!locals.empty())
+    msg.route = locals.front();
+  send_zprn_msg(msg);
+}
+
+template<class TCont, class Fn>
+static void map_remove_if(TCont &cont, const Fn &fn) {
+  for(auto it = cont.begin(); it != cont.end();) {
+    if(fn(*it))
+      it = cont.erase(it);
+    else
+      ++it;
+  }
+}
+
+void router_t::start() {
+  // notify our peers that we are here
+  send_zprn_connmgmt_msg(ZPRN_CONNMGMT_OPEN);
+
+  // add route to ourselves to avoid sending two 'ZPRN add route' packets
+  routes.reserve(locals.size());
+  for(const auto &i : locals)
+    routes[i].add_router(local_router, 0);
+  _tables_dirty = true;
+}
+
+void router_t::stop() {
+  // notify our peers that we quit
+  send_zprn_connmgmt_msg(ZPRN_CONNMGMT_CLOSE);
+}
+
+void router_t::cleanup() {
+  // expires entries and refreshes the seen timestamps + latencies of the next snapshot
+  _tables_dirty = true;
+  _found_remotes.assign(cfg_remotes.size(), false);
+  zeroify(_budget_warned);
+
+  for(auto it = remotes.cbegin(); it != remotes.cend(); ++it) {
+    auto &i = *it;
+    auto &pdat = *i;
+
+    if(pdat.cent)
+      _found_remotes[pdat.cent - 1] = true;
+
+    // skip remotes which aren't timed out or try to update ip
+    if(zs_likely((last_time - zprd_conf.remote_timeout) < pdat.seen) || update_server_addr(i)) {
+      // check for duplicates
+      for(auto kt = it + 1; kt != remotes.cend(); ++kt) {
+        auto &op = *kt;
+        auto &odat = *op;
+        if(zs_likely(odat.to_discard || pdat != odat))
+          continue;
+        // we found a duplicate
+        // delete the one which doesn't have a corresponding config entry or a lower use count
+        ((!pdat.cent && odat.cent) || (i.use_count() < op.use_count()) ? i : op)
+          ->to_discard = true;
+      }
+      if(!pdat.to_discard)
+        continue;
+    }
+
+    forget_peer(i);
+    pdat.to_discard = true;
+  }
+
+  // cleanup routes, needs to be done after del_router calls
+  zprn_v2 msg;
+  // when seen is smaller than the following time, the route will be probed
+  const time_t route_probe_tin = last_time - zprd_conf.remote_timeout;
+  map_remove_if(routes, [&](auto &route) -> bool {
+    msg.route = route.first;
+    auto &ise = route.second;
+    ise.cleanup([route](const remote_peer_ptr_t &router)
+      { del_route_msg(route, router); });
+
+    const bool iee = ise.empty();
+    if(iee || ise._fresh_add) {
+      ise._fresh_add = false;
+      msg.zprn_cmd = ZPRN_ROUTEMOD;
+      msg.zprn_prio = (iee ? 0xff : ise._routers.front().hops);
+      send_zprn_msg(msg, iee ? remote_peer_ptr_t() : ise.get_router());
+      if(route_hook) route_hook(iee, route.first);
+    } else if(!iee && ise._routers.front().seen < route_probe_tin) {
+      msg.zprn_cmd = ZPRN2_PROBE;
+      msg.zprn_prio = 0xff;
+      send_zprn_probe_req(msg.route);
+    }
+
+    return iee;
+  });
+
+  // multicast groups: expire remote members and branches,
+  //  refresh our memberships and grafts (soft state), follow route changes
+  const time_t member_tin = last_time - zprd_conf.remote_timeout;
+  const auto aptr = get_local_aptr(IAFA_AT_INET);
+  map_remove_if(groups, [&](auto &grp) -> bool {
+    auto &g = grp.second;
+    g.cleanup(member_tin);
+    if(g._local && aptr)
+      send_zprn_mcast(mcast_msg(grp.first, *aptr, ZPRN_MCAST_JOIN));
+    mcast_tree_update(grp.first, g, true);
+    return g.empty();
+  });
+  _bcast_tree.cleanup(member_tin);
+  map_remove_if(_zprn_peers, [member_tin](const auto &i) { return i.second.zprn < member_tin; });
+  bcast_tree_update(true);
+  _macs.cleanup(member_tin);
+
+  // drop ring slots of deleted or promoted routes
+  _learned_ring.erase(remove_if(_learned_ring.begin(), _learned_ring.end(),
+    [this](const inner_addr_t &a) {
+      const auto it = routes.find(a);
+      return it == routes.end() || !it->second._learned;
+    }), _learned_ring.end());
+
+  // discard remotes (after cleanup -> cleanup has a chance to notify them)
+  map_remove_if(remotes, [this](const auto &peer) -> bool {
+    if(peer->to_discard && peer_hook)
+      peer_hook(true, peer);
+    return peer->to_discard;
+  });
+  map_remove_if(_path_peers, [](const auto &i) { return i.second->to_discard; });
+
+  size_t i = 0;
+  for(const auto fri : _found_remotes) {
+    if(zs_unlikely(!fri)) // remote from config wasn't found in 'remotes' map
+      connect2server(cfg_remotes[i], i);
+    ++i;
+  }
+
+  std::sort(remotes.begin(), remotes.end(), x_less);
+}
+
+void router_t::clear() noexcept {
+  routes.clear();
+  _learned_ring.clear();
+  groups.clear();
+  _bcast_tree._downstream.clear();
+  _bcast_tree._upstream.reset();
+  _bcast_tree._dests.clear();
+  _bcast_root = inner_addr_t();
+  _zprn_peers.clear();
+  _flood_filter.clear();
+  _icmp_limit.clear();
+  _macs.clear();
+  remotes.clear();
+  locals.clear();
+  exported_locals.clear();
+  blocked_broadcast_dsts.clear();
+  _tables_dirty = true;
+}
@@ -0,0 +1,261 @@
+/**
+ * zprd / router.hpp - the routing core
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include "flood_filter.hpp"
+#include "iAFa.hpp"
+#include "icmp_limit.hpp"
+#include "l2.hpp"
+#include "ping_cache.hpp"
+#include "pkt_meta.hpp"
+#include "remote_peer.hpp"
+#include "routes.hpp"
+#include "sender.hpp"
+#include "snapshot.hpp"
+#include <inttypes.h>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct ip;
+struct ip6_hdr;
+
+// peer_desc_t: description of the source peer for log messages,
+//  formatted on first use (the steady-state forwarding path doesn't log)
+class peer_desc_t final {
+  const outer_addr_t &_addr;
+  mutable char _buf[AFA_SA_BUFLEN];
+
+ public:
+  explicit peer_desc_t(const outer_addr_t &addr) noexcept : _addr(addr) { _buf[0] = 0; }
+  peer_desc_t(const peer_desc_t &) = delete;
+  peer_desc_t& operator=(const peer_desc_t &) = delete;
+
+  const char *c_str() const noexcept {
+    if(zs_unlikely(!_buf[0]))
+      AFa_sa2buf(_addr, "peer ", _buf, sizeof(_buf));
+    return _buf;
+  }
+};
+
+/* router_t contains the routing state of one node (peers, routes, local addresses)
+ * and the routing logic. It doesn't do any I/O: outgoing packets are passed to
+ * a packet_sink_t. zprd uses one instance, the simulator (bench/zprd-sim) many.
+ * The settings in zprd_conf and last_time are shared by all instances.
+ * NOTE: all methods must be called from the same thread.
+ */
+class router_t final {
+ public:
+  typedef std::unordered_map<inner_addr_t, route_via_t, inner_addr_hash> routes_t;
+  typedef std::unordered_set<inner_addr_t, inner_addr_hash> addr_set_t;
+  typedef std::unordered_map<inner_addr_t, mcast_group_t, inner_addr_hash> groups_t;
+
+  std::vector<remote_peer_detail_ptr_t> remotes; // sorted
+  std::vector<xner_addr_t> locals;
+  addr_set_t exported_locals, blocked_broadcast_dsts;
+  routes_t routes;
+  // IPv4 multicast groups with receivers (IGMP snooping + ZPRN)
+  groups_t groups;
+
+  // config entries of remotes (R...), index = remote_peer_detail_t::cent - 1
+  std::vector<std::string> cfg_remotes;
+
+  // the peer of packets from the tun device
+  const remote_peer_detail_ptr_t local_router;
+
+  // routing domain ID (see zprd_domain_conf_t), TAP mode: forward L2 frames instead of IP packets
+  uint16_t domain;
+  bool tap;
+
+  // memory budgets in bytes (0 = unlimited), see zprd_conf_t::budget_*
+  size_t budget_routes, budget_peers;
+  // max count of learned host routes (0 = unlimited), see zprd_conf_t::max_learned_routes
+  size_t max_learned_routes;
+
+  // optional, called when a route or peer is added or deleted
+  std::function<void (bool is_deleted, const inner_addr_t &dest)> route_hook;
+  std::function<void (bool is_deleted, const remote_peer_ptr_t &peer)> peer_hook;
+  // optional, called after a configured remote was (re-)resolved
+  //  (all addresses, preferred address family first), see path_prober_t
+  std::function<void (const remote_peer_detail_ptr_t &peer, std::vector<outer_addr_t> &&paths)> paths_hook;
+  // optional, returns the address of the peer of a node with uplinks if saddr is one of its addresses,
+  //  see path_prober_t::alias
+  std::function<bool (const outer_addr_t &saddr, outer_addr_t &primary)> alias_hook;
+
+  explicit router_t(packet_sink_t &sink);
+
+  // connect_remotes: resolve and add all cfg_remotes,
+  //  returns false if none of them could be resolved
+  bool connect_remotes();
+
+  // start: add routes to the locals and notify the peers, stop: notify the peers
+  void start();
+  void stop();
+
+  // intern_peer: returns the known peer with the same address or adds peer to remotes
+  auto intern_peer(remote_peer_detail_ptr_t &&peer) -> remote_peer_detail_ptr_t;
+  // only allocates if the peer is new, returns nullptr if the peer budget is exceeded,
+  //  every address of a configured remote (paths_hook) belongs to its peer
+  auto intern_peer(const outer_addr_t &saddr) -> remote_peer_detail_ptr_t;
+  // switch_path: send to a configured remote via another one of its addresses from now on,
+  //  a peer which was interned under that address before is merged into it
+  void switch_path(const remote_peer_detail_ptr_t &peer, const outer_addr_t &addr);
+  // rekey_peer: the peer of a node with uplinks is reached via another address from now on
+  void rekey_peer(const outer_addr_t &from, const outer_addr_t &to);
+
+  /** route_genip_packet:
+   * route an ip or ZPRN packet (TAP mode: L2 frame) received from srca (local_router = tun device)
+   *
+   * @param buffer    (in/out) packet data
+   * @param t_ingress monotonic receive timestamp in ns (0 = unknown)
+   **/
+  void route_genip_packet(const remote_peer_detail_ptr_t &srca, char buffer[], uint16_t len, uint64_t t_ingress = 0);
+
+  // cleanup: discard timed out peers and routes, announce route changes,
+  //  should be called every remote_timeout / 4 seconds
+  void cleanup();
+
+  // make_snapshot: copy the routing state (without sender queue depth + memory),
+  //  the tables are shared with the previous snapshot if nothing changed since then
+  auto make_snapshot() -> std::shared_ptr<zprd_snapshot_t>;
+
+  // mem_usage: estimated heap usage of routes, peers and caches (indexed by zprd_mem_t)
+  size_t mem_usage(zprd_mem_t m) const noexcept;
+
+  void clear() noexcept;
+
+  // am_ii_addr: is o a local address (or an exported one)?
+  bool am_ii_addr(const inner_addr_t &o, bool with_exported = true) const noexcept;
+
+ private:
+  enum zprd_icmpe {
+    ZICMPM_TTL, ZICMPM_UNREACH, ZICMPM_UNREACH_NET
+  };
+
+  packet_sink_t &sender;
+  ping_cache_t ping_cache;
+  std::vector<bool> _found_remotes;
+  uint64_t _snap_generation;
+  // tables of the last snapshot, rebuilt if _tables_dirty (set by every change of the routing state)
+  std::shared_ptr<const zprd_snapshot_t::tables_t> _snap_tables;
+  bool _tables_dirty;
+
+  // ingress timestamp of the packet which is currently routed
+  uint64_t pkt_t_ingress;
+  // upper-layer header of the IP packet which is currently routed
+  pkt_meta_t pkt_meta;
+
+  // the next data packet is built in here, its buffers are recycled by the sender
+  send_data _sdat;
+
+  // budget exceeded warnings, printed once per cleanup interval
+  bool _budget_warned[ZMEM_MAX];
+
+  // all addresses of the configured remotes which are probed (paths_hook) -> their peer
+  std::unordered_map<outer_addr_t, remote_peer_detail_ptr_t, outer_addr_hash> _path_peers;
+
+  // CLOCK ring of the learned routes (may contain promoted entries until the next cleanup)
+  std::vector<inner_addr_t> _learned_ring;
+  size_t _clock_hand;
+
+  // broadcast tree: spanning tree over the peers, rooted at the lowest announced address
+  //  (_bcast_root, type 0 = none yet), broadcasts and unrouted packets are sent along it
+  mcast_group_t _bcast_tree;
+  inner_addr_t _bcast_root;
+  // peers which sent ZPRN packets -> last ZPRN packet + last broadcast tree message (graft, prune, tree)
+  //  + last tree announcement sent without an answer, live peers without broadcast tree messages
+  //  (older versions) don't forward along the tree and get every broadcast
+  struct zprn_peer_t final { time_t zprn, tree, probed; };
+  std::unordered_map<remote_peer_detail_ptr_t, zprn_peer_t> _zprn_peers;
+
+  // recently flooded packets (broadcasts, no route), copies which arrive via other paths are dropped
+  flood_filter_t _flood_filter;
+
+  // token buckets of the generated ICMP errors (per source peer + per destination)
+  icmp_limit_t _icmp_limit;
+
+  // TAP mode: MAC address -> peer (local_router = tap device), id of the next local frame,
+  //  flooded local frames in the current second (l2_flood_rate)
+  mac_table_t _macs;
+  uint16_t _l2_id;
+  unsigned _l2_floods;
+  time_t _l2_flood_sec;
+
+  void connect2server(const std::string &r, size_t cent);
+  bool update_server_addr(const remote_peer_detail_ptr_t &peer);
+  void set_path_peers(const remote_peer_detail_ptr_t &peer, const std::vector<outer_addr_t> &paths);
+  // forget_peer: delete the routes + MAC addresses via peer
+  void forget_peer(const remote_peer_detail_ptr_t &peer);
+  const char *cfgent_name(const remote_peer_detail_t &pdat) const noexcept;
+
+  auto get_local_aptr(iafa_at_t preferred_at) const noexcept -> const xner_addr_t*;
+  template<typename T>
+  void get_local_addr(iafa_at_t preferred_at, T &addr) const noexcept;
+  route_via_t* have_route(const inner_addr_t &dsta) noexcept;
+  // route_slot: returns the entry for dsta, creates it if the route budget allows it
+  //  learned = false marks the entry as announced (protected from eviction)
+  route_via_t* route_slot(const inner_addr_t &dsta, bool learned);
+  // evict_learned_route: CLOCK eviction of an idle learned route, returns false if none is left
+  bool evict_learned_route() noexcept;
+  bool over_budget(zprd_mem_t m, size_t used, size_t budget) noexcept;
+
+  bool icmp_allowed(const remote_peer_ptr_t &source_peer, const inner_addr_t &dest) noexcept;
+  char *prepare_icmp(size_t buflen, const remote_peer_ptr_t &source_ip, uint16_t frag);
+  void send_icmp_msg(zprd_icmpe msg, struct ip *orig_hip, const remote_peer_ptr_t &source_ip);
+  void send_icmp_msg(zprd_icmpe msg, struct ip6_hdr *orig_hip, const remote_peer_ptr_t &source_ip);
+  void send_zprn_msg(const zprn_v2 &msg, const remote_peer_ptr_t &confirmed = {});
+  void send_zprn_probe_req(const inner_addr_t &dest);
+  void send_zprn_connmgmt_msg(uint8_t prio);
+  // send_zprn_mcast: send a membership message to all peers except one
+  void send_zprn_mcast(const zprn_v2 &msg, const remote_peer_ptr_t &except = {});
+
+  bool verify_ipv4_packet(const remote_peer_detail_ptr_t &srca, const char buffer[], uint16_t &len, const peer_desc_t &source_desc);
+  bool verify_ipv6_packet(const remote_peer_detail_ptr_t &srca, const char buffer[], uint16_t &len, const peer_desc_t &source_desc);
+  // resolve_route: writes the destinations into ret,
+  //  returns false if the packet was dropped as a copy of a recently flooded one
+  bool resolve_route(const remote_peer_detail_ptr_t &source_peer, const peer_desc_t &source_desc,
+                     const char buffer[], uint16_t buflen,
+                     const inner_addr_t &iaddr_src, const inner_addr_t &iaddr_dest, uint8_t ip_ttl, bool destination_is_local,
+                     std::vector<remote_peer_ptr_t> &ret);
+  void enqueue_data(const char *buffer, uint16_t buflen, uint16_t frag, uint32_t tos);
+  // route_packet: the forwarding core, specialized per IP version (4, 6)
+  template<unsigned IPV>
+  void route_packet(const remote_peer_detail_ptr_t &source_peer, char *buffer, uint16_t buflen, const peer_desc_t &source_desc);
+  // learn_route: add / refresh the route to the source of a data packet
+  void learn_route(const remote_peer_detail_ptr_t &source_peer, const peer_desc_t &source_desc,
+                   const inner_addr_t &iaddr_src, uint8_t ip_ttl);
+  // mcast_local: the hosts on the tun device joined / left group
+  void mcast_local(const inner_addr_t &group, bool join);
+  void igmp_snoop(const char buffer[], uint16_t buflen);
+  // mcast_tree_update: (re-)graft the distribution tree of group towards the core
+  void mcast_tree_update(const inner_addr_t &group, mcast_group_t &g, bool refresh);
+  void tree_update(const inner_addr_t &group, mcast_group_t &g, const inner_addr_t *core, bool refresh);
+  // bcast_tree_update: select the root of the broadcast tree and (re-)graft onto it
+  void bcast_tree_update(bool refresh);
+  // bcast_dests: tree neighbors + peers without tree support except source_peer
+  //  (all peers until the tree is built)
+  void bcast_dests(const remote_peer_ptr_t &source_peer, std::vector<remote_peer_ptr_t> &ret);
+  // flood_seen: returns true if the packet from source_peer is a copy of a recently flooded one
+  //  (l4off: see flood_filter_t::key)
+  bool flood_seen(const remote_peer_ptr_t &source_peer, const char buffer[], uint16_t buflen, uint16_t l4off = 0) noexcept;
+  void route_bcast_packet(const remote_peer_detail_ptr_t &source_peer, char *buffer, uint16_t buflen, const peer_desc_t &source_desc);
+  void route_mcast_packet(const remote_peer_detail_ptr_t &source_peer, char *buffer, uint16_t buflen, const peer_desc_t &source_desc);
+  // route_l2_frame: TAP mode, forward an ethernet frame via the MAC table or the broadcast tree
+  void route_l2_frame(const remote_peer_detail_ptr_t &source_peer, char *buffer, uint16_t buflen, const peer_desc_t &source_desc);
+  // route_ip_packet: verify + route, specialized per IP version (4, 6)
+  template<unsigned IPV>
+  void route_ip_packet(const remote_peer_detail_ptr_t &srca, char buffer[], uint16_t len, const peer_desc_t &source_desc);
+
+  // handlers for incoming ZPRN packets
+  void zprn_v2_routemod_handler(const remote_peer_detail_ptr_t &srca, const peer_desc_t &source_desc, const zprn_v2 &d);
+  void zprn_v2_connmgmt_handler(const remote_peer_detail_ptr_t &srca, const peer_desc_t &source_desc, const zprn_v2 &d);
+  void zprn_v2_probe_handler(const remote_peer_detail_ptr_t &srca, const peer_desc_t &source_desc, const zprn_v2 &d);
+  void zprn_v2_mcast_handler(const remote_peer_detail_ptr_t &srca, const peer_desc_t &source_desc, const zprn_v2 &d);
+  void zprn_handle_probe_req(const remote_peer_ptr_t &srca, const zprn_v2 &d, bool expected_to_hr);
+  bool handle_zprn_v2_pkt(const remote_peer_detail_ptr_t &srca, char buffer[], uint16_t len, const peer_desc_t &source_desc);
+  bool handle_zprn_pkt(const remote_peer_detail_ptr_t &srca, char buffer[], uint16_t len, const peer_desc_t &source_desc);
+};
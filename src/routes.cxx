@@ -5,7 +5,9 @@
  **/
 
 #include "routes.hpp"
+#include "alloc_stats.hpp"
 #include <algorithm>
+#include <string.h>
 #include <config.h> // zs_*likely
 
 using namespace std;
@@ -37,6 +39,7 @@ bool route_via_t::add_router(const remote_peer_ptr_t &router, const uint8_t hops
   const auto it = find_router(router);
   const bool ret = (it == _routers.end());
   if(zs_unlikely(ret)) {
+    zprd_alloc_allow_t aa;
     _routers.emplace_front(router, hops);
   } else {
     it->seen = last_time;
@@ -121,3 +124,82 @@ void route_via_t::swap_near_routers() noexcept {
   std::advance(previt, near_rcnt - 1);
   _routers.emplace_after(previt, move(primary_backup));
 }
+
+mcast_member_t* mcast_group_t::find(const inner_addr_t &receiver) noexcept {
+  for(auto &i : _members)
+    if(i.receiver == receiver)
+      return &i;
+  return nullptr;
+}
+
+bool mcast_group_t::join(const inner_addr_t &receiver) {
+  if(const auto m = find(receiver)) {
+    m->seen = last_time;
+    return false;
+  }
+  zprd_alloc_allow_t aa;
+  _members.push_back({receiver, last_time});
+  return true;
+}
+
+bool mcast_group_t::leave(const inner_addr_t &receiver) noexcept {
+  const auto it = find_if(_members.begin(), _members.end(),
+    [&receiver](const mcast_member_t &i) noexcept { return i.receiver == receiver; });
+  if(it == _members.end()) return false;
+  // the order of the members doesn't matter
+  if(it != _members.end() - 1)
+    *it = _members.back();
+  _members.pop_back();
+  return true;
+}
+
+bool mcast_group_t::graft(const remote_peer_ptr_t &peer) {
+  for(auto &i : _downstream)
+    if(i.peer == peer) {
+      i.seen = last_time;
+      return false;
+    }
+  zprd_alloc_allow_t aa;
+  _downstream.push_back({peer, last_time});
+  update_dests();
+  return true;
+}
+
+bool mcast_group_t::prune(const remote_peer_ptr_t &peer) noexcept {
+  const auto it = find_if(_downstream.begin(), _downstream.end(),
+    [&peer](const mcast_branch_t &i) noexcept { return i.peer == peer; });
+  if(it == _downstream.end()) return false;
+  if(it != _downstream.end() - 1)
+    *it = move(_downstream.back());
+  _downstream.pop_back();
+  update_dests();
+  return true;
+}
+
+const inner_addr_t* mcast_group_t::core(const inner_addr_t *const local) const noexcept {
+  const inner_addr_t *ret = local;
+  for(const auto &i : _members)
+    if(!ret || memcmp(i.receiver.addr, ret->addr, sizeof(i.receiver.addr)) < 0)
+      ret = &i.receiver;
+  return ret;
+}
+
+void mcast_group_t::update_dests() {
+  zprd_alloc_allow_t aa;
+  _dests.clear();
+  if(_upstream)
+    _dests.emplace_back(_upstream);
+  for(const auto &i : _downstream)
+    if(i.peer != _upstream)
+      _dests.emplace_back(i.peer);
+}
+
+void mcast_group_t::cleanup(const time_t ct) {
+  _members.erase(remove_if(_members.begin(), _members.end(),
+    [ct](const mcast_member_t &i) noexcept { return i.seen <= ct; }), _members.end());
+  const size_t dcnt = _downstream.size();
+  _downstream.erase(remove_if(_downstream.begin(), _downstream.end(),
+    [ct](const mcast_branch_t &i) noexcept { return i.seen <= ct; }), _downstream.end());
+  if(dcnt != _downstream.size())
+    update_dests();
+}
@@ -4,6 +4,7 @@
  * License: GPL-2+
  **/
 #pragma once
+#include "iAFa.hpp"
 #include "remote_peer.hpp"
 
 extern time_t last_time;
@@ -25,8 +26,11 @@ class route_via_t final {
  public:
   std::forward_list<via_router_t> _routers;
   bool _fresh_add;
+  // _learned: only learned from the source address of data packets (evictable),
+  // _referenced: CLOCK reference bit, set on each lookup
+  bool _learned, _referenced;
 
-  route_via_t(): _fresh_add(false) { }
+  route_via_t(): _fresh_add(false), _learned(false), _referenced(false) { }
 
   // deletes all outdates routers and sort routers
   void cleanup(const std::function<void (const remote_peer_ptr_t&)> &f);
@@ -52,3 +56,58 @@ class route_via_t final {
  private:
   auto find_router(const remote_peer_ptr_t &router) noexcept -> decltype(_routers)::iterator;
 };
+
+#include <vector>
+
+// remote receiver of a multicast group: a node with interested hosts on its tun device
+struct mcast_member_t final {
+  inner_addr_t receiver; // address of the node
+  time_t seen;
+};
+
+// downstream neighbor in the distribution tree of a multicast group
+struct mcast_branch_t final {
+  remote_peer_ptr_t peer;
+  time_t seen;
+};
+
+// members of a multicast group + distribution tree
+//  the tree is shared by all sources, it is rooted at the core (the receiving
+//  node with the lowest address) and consists of the unicast routes of all
+//  receivers towards the core (grafted hop by hop)
+class mcast_group_t final {
+ public:
+  std::vector<mcast_member_t> _members;
+  std::vector<mcast_branch_t> _downstream;
+  // _upstream: tree neighbor towards the core, empty if we are the core or off the tree
+  remote_peer_ptr_t _upstream;
+  // distribution set: _upstream + _downstream, each peer once
+  std::vector<remote_peer_ptr_t> _dests;
+  // _local: hosts on our tun device joined the group (learned via IGMP, no timeout)
+  bool _local;
+
+  mcast_group_t(): _local(false) { }
+
+  bool empty() const noexcept
+    { return !_local && _members.empty() && _downstream.empty(); }
+
+  bool on_tree() const noexcept
+    { return _local || !_downstream.empty(); }
+
+  mcast_member_t* find(const inner_addr_t &receiver) noexcept;
+  // join: add or refresh a member, returns true if it is new
+  bool join(const inner_addr_t &receiver);
+  bool leave(const inner_addr_t &receiver) noexcept;
+
+  // graft: add or refresh a downstream neighbor, returns true if it is new
+  bool graft(const remote_peer_ptr_t &peer);
+  bool prune(const remote_peer_ptr_t &peer) noexcept;
+
+  // core: the receiver with the lowest address, local = our address if _local
+  const inner_addr_t* core(const inner_addr_t *local) const noexcept;
+
+  void update_dests();
+
+  // cleanup: drop members and branches which weren't refreshed since ct
+  void cleanup(time_t ct);
+};
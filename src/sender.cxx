@@ -7,12 +7,19 @@
 #define __USE_MISC 1
 #include <sys/types.h>
 #include "sender.hpp"
+#include "alloc_stats.hpp"
 #include "crest.h"
+#include "l2.hpp"           // zprd_is_l2
+#include "stats.hpp"
+#include "trace.hpp"
+#include "watchdog.hpp"
 #include <zs/ll/memut.hpp>
 #include <config.h>
 #include <stdio.h>       // perror
 #include <unistd.h>      // write
 #include <sys/prctl.h>   // prctl
+#include <sys/socket.h>  // sendmsg
+#include <sys/uio.h>     // struct iovec
 #include <netinet/ip.h>  // struct ip, IP_*
 #include <algorithm>     // remove_if
 
@@ -24,12 +31,30 @@ void sender_t::enqueue(send_data &&dat) {
     return;
   if(dat.dests.front()->is_local())
     dat.dests.clear();
-  dat.dests.shrink_to_fit();
+  dat.t_enqueue = zprd_now_ns();
+  ZPRD_TRACE(sender_enqueue_data, dat.buffer.size(), dat.dests.size());
 
-  // move into queue
+  // move into queue, swap in a recycled send_data
   {
+    zprd_phase_guard_t pg(ZPH_SENDER);
+    const size_t msiz = dat.mem_size();
     lock_guard<mutex> lock(_mtx);
-    _tasks.emplace_back(move(dat));
+    if(zs_unlikely(budget && (_data_bytes + _zprn_bytes + msiz) > budget)) {
+      // backpressure: the caller keeps dat
+      zprd_stats.drop(ZDROP_BUDGET);
+      zprd_stats.inc(zprd_stats.budget_hits[ZMEM_SENDER]);
+      return;
+    }
+    _data_bytes += msiz;
+    {
+      zprd_alloc_allow_t aa(_tasks.size() == _tasks.capacity());
+      _tasks.emplace_back(move(dat));
+    }
+    if(zs_likely(!_spares.empty())) {
+      dat = move(_spares.back());
+      _spares.pop_back();
+      _spares_bytes -= dat.mem_size();
+    }
   }
   _cond.notify_one();
 }
@@ -45,15 +70,84 @@ void sender_t::enqueue(zprn2_sdat &&dat) {
   if(dat.dests.empty())
     return;
   dat.dests.shrink_to_fit();
+  ZPRD_TRACE(sender_enqueue_zprn, dat.zprn.zprn_cmd, dat.zprn.zprn_prio, &dat.zprn.route, dat.dests.size());
 
   // move into queue
   {
+    zprd_phase_guard_t pg(ZPH_SENDER);
+    const size_t msiz = dat.mem_size();
     lock_guard<mutex> lock(_mtx);
+    if(zs_unlikely(budget && (_data_bytes + _zprn_bytes + msiz) > budget)) {
+      zprd_stats.inc(zprd_stats.budget_hits[ZMEM_ZPRN]);
+      // route deletions and connection management aren't repeated by the cleanup,
+      //  losing them would leave stale routes at the peers
+      const auto &z = dat.zprn;
+      const bool vital = (z.zprn_cmd == ZPRN_CONNMGMT)
+                      || (z.zprn_cmd == ZPRN_ROUTEMOD && z.zprn_prio == 0xff);
+      if(!vital) {
+        zprd_stats.drop(ZDROP_BUDGET);
+        return;
+      }
+    }
+    _zprn_bytes += msiz;
     _zprn_msgs.emplace_back(move(dat));
   }
   _cond.notify_one();
 }
 
+void zprn2_packer_t::add(zprn2_sdat &msg) {
+  static const auto zprn_hdrv = ([]() -> vector<char> {
+    zprn_v2hdr x_zprn;
+    zeroify(x_zprn);
+    x_zprn.zprn_ver = 2;
+    const auto h_zprn = reinterpret_cast<const char *>(&x_zprn);
+    return vector<char>(h_zprn, h_zprn + sizeof(x_zprn));
+  })();
+
+  // don't convert this earlier, as we need thy host-byte-order.type in get_needed_size
+  const size_t zmsiz = msg.zprn.get_needed_size();
+  {
+    auto &x = msg.zprn.route.type;
+    x = htons(x);
+  }
+  const char *const zmbeg = reinterpret_cast<const char *>(&msg.zprn), *const zmend = zmbeg + zmsiz;
+
+  // NOTE: split zprn packet in multiple parts if it exceeds a certain size (e.g. 1232 bytes = 35 packets in worst case),
+  //  but it is irrealistic, that this happens.
+  //  This is important because IPv6 doesn't perform fragmentation.
+  for(const auto &dest : msg.dests) {
+    auto &buffer = _bufs[dest];
+    if(buffer.empty() || zs_unlikely((buffer.back().size() + zmsiz) > 1232)) {
+      // create new buffer slot
+      buffer.emplace_back();
+      auto &bufitem = buffer.back();
+      if(msg.domain) {
+        // a peer belongs to exactly one domain, so its buffers don't mix domains
+        const zprd_domhdr h_dom = { ZDOM_MGC, 0, htons(msg.domain) };
+        const auto h_domc = reinterpret_cast<const char *>(&h_dom);
+        bufitem.assign(h_domc, h_domc + sizeof(h_dom));
+      }
+      bufitem.insert(bufitem.end(), zprn_hdrv.begin(), zprn_hdrv.end());
+    }
+    auto &bufitem = buffer.back();
+    bufitem.reserve(bufitem.size() + zmsiz);
+    bufitem.insert(bufitem.end(), zmbeg, zmend);
+  }
+}
+
+auto sender_t::get_queue_depth() -> pair<size_t, size_t> {
+  lock_guard<mutex> lock(_mtx);
+  return { _tasks.size(), _zprn_msgs.size() };
+}
+
+auto sender_t::mem_usage() -> pair<size_t, size_t> {
+  lock_guard<mutex> lock(_mtx);
+  return {
+    _data_bytes + _spares_bytes + (_tasks.capacity() + _spares.capacity()) * sizeof(send_data),
+    _zprn_bytes + _zprn_msgs.capacity() * sizeof(zprn2_sdat)
+  };
+}
+
 void sender_t::start() {
   {
     lock_guard<mutex> lock(_mtx);
@@ -75,21 +169,45 @@ void sender_t::stop() noexcept {
 
 /** file descriptors
  *
- * local_fd   = the tun device
+ * local_fds  = the tun / tap devices of the routing domains
  * server_fds = the server udp sockets
+ * uplink_fds = the udp sockets of the uplinks
  **/
-extern int local_fd;
-extern unordered_map<sa_family_t, int> server_fds;
 
 void sender_t::worker_fn() noexcept {
+  // upper bound of _spares (the packets in flight are usually less)
+  constexpr size_t max_spares = 256;
+
   // create a backup
   const auto my_server_fds = server_fds;
+  const auto my_uplink_fds = uplink_fds;
 
   unordered_set<remote_peer_ptr_t> zprn_confirmed;
   bool got_error = false, df = false;
   uint32_t tos = 0;
 
-  const auto sendto_peer = [&](const remote_peer_ptr_t &i, const vector<char> &buf) noexcept {
+  // dom_hdr: the domain header of the current data packet, if its domain isn't 0
+  zprd_domhdr dom_hdr = { ZDOM_MGC, 0, 0 };
+  struct iovec dom_iov[2] = { { &dom_hdr, sizeof(dom_hdr) }, { nullptr, 0 } };
+
+  // uplink_fd: the socket of the uplink which carries flow, the flows are distributed
+  //  over the healthy uplinks of the peer (mask) by their weights
+  const auto uplink_fd = [&my_uplink_fds](const uint8_t mask, const uint32_t flow, const int oaf) noexcept -> int {
+    unsigned total = 0;
+    for(size_t u = 0; u < my_uplink_fds.size(); ++u)
+      if(mask & (1U << u)) total += my_uplink_fds[u].weight;
+    if(!total) return -1;
+    unsigned r = flow % total;
+    for(size_t u = 0; u < my_uplink_fds.size(); ++u) {
+      if(!(mask & (1U << u))) continue;
+      const unsigned w = my_uplink_fds[u].weight;
+      if(r < w) return my_uplink_fds[u].fds[oaf];
+      r -= w;
+    }
+    return -1;
+  };
+
+  const auto sendto_peer = [&](const remote_peer_ptr_t &i, const vector<char> &buf, const bool with_dom, const uint32_t flow) noexcept {
     const auto confirmed_it = zprn_confirmed.find(i);
     const bool is_confirmed = (confirmed_it != zprn_confirmed.end());
     if(is_confirmed) zprn_confirmed.erase(confirmed_it);
@@ -98,42 +216,95 @@ void sender_t::worker_fn() noexcept {
         fprintf(stderr, "SENDER INTERNAL ERROR: destination peer is local, use count = %ld, size = %zu\n", i.use_count(), buf.size());
         return;
       }
-      const auto fdit = my_server_fds.find(o.saddr.ss_family);
-      if(zs_unlikely(fdit == my_server_fds.end())) {
+      // the only dispatch on the outer address family
+      struct sockaddr_storage sas;
+      socklen_t saslen = 0;
+      int fd = -1;
+      switch(o.saddr.family) {
+        case AF_INET:
+          fd = my_server_fds[ZOAF_INET];
+          saslen = o.saddr.to_sa<AF_INET>(sas);
+          break;
+#ifdef USE_IPV6
+        case AF_INET6:
+          fd = my_server_fds[ZOAF_INET6];
+          saslen = o.saddr.to_sa<AF_INET6>(sas);
+          break;
+#endif
+        default:
+          break;
+      }
+      if(zs_unlikely(fd < 0)) {
         fprintf(stderr, "SENDER INTERNAL ERROR: destination peer with unknown address family %u, size = %zu\n",
-          static_cast<unsigned>(o.saddr.ss_family), buf.size());
+          static_cast<unsigned>(o.saddr.family), buf.size());
         return;
       }
-      if(zs_unlikely(sendto(
-          fdit->second, buf.data(), buf.size(), is_confirmed ? MSG_CONFIRM : 0,
-          reinterpret_cast<const struct sockaddr *>(&o.saddr), sizeof(o.saddr)) < 0))
-      {
+      if(o.uplinks) {
+        // the wildcard socket is the fallback
+        const int ufd = uplink_fd(o.uplinks, flow, zprd_af2oaf(o.saddr.family));
+        if(zs_likely(ufd >= 0)) fd = ufd;
+      }
+      ssize_t ret;
+      if(zs_likely(!with_dom)) {
+        ret = sendto(fd, buf.data(), buf.size(), is_confirmed ? MSG_CONFIRM : 0,
+          reinterpret_cast<const struct sockaddr *>(&sas), saslen);
+      } else {
+        // prepend the domain header without copying the packet
+        dom_iov[1].iov_base = const_cast<char *>(buf.data());
+        dom_iov[1].iov_len = buf.size();
+        struct msghdr mh;
+        zeroify(mh);
+        mh.msg_name = &sas;
+        mh.msg_namelen = saslen;
+        mh.msg_iov = dom_iov;
+        mh.msg_iovlen = 2;
+        ret = sendmsg(fd, &mh, is_confirmed ? MSG_CONFIRM : 0);
+      }
+      if(zs_unlikely(ret < 0)) {
         perror("sendto()");
         got_error = true;
+        zprd_stats.inc(zprd_stats.tx_errors);
+      } else {
+        zprd_stats.inc(zprd_stats.tx_pkts[1]);
+        zprd_stats.inc(zprd_stats.tx_bytes[1], ret);
       }
     });
   };
 
   prctl(PR_SET_NAME, "sender", 0, 0, 0);
+  zprd_alloc_set_thread(ZALLOC_THR_SENDER);
+
+  // the sockets of an outer address family (wildcard + uplinks), TOS + DF are set on all of them
+  const auto oaf_fds = [&](const zprd_oaf_t oaf) {
+    vector<int> ret;
+    if(my_server_fds[oaf] >= 0) ret.emplace_back(my_server_fds[oaf]);
+    for(const auto &u : my_uplink_fds)
+      if(u.fds[oaf] >= 0) ret.emplace_back(u.fds[oaf]);
+    return ret;
+  };
+  const auto setsockopt_all = [](const vector<int> &fds, const int level, const int optname,
+                                 const void *const optval, const socklen_t optlen) noexcept {
+    bool ret = true;
+    for(const int fd : fds)
+      if(setsockopt(fd, level, optname, optval, optlen) < 0)
+        ret = false;
+    return ret;
+  };
 
-  const int fd_inet = my_server_fds.at(AF_INET);
+  const auto fds_inet = oaf_fds(ZOAF_INET);
 #ifdef USE_IPV6
-  const auto fdx_inet6 = ([&my_server_fds]() noexcept -> pair<bool, int> {
-    const auto it = my_server_fds.find(AF_INET6);
-    const bool x = (it != my_server_fds.end());
-    return { x, x ? it->second : 0 };
-  })();
+  const auto fds_inet6 = oaf_fds(ZOAF_INET6);
 #endif
 
   const auto set_df = [&](const bool cdf) noexcept {
     const int tmp_df = cdf
 # if defined(IP_DONTFRAG)
       ;
-    if(setsockopt(fd_inet, IPPROTO_IP, IP_DONTFRAG, &tmp_df, sizeof(tmp_df)) < 0)
+    if(!setsockopt_all(fds_inet, IPPROTO_IP, IP_DONTFRAG, &tmp_df, sizeof(tmp_df)))
       perror("SENDER WARNING: setsockopt(IP_DONTFRAG) failed");
 # elif defined(IP_MTU_DISCOVER)
       ? IP_PMTUDISC_WANT : IP_PMTUDISC_DONT;
-    if(setsockopt(fd_inet, IPPROTO_IP, IP_MTU_DISCOVER, &tmp_df, sizeof(tmp_df)) < 0)
+    if(!setsockopt_all(fds_inet, IPPROTO_IP, IP_MTU_DISCOVER, &tmp_df, sizeof(tmp_df)))
       perror("SENDER WARNING: setsockopt(IP_MTU_DISCOVER) failed");
 # else
 #  warning "set_ip_df: no method available to manage the dont-frag bit"
@@ -146,64 +317,100 @@ void sender_t::worker_fn() noexcept {
   const auto set_tos = [&](const uint32_t ctos) noexcept {
     // ignore failure of set_tos
     const uint8_t ip4_tos = tos = ctos;
-    if(setsockopt(fd_inet, IPPROTO_IP, IP_TOS, &ip4_tos, 1) < 0) {
+    if(!setsockopt_all(fds_inet, IPPROTO_IP, IP_TOS, &ip4_tos, 1)) {
       perror("SENDER WARNING: setsockopt(IP_TOS) failed");
       got_error = true;
     }
 #ifdef USE_IPV6
-    if(fdx_inet6.first && setsockopt(fdx_inet6.second, IPPROTO_IPV6, IPV6_TCLASS, &ctos, sizeof(ctos)) < 0) {
+    if(!setsockopt_all(fds_inet6, IPPROTO_IPV6, IPV6_TCLASS, &ctos, sizeof(ctos))) {
       perror("SENDER WARNING: setsockopt(IPV6_TCLASS) failed");
       got_error = true;
     }
 #endif
   };
 
-  const auto zprn_rttr = [](zprn2_sdat &i) noexcept {
-    auto &x = i.zprn.route.type;
-    x = htons(x);
-  };
-
   set_df(false);
   set_tos(0);
 
   vector<send_data> tasks;
   vector<zprn2_sdat> zprn_msgs;
-  unordered_map<remote_peer_ptr_t, vector<vector<char>>> zprn_buf;
-  const auto zprn_hdrv = ([]() -> vector<char> {
-    zprn_v2hdr x_zprn;
-    zeroify(x_zprn);
-    x_zprn.zprn_ver = 2;
-    const auto h_zprn = reinterpret_cast<const char *>(&x_zprn);
-    return vector<char>(h_zprn, h_zprn + sizeof(x_zprn));
-  })();
+  zprn2_packer_t zprn_packer;
+
+  // memory of the messages of the last round
+  size_t done_data = 0, done_zprn = 0;
 
   while(true) {
+    // release the references to the peers outside of the lock
+    for(auto &dat: tasks) {
+      done_data += dat.mem_size();
+      dat.buffer.clear();
+      dat.dests.clear();
+    }
+
     {
       unique_lock<mutex> lock(_mtx);
+      _data_bytes -= done_data;
+      _zprn_bytes -= done_zprn;
+      done_data = done_zprn = 0;
+      // recycle the sent send_data objects (keep at most max_spares)
+      for(auto &dat: tasks) {
+        if(_spares.size() >= max_spares) break;
+        _spares_bytes += dat.mem_size();
+        _spares.emplace_back(move(dat));
+      }
+      tasks.clear();
       _cond.wait(lock, [this] { return _stop || !(_tasks.empty() && _zprn_msgs.empty()); });
       if(zs_unlikely(_tasks.empty() && _zprn_msgs.empty())) return;
-      tasks = move(_tasks);
-      zprn_msgs = move(_zprn_msgs);
+      // swap, so that both vectors keep their capacity
+      tasks.swap(_tasks);
+      zprn_msgs.swap(_zprn_msgs);
     }
+    ZPRD_TRACE(sender_dequeue, tasks.size(), zprn_msgs.size());
 
     got_error = false;
 
+    const auto record_latency = [](const send_data &dat) noexcept {
+      if(dat.t_ingress)
+        zprd_stats.residence.record(zprd_now_ns() - dat.t_ingress);
+    };
+
+    if(!tasks.empty()) {
+      const uint64_t t_dequeue = zprd_now_ns();
+      for(const auto &dat: tasks)
+        zprd_stats.queue_wait.record(t_dequeue - dat.t_enqueue);
+    }
+
     // send normal data
     for(auto &dat: tasks) {
       // NOTE: it is impossible that local_ip and others are destinations together
       if(dat.dests.empty()) {
         auto buf = dat.buffer.data();
-        const auto buflen = dat.buffer.size();
+        auto buflen = dat.buffer.size();
 
-        { // update checksum if ipv4
+        if(zprd_is_l2(buf, buflen)) {
+          // TAP mode: the tap device gets the plain ethernet frame
+          buf += sizeof(struct zprd_l2hdr);
+          buflen -= sizeof(struct zprd_l2hdr);
+        } else { // update checksum if ipv4
           const auto h_ip = reinterpret_cast<struct ip*>(buf);
           if(buflen >= sizeof(struct ip) && h_ip->ip_v == 4)
             h_ip->ip_sum = IN_CKSUM(h_ip);
         }
+        int local_fd = -1;
+        for(const auto &i : local_fds)
+          if(i.domain == dat.domain) {
+            local_fd = i.fd;
+            break;
+          }
         if(zs_unlikely(write(local_fd, buf, buflen) < 0)) {
           got_error = true;
           perror("write()");
+          zprd_stats.inc(zprd_stats.tx_errors);
+        } else {
+          zprd_stats.inc(zprd_stats.tx_pkts[0]);
+          zprd_stats.inc(zprd_stats.tx_bytes[0], buflen);
         }
+        record_latency(dat);
         continue;
       }
 
@@ -215,67 +422,33 @@ void sender_t::worker_fn() noexcept {
         if(df != cdf) set_df(cdf);
       }
 
+      dom_hdr.id = htons(dat.domain);
       for(const auto &i : dat.dests)
-        sendto_peer(i, dat.buffer);
+        sendto_peer(i, dat.buffer, dat.domain != 0, dat.flow);
+      record_latency(dat);
     }
 
     if(zprn_msgs.empty()) goto flush_stdstreams;
-    tasks.clear();
 
     // setup outer Dont-Frag bit + TOS
     if(df)  set_df(false);
     if(tos) set_tos(0);
 
     // build ZPRN v2 messages for each destination
-    if(zprn_msgs.size() == 1) {
-      // skip concat part
-      vector<char> xbuf = zprn_hdrv;
-      auto &i = zprn_msgs.front();
-      if(i.confirmed) zprn_confirmed.insert(i.confirmed);
-      {
-        const size_t zmsiz = i.zprn.get_needed_size();
-        const char *const zmbeg = reinterpret_cast<const char *>(&i.zprn), *const zmend = zmbeg + zmsiz;
-        // don't set this earlier, as we need thy host-byte-order.type in get_needed_size
-        zprn_rttr(i);
-        xbuf.reserve(xbuf.size() + zmsiz);
-        xbuf.insert(xbuf.end(), zmbeg, zmend);
-      }
-      for(const auto &dest : i.dests)
-        sendto_peer(dest, xbuf);
-
-      zprn_msgs.clear();
-      goto flush_stdstreams;
-    }
-
-    // NOTE: split zprn packet in multiple parts if it exceeds a certain size (e.g. 1232 bytes = 35 packets in worst case),
-    //  but it is irrealistic, that this happens.
-    //  This is important because IPv6 doesn't perform fragmentation.
     for(auto &i : zprn_msgs) {
-      const size_t zmsiz = i.zprn.get_needed_size();
-      zprn_buf.reserve(i.dests.size());
-      zprn_rttr(i);
-      const char *const zmbeg = reinterpret_cast<const char *>(&i.zprn), *const zmend = zmbeg + zmsiz;
+      done_zprn += i.mem_size();
       if(i.confirmed) zprn_confirmed.insert(i.confirmed);
-      for(const auto &dest : i.dests) {
-        auto &buffer = zprn_buf[dest];
-        if(buffer.empty() || zs_unlikely((buffer.back().size() + zmsiz) > 1232)) {
-          // create new buffer slot
-          buffer.emplace_back(zprn_hdrv);
-        }
-        auto &bufitem = buffer.back();
-        bufitem.reserve(bufitem.size() + zmsiz);
-        bufitem.insert(bufitem.end(), zmbeg, zmend);
-      }
+      zprd_stats.inc(zprd_stats.zprn_tx_msgs, i.dests.size());
+      zprn_packer.add(i);
     }
-
     zprn_msgs.clear();
 
     // send ZPRN v2 messages
-    for(const auto &bufpd : zprn_buf)
-      for(const auto &pkt : bufpd.second)
-        sendto_peer(bufpd.first, pkt);
-
-    zprn_buf.clear();
+    zprn_packer.flush([&](const remote_peer_ptr_t &dest, const vector<char> &pkt) {
+      // the packer already prepended the domain header
+      sendto_peer(dest, pkt, false, 0);
+      zprd_stats.inc(zprd_stats.zprn_tx_pkts);
+    });
 
    flush_stdstreams:
     if(zs_unlikely(got_error)) {
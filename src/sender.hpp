@@ -7,9 +7,61 @@
 #include "remote_peer.hpp"
 #include "zprn.hpp"
 
+#include <array>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+/* outer address families with a server socket,
+ * server_fds (defined in main.cxx) is indexed by zprd_oaf_t, -1 = no socket
+ */
+enum zprd_oaf_t : unsigned char { ZOAF_INET, ZOAF_INET6, ZOAF_MAX };
+
+static inline constexpr int zprd_af2oaf(const sa_family_t af) noexcept {
+  switch(af) {
+    case AF_INET:  return ZOAF_INET;
+    case AF_INET6: return ZOAF_INET6;
+    default:       return -1;
+  }
+}
+
+extern std::array<int, ZOAF_MAX> server_fds;
+
+/* uplinks: additional sockets on the data port, bound to a local address or interface
+ * (defined in main.cxx, set before sender_t::start, see docs/UPLINKS),
+ * remote_peer_t::uplinks selects the healthy ones of each peer
+ */
+#define ZPRD_MAX_UPLINKS 8
+
+struct uplink_fd_t final {
+  std::array<int, ZOAF_MAX> fds;
+  unsigned weight;
+};
+extern std::vector<uplink_fd_t> uplink_fds;
+
+/* routing domains: the packets of a domain with ID != 0 are prefixed
+ * with a zprd_domhdr on the wire (first nibble 3, see docs/DOMAINS)
+ */
+#define ZDOM_MGC 0x30
+
+#pragma pack(push, 1)
+struct zprd_domhdr final {
+  uint8_t  mgc;
+  uint8_t  reserved;
+  uint16_t id; // network byte order
+};
+#pragma pack(pop)
+
+// the tun / tap device of each routing domain (defined in main.cxx, set before sender_t::start)
+struct local_fd_t final {
+  uint16_t domain;
+  int fd;
+};
+extern std::vector<local_fd_t> local_fds;
+
 // helper classes
 
 struct send_data final {
@@ -17,26 +69,40 @@ struct send_data final {
   std::vector<remote_peer_ptr_t> dests;
   uint32_t tos;
   uint16_t frag;
+  // routing domain ID, set by domain_sink_t
+  uint16_t domain;
+  // flow hash (pkt_meta_t::flow), the packets of a flow use the same uplink
+  uint32_t flow;
+
+  // monotonic timestamps in ns (0 = unknown), used for latency stats
+  uint64_t t_ingress, t_enqueue;
 
-  send_data() noexcept: tos(0), frag(0) { }
+  send_data() noexcept: tos(0), frag(0), domain(0), flow(0), t_ingress(0), t_enqueue(0) { }
 
   send_data(const send_data &o) = default;
 
   send_data(send_data &&o) noexcept
     : buffer(std::move(o.buffer)), dests(std::move(o.dests)),
-      tos(o.tos), frag(o.frag) { }
+      tos(o.tos), frag(o.frag), domain(o.domain), flow(o.flow), t_ingress(o.t_ingress), t_enqueue(o.t_enqueue) { }
 
   send_data(std::vector<char> &&buf, decltype(dests) &&d,
-            const uint16_t frag_ = 0, const uint32_t tos_ = 0) noexcept
-    : buffer(std::move(buf)), dests(std::move(d)), tos(tos_), frag(frag_) { }
+            const uint16_t frag_ = 0, const uint32_t tos_ = 0, const uint64_t t_ingress_ = 0) noexcept
+    : buffer(std::move(buf)), dests(std::move(d)), tos(tos_), frag(frag_), domain(0), flow(0),
+      t_ingress(t_ingress_), t_enqueue(0) { }
 
   send_data& operator=(const send_data &o) = default;
 
+  // mem_size: estimated heap usage
+  size_t mem_size() const noexcept {
+    return sizeof(send_data) + buffer.capacity() + dests.capacity() * sizeof(remote_peer_ptr_t);
+  }
+
   send_data& operator=(send_data &&o) noexcept {
     if(this != &o) {
       buffer = std::move(o.buffer);
       dests  = std::move(o.dests);
-      frag   = o.frag; tos = o.tos;
+      frag   = o.frag; tos = o.tos; domain = o.domain; flow = o.flow;
+      t_ingress = o.t_ingress; t_enqueue = o.t_enqueue;
     }
     return *this;
   }
@@ -46,10 +112,12 @@ struct zprn2_sdat {
   zprn_v2 zprn;
   std::vector<remote_peer_ptr_t> dests;
   remote_peer_ptr_t confirmed;
+  // routing domain ID, set by domain_sink_t
+  uint16_t domain = 0;
 
   zprn2_sdat(const zprn2_sdat &o) = default;
   zprn2_sdat(zprn2_sdat &&o) noexcept
-    : zprn(o.zprn), dests(std::move(o.dests)) { }
+    : zprn(o.zprn), dests(std::move(o.dests)), domain(o.domain) { }
 
   zprn2_sdat(const zprn_v2 &zprn_, decltype(dests) &&d) noexcept
     : zprn(zprn_), dests(std::move(d)) { }
@@ -59,22 +127,60 @@ struct zprn2_sdat {
 
   zprn2_sdat& operator=(const zprn2_sdat &o) = default;
 
+  size_t mem_size() const noexcept
+    { return sizeof(zprn2_sdat) + dests.capacity() * sizeof(remote_peer_ptr_t); }
+
   zprn2_sdat& operator=(zprn2_sdat &&o) noexcept {
     if(this != &o) {
       zprn  = o.zprn;
       dests = std::move(o.dests);
       confirmed = std::move(o.confirmed);
+      domain = o.domain;
     }
     return *this;
   }
 };
 
+// zprn2_packer_t: packs ZPRN v2 messages into packets for each destination
+class zprn2_packer_t final {
+  std::unordered_map<remote_peer_ptr_t, std::vector<std::vector<char>>> _bufs;
+
+ public:
+  // add: NOTE: converts msg.zprn to network byte order
+  void add(zprn2_sdat &msg);
+
+  // flush: calls fn(dest, packet) for each packet
+  template<typename Fn>
+  void flush(const Fn &fn) {
+    for(const auto &bufpd : _bufs)
+      for(const auto &pkt : bufpd.second)
+        fn(bufpd.first, pkt);
+    _bufs.clear();
+  }
+};
+
+// packet_sink_t: receives the packets produced by router_t
+class packet_sink_t {
+ public:
+  virtual ~packet_sink_t() = default;
+  // enqueue: takes the contents of dat, and may leave a recycled
+  //  (empty, but still allocated) send_data in it
+  virtual void enqueue(send_data &&dat) = 0;
+  virtual void enqueue(zprn2_sdat &&dat) = 0;
+};
+
 // main sender class
 
-class sender_t final {
+class sender_t final : public packet_sink_t {
   std::vector<send_data> _tasks;
   std::vector<zprn2_sdat> _zprn_msgs;
 
+  // sent send_data objects, handed back to the router to avoid allocations
+  std::vector<send_data> _spares;
+
+  // memory accounting (queued + currently sent messages), see mem_usage
+  size_t _data_bytes = 0, _zprn_bytes = 0, _spares_bytes = 0;
+
   // sync
   std::mutex _mtx;
   std::condition_variable _cond;
@@ -85,8 +191,39 @@ class sender_t final {
  public:
   ~sender_t() noexcept { stop(); }
 
-  void enqueue(send_data &&dat);
-  void enqueue(zprn2_sdat &&dat);
+  void enqueue(send_data &&dat) override;
+  void enqueue(zprn2_sdat &&dat) override;
+
+  // memory budget for queued data + ZPRN messages in bytes (0 = unlimited),
+  //  messages are dropped while it is exceeded; must be set before start()
+  size_t budget = 0;
+
+  // get_queue_depth: returns the count of queued { data, ZPRN } messages
+  auto get_queue_depth() -> std::pair<size_t, size_t>;
+
+  // mem_usage: returns the estimated heap usage of the { data, ZPRN } queues
+  auto mem_usage() -> std::pair<size_t, size_t>;
+
   void start();
   void stop() noexcept;
 };
+
+// domain_sink_t: tags the packets of one routing domain and passes them to the shared sender
+class domain_sink_t final : public packet_sink_t {
+  packet_sink_t &_sink;
+  const uint16_t _domain;
+
+ public:
+  domain_sink_t(packet_sink_t &sink, const uint16_t domain) noexcept
+    : _sink(sink), _domain(domain) { }
+
+  void enqueue(send_data &&dat) override {
+    dat.domain = _domain;
+    _sink.enqueue(std::move(dat));
+  }
+
+  void enqueue(zprn2_sdat &&dat) override {
+    dat.domain = _domain;
+    _sink.enqueue(std::move(dat));
+  }
+};
@@ -0,0 +1,328 @@
+/**
+ * zprd / shm.cxx - shared memory packet interface for local applications (server side)
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "shm.hpp"
+#include "crest.h"
+#include "router.hpp"
+#include "stats.hpp"
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <zs/ll/memut.hpp>
+
+using namespace std;
+
+bool shm_server_t::listen(const string &path) {
+  struct sockaddr_un sun;
+  zeroify(sun);
+  if(path.size() >= sizeof(sun.sun_path)) {
+    fprintf(stderr, "STARTUP ERROR: socket path too long: %s\n", path.c_str());
+    return false;
+  }
+
+  _listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(_listen_fd < 0) {
+    perror("STARTUP ERROR: socket(AF_UNIX)");
+    return false;
+  }
+
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path.c_str());
+  unlink(path.c_str());
+
+  if(::bind(_listen_fd, reinterpret_cast<struct sockaddr*>(&sun), sizeof(sun)) < 0 || ::listen(_listen_fd, 4) < 0) {
+    fprintf(stderr, "STARTUP ERROR: bind/listen(%s) failed: %s\n", path.c_str(), strerror(errno));
+    close(_listen_fd);
+    _listen_fd = -1;
+    return false;
+  }
+  _path = path;
+  return true;
+}
+
+bool shm_server_t::epoll_add(const int fd, const uint32_t tag) noexcept {
+  struct epoll_event epevent;
+  zeroify(epevent);
+  epevent.events = EPOLLIN;
+  epevent.data.u64 = (static_cast<uint64_t>(ZSHM_EV | tag) << 32) | static_cast<uint32_t>(fd);
+  if(epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &epevent)) {
+    perror("SHM ERROR: epoll_ctl(ADD)");
+    return false;
+  }
+  return true;
+}
+
+bool shm_server_t::start(const int epoll_fd, find_router_t find_router) {
+  _epoll_fd = epoll_fd;
+  _find_router = move(find_router);
+  return _listen_fd < 0 || epoll_add(_listen_fd, ZSHM_EV_LISTEN);
+}
+
+void shm_server_t::stop() noexcept {
+  for(size_t i = 0; i < ZSHM_MAX_CLIENTS; ++i)
+    detach(i);
+  if(_listen_fd >= 0) {
+    close(_listen_fd);
+    _listen_fd = -1;
+    unlink(_path.c_str());
+  }
+}
+
+[[gnu::cold]]
+void shm_server_t::handle_event(const uint32_t tag) {
+  const uint32_t slot = tag & ZSHM_EV_LISTEN;
+  if(slot != ZSHM_EV_LISTEN) {
+    attach(slot);
+    return;
+  }
+
+  const int cfd = accept4(_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if(cfd < 0) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK)
+      perror("SHM ERROR: accept()");
+    return;
+  }
+  for(size_t i = 0; i < ZSHM_MAX_CLIENTS; ++i) {
+    auto &c = _clients[i];
+    if(c.conn_fd >= 0) continue;
+    c.conn_fd = cfd;
+    if(!epoll_add(cfd, i)) {
+      close(cfd);
+      c.conn_fd = -1;
+    }
+    return;
+  }
+  fprintf(stderr, "SHM ERROR: too many clients (max %u)\n", static_cast<unsigned>(ZSHM_MAX_CLIENTS));
+  close(cfd);
+}
+
+// attach: reads the attach request of the client in slot, or detaches it if it closed the connection
+[[gnu::cold]]
+void shm_server_t::attach(const size_t slot) {
+  auto &c = _clients[slot];
+  zprd_shm_req_t req;
+  const ssize_t n = recv(c.conn_fd, &req, sizeof(req), 0);
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if(n <= 0 || c.area) {
+    // connection closed (or a protocol violation after the attach)
+    detach(slot);
+    return;
+  }
+
+  zprd_shm_resp_t resp;
+  resp.magic = ZSHM_MAGIC;
+  resp.error = 0;
+
+  if(n != sizeof(req) || req.magic != ZSHM_MAGIC || req.version != ZSHM_VERSION) {
+    resp.error = EPROTO;
+  } else {
+    if(req.af == AF_INET) {
+      uint32_t a4;
+      memcpy(&a4, req.addr, sizeof(a4));
+      c.addr = inner_addr_t(a4);
+    } else if(req.af == AF_INET6) {
+      in6_addr a6;
+      memcpy(&a6, req.addr, sizeof(a6));
+      c.addr = inner_addr_t(a6);
+    } else {
+      resp.error = EAFNOSUPPORT;
+    }
+    c.domain = req.domain;
+    c.router = _find_router(req.domain);
+  }
+
+  // the claimed address has to be a local or exported address of a TUN domain
+  if(resp.error) {
+    // nothing
+  } else if(!c.router || c.router->tap) {
+    resp.error = ENODEV;
+  } else if(!c.router->am_ii_addr(c.addr)) {
+    resp.error = EADDRNOTAVAIL;
+  } else {
+    for(const auto &i : _clients)
+      if(i.area && i.domain == c.domain && i.addr == c.addr) {
+        resp.error = EADDRINUSE;
+        break;
+      }
+  }
+
+  int shm_fd = -1;
+  if(!resp.error) {
+    shm_fd = memfd_create("zprd-shm", MFD_CLOEXEC);
+    void *p = MAP_FAILED;
+    if(shm_fd < 0 || ftruncate(shm_fd, sizeof(zprd_shm_area_t)) < 0
+       || (p = mmap(nullptr, sizeof(zprd_shm_area_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0)) == MAP_FAILED
+       || (c.tx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+       || (c.rx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+      resp.error = errno;
+      perror("SHM ERROR: can't setup shared memory");
+    }
+    if(p != MAP_FAILED) {
+      // the memfd is zero-initialized, zprd sleeps until the client wakes it up
+      c.area = static_cast<zprd_shm_area_t*>(p);
+      ++_attached;
+      c.area->magic = ZSHM_MAGIC;
+      c.area->version = ZSHM_VERSION;
+      c.area->tx.waiting.store(1);
+    }
+  }
+
+  struct iovec iov = { &resp, sizeof(resp) };
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } cbuf;
+  struct msghdr msg;
+  zeroify(msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if(!resp.error) {
+    const int fds[3] = { shm_fd, c.tx_efd, c.rx_efd };
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof(cbuf.buf);
+    struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  }
+  if(sendmsg(c.conn_fd, &msg, MSG_NOSIGNAL) != sizeof(resp) && !resp.error) {
+    resp.error = errno;
+    perror("SHM ERROR: sendmsg()");
+  }
+  // the mapping stays valid without the memfd
+  if(shm_fd >= 0) close(shm_fd);
+
+  if(resp.error || !epoll_add(c.tx_efd, ZSHM_EV_DATA | slot)) {
+    fprintf(stderr, "SHM ERROR: attach refused (%s)\n", strerror(resp.error));
+    detach(slot);
+    return;
+  }
+  const auto addrdesc = c.addr.to_string();
+  printf("SHM: client attached to %s (domain %u)\n", addrdesc.c_str(), static_cast<unsigned>(c.domain));
+}
+
+void shm_server_t::detach(const size_t slot) noexcept {
+  auto &c = _clients[slot];
+  if(c.area) {
+    --_attached;
+    munmap(c.area, sizeof(zprd_shm_area_t));
+    c.area = nullptr;
+    printf("SHM: client detached (domain %u)\n", static_cast<unsigned>(c.domain));
+  }
+  // the eventfds are shared with the client, remove them from the epoll set explicitly
+  for(int *i : { &c.tx_efd, &c.rx_efd, &c.conn_fd })
+    if(*i >= 0) {
+      epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, *i, nullptr);
+      close(*i);
+      *i = -1;
+    }
+  c.router = nullptr;
+}
+
+// pkt_dest: get the destination address of an IP packet
+static bool pkt_dest(const char *const buf, const size_t buflen, inner_addr_t &dest) noexcept {
+  if(buflen >= sizeof(struct ip) && (static_cast<uint8_t>(buf[0]) >> 4) == 4)
+    dest = inner_addr_t(reinterpret_cast<const struct ip*>(buf)->ip_dst.s_addr);
+  else if(buflen >= sizeof(struct ip6_hdr) && (static_cast<uint8_t>(buf[0]) >> 4) == 6)
+    dest = inner_addr_t(reinterpret_cast<const struct ip6_hdr*>(buf)->ip6_dst);
+  else
+    return false;
+  return true;
+}
+
+bool shm_server_t::src_ok(const client_t &c, const char *const buf, const uint16_t len) noexcept {
+  inner_addr_t src;
+  if(len >= sizeof(struct ip) && (static_cast<uint8_t>(buf[0]) >> 4) == 4)
+    src = inner_addr_t(reinterpret_cast<const struct ip*>(buf)->ip_src.s_addr);
+  else if(len >= sizeof(struct ip6_hdr) && (static_cast<uint8_t>(buf[0]) >> 4) == 6)
+    src = inner_addr_t(reinterpret_cast<const struct ip6_hdr*>(buf)->ip6_src);
+  else {
+    zprd_stats.drop(ZDROP_INVALID);
+    return false;
+  }
+  // a client may only send with the address it claimed
+  if(zs_unlikely(src != c.addr)) {
+    zprd_stats.drop(ZDROP_INVALID);
+    return false;
+  }
+  return true;
+}
+
+auto shm_server_t::find_client(const uint16_t domain, const inner_addr_t &dest) noexcept -> client_t* {
+  for(auto &c : _clients)
+    if(c.area && c.domain == domain && c.addr == dest)
+      return &c;
+  return nullptr;
+}
+
+void shm_server_t::push(client_t &c, char *const buf, const size_t buflen) noexcept {
+  if(reinterpret_cast<const struct ip*>(buf)->ip_v == 4) {
+    // like the sender does before writing to the tun device
+    const auto h_ip = reinterpret_cast<struct ip*>(buf);
+    h_ip->ip_sum = IN_CKSUM(h_ip);
+  }
+  auto &rx = c.area->rx;
+  if(zs_unlikely(!rx.push(buf, buflen))) {
+    zprd_stats.drop(ZDROP_SHMFULL);
+    return;
+  }
+  zprd_stats.inc(zprd_stats.tx_pkts[0]);
+  zprd_stats.inc(zprd_stats.tx_bytes[0], buflen);
+  if(rx.need_wakeup())
+    eventfd_write(c.rx_efd, 1);
+}
+
+[[gnu::hot]]
+bool shm_server_t::deliver(const uint16_t domain, char *const buf, const size_t buflen) noexcept {
+  inner_addr_t dest;
+  if(!pkt_dest(buf, buflen, dest))
+    return false;
+  client_t *const c = find_client(domain, dest);
+  if(c) push(*c, buf, buflen);
+  return c;
+}
+
+[[gnu::hot]]
+bool shm_server_t::deliver_local(const client_t &src, char *const buf, const uint16_t len) noexcept {
+  inner_addr_t dest;
+  if(!pkt_dest(buf, len, dest))
+    return false;
+
+  client_t *const c = find_client(src.domain, dest);
+  if(!c && !src.router->am_ii_addr(dest, false))
+    return false;
+
+  zprd_stats.inc(zprd_stats.rx_pkts[0]);
+  zprd_stats.inc(zprd_stats.rx_bytes[0], len);
+  if(c) {
+    push(*c, buf, len);
+    return true;
+  }
+
+  // the router never sends packets from the tun device back to it, write it directly
+  //  (the packet comes from the client, its IPv4 header checksum is already valid)
+  for(const auto &i : local_fds)
+    if(i.domain == src.domain) {
+      if(zs_unlikely(write(i.fd, buf, len) < 0)) {
+        perror("SHM ERROR: write()");
+        zprd_stats.inc(zprd_stats.tx_errors);
+      } else {
+        zprd_stats.inc(zprd_stats.tx_pkts[0]);
+        zprd_stats.inc(zprd_stats.tx_bytes[0], len);
+      }
+      break;
+    }
+  return true;
+}
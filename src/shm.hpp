@@ -0,0 +1,141 @@
+/**
+ * zprd / shm.hpp - shared memory packet interface for local applications (server side)
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include <config.h>
+#include <sys/eventfd.h>
+#include "iAFa.hpp"
+#include "sender.hpp"
+#include "zprd_shm.hpp"
+#include <functional>
+#include <string>
+#include <vector>
+
+class router_t;
+
+/* epoll tags (upper 32 bits of the epoll data, see main.cxx):
+ *  ZSHM_EV | slot             : connection of the client in slot
+ *  ZSHM_EV | ZSHM_EV_DATA | slot : tx eventfd of the client in slot
+ *  ZSHM_EV | ZSHM_EV_LISTEN   : listening socket
+ */
+#define ZSHM_EV        0x80000000U
+#define ZSHM_EV_DATA   0x40000000U
+#define ZSHM_EV_LISTEN 0x0000ffffU
+#define ZSHM_MAX_CLIENTS 16
+
+/* shm_server_t: accepts local applications (see zprd_shm.hpp),
+ * runs in the forwarding thread (all fds are part of the main epoll set)
+ */
+class shm_server_t final {
+ public:
+  // find_router: returns the router of a domain, nullptr if it doesn't exist
+  typedef std::function<router_t* (uint16_t domain)> find_router_t;
+
+ private:
+  struct client_t final {
+    int conn_fd = -1, tx_efd = -1, rx_efd = -1;
+    uint16_t domain = 0;
+    inner_addr_t addr;
+    router_t *router = nullptr;
+    zprd_shm_area_t *area = nullptr;
+  };
+
+  std::string _path;
+  int _listen_fd = -1, _epoll_fd = -1;
+  client_t _clients[ZSHM_MAX_CLIENTS];
+  size_t _attached = 0;
+  find_router_t _find_router;
+
+  bool epoll_add(int fd, uint32_t tag) noexcept;
+  void attach(size_t slot);
+  void detach(size_t slot) noexcept;
+  client_t *find_client(uint16_t domain, const inner_addr_t &dest) noexcept;
+  void push(client_t &c, char *buf, size_t buflen) noexcept;
+  // src_ok: checks that a packet of c has the claimed address as source, counts a drop otherwise
+  static bool src_ok(const client_t &c, const char *buf, uint16_t len) noexcept;
+  // deliver_local: handles packets of src to local addresses of its domain, returns false for other packets
+  bool deliver_local(const client_t &src, char *buf, uint16_t len) noexcept;
+
+ public:
+  ~shm_server_t() noexcept { stop(); }
+
+  // listen: binds the socket, should be called before privileges are dropped
+  bool listen(const std::string &path);
+  // start: adds the listening socket to the main epoll set
+  bool start(int epoll_fd, find_router_t find_router);
+  void stop() noexcept;
+
+  size_t attached() const noexcept { return _attached; }
+
+  // handle_event: accept, attach + detach of clients (tag without ZSHM_EV_DATA)
+  void handle_event(uint32_t tag);
+
+  /* receive: copies the packets of the client in slot (tag with ZSHM_EV_DATA)
+   *   into buf and calls fn(router, buf, len) for each one which isn't
+   *   destined to a local address (those are delivered directly)
+   * NOTE: at most ZSHM_SLOTS packets per call, the other ones are handled
+   *   in the next main loop iteration
+   */
+  template<typename Fn>
+  void receive(uint32_t tag, char *buf, const Fn &fn);
+
+  /* deliver: puts a packet into the rx ring of the client which claimed
+   *   the destination address (packets from peers or the tun device)
+   * @ret true if the packet was consumed (delivered or dropped because the ring is full)
+   */
+  bool deliver(uint16_t domain, char *buf, size_t buflen) noexcept;
+};
+
+template<typename Fn>
+void shm_server_t::receive(const uint32_t tag, char *const buf, const Fn &fn) {
+  auto &c = _clients[tag & ZSHM_EV_LISTEN];
+  if(zs_unlikely(!c.area)) return;
+  eventfd_t val;
+  eventfd_read(c.tx_efd, &val);
+
+  auto &tx = c.area->tx;
+  for(size_t n = 0; n < ZSHM_SLOTS; ++n) {
+    const zprd_shm_slot_t *const s = tx.front();
+    if(!s) {
+      // sleep until the client wakes us up
+      if(tx.prepare_wait()) return;
+      continue;
+    }
+    const uint32_t len = s->len;
+    if(zs_likely(len && len <= ZSHM_MTU)) {
+      memcpy(buf, s->data, len);
+      tx.pop();
+      if(zs_unlikely(!src_ok(c, buf, static_cast<uint16_t>(len))))
+        continue;
+      if(!deliver_local(c, buf, static_cast<uint16_t>(len)))
+        fn(*c.router, buf, static_cast<uint16_t>(len));
+    } else {
+      tx.pop();
+    }
+  }
+  // more packets are pending, poll again
+  eventfd_write(c.tx_efd, 1);
+}
+
+// shm_sink_t: delivers local packets of a domain to attached clients, passes everything else on
+class shm_sink_t final : public packet_sink_t {
+  packet_sink_t &_sink;
+  shm_server_t &_shm;
+  const uint16_t _domain;
+
+ public:
+  shm_sink_t(packet_sink_t &sink, shm_server_t &shm, const uint16_t domain) noexcept
+    : _sink(sink), _shm(shm), _domain(domain) { }
+
+  void enqueue(send_data &&dat) override {
+    // the sender never mixes local and remote destinations
+    if(zs_unlikely(_shm.attached()) && !dat.dests.empty() && dat.dests.front()->is_local()
+       && _shm.deliver(_domain, dat.buffer.data(), dat.buffer.size()))
+      return;
+    _sink.enqueue(std::move(dat));
+  }
+
+  void enqueue(zprn2_sdat &&dat) override { _sink.enqueue(std::move(dat)); }
+};
@@ -0,0 +1,139 @@
+/**
+ * zprd / shm_client.cxx - client side of the shared memory packet interface (libzprdshm)
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "zprd_shm.hpp"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+int zprd_shm_client_t::attach(const string &sock_path, const string &addr, const uint16_t domain) {
+  detach();
+
+  zprd_shm_req_t req;
+  memset(&req, 0, sizeof(req));
+  req.magic = ZSHM_MAGIC;
+  req.version = ZSHM_VERSION;
+  req.domain = domain;
+  if(inet_pton(AF_INET, addr.c_str(), req.addr) == 1)
+    req.af = AF_INET;
+  else if(inet_pton(AF_INET6, addr.c_str(), req.addr) == 1)
+    req.af = AF_INET6;
+  else
+    return EINVAL;
+
+  struct sockaddr_un sun;
+  memset(&sun, 0, sizeof(sun));
+  if(sock_path.size() >= sizeof(sun.sun_path))
+    return ENAMETOOLONG;
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, sock_path.c_str());
+
+  _sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if(_sock < 0)
+    return errno;
+  if(connect(_sock, reinterpret_cast<struct sockaddr*>(&sun), sizeof(sun)) < 0
+     || ::send(_sock, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+    const int ret = errno;
+    detach();
+    return ret;
+  }
+
+  // the response carries the fds
+  zprd_shm_resp_t resp;
+  struct iovec iov = { &resp, sizeof(resp) };
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } cbuf;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf.buf;
+  msg.msg_controllen = sizeof(cbuf.buf);
+
+  const ssize_t n = recvmsg(_sock, &msg, MSG_CMSG_CLOEXEC);
+  const struct cmsghdr *const cmsg = (n > 0) ? CMSG_FIRSTHDR(&msg) : nullptr;
+  if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+     && cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int))) {
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    _shm_fd = fds[0]; _tx_efd = fds[1]; _rx_efd = fds[2];
+  }
+
+  int ret = 0;
+  if(n != sizeof(resp) || resp.magic != ZSHM_MAGIC)
+    ret = EPROTO;
+  else if(resp.error)
+    ret = resp.error;
+  else if(_shm_fd < 0)
+    ret = EPROTO;
+
+  if(!ret) {
+    void *const p = mmap(nullptr, sizeof(zprd_shm_area_t), PROT_READ | PROT_WRITE, MAP_SHARED, _shm_fd, 0);
+    if(p == MAP_FAILED) {
+      ret = errno;
+    } else {
+      _area = static_cast<zprd_shm_area_t*>(p);
+      if(_area->magic != ZSHM_MAGIC || _area->version != ZSHM_VERSION)
+        ret = EPROTO;
+    }
+  }
+
+  if(ret) detach();
+  return ret;
+}
+
+void zprd_shm_client_t::detach() noexcept {
+  if(_area) {
+    munmap(_area, sizeof(zprd_shm_area_t));
+    _area = nullptr;
+  }
+  // closing the socket detaches us from zprd
+  for(int *i : { &_rx_efd, &_tx_efd, &_shm_fd, &_sock })
+    if(*i >= 0) {
+      close(*i);
+      *i = -1;
+    }
+}
+
+bool zprd_shm_client_t::send(const void *const pkt, const size_t len) noexcept {
+  if(len > ZSHM_MTU || !_area->tx.push(pkt, len))
+    return false;
+  if(_area->tx.need_wakeup())
+    eventfd_write(_tx_efd, 1);
+  return true;
+}
+
+size_t zprd_shm_client_t::recv(void *const buf, const size_t buflen) noexcept {
+  auto &rx = _area->rx;
+  const zprd_shm_slot_t *const s = rx.front();
+  if(!s) return 0;
+  const size_t len = s->len;
+  memcpy(buf, s->data, (len < buflen) ? len : buflen);
+  rx.pop();
+  return len;
+}
+
+bool zprd_shm_client_t::wait(const int timeout_ms) noexcept {
+  if(!_area->rx.prepare_wait())
+    return true;
+  struct pollfd pfd = { _rx_efd, POLLIN, 0 };
+  if(poll(&pfd, 1, timeout_ms) <= 0) {
+    // zprd may still write to the eventfd, that only causes a spurious wakeup later
+    return _area->rx.front();
+  }
+  eventfd_t val;
+  eventfd_read(_rx_efd, &val);
+  return true;
+}
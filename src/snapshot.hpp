@@ -0,0 +1,81 @@
+/**
+ * zprd / snapshot.hpp - immutable copy of the routing state
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include "iAFa.hpp"
+#include "oAFa.hpp"
+#include "stats.hpp"
+#include <time.h>       // time_t
+#include <memory>
+#include <string>
+#include <vector>
+
+/* A snapshot is built by the forwarding thread and never modified afterwards,
+ * so it can be shared with (and formatted by) other threads without locking.
+ * It only contains raw data, formatting is done by the consumer.
+ * With several routing domains, the snapshots of all routers are merged.
+ */
+struct zprd_snapshot_t final {
+  struct peer_t final {
+    uint16_t domain;
+    outer_addr_t saddr;
+    time_t seen;
+    std::string cfgent;
+  };
+
+  struct router_t final {
+    outer_addr_t saddr; // family == AF_UNSPEC -> local
+    time_t  seen;
+    double  latency;
+    uint8_t hops;
+  };
+
+  struct route_t final {
+    uint16_t domain;
+    inner_addr_t dest;
+    std::vector<router_t> routers;
+  };
+
+  struct member_t final {
+    inner_addr_t receiver;
+    time_t seen;
+  };
+
+  // multicast group, local = receivers on our tun device
+  struct group_t final {
+    uint16_t domain;
+    inner_addr_t group;
+    bool local;
+    std::vector<member_t> members;
+  };
+
+  /* the tables are only rebuilt after the routing state changed (or a cleanup ran),
+   * consecutive snapshots share them
+   */
+  struct tables_t final {
+    std::vector<peer_t>  peers;
+    std::vector<route_t> routes;
+    std::vector<group_t> groups;
+  };
+
+  time_t   taken;
+  uint64_t generation;
+  std::shared_ptr<const tables_t> tables;
+  // TAP mode: count of learned MAC addresses
+  size_t macs;
+  // count of routing domains, the entries above are tagged with their domain
+  size_t domains;
+  // count of attached shared memory clients
+  size_t shm_clients;
+  zprd_stats_snap_t    stats;
+
+  // sender queue depth at the time of the snapshot
+  size_t sender_tasks, sender_zprn_msgs;
+
+  // estimated memory usage and budgets (0 = unlimited) in bytes
+  size_t mem[ZMEM_MAX], mem_budget[ZMEM_MAX];
+};
+
+typedef std::shared_ptr<const zprd_snapshot_t> zprd_snapshot_ptr_t;
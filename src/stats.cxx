@@ -0,0 +1,111 @@
+/**
+ * zprd / stats.cxx
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "stats.hpp"
+
+zprd_stats_t zprd_stats;
+
+const char *zprd_drop_reason2str(const zprd_drop_reason_t r) noexcept {
+  switch(r) {
+    case ZDROP_INVALID: return "invalid";
+    case ZDROP_TTL:     return "ttl";
+    case ZDROP_LOOP:    return "loop";
+    case ZDROP_NOROUTE: return "noroute";
+    case ZDROP_BLOCKED: return "blocked";
+    case ZDROP_MCAST:   return "multicast";
+    case ZDROP_DUP:     return "duplicate";
+    case ZDROP_ICMPERR: return "icmperr";
+    case ZDROP_BUDGET:  return "budget";
+    case ZDROP_FLOODLIMIT: return "floodlimit";
+    case ZDROP_SHMFULL: return "shmfull";
+    default:            return "unknown";
+  }
+}
+
+const char *zprd_phase2str(const zprd_phase_t p) noexcept {
+  switch(p) {
+    case ZPH_IDLE:    return "idle";
+    case ZPH_RECV:    return "recv";
+    case ZPH_ROUTE:   return "route";
+    case ZPH_ZPRN:    return "zprn";
+    case ZPH_SENDER:  return "sender";
+    case ZPH_CONTROL: return "control";
+    case ZPH_CLEANUP: return "cleanup";
+    case ZPH_DNS:     return "dns";
+    case ZPH_HOOKS:   return "hooks";
+    case ZPH_FLUSH:   return "flush";
+    case ZPH_PATHS:   return "paths";
+    default:          return "unknown";
+  }
+}
+
+const char *zprd_mem2str(const zprd_mem_t m) noexcept {
+  switch(m) {
+    case ZMEM_ROUTES: return "routes";
+    case ZMEM_PEERS:  return "peers";
+    case ZMEM_SENDER: return "sender";
+    case ZMEM_ZPRN:   return "zprn";
+    case ZMEM_CACHES: return "caches";
+    default:          return "unknown";
+  }
+}
+
+const char *zprd_alloc_slot2str(const zprd_alloc_slot_t s) noexcept {
+  switch(s) {
+    case ZALLOC_SENDER: return "sender_thread";
+    case ZALLOC_OTHER:  return "other_threads";
+    default:
+      return (static_cast<unsigned>(s) < ZPH_MAX) ? zprd_phase2str(static_cast<zprd_phase_t>(s)) : "unknown";
+  }
+}
+
+zprd_stats_t::zprd_stats_t() noexcept {
+  for(auto &i : rx_pkts)  i = 0;
+  for(auto &i : rx_bytes) i = 0;
+  for(auto &i : tx_pkts)  i = 0;
+  for(auto &i : tx_bytes) i = 0;
+  for(auto &i : drops)    i = 0;
+  for(auto &i : stall_phases) i = 0;
+  for(auto &i : budget_hits)  i = 0;
+  // NOTE: allocs + alloc_bytes aren't reset, operator new may have been called before
+  tx_errors = zprn_rx_msgs = zprn_tx_msgs = zprn_tx_pkts = stalls = route_evictions = igmp_msgs = icmp_ratelimited = path_switches = uplink_failovers = 0;
+}
+
+auto zprd_stats_t::snapshot() const noexcept -> zprd_stats_snap_t {
+  constexpr auto mo = std::memory_order_relaxed;
+  zprd_stats_snap_t ret;
+  for(size_t i = 0; i < 2; ++i) {
+    ret.rx_pkts[i]  = rx_pkts[i].load(mo);
+    ret.rx_bytes[i] = rx_bytes[i].load(mo);
+    ret.tx_pkts[i]  = tx_pkts[i].load(mo);
+    ret.tx_bytes[i] = tx_bytes[i].load(mo);
+  }
+  ret.tx_errors    = tx_errors.load(mo);
+  ret.zprn_rx_msgs = zprn_rx_msgs.load(mo);
+  ret.zprn_tx_msgs = zprn_tx_msgs.load(mo);
+  ret.zprn_tx_pkts = zprn_tx_pkts.load(mo);
+  for(size_t i = 0; i < ZDROP_MAX; ++i)
+    ret.drops[i] = drops[i].load(mo);
+  ret.fwd_time   = fwd_time.snapshot();
+  ret.queue_wait = queue_wait.snapshot();
+  ret.residence  = residence.snapshot();
+  ret.stalls     = stalls.load(mo);
+  for(size_t i = 0; i < ZPH_MAX; ++i)
+    ret.stall_phases[i] = stall_phases[i].load(mo);
+  ret.stall_time = stall_time.snapshot();
+  for(size_t i = 0; i < ZALLOC_MAX; ++i) {
+    ret.allocs[i]      = allocs[i].load(mo);
+    ret.alloc_bytes[i] = alloc_bytes[i].load(mo);
+  }
+  for(size_t i = 0; i < ZMEM_MAX; ++i)
+    ret.budget_hits[i] = budget_hits[i].load(mo);
+  ret.route_evictions = route_evictions.load(mo);
+  ret.igmp_msgs       = igmp_msgs.load(mo);
+  ret.icmp_ratelimited = icmp_ratelimited.load(mo);
+  ret.path_switches   = path_switches.load(mo);
+  ret.uplink_failovers = uplink_failovers.load(mo);
+  return ret;
+}
@@ -0,0 +1,147 @@
+/**
+ * zprd / stats.hpp - runtime counters
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include "histogram.hpp"
+#include "trace.hpp"
+#include <inttypes.h>
+#include <atomic>
+
+// reasons why a packet was dropped
+enum zprd_drop_reason_t {
+  ZDROP_INVALID, // malformed / truncated packet
+  ZDROP_TTL,     // ttl / hop limit exceeded
+  ZDROP_LOOP,    // looped packet with local as source
+  ZDROP_NOROUTE, // no destination available
+  ZDROP_BLOCKED, // blocked broadcast destination
+  ZDROP_MCAST,   // multicast without receivers / link-local
+  ZDROP_DUP,     // copy of a recently flooded packet (broadcast, no route)
+  ZDROP_ICMPERR, // filtered icmp error message
+  ZDROP_BUDGET,  // memory budget exceeded (sender queue full, new peer refused)
+  ZDROP_FLOODLIMIT, // TAP mode: flood rate limit of the local tap device exceeded
+  ZDROP_SHMFULL, // receive ring of a shared memory client full
+  ZDROP_MAX
+};
+
+const char *zprd_drop_reason2str(zprd_drop_reason_t r) noexcept;
+
+// main loop phases, see watchdog.hpp
+enum zprd_phase_t {
+  ZPH_IDLE,    // waiting in epoll_wait
+  ZPH_RECV,    // reading packets
+  ZPH_ROUTE,   // routing a packet
+  ZPH_ZPRN,    // handling ZPRN messages
+  ZPH_SENDER,  // waiting for the sender queue
+  ZPH_CONTROL, // building a snapshot
+  ZPH_CLEANUP, // periodic peer + route cleanup
+  ZPH_DNS,     // resolving peer hostnames
+  ZPH_HOOKS,   // running route hooks
+  ZPH_FLUSH,   // flushing the log output
+  ZPH_PATHS,   // probing the outer paths of peers
+  ZPH_MAX
+};
+
+const char *zprd_phase2str(zprd_phase_t p) noexcept;
+
+// memory accounting (estimated heap usage), see router_t::mem_usage, sender_t::mem_usage
+enum zprd_mem_t {
+  ZMEM_ROUTES, // routing table (hash nodes + via router lists)
+  ZMEM_PEERS,  // remotes (incl. their shared_mutex + control blocks)
+  ZMEM_SENDER, // queued data packets + recycled send_data
+  ZMEM_ZPRN,   // queued ZPRN messages
+  ZMEM_CACHES, // local/exported addresses, blocked broadcasts, ping cache
+  ZMEM_MAX
+};
+
+const char *zprd_mem2str(zprd_mem_t m) noexcept;
+
+// heap allocation accounting slots (USE_ALLOC_STATS), see alloc_stats.hpp
+//  [0, ZPH_MAX) = main loop phase of the forwarding thread
+enum zprd_alloc_slot_t {
+  ZALLOC_SENDER = ZPH_MAX, // sender thread
+  ZALLOC_OTHER,            // other threads (control, watchdog)
+  ZALLOC_MAX
+};
+
+const char *zprd_alloc_slot2str(zprd_alloc_slot_t s) noexcept;
+
+// plain copy of zprd_stats_t, used in snapshots
+struct zprd_stats_snap_t final {
+  // [0] = local (tun), [1] = remote (udp)
+  uint64_t rx_pkts[2], rx_bytes[2], tx_pkts[2], tx_bytes[2], tx_errors;
+  uint64_t zprn_rx_msgs, zprn_tx_msgs, zprn_tx_pkts;
+  uint64_t drops[ZDROP_MAX];
+
+  // latencies, see zprd_stats_t
+  histogram_snap_t fwd_time, queue_wait, residence;
+
+  // main loop stalls
+  uint64_t stalls, stall_phases[ZPH_MAX];
+  histogram_snap_t stall_time;
+
+  // heap allocations (only counted with USE_ALLOC_STATS)
+  uint64_t allocs[ZALLOC_MAX], alloc_bytes[ZALLOC_MAX];
+
+  uint64_t budget_hits[ZMEM_MAX];
+  uint64_t route_evictions, igmp_msgs, icmp_ratelimited, path_switches, uplink_failovers;
+};
+
+/* all counters are updated with relaxed atomics,
+ * readers only need an eventually consistent view
+ */
+struct zprd_stats_t final {
+  typedef std::atomic<uint64_t> counter_t;
+  counter_t rx_pkts[2], rx_bytes[2], tx_pkts[2], tx_bytes[2], tx_errors;
+  counter_t zprn_rx_msgs, zprn_tx_msgs, zprn_tx_pkts;
+  counter_t drops[ZDROP_MAX];
+
+  /* latency histograms (each one has exactly one writer thread)
+   *  fwd_time   : ingress -> routing decision  (forwarding thread)
+   *  queue_wait : sender enqueue -> dequeue    (sender thread)
+   *  residence  : ingress -> sendto/write done (sender thread)
+   */
+  latency_histogram_t fwd_time, queue_wait, residence;
+
+  /* main loop stalls (iterations which took longer than the watchdog threshold)
+   *  stalls, stall_time : updated by the forwarding thread after the iteration
+   *  stall_phases       : phase in which the watchdog detected the stall
+   */
+  counter_t stalls, stall_phases[ZPH_MAX];
+  latency_histogram_t stall_time;
+
+  // heap allocations (operator new) per slot, only counted with USE_ALLOC_STATS
+  counter_t allocs[ZALLOC_MAX], alloc_bytes[ZALLOC_MAX];
+
+  // refused routes / peers and dropped messages because a memory budget was exceeded
+  counter_t budget_hits[ZMEM_MAX];
+
+  // learned routes evicted to make room for new ones (CLOCK, see router_t::route_slot)
+  counter_t route_evictions;
+
+  // IGMP messages seen on the tun device (multicast group membership, see router_t::igmp_snoop)
+  counter_t igmp_msgs;
+
+  // ICMP errors (and drop messages) suppressed by the rate limit (see icmp_limit_t)
+  counter_t icmp_ratelimited;
+
+  // switches of the outer address of a peer (dual-stack peers, see path_prober_t)
+  counter_t path_switches;
+  // uplinks which were dropped from the uplinks of a peer (no answer or too slow, see docs/UPLINKS)
+  counter_t uplink_failovers;
+
+  zprd_stats_t() noexcept;
+
+  static void inc(counter_t &c, const uint64_t n = 1) noexcept
+    { c.fetch_add(n, std::memory_order_relaxed); }
+
+  void drop(const zprd_drop_reason_t r) noexcept {
+    ZPRD_TRACE(drop, static_cast<int>(r), zprd_drop_reason2str(r));
+    inc(drops[r]);
+  }
+
+  auto snapshot() const noexcept -> zprd_stats_snap_t;
+};
+
+extern zprd_stats_t zprd_stats;
@@ -0,0 +1,30 @@
+/**
+ * zprd / trace.hpp - static user-space tracepoints (USDT)
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ *
+ * The probes are nops until a tracer attaches, list them with
+ *   bpftrace -l 'usdt:/usr/bin/zprd:*'
+ * Build with -DUSE_USDT=OFF to remove them completely.
+ * Address arguments are pointers to 'outer_addr_t' (peers)
+ * or 'inner_addr_t' (u16 type + network-byte-order address).
+ * See docs/TRACING for the list of probes.
+ **/
+#pragma once
+#include <config.h>
+
+#ifdef USE_USDT
+# include <sys/sdt.h>
+# define ZPRD_TRACE(...) STAP_PROBEV(zprd, __VA_ARGS__)
+#else
+# define ZPRD_TRACE(...) do { } while(0)
+#endif
+
+// route_decision kinds
+enum {
+  ZTRACE_RD_LOCAL = 0, // deliver to the tun interface
+  ZTRACE_RD_ROUTE,     // known route
+  ZTRACE_RD_BLOCKED,   // blocked broadcast destination
+  ZTRACE_RD_FLOOD,     // no route, send along the broadcast tree
+  ZTRACE_RD_DUP,       // no route, copy of a recently flooded packet
+};
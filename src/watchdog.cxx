@@ -0,0 +1,80 @@
+/**
+ * zprd / watchdog.cxx - main loop stall detection
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+
+#include "watchdog.hpp"
+#include <config.h>
+#include <stdio.h>
+#include <unistd.h>      // write
+#include <sys/prctl.h>   // prctl
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+watchdog_t zprd_watchdog;
+
+void watchdog_t::start(const unsigned threshold_ms) {
+  _threshold = static_cast<uint64_t>(threshold_ms) * 1000000;
+  if(!_threshold) return;
+  {
+    lock_guard<mutex> lock(_mtx);
+    _stop = false;
+  }
+  _thread = thread(&watchdog_t::worker_fn, this);
+}
+
+void watchdog_t::stop() noexcept {
+  {
+    lock_guard<mutex> lock(_mtx);
+    _stop = true;
+  }
+  _cond.notify_all();
+  // the worker uses _mtx + _cond, which are destroyed with zprd_watchdog
+  if(_thread.joinable())
+    _thread.join();
+}
+
+void watchdog_t::end() noexcept {
+  const uint64_t t = _iter_start.load(memory_order_relaxed);
+  _phase.store(ZPH_IDLE, memory_order_relaxed);
+  if(!t) return;
+  _iter_start.store(0, memory_order_relaxed);
+
+  const uint64_t d = zprd_now_ns() - t;
+  if(zs_likely(d < _threshold)) return;
+  zprd_stats.inc(zprd_stats.stalls);
+  zprd_stats.stall_time.record(d);
+  printf("WATCHDOG: main loop iteration took %" PRIu64 " ms\n", d / 1000000);
+}
+
+void watchdog_t::worker_fn() noexcept {
+  prctl(PR_SET_NAME, "watchdog", 0, 0, 0);
+
+  // poll 4 times per threshold -> a stall is detected after at most 1.25 * threshold
+  const chrono::nanoseconds period(std::max(_threshold / 4, static_cast<uint64_t>(1000000)));
+  uint64_t reported = 0;
+  char buf[128];
+
+  unique_lock<mutex> lock(_mtx);
+  while(!_cond.wait_for(lock, period, [this] { return _stop; })) {
+    const uint64_t t = _iter_start.load(memory_order_relaxed);
+    if(!t || t == reported) continue;
+    const uint64_t d = zprd_now_ns() - t;
+    if(d < _threshold) continue;
+
+    // report every stalled iteration only once
+    reported = t;
+    const auto p = static_cast<zprd_phase_t>(_phase.load(memory_order_relaxed));
+    zprd_stats.inc(zprd_stats.stall_phases[p]);
+
+    // don't use stdio here, the forwarding thread might be stuck in fflush() holding the lock
+    const int len = snprintf(buf, sizeof(buf), "WATCHDOG: main loop stalled for %" PRIu64 " ms in phase %s\n",
+                             d / 1000000, zprd_phase2str(p));
+    if(len > 0 && write(STDERR_FILENO, buf, std::min(static_cast<size_t>(len), sizeof(buf) - 1)) < 0) {
+      // nothing we could do
+    }
+  }
+}
@@ -0,0 +1,76 @@
+/**
+ * zprd / watchdog.hpp - main loop stall detection
+ * (C) 2019 Erik Zscheile.
+ * License: GPL-2+
+ **/
+#pragma once
+#include "stats.hpp"
+#include <inttypes.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/* The forwarding thread marks the start and end of each main loop iteration
+ * and the phase it is currently in (cheap relaxed stores). The watchdog thread
+ * polls these markers and reports iterations which run longer than the
+ * threshold, together with the phase which was active at that time.
+ */
+class watchdog_t final {
+  std::atomic<uint64_t> _iter_start; // 0 = idle
+  std::atomic<uint8_t>  _phase;
+  uint64_t _threshold;               // ns, 0 = disabled
+
+  std::mutex _mtx;
+  std::condition_variable _cond;
+  bool _stop = true;
+  std::thread _thread;
+
+  void worker_fn() noexcept;
+
+ public:
+  watchdog_t() noexcept: _iter_start(0), _phase(ZPH_IDLE), _threshold(0) { }
+  ~watchdog_t() noexcept { stop(); }
+
+  // start: threshold in milliseconds, 0 disables the watchdog
+  void start(unsigned threshold_ms);
+  void stop() noexcept;
+
+  /* the following functions may only be called from the forwarding thread */
+
+  // begin: a new iteration starts (after epoll_wait)
+  void begin(const zprd_phase_t p) noexcept {
+    _phase.store(p, std::memory_order_relaxed);
+    if(_threshold) _iter_start.store(zprd_now_ns(), std::memory_order_relaxed);
+  }
+
+  // end: the iteration is finished (before epoll_wait)
+  void end() noexcept;
+
+  // get_phase: the current phase (also used by the allocation accounting)
+  auto get_phase() const noexcept -> zprd_phase_t
+    { return static_cast<zprd_phase_t>(_phase.load(std::memory_order_relaxed)); }
+
+  // set_phase: returns the previous phase
+  auto set_phase(const zprd_phase_t p) noexcept -> zprd_phase_t {
+    const auto ret = static_cast<zprd_phase_t>(_phase.load(std::memory_order_relaxed));
+    _phase.store(p, std::memory_order_relaxed);
+    return ret;
+  }
+};
+
+extern watchdog_t zprd_watchdog;
+
+// zprd_phase_guard_t: marks a (possibly blocking) section of the main loop
+class zprd_phase_guard_t final {
+  zprd_phase_t _prev;
+
+ public:
+  explicit zprd_phase_guard_t(const zprd_phase_t p) noexcept
+    : _prev(zprd_watchdog.set_phase(p)) { }
+  ~zprd_phase_guard_t() noexcept
+    { zprd_watchdog.set_phase(_prev); }
+
+  zprd_phase_guard_t(const zprd_phase_guard_t &) = delete;
+  zprd_phase_guard_t& operator=(const zprd_phase_guard_t &) = delete;
+};
@@ -11,9 +11,18 @@
 #define ZPRN_ROUTEMOD 0x00
 #define ZPRN_CONNMGMT 0x01
 #define ZPRN2_PROBE   0x02
+#define ZPRN2_MCAST   0x04
 // priority / negation / hop count
 #define ZPRN_CONNMGMT_OPEN   0x00
 #define ZPRN_CONNMGMT_CLOSE  0xFF
+#define ZPRN_MCAST_JOIN      0x00
+#define ZPRN_MCAST_GRAFT     0x01
+#define ZPRN_MCAST_TREE      0x02 // broadcast group only: the node forwards along the broadcast tree
+#define ZPRN_MCAST_PRUNE     0xFE
+#define ZPRN_MCAST_LEAVE     0xFF
+
+// address type of ZPRN2_MCAST messages: IPv4 group + IPv4 address of the receiving node (core for graft/prune)
+#define ZPRN_MCAST_AT 0x0808
 
 #pragma pack(push, 1)
 struct zprn_v2hdr final {